@@ -0,0 +1,898 @@
+/* Benchmarks for some hot paths of the core; if used as a lib, this file is obsolete.
+
+Usage:  dc-bench [options]
+
+The program creates two accounts in a temporary directory, generates a
+synthetic corpus of plain, HTML, multipart, Autocrypt-encrypted and group
+mails, feeds it to dc_receive_imf() and measures the typical read paths
+afterwards.  The results are written as JSON to stdout, one entry per
+measured function, with the time in milliseconds per operation; see
+`dc-bench --help` for the options. */
+
+
+#include <getopt.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../src/dc_context.h"
+#include "../src/dc_mimefactory.h"
+#include "../src/dc_key.h"
+#include "../src/dc_base64.h"
+
+
+/*******************************************************************************
+ * Options and events
+ ******************************************************************************/
+
+
+typedef struct bench_opts_t
+{
+	int         msgs;             /* number of mails in the corpus */
+	int         body_bytes;       /* approx. size of the text of each mail */
+	int         attachment_bytes; /* size of the attachment of multipart mails */
+	int         rounds;           /* how often the read paths are measured */
+	int         backup_rounds;
+	const char* dir;              /* parent of the temporary directory */
+	const char* out;              /* JSON file, NULL=stdout */
+	int         keep;
+	int         verbose;
+} bench_opts_t;
+
+
+static int   s_verbose = 0;
+static int   s_imex_progress = 0;
+static char* s_imex_file = NULL;
+
+
+static uintptr_t receive_event(dc_context_t* context, int event, uintptr_t data1, uintptr_t data2)
+{
+	switch (event)
+	{
+		case DC_EVENT_INFO:
+		case DC_EVENT_WARNING:
+			if (s_verbose) {
+				fprintf(stderr, "%s\n", (char*)data2);
+			}
+			break;
+
+		case DC_EVENT_ERROR:
+			fprintf(stderr, "[Error] %s\n", (char*)data2);
+			break;
+
+		case DC_EVENT_IMEX_PROGRESS:
+			s_imex_progress = (int)data1;
+			break;
+
+		case DC_EVENT_IMEX_FILE_WRITTEN:
+			free(s_imex_file);
+			s_imex_file = dc_strdup((char*)data1);
+			break;
+	}
+	return 0;
+}
+
+
+/*******************************************************************************
+ * Tools
+ ******************************************************************************/
+
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec*1000.0 + (double)ts.tv_nsec/1000000.0;
+}
+
+
+static uint32_t s_rand_state = 2463534242u;
+
+
+static uint32_t bench_rand(void)
+{
+	/* xorshift32, we want the same corpus on every run */
+	s_rand_state ^= s_rand_state << 13;
+	s_rand_state ^= s_rand_state >> 17;
+	s_rand_state ^= s_rand_state << 5;
+	return s_rand_state;
+}
+
+
+static void remove_dir(const char* path)
+{
+	DIR*           dir = NULL;
+	struct dirent* entry = NULL;
+	struct stat    st;
+
+	if ((dir=opendir(path))!=NULL) {
+		while ((entry=readdir(dir))!=NULL) {
+			if (strcmp(entry->d_name, ".")==0 || strcmp(entry->d_name, "..")==0) {
+				continue;
+			}
+			char* child = dc_mprintf("%s/%s", path, entry->d_name);
+			if (lstat(child, &st)==0 && S_ISDIR(st.st_mode)) {
+				remove_dir(child);
+			}
+			else {
+				unlink(child);
+			}
+			free(child);
+		}
+		closedir(dir);
+	}
+	rmdir(path);
+}
+
+
+static dc_context_t* open_account(const char* dir, const char* name, const char* addr)
+{
+	dc_context_t* context = dc_context_new(receive_event, NULL, "dc-bench");
+	char*         dbfile = dc_mprintf("%s/%s.db", dir, name);
+
+	if (!dc_open(context, dbfile, NULL)) {
+		fprintf(stderr, "Cannot open %s.\n", dbfile);
+		exit(1);
+	}
+
+	if (addr) {
+		/* pretend the account is configured, we never connect to a server */
+		dc_set_config(context, "addr", addr);
+		dc_set_config(context, "displayname", name);
+		dc_set_config(context, "show_emails", DC_STRINGIFY(DC_SHOW_EMAILS_ALL));
+		dc_sqlite3_set_config(context->sql, "configured_addr", addr);
+		dc_sqlite3_set_config_int(context->sql, "configured", 1);
+		dc_ensure_secret_key_exists(context);
+	}
+
+	free(dbfile);
+	return context;
+}
+
+
+static void close_account(dc_context_t* context)
+{
+	dc_close(context);
+	dc_context_unref(context);
+}
+
+
+/*******************************************************************************
+ * Measurements
+ ******************************************************************************/
+
+
+typedef struct bench_t
+{
+	char*    name;
+	double*  samples;   /* milliseconds per operation */
+	size_t   cnt;
+	size_t   allocated;
+	uint64_t bytes;     /* bytes processed by all operations, if applicable */
+	uint64_t items;     /* items returned by all operations, if applicable */
+	int      encrypted; /* number of encrypted operations, -1=not applicable */
+	struct bench_t* next;
+} bench_t;
+
+
+static bench_t* s_first = NULL;
+static bench_t* s_last = NULL;
+
+
+static bench_t* bench_get(const char* name)
+{
+	bench_t* bench = NULL;
+
+	for (bench = s_first; bench; bench = bench->next) {
+		if (strcmp(bench->name, name)==0) {
+			return bench;
+		}
+	}
+
+	if ((bench=calloc(1, sizeof(bench_t)))==NULL) {
+		exit(1);
+	}
+	bench->name = dc_strdup(name);
+	bench->encrypted = -1;
+	if (s_last) {
+		s_last->next = bench;
+	}
+	else {
+		s_first = bench;
+	}
+	s_last = bench;
+	return bench;
+}
+
+
+static void bench_add(bench_t* bench, double start_ms, uint64_t bytes, uint64_t items)
+{
+	if (bench->cnt >= bench->allocated) {
+		bench->allocated = bench->allocated? bench->allocated*2 : 64;
+		if ((bench->samples=realloc(bench->samples, bench->allocated*sizeof(double)))==NULL) {
+			exit(1);
+		}
+	}
+	bench->samples[bench->cnt++] = now_ms()-start_ms;
+	bench->bytes += bytes;
+	bench->items += items;
+}
+
+
+static int cmp_doubles(const void* p1, const void* p2)
+{
+	double d1 = *(const double*)p1, d2 = *(const double*)p2;
+	return d1<d2? -1 : (d1>d2? 1 : 0);
+}
+
+
+static double percentile(const bench_t* bench, int p) /* samples must be sorted */
+{
+	size_t rank = (bench->cnt*p + 99) / 100; /* nearest-rank method */
+	return bench->samples[rank>0? rank-1 : 0];
+}
+
+
+static void print_results(FILE* f, const bench_opts_t* opts)
+{
+	char* version = dc_get_version_str();
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"version\": \"%s\",\n", version);
+	fprintf(f, "  \"config\": {\"msgs\": %i, \"body_bytes\": %i, \"attachment_bytes\": %i, \"rounds\": %i, \"backup_rounds\": %i},\n",
+		opts->msgs, opts->body_bytes, opts->attachment_bytes, opts->rounds, opts->backup_rounds);
+	fprintf(f, "  \"results\": [");
+
+	int printed = 0;
+	for (bench_t* bench = s_first; bench; bench = bench->next)
+	{
+		if (bench->cnt==0) {
+			continue;
+		}
+
+		double total_ms = 0;
+		for (size_t i = 0; i < bench->cnt; i++) {
+			total_ms += bench->samples[i];
+		}
+		double total_s = DC_MAX(total_ms, 0.001) / 1000.0;
+		qsort(bench->samples, bench->cnt, sizeof(double), cmp_doubles);
+
+		fprintf(f, "%s\n    {\"name\": \"%s\", \"ops\": %i, \"total_ms\": %.3f, \"ops_per_sec\": %.1f",
+			printed++? "," : "", bench->name, (int)bench->cnt, total_ms, bench->cnt/total_s);
+		if (bench->bytes) {
+			fprintf(f, ", \"bytes\": %llu, \"bytes_per_sec\": %.0f", (unsigned long long)bench->bytes, bench->bytes/total_s);
+		}
+		if (bench->items) {
+			fprintf(f, ", \"items\": %llu, \"items_per_sec\": %.1f", (unsigned long long)bench->items, bench->items/total_s);
+		}
+		if (bench->encrypted>=0) {
+			fprintf(f, ", \"encrypted\": %i", bench->encrypted);
+		}
+		fprintf(f, ", \"min_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}",
+			bench->samples[0], percentile(bench, 50), percentile(bench, 90), percentile(bench, 99), bench->samples[bench->cnt-1]);
+	}
+
+	fprintf(f, "\n  ]\n}\n");
+	free(version);
+}
+
+
+/*******************************************************************************
+ * Corpus
+ ******************************************************************************/
+
+
+#define BENCH_SELF_ADDR  "alice@bench.example"
+#define BENCH_PEER_ADDR  "bob@bench.example"
+#define BENCH_SENDERS    50
+#define BENCH_GROUPS     10
+
+
+typedef enum {
+	BENCH_PLAIN = 0,
+	BENCH_HTML,
+	BENCH_MULTIPART,
+	BENCH_ENCRYPTED,
+	BENCH_GROUP,
+	BENCH_KINDS
+} bench_kind_t;
+
+
+static const char* s_kind_names[BENCH_KINDS] = { "plain", "html", "multipart", "encrypted", "group" };
+
+
+typedef struct bench_mail_t
+{
+	bench_kind_t kind;
+	char*        data;
+	size_t       bytes;
+} bench_mail_t;
+
+
+static const char* s_words[] = {
+	"hello", "meeting", "tomorrow", "the", "a", "and", "project", "delta",
+	"chat", "message", "see", "you", "later", "thanks", "for", "your",
+	"reply", "please", "find", "attached", "report", "about", "weekend", "train",
+	"coffee", "lunch", "maybe", "today", "great", "idea", "schedule", "update"
+};
+#define BENCH_WORDS_CNT (sizeof(s_words)/sizeof(s_words[0]))
+#define BENCH_RARE_WORD "zeppelin"    /* appears in about one of 100 mails, used for searching */
+
+
+static char* create_text(int bytes, const char* line_start, const char* line_end)
+{
+	dc_strbuilder_t text;
+	int             words_in_line = 0;
+
+	dc_strbuilder_init(&text, bytes+256);
+	dc_strbuilder_cat(&text, line_start);
+
+	if (bench_rand()%100==0) {
+		dc_strbuilder_cat(&text, BENCH_RARE_WORD " ");
+	}
+
+	while (text.eos-text.buf < bytes) {
+		dc_strbuilder_cat(&text, s_words[bench_rand()%BENCH_WORDS_CNT]);
+		if (++words_in_line >= 12) {
+			dc_strbuilder_cat(&text, line_end);
+			dc_strbuilder_cat(&text, line_start);
+			words_in_line = 0;
+		}
+		else {
+			dc_strbuilder_cat(&text, " ");
+		}
+	}
+
+	dc_strbuilder_cat(&text, line_end);
+	return text.buf;
+}
+
+
+static char* create_date(int i)
+{
+	time_t    t = 1546300800 + i*60; /* 2019-01-01, one mail a minute */
+	struct tm tm;
+	char      buf[64];
+
+	gmtime_r(&t, &tm);
+	strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S +0000", &tm);
+	return dc_strdup(buf);
+}
+
+
+static char* create_mail(bench_kind_t kind, int i, const bench_opts_t* opts)
+{
+	char* ret = NULL;
+	char* date = create_date(i);
+	char* text = NULL;
+	int   sender = bench_rand()%BENCH_SENDERS;
+
+	#define BENCH_HEADERS \
+		"From: Sender %i <sender%i@bench.example>\r\n" \
+		"To: " BENCH_SELF_ADDR "\r\n" \
+		"Subject: Message %i\r\n" \
+		"Date: %s\r\n" \
+		"Message-ID: <%s%i@bench.example>\r\n" \
+		"MIME-Version: 1.0\r\n"
+
+	switch (kind)
+	{
+		case BENCH_PLAIN:
+			text = create_text(opts->body_bytes, "", "\r\n");
+			ret = dc_mprintf(BENCH_HEADERS
+				"Content-Type: text/plain; charset=utf-8\r\n"
+				"Content-Transfer-Encoding: 8bit\r\n"
+				"\r\n"
+				"%s",
+				sender, sender, i, date, s_kind_names[kind], i, text);
+			break;
+
+		case BENCH_HTML:
+			text = create_text(opts->body_bytes, "<p>", "</p>\r\n");
+			ret = dc_mprintf(BENCH_HEADERS
+				"Content-Type: text/html; charset=utf-8\r\n"
+				"Content-Transfer-Encoding: 8bit\r\n"
+				"\r\n"
+				"<html><head><style>p { color: #333; }</style></head><body>\r\n"
+				"%s"
+				"</body></html>\r\n",
+				sender, sender, i, date, s_kind_names[kind], i, text);
+			break;
+
+		case BENCH_MULTIPART:
+			{
+				char* attachment = NULL;
+				char* base64 = NULL;
+				if ((attachment=malloc(opts->attachment_bytes+1))==NULL) {
+					exit(1);
+				}
+				for (int j = 0; j < opts->attachment_bytes; j++) {
+					attachment[j] = (char)bench_rand();
+				}
+				base64 = dc_render_base64(attachment, opts->attachment_bytes, 76, "\r\n", 0);
+				text = create_text(opts->body_bytes, "", "\r\n");
+				ret = dc_mprintf(BENCH_HEADERS
+					"Content-Type: multipart/mixed; boundary=\"==break==\"\r\n"
+					"\r\n"
+					"--==break==\r\n"
+					"Content-Type: text/plain; charset=utf-8\r\n"
+					"Content-Transfer-Encoding: 8bit\r\n"
+					"\r\n"
+					"%s"
+					"--==break==\r\n"
+					"Content-Type: application/octet-stream; name=\"data%i.bin\"\r\n"
+					"Content-Disposition: attachment; filename=\"data%i.bin\"\r\n"
+					"Content-Transfer-Encoding: base64\r\n"
+					"\r\n"
+					"%s\r\n"
+					"--==break==--\r\n",
+					sender, sender, i, date, s_kind_names[kind], i, text, i, i, base64);
+				free(base64);
+				free(attachment);
+			}
+			break;
+
+		case BENCH_GROUP:
+			{
+				int grp = bench_rand()%BENCH_GROUPS;
+				text = create_text(opts->body_bytes, "", "\r\n");
+				ret = dc_mprintf(
+					"From: Member %i <member%i.%i@bench.example>\r\n"
+					"To: " BENCH_SELF_ADDR ", member%i.0@bench.example, member%i.1@bench.example, member%i.2@bench.example\r\n"
+					"Subject: Chat: Group %i\r\n"
+					"Date: %s\r\n"
+					"Message-ID: <Gr.BenchGrp%04i.%i@bench.example>\r\n"
+					"Chat-Version: 1.0\r\n"
+					"Chat-Group-ID: BenchGrp%04i\r\n"
+					"Chat-Group-Name: Group %i\r\n"
+					"MIME-Version: 1.0\r\n"
+					"Content-Type: text/plain; charset=utf-8\r\n"
+					"Content-Transfer-Encoding: 8bit\r\n"
+					"\r\n"
+					"%s",
+					sender%3, grp, sender%3, grp, grp, grp, grp, date, grp, i, grp, grp, text);
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	free(text);
+	free(date);
+	return ret;
+}
+
+
+static char* render_msg(dc_context_t* context, uint32_t msg_id, size_t* ret_bytes, int* ret_encrypted)
+{
+	/* render a message that is prepared for sending, the result is what would be sent by SMTP */
+	dc_mimefactory_t factory;
+	char*            ret = NULL;
+
+	*ret_bytes = 0;
+	dc_mimefactory_init(&factory, context);
+	if (dc_mimefactory_load_msg(&factory, msg_id)
+	 && dc_mimefactory_render(&factory)) {
+		dc_read_file(context, factory.out_file, (void**)&ret, ret_bytes);
+		if (ret_encrypted) {
+			*ret_encrypted = factory.out_encrypted;
+		}
+	}
+	dc_mimefactory_empty(&factory);
+	return ret;
+}
+
+
+static uint32_t prepare_text_msg(dc_context_t* context, uint32_t chat_id, const char* text)
+{
+	dc_msg_t* msg = dc_msg_new(context, DC_MSG_TEXT);
+	dc_msg_set_text(msg, text);
+	uint32_t msg_id = dc_prepare_msg(context, chat_id, msg);
+	dc_msg_unref(msg);
+	return msg_id;
+}
+
+
+static bench_mail_t* create_corpus(dc_context_t* self, dc_context_t* peer, const bench_opts_t* opts)
+{
+	bench_mail_t* corpus = NULL;
+	uint32_t      peer_chat_id = 0;
+	uint32_t      self_chat_id = 0;
+	int           encrypted = 0;
+
+	if ((corpus=calloc(opts->msgs, sizeof(bench_mail_t)))==NULL) {
+		exit(1);
+	}
+
+	/* let the peer learn our key from the Autocrypt header of an unencrypted message,
+	the encrypted mails of the corpus are then rendered by the peer as usual */
+	self_chat_id = dc_create_chat_by_contact_id(self, dc_create_contact(self, "Bob", BENCH_PEER_ADDR));
+	peer_chat_id = dc_create_chat_by_contact_id(peer, dc_create_contact(peer, "Alice", BENCH_SELF_ADDR));
+	{
+		size_t bytes = 0;
+		char*  handshake = render_msg(self, prepare_text_msg(self, self_chat_id, "hi"), &bytes, NULL);
+		if (handshake==NULL) {
+			fprintf(stderr, "Cannot render handshake message.\n");
+			exit(1);
+		}
+		dc_receive_imf(peer, handshake, bytes, "INBOX", 0, 0);
+		free(handshake);
+	}
+
+	for (int i = 0; i < opts->msgs; i++)
+	{
+		bench_kind_t kind = i % BENCH_KINDS;
+		corpus[i].kind = kind;
+		if (kind==BENCH_ENCRYPTED) {
+			char* text = create_text(opts->body_bytes, "", "\n");
+			int   is_encrypted = 0;
+			corpus[i].data = render_msg(peer, prepare_text_msg(peer, peer_chat_id, text), &corpus[i].bytes, &is_encrypted);
+			encrypted += is_encrypted;
+			free(text);
+		}
+		else {
+			corpus[i].data = create_mail(kind, i, opts);
+			corpus[i].bytes = strlen(corpus[i].data);
+		}
+	}
+
+	if (encrypted==0 && opts->msgs>BENCH_ENCRYPTED) {
+		fprintf(stderr, "Warning: The peer did not encrypt any mail.\n");
+	}
+
+	return corpus;
+}
+
+
+static void free_corpus(bench_mail_t* corpus, int cnt)
+{
+	for (int i = 0; i < cnt; i++) {
+		free(corpus[i].data);
+	}
+	free(corpus);
+}
+
+
+/*******************************************************************************
+ * Benchmarks
+ ******************************************************************************/
+
+
+static void bench_receive_imf(dc_context_t* context, const bench_mail_t* corpus, const bench_opts_t* opts)
+{
+	bench_t* all = bench_get("receive_imf");
+	bench_t* kinds[BENCH_KINDS];
+
+	for (int k = 0; k < BENCH_KINDS; k++) {
+		char* name = dc_mprintf("receive_imf.%s", s_kind_names[k]);
+		kinds[k] = bench_get(name);
+		free(name);
+	}
+
+	for (int i = 0; i < opts->msgs; i++) {
+		if (corpus[i].data==NULL) {
+			continue;
+		}
+		double start = now_ms();
+			dc_receive_imf(context, corpus[i].data, corpus[i].bytes, "INBOX", i+1, 0);
+		bench_add(all, start, corpus[i].bytes, 0);
+		bench_add(kinds[corpus[i].kind], start, corpus[i].bytes, 0);
+	}
+}
+
+
+static void accept_deaddrop(dc_context_t* context)
+{
+	/* chats started by incoming mails are in the deaddrop until the user accepts them */
+	dc_array_t* msgs = dc_get_chat_msgs(context, DC_CHAT_ID_DEADDROP, 0, 0);
+	for (size_t i = 0; i < dc_array_get_cnt(msgs); i++) {
+		dc_create_chat_by_msg_id(context, dc_array_get_id(msgs, i));
+	}
+	dc_array_unref(msgs);
+}
+
+
+static void bench_chatlist(dc_context_t* context, const bench_opts_t* opts)
+{
+	bench_t* bench = bench_get("get_chatlist+summaries");
+
+	for (int r = 0; r < opts->rounds; r++) {
+		double       start = now_ms();
+			dc_chatlist_t* chatlist = dc_get_chatlist(context, 0, NULL, 0);
+			size_t         cnt = dc_chatlist_get_cnt(chatlist);
+			for (size_t i = 0; i < cnt; i++) {
+				dc_lot_unref(dc_chatlist_get_summary(chatlist, i, NULL));
+			}
+			dc_chatlist_unref(chatlist);
+		bench_add(bench, start, 0, cnt);
+	}
+}
+
+
+static void bench_chat_msgs(dc_context_t* context, const bench_opts_t* opts)
+{
+	bench_t*       bench = bench_get("get_chat_msgs");
+	dc_chatlist_t* chatlist = dc_get_chatlist(context, 0, NULL, 0);
+	size_t         cnt = dc_chatlist_get_cnt(chatlist);
+
+	for (int r = 0; r < opts->rounds; r++) {
+		for (size_t i = 0; i < cnt; i++) {
+			uint32_t chat_id = dc_chatlist_get_chat_id(chatlist, i);
+			double start = now_ms();
+				dc_array_t* msgs = dc_get_chat_msgs(context, chat_id, 0, 0);
+			bench_add(bench, start, 0, dc_array_get_cnt(msgs));
+			dc_array_unref(msgs);
+		}
+	}
+
+	dc_chatlist_unref(chatlist);
+}
+
+
+static void bench_search_msgs(dc_context_t* context, const bench_opts_t* opts)
+{
+	static const char* queries[] = { "meeting", BENCH_RARE_WORD, "nonexistingword" };
+	bench_t*           bench = bench_get("search_msgs");
+	bench_t*           bench_chat = bench_get("search_msgs.chat");
+
+	/* search in the chat with the most messages as well */
+	uint32_t      chat_id = 0;
+	sqlite3_stmt* stmt = dc_sqlite3_prepare(context->sql,
+		"SELECT chat_id FROM msgs WHERE chat_id>" DC_STRINGIFY(DC_CHAT_ID_LAST_SPECIAL)
+		" GROUP BY chat_id ORDER BY COUNT(*) DESC LIMIT 1;");
+	if (sqlite3_step(stmt)==SQLITE_ROW) {
+		chat_id = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+
+	for (int r = 0; r < opts->rounds; r++) {
+		for (size_t q = 0; q < sizeof(queries)/sizeof(queries[0]); q++) {
+			double start = now_ms();
+				dc_array_t* msgs = dc_search_msgs(context, 0, queries[q]);
+			bench_add(bench, start, 0, dc_array_get_cnt(msgs));
+			dc_array_unref(msgs);
+
+			if (chat_id) {
+				start = now_ms();
+					msgs = dc_search_msgs(context, chat_id, queries[q]);
+				bench_add(bench_chat, start, 0, dc_array_get_cnt(msgs));
+				dc_array_unref(msgs);
+			}
+		}
+	}
+}
+
+
+static void bench_render(dc_context_t* context, const bench_opts_t* opts)
+{
+	bench_t* bench = bench_get("mimefactory_render");
+	uint32_t chat_id = dc_create_chat_by_contact_id(context, dc_create_contact(context, "Bob", BENCH_PEER_ADDR));
+	int      cnt = DC_MAX(opts->msgs/10, 10);
+
+	bench->encrypted = 0;
+	for (int i = 0; i < cnt; i++) {
+		char*    text = create_text(opts->body_bytes, "", "\n");
+		uint32_t msg_id = prepare_text_msg(context, chat_id, text);
+		size_t   bytes = 0;
+		int      encrypted = 0;
+		double   start = now_ms();
+			char* rendered = render_msg(context, msg_id, &bytes, &encrypted);
+		bench_add(bench, start, bytes, 0);
+		bench->encrypted += encrypted;
+		free(rendered);
+		free(text);
+	}
+}
+
+
+static void bench_base64(const bench_opts_t* opts)
+{
+	/* the attachment as sent in a MIME part, libetpan's decoder is measured for comparison */
+	size_t   bytes = opts->attachment_bytes;
+	uint8_t* binary = malloc(bytes);
+	char*    encoded = malloc(DC_BASE64_ENCODED_BYTES(bytes));
+	if (binary==NULL || encoded==NULL) {
+		exit(1);
+	}
+	for (size_t i = 0; i < bytes; i++) {
+		binary[i] = (uint8_t)bench_rand();
+	}
+	char*    mime = dc_render_base64(binary, bytes, 76, "\r\n", 0);
+	size_t   mime_bytes = strlen(mime);
+	uint8_t* decoded = malloc(DC_BASE64_DECODED_MAX(mime_bytes));
+	if (decoded==NULL) {
+		exit(1);
+	}
+
+	for (int impl = DC_BASE64_SCALAR; impl <= DC_BASE64_AVX2; impl++)
+	{
+		if (dc_base64_set_impl(impl)!=impl) {
+			break;
+		}
+
+		char* name = dc_mprintf("base64_encode.%s", dc_base64_impl_name(impl));
+		bench_t* bench = bench_get(name);
+		for (int r = 0; r < opts->rounds*10; r++) {
+			double start = now_ms();
+				dc_base64_encode(binary, bytes, encoded);
+			bench_add(bench, start, bytes, 0);
+		}
+		free(name);
+
+		name = dc_mprintf("base64_decode.%s", dc_base64_impl_name(impl));
+		bench = bench_get(name);
+		for (int r = 0; r < opts->rounds*10; r++) {
+			double start = now_ms();
+				size_t decoded_bytes = dc_base64_decode(mime, mime_bytes, decoded);
+			bench_add(bench, start, decoded_bytes, 0);
+			if (decoded_bytes!=bytes || memcmp(decoded, binary, bytes)!=0) {
+				fprintf(stderr, "Bad base64 result.\n");
+				exit(1);
+			}
+		}
+		free(name);
+	}
+	dc_base64_set_impl(DC_BASE64_BEST);
+
+	bench_t* bench = bench_get("base64_decode.libetpan");
+	for (int r = 0; r < opts->rounds*10; r++) {
+		size_t indx = 0, result_bytes = 0;
+		char*  result = NULL;
+		double start = now_ms();
+			mailmime_base64_body_parse(mime, mime_bytes, &indx, &result, &result_bytes);
+		bench_add(bench, start, result_bytes, 0);
+		mmap_string_unref(result);
+	}
+
+	free(mime);
+	free(encoded);
+	free(decoded);
+	free(binary);
+}
+
+
+static void bench_backup(dc_context_t* context, const char* dir, const bench_opts_t* opts)
+{
+	bench_t* bench_export = bench_get("backup_export");
+	bench_t* bench_import = bench_get("backup_import");
+
+	for (int r = 0; r < opts->backup_rounds; r++)
+	{
+		char* backup_dir = dc_mprintf("%s/backup%i", dir, r);
+		char* import_name = dc_mprintf("import%i", r);
+
+		/* dc_imex() only adds a job, it is done by the next call to dc_perform_imap_jobs();
+		the job does not need a connection */
+		s_imex_progress = 0;
+		free(s_imex_file);
+		s_imex_file = NULL;
+		double start = now_ms();
+			dc_imex(context, DC_IMEX_EXPORT_BACKUP, backup_dir, NULL);
+			dc_perform_imap_jobs(context);
+		if (s_imex_progress!=1000 || s_imex_file==NULL) {
+			fprintf(stderr, "Backup export failed.\n");
+			exit(1);
+		}
+		uint64_t backup_bytes = dc_get_filebytes(context, s_imex_file);
+		bench_add(bench_export, start, backup_bytes, 0);
+
+		dc_context_t* imported = open_account(dir, import_name, NULL);
+		s_imex_progress = 0;
+		start = now_ms();
+			dc_imex(imported, DC_IMEX_IMPORT_BACKUP, s_imex_file, NULL);
+			dc_perform_imap_jobs(imported);
+		if (s_imex_progress!=1000) {
+			fprintf(stderr, "Backup import failed.\n");
+			exit(1);
+		}
+		bench_add(bench_import, start, backup_bytes, 0);
+		close_account(imported);
+
+		free(import_name);
+		free(backup_dir);
+	}
+}
+
+
+/*******************************************************************************
+ * Main
+ ******************************************************************************/
+
+
+static void usage(const char* prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -n, --msgs N              number of mails in the corpus (default 1000)\n"
+		"  -s, --size BYTES          approx. text size of each mail (default 1000)\n"
+		"  -a, --attachment BYTES    attachment size of multipart mails (default 100000)\n"
+		"  -r, --rounds N            repetitions of the read paths (default 10)\n"
+		"  -b, --backup-rounds N     repetitions of backup export/import (default 2)\n"
+		"  -d, --dir DIR             where to create the temporary directory (default $TMPDIR or /tmp)\n"
+		"  -o, --out FILE            write the JSON results to FILE instead of stdout\n"
+		"  -k, --keep                do not delete the temporary directory\n"
+		"  -v, --verbose             show info and warnings of the core\n",
+		prog);
+}
+
+
+int main(int argc, char ** argv)
+{
+	static const struct option long_opts[] = {
+		{ "msgs",          required_argument, NULL, 'n' },
+		{ "size",          required_argument, NULL, 's' },
+		{ "attachment",    required_argument, NULL, 'a' },
+		{ "rounds",        required_argument, NULL, 'r' },
+		{ "backup-rounds", required_argument, NULL, 'b' },
+		{ "dir",           required_argument, NULL, 'd' },
+		{ "out",           required_argument, NULL, 'o' },
+		{ "keep",          no_argument,       NULL, 'k' },
+		{ "verbose",       no_argument,       NULL, 'v' },
+		{ "help",          no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	bench_opts_t opts = { 1000, 1000, 100000, 10, 2, NULL, NULL, 0, 0 };
+	int          c = 0;
+
+	while ((c=getopt_long(argc, argv, "n:s:a:r:b:d:o:kvh", long_opts, NULL))!=-1) {
+		switch (c) {
+			case 'n': opts.msgs             = DC_MAX(atoi(optarg), 1); break;
+			case 's': opts.body_bytes       = DC_MAX(atoi(optarg), 1); break;
+			case 'a': opts.attachment_bytes = DC_MAX(atoi(optarg), 1); break;
+			case 'r': opts.rounds           = DC_MAX(atoi(optarg), 1); break;
+			case 'b': opts.backup_rounds    = DC_MAX(atoi(optarg), 0); break;
+			case 'd': opts.dir              = optarg; break;
+			case 'o': opts.out              = optarg; break;
+			case 'k': opts.keep             = 1; break;
+			case 'v': opts.verbose          = 1; break;
+			default:  usage(argv[0]); return c=='h'? 0 : 1;
+		}
+	}
+	s_verbose = opts.verbose;
+
+	if (opts.dir==NULL) {
+		opts.dir = getenv("TMPDIR")? getenv("TMPDIR") : "/tmp";
+	}
+	char* dir = dc_mprintf("%s/dc-bench-XXXXXX", opts.dir);
+	if (mkdtemp(dir)==NULL) {
+		fprintf(stderr, "Cannot create temporary directory in %s.\n", opts.dir);
+		return 1;
+	}
+	fprintf(stderr, "Using %s ...\n", dir);
+
+	dc_context_t* self = open_account(dir, "alice", BENCH_SELF_ADDR);
+	dc_context_t* peer = open_account(dir, "bob", BENCH_PEER_ADDR);
+
+	fprintf(stderr, "Creating %i mails ...\n", opts.msgs);
+	bench_mail_t* corpus = create_corpus(self, peer, &opts);
+
+	fprintf(stderr, "Measuring ...\n");
+	bench_receive_imf(self, corpus, &opts);
+	accept_deaddrop(self);
+	bench_chatlist(self, &opts);
+	bench_chat_msgs(self, &opts);
+	bench_search_msgs(self, &opts);
+	bench_render(self, &opts);
+	bench_base64(&opts);
+	bench_backup(self, dir, &opts);
+
+	FILE* f = opts.out? fopen(opts.out, "w") : stdout;
+	if (f==NULL) {
+		fprintf(stderr, "Cannot write %s.\n", opts.out);
+		return 1;
+	}
+	print_results(f, &opts);
+	if (f!=stdout) {
+		fclose(f);
+	}
+
+	free_corpus(corpus, opts.msgs);
+	close_account(peer);
+	close_account(self);
+	if (!opts.keep) {
+		remove_dir(dir);
+	}
+	free(dir);
+	return 0;
+}
@@ -38,6 +38,7 @@ int dc_reset_tables(dc_context_t* context, int bits)
 
 	if (bits & 2) {
 		dc_sqlite3_execute(context->sql, "DELETE FROM acpeerstates;");
+		dc_apeerstate_cache_clear(context->sql);
 		dc_log_info(context, 0, "(2) Peerstates reset.");
 	}
 
@@ -418,6 +419,7 @@ char* dc_cmdline(dc_context_t* context, const char* cmdline)
 			ret = dc_strdup(
 				"==========================Database commands==\n"
 				"info\n"
+				"metrics [reset]\n"
 				"open <file to open or create>\n"
 				"close\n"
 				"set <configuration-key> [<value>]\n"
@@ -665,6 +667,13 @@ char* dc_cmdline(dc_context_t* context, const char* cmdline)
 			ret = COMMAND_FAILED;
 		}
 	}
+	else if (strcmp(cmd, "metrics")==0)
+	{
+		ret = dc_get_metrics(context, (arg1 && strcmp(arg1, "reset")==0)? DC_METRICS_RESET : 0, NULL);
+		if (ret == NULL) {
+			ret = COMMAND_FAILED;
+		}
+	}
 	else if (strcmp(cmd, "maybenetwork")==0)
 	{
 		dc_maybe_network(context);
@@ -686,6 +695,7 @@ char* dc_cmdline(dc_context_t* context, const char* cmdline)
 		dc_chatlist_t* chatlist = dc_get_chatlist(context, listflags, arg1, 0);
 		if (chatlist) {
 			int i, cnt = dc_chatlist_get_cnt(chatlist);
+			dc_array_t* summaries = dc_chatlist_get_summaries(chatlist, 0, cnt);
 			if (cnt>0) {
 				dc_log_info(context, 0, "================================================================================");
 				for (i = cnt-1; i >= 0; i--)
@@ -700,7 +710,7 @@ char* dc_cmdline(dc_context_t* context, const char* cmdline)
 					free(temp_subtitle);
 					free(temp_name);
 
-					dc_lot_t* lot = dc_chatlist_get_summary(chatlist, i, chat);
+					dc_lot_t* lot = (dc_lot_t*)dc_array_get_ptr(summaries, i);
 
 						const char* statestr = "";
 						if (dc_chat_get_archived(chat)) {
@@ -727,8 +737,6 @@ char* dc_cmdline(dc_context_t* context, const char* cmdline)
 						free(text2);
 						free(timestr);
 
-					dc_lot_unref(lot);
-
 					dc_chat_unref(chat);
 
 					dc_log_info(context, 0, "================================================================================");
@@ -738,6 +746,7 @@ char* dc_cmdline(dc_context_t* context, const char* cmdline)
 				dc_log_info(context, 0, "Location streaming enabled.");
 			}
 			ret = dc_mprintf("%i chats.", (int)cnt);
+			dc_array_unref(summaries);
 			dc_chatlist_unref(chatlist);
 		}
 		else {
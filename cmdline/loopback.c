@@ -0,0 +1,3134 @@
+/* A minimal IMAP and SMTP server for tests and benchmarks; if used as a lib, this file is obsolete.
+
+Usage:  dc-loopback --maildir <dir> [options]
+
+The server listens on localhost only and accepts any user and password.
+Mails sent by SMTP are delivered to the INBOX of each recipient, the mailboxes
+are maildirs below <dir>/<user>/, other folders are stored as <dir>/<user>/.<name>/
+(Maildir++).  The UIDs are kept in a file `dc-loopback-uidlist` in each folder,
+the standard flags are part of the file names as usual, keywords as $MDNSent
+are kept in the uidlist.
+
+Only the IMAP4rev1 subset used by the core is implemented, plus IDLE, UIDPLUS,
+MOVE, LITERAL+, CONDSTORE, QRESYNC and COMPRESS=DEFLATE; no TLS, no SEARCH.  Mod-sequences are not
+stored, they restart above the current time in microseconds when a folder is
+loaded, so they never decrease and clients just see all messages as changed
+after a restart.  To make the network paths measurable,
+a latency can be added to each command, the bandwidth of each connection can be
+limited and connections can be dropped after a given number of commands;
+see `dc-loopback --help`.
+
+To use the server, configure an account with mail_server=127.0.0.1,
+mail_port=<imap port>, send_server=127.0.0.1, send_port=<smtp port> and
+server_flags=DC_LP_IMAP_SOCKET_PLAIN|DC_LP_SMTP_SOCKET_PLAIN (0x40400).
+
+`dc-loopback --selftest` starts the server on free ports and runs the IMAP code
+of the core against it. */
+
+
+#define _GNU_SOURCE /* vasprintf(), strcasestr() */
+#include <assert.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "../src/dc_context.h"
+#include "../src/dc_hash.h"
+
+
+/*******************************************************************************
+ * Options and tools
+ ******************************************************************************/
+
+
+typedef struct lb_opts_t
+{
+	const char* maildir;
+	int         imap_port;
+	int         smtp_port;
+	int         latency_ms;        /* added before the response of each command */
+	int         bandwidth;         /* bytes per second and connection, 0=unlimited */
+	int         disconnect_after;  /* drop connections after this number of commands, 0=never */
+	int         verbose;
+} lb_opts_t;
+
+
+static lb_opts_t s_opts = { NULL, 10143, 10025, 0, 0, 0, 0 };
+
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec*1000.0 + (double)ts.tv_nsec/1000000.0;
+}
+
+
+static void sleep_ms(double ms)
+{
+	if (ms > 0) {
+		struct timespec ts;
+		ts.tv_sec = (time_t)(ms/1000.0);
+		ts.tv_nsec = (long)((ms-ts.tv_sec*1000.0)*1000000.0);
+		nanosleep(&ts, NULL);
+	}
+}
+
+
+typedef struct lb_buf_t
+{
+	char*  buf;
+	size_t bytes;
+	size_t allocated;
+} lb_buf_t;
+
+
+static void buf_add(lb_buf_t* b, const void* data, size_t bytes)
+{
+	if (b->bytes+bytes+1 > b->allocated) {
+		b->allocated = DC_MAX(b->allocated*2, b->bytes+bytes+1024);
+		if ((b->buf=realloc(b->buf, b->allocated))==NULL) {
+			exit(1);
+		}
+	}
+	memcpy(&b->buf[b->bytes], data, bytes);
+	b->bytes += bytes;
+	b->buf[b->bytes] = 0;
+}
+
+
+static void buf_addf(lb_buf_t* b, const char* format, ...)
+{
+	char*   str = NULL;
+	va_list va;
+
+	va_start(va, format);
+	if (vasprintf(&str, format, va) < 0) {
+		exit(1);
+	}
+	va_end(va);
+
+	buf_add(b, str, strlen(str));
+	free(str);
+}
+
+
+static void buf_empty(lb_buf_t* b)
+{
+	free(b->buf);
+	b->buf = NULL;
+	b->bytes = 0;
+	b->allocated = 0;
+}
+
+
+/*******************************************************************************
+ * Connections
+ ******************************************************************************/
+
+
+typedef struct lb_folder_t lb_folder_t;
+
+
+typedef struct lb_conn_t
+{
+	int          fd;
+	int          id;
+	const char*  proto;
+
+	char         in[16384];
+	size_t       in_pos;
+	size_t       in_len;
+	lb_buf_t     out;
+	z_stream*    inflater;       /* set after COMPRESS DEFLATE, see RFC 4978; `in` then holds the inflated data */
+	z_stream*    deflater;
+	char         zin[16384];     /* compressed input not yet inflated */
+	double       next_send_ms;
+	int          commands;
+
+	/* IMAP state */
+	char*        user;
+	lb_folder_t* selected;
+	int          readonly;
+	uint32_t*    view;           /* the UIDs of the selected folder as known by the client, index+1 is the sequence number */
+	size_t       view_cnt;
+	size_t       view_allocated;
+	int          condstore;      /* MODSEQ is added to the FETCH responses of STORE */
+	int          qresync;        /* expunges are sent as VANISHED instead of EXPUNGE */
+	int          wake_pipe[2];   /* written to when a folder is changed while idling */
+	int          idling;
+	struct lb_conn_t* next_idling;
+} lb_conn_t;
+
+
+static int flush_out(lb_conn_t* conn)
+{
+	/* send the output buffer, if a bandwidth is set, in chunks of 1/20 second;
+	the bandwidth applies to the compressed data */
+	const char* data = conn->out.buf;
+	size_t      bytes = conn->out.bytes;
+	size_t      pos = 0;
+	char*       zout = NULL;
+
+	if (conn->deflater && bytes)
+	{
+		size_t zout_allocated = deflateBound(conn->deflater, bytes)+64;
+		if ((zout=malloc(zout_allocated))==NULL) {
+			exit(1);
+		}
+		conn->deflater->next_in = (Bytef*)conn->out.buf;
+		conn->deflater->avail_in = bytes;
+		conn->deflater->next_out = (Bytef*)zout;
+		conn->deflater->avail_out = zout_allocated;
+		if (deflate(conn->deflater, Z_SYNC_FLUSH)!=Z_OK || conn->deflater->avail_in) {
+			free(zout);
+			return 0;
+		}
+		data = zout;
+		bytes = zout_allocated-conn->deflater->avail_out;
+	}
+
+	while (pos < bytes)
+	{
+		size_t chunk = bytes-pos;
+		if (s_opts.bandwidth) {
+			chunk = DC_MIN(chunk, (size_t)DC_MAX(s_opts.bandwidth/20, 512));
+			double now = now_ms();
+			if (conn->next_send_ms > now) {
+				sleep_ms(conn->next_send_ms-now);
+			}
+			else {
+				conn->next_send_ms = now;
+			}
+			conn->next_send_ms += (double)chunk*1000.0/s_opts.bandwidth;
+		}
+
+		ssize_t sent = send(conn->fd, &data[pos], chunk, MSG_NOSIGNAL);
+		if (sent <= 0) {
+			if (sent<0 && errno==EINTR) {
+				continue;
+			}
+			free(zout);
+			return 0;
+		}
+		pos += sent;
+	}
+
+	free(zout);
+	conn->out.bytes = 0;
+	return 1;
+}
+
+
+static int fill_in(lb_conn_t* conn)
+{
+	ssize_t r;
+
+	while (1)
+	{
+		if (conn->inflater && conn->inflater->avail_in)
+		{
+			conn->inflater->next_out = (Bytef*)conn->in;
+			conn->inflater->avail_out = sizeof(conn->in);
+			int z = inflate(conn->inflater, Z_SYNC_FLUSH);
+			if (z!=Z_OK && z!=Z_BUF_ERROR) {
+				return 0;
+			}
+			if (conn->inflater->avail_out < sizeof(conn->in)) {
+				conn->in_pos = 0;
+				conn->in_len = sizeof(conn->in)-conn->inflater->avail_out;
+				return 1;
+			}
+		}
+
+		char* dest = conn->inflater? conn->zin : conn->in;
+		do {
+			r = recv(conn->fd, dest, sizeof(conn->zin), 0);
+		} while (r<0 && errno==EINTR);
+
+		if (r <= 0) {
+			return 0;
+		}
+
+		if (conn->inflater==NULL) {
+			conn->in_pos = 0;
+			conn->in_len = r;
+			return 1;
+		}
+		conn->inflater->next_in = (Bytef*)conn->zin;
+		conn->inflater->avail_in = r;
+	}
+}
+
+
+static int has_input(lb_conn_t* conn)
+{
+	/* check if input can be read without waiting for the socket */
+	return conn->in_pos < conn->in_len || (conn->inflater && conn->inflater->avail_in);
+}
+
+
+static int start_compress(lb_conn_t* conn)
+{
+	/* raw deflate streams without zlib header as defined by RFC 4978 */
+	conn->inflater = calloc(1, sizeof(z_stream));
+	conn->deflater = calloc(1, sizeof(z_stream));
+	if (conn->inflater==NULL || conn->deflater==NULL) {
+		exit(1);
+	}
+
+	if (inflateInit2(conn->inflater, -15)!=Z_OK
+	 || deflateInit2(conn->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)!=Z_OK) {
+		return 0;
+	}
+
+	/* the client waits for the response before compressing, so there is no input left;
+	if there is, it is already compressed */
+	if (conn->in_pos < conn->in_len) {
+		memcpy(conn->zin, &conn->in[conn->in_pos], conn->in_len-conn->in_pos);
+		conn->inflater->next_in = (Bytef*)conn->zin;
+		conn->inflater->avail_in = conn->in_len-conn->in_pos;
+		conn->in_pos = conn->in_len = 0;
+	}
+	return 1;
+}
+
+
+static int read_line(lb_conn_t* conn, lb_buf_t* line) /* appends a line including the CRLF to the buffer */
+{
+	while (1)
+	{
+		if (conn->in_pos >= conn->in_len && !fill_in(conn)) {
+			return 0;
+		}
+
+		char*  start = &conn->in[conn->in_pos];
+		size_t avail = conn->in_len-conn->in_pos;
+		char*  lf = memchr(start, '\n', avail);
+		size_t take = lf? (size_t)(lf-start)+1 : avail;
+		buf_add(line, start, take);
+		conn->in_pos += take;
+
+		if (lf) {
+			return 1;
+		}
+		if (line->bytes > 1024*1024) {
+			return 0; /* no line is that long */
+		}
+	}
+}
+
+
+static int read_bytes(lb_conn_t* conn, lb_buf_t* data, size_t bytes)
+{
+	while (bytes > 0)
+	{
+		if (conn->in_pos >= conn->in_len && !fill_in(conn)) {
+			return 0;
+		}
+
+		size_t take = DC_MIN(bytes, conn->in_len-conn->in_pos);
+		buf_add(data, &conn->in[conn->in_pos], take);
+		conn->in_pos += take;
+		bytes -= take;
+	}
+	return 1;
+}
+
+
+static void log_command(lb_conn_t* conn, const char* line)
+{
+	if (s_opts.verbose) {
+		int len = strcspn(line, "\r\n");
+		fprintf(stderr, "[%s %i] %.*s%s\n", conn->proto, conn->id, DC_MIN(len, 200), line, len>200? "..." : "");
+	}
+}
+
+
+static int count_command(lb_conn_t* conn) /* returns 0 if the connection should be dropped */
+{
+	conn->commands++;
+	if (s_opts.disconnect_after && conn->commands > s_opts.disconnect_after) {
+		if (s_opts.verbose) {
+			fprintf(stderr, "[%s %i] dropping connection after %i commands\n", conn->proto, conn->id, s_opts.disconnect_after);
+		}
+		return 0;
+	}
+	return 1;
+}
+
+
+/*******************************************************************************
+ * Maildir store
+ ******************************************************************************/
+
+
+#define LB_SEEN      0x01
+#define LB_ANSWERED  0x02
+#define LB_FLAGGED   0x04
+#define LB_DELETED   0x08
+#define LB_DRAFT     0x10
+
+
+typedef struct lb_msg_t
+{
+	uint32_t uid;
+	char*    base;      /* file name in cur/ without the ":2," info */
+	int      flags;
+	char*    keywords;  /* space separated, NULL if there are none */
+	uint64_t modseq;    /* mod-sequence of the last change */
+} lb_msg_t;
+
+
+typedef struct lb_expunged_t
+{
+	uint32_t uid;
+	uint64_t modseq;
+} lb_expunged_t;
+
+
+struct lb_folder_t
+{
+	char*          user;
+	char*          name;
+	char*          path;
+	uint32_t       uidvalidity;
+	uint32_t       uidnext;
+	lb_msg_t*      msgs;      /* sorted by UID */
+	size_t         cnt;
+	size_t         allocated;
+	uint64_t       highestmodseq;
+	uint64_t       expunged_floor; /* expunges before this mod-sequence are not known */
+	lb_expunged_t* expunged;
+	size_t         expunged_cnt;
+	size_t         expunged_allocated;
+	lb_folder_t*   next;
+};
+
+
+/* all folders are kept in memory once used, they are never freed;
+all access to the store is guarded by s_store_lock */
+static pthread_mutex_t s_store_lock = PTHREAD_MUTEX_INITIALIZER;
+static lb_folder_t*    s_folders = NULL;
+static lb_conn_t*      s_idling = NULL;
+static int             s_unique_cnt = 0;
+
+
+static char* flags_to_maildir(int flags)
+{
+	/* the letters must be in ASCII order */
+	char buf[8], *p = buf;
+	if (flags&LB_DRAFT)    { *p++ = 'D'; }
+	if (flags&LB_FLAGGED)  { *p++ = 'F'; }
+	if (flags&LB_ANSWERED) { *p++ = 'R'; }
+	if (flags&LB_SEEN)     { *p++ = 'S'; }
+	if (flags&LB_DELETED)  { *p++ = 'T'; }
+	*p = 0;
+	return dc_strdup(buf);
+}
+
+
+static int flags_from_maildir(const char* info)
+{
+	int flags = 0;
+	for (; info && *info; info++) {
+		switch (*info) {
+			case 'D': flags |= LB_DRAFT;    break;
+			case 'F': flags |= LB_FLAGGED;  break;
+			case 'R': flags |= LB_ANSWERED; break;
+			case 'S': flags |= LB_SEEN;     break;
+			case 'T': flags |= LB_DELETED;  break;
+		}
+	}
+	return flags;
+}
+
+
+static char* msg_path(const lb_folder_t* folder, const lb_msg_t* msg)
+{
+	char* letters = flags_to_maildir(msg->flags);
+	char* ret = dc_mprintf("%s/cur/%s:2,%s", folder->path, msg->base, letters);
+	free(letters);
+	return ret;
+}
+
+
+static char* unique_name(void) /* call with the lock held */
+{
+	return dc_mprintf("%lu.P%iQ%i.dc-loopback", (unsigned long)time(NULL), (int)getpid(), ++s_unique_cnt);
+}
+
+
+static void notify_change(void) /* call with the lock held */
+{
+	for (lb_conn_t* conn = s_idling; conn; conn = conn->next_idling) {
+		if (write(conn->wake_pipe[1], "!", 1) < 0) {
+			; /* the pipe is full, the connection is woken up anyway */
+		}
+	}
+}
+
+
+static void save_uidlist(lb_folder_t* folder)
+{
+	char* filename = dc_mprintf("%s/dc-loopback-uidlist", folder->path);
+	char* tmp_filename = dc_mprintf("%s.tmp", filename);
+	FILE* f = NULL;
+
+	if ((f=fopen(tmp_filename, "w"))!=NULL) {
+		fprintf(f, "%u %u\n", folder->uidvalidity, folder->uidnext);
+		for (size_t i = 0; i < folder->cnt; i++) {
+			fprintf(f, "%u %s%s%s\n", folder->msgs[i].uid, folder->msgs[i].base,
+				folder->msgs[i].keywords? " " : "", folder->msgs[i].keywords? folder->msgs[i].keywords : "");
+		}
+		fclose(f);
+		rename(tmp_filename, filename);
+	}
+
+	free(tmp_filename);
+	free(filename);
+}
+
+
+static void append_uidlist(lb_folder_t* folder, const lb_msg_t* msg)
+{
+	/* adding messages is the most common change, so we do not rewrite the file for it;
+	the UIDNEXT in the first line may be outdated, it is corrected when loading */
+	char* filename = dc_mprintf("%s/dc-loopback-uidlist", folder->path);
+	FILE* f = NULL;
+
+	if ((f=fopen(filename, "a"))!=NULL) {
+		fprintf(f, "%u %s%s%s\n", msg->uid, msg->base, msg->keywords? " " : "", msg->keywords? msg->keywords : "");
+		fclose(f);
+	}
+
+	free(filename);
+}
+
+
+static lb_msg_t* add_msg_entry(lb_folder_t* folder, uint32_t uid, const char* base, int flags, const char* keywords)
+{
+	if (folder->cnt >= folder->allocated) {
+		folder->allocated = DC_MAX(folder->allocated*2, 64);
+		if ((folder->msgs=realloc(folder->msgs, folder->allocated*sizeof(lb_msg_t)))==NULL) {
+			exit(1);
+		}
+	}
+
+	lb_msg_t* msg = &folder->msgs[folder->cnt++];
+	msg->uid      = uid;
+	msg->base     = dc_strdup(base);
+	msg->flags    = flags;
+	msg->keywords = (keywords && keywords[0])? dc_strdup(keywords) : NULL;
+	msg->modseq   = ++folder->highestmodseq;
+	return msg;
+}
+
+
+static void remove_msg_entry(lb_folder_t* folder, size_t i)
+{
+	/* remember the expunge for `VANISHED (EARLIER)` */
+	if (folder->expunged_cnt >= folder->expunged_allocated) {
+		folder->expunged_allocated = DC_MAX(folder->expunged_allocated*2, 64);
+		if ((folder->expunged=realloc(folder->expunged, folder->expunged_allocated*sizeof(lb_expunged_t)))==NULL) {
+			exit(1);
+		}
+	}
+	folder->expunged[folder->expunged_cnt].uid = folder->msgs[i].uid;
+	folder->expunged[folder->expunged_cnt].modseq = ++folder->highestmodseq;
+	folder->expunged_cnt++;
+
+	free(folder->msgs[i].base);
+	free(folder->msgs[i].keywords);
+	memmove(&folder->msgs[i], &folder->msgs[i+1], (folder->cnt-i-1)*sizeof(lb_msg_t));
+	folder->cnt--;
+}
+
+
+static int cmp_strings(const void* p1, const void* p2)
+{
+	return strcmp(*(char* const*)p1, *(char* const*)p2);
+}
+
+
+static int scan_folder(lb_folder_t* folder)
+{
+	/* sync the folder with the files on disk, new files get new UIDs;
+	returns 1 if messages were added or removed */
+	DIR*           dir = NULL;
+	struct dirent* entry = NULL;
+	dc_hash_t      on_disk;
+	char**         new_names = NULL;
+	size_t         new_cnt = 0;
+	int            changed = 0;
+
+	dc_hash_init(&on_disk, DC_HASH_STRING, DC_HASH_COPY_KEY);
+
+	/* move new mails to cur/, we do not use the "recent" state */
+	char* new_dir = dc_mprintf("%s/new", folder->path);
+	if ((dir=opendir(new_dir))!=NULL) {
+		while ((entry=readdir(dir))!=NULL) {
+			if (entry->d_name[0]!='.') {
+				char* src = dc_mprintf("%s/%s", new_dir, entry->d_name);
+				char* dest = dc_mprintf("%s/cur/%s%s", folder->path, entry->d_name, strchr(entry->d_name, ':')? "" : ":2,");
+				rename(src, dest);
+				free(dest);
+				free(src);
+			}
+		}
+		closedir(dir);
+	}
+	free(new_dir);
+
+	char* cur_dir = dc_mprintf("%s/cur", folder->path);
+	if ((dir=opendir(cur_dir))!=NULL) {
+		while ((entry=readdir(dir))!=NULL) {
+			if (entry->d_name[0]!='.') {
+				char* base = dc_strdup(entry->d_name);
+				char* info = strstr(base, ":2,");
+				int   flags = 0;
+				if (info) {
+					flags = flags_from_maildir(info+3);
+					*info = 0;
+				}
+				dc_hash_insert_str(&on_disk, base, (void*)(uintptr_t)(flags|0x100));
+				free(base);
+			}
+		}
+		closedir(dir);
+	}
+	free(cur_dir);
+
+	for (size_t i = 0; i < folder->cnt; ) {
+		uintptr_t found = (uintptr_t)dc_hash_find_str(&on_disk, folder->msgs[i].base);
+		if (found==0) {
+			remove_msg_entry(folder, i);
+			changed = 1;
+		}
+		else {
+			if (folder->msgs[i].flags!=(int)(found&0xFF)) {
+				folder->msgs[i].flags = (int)(found&0xFF);
+				folder->msgs[i].modseq = ++folder->highestmodseq;
+			}
+			dc_hash_insert_str(&on_disk, folder->msgs[i].base, (void*)(uintptr_t)0x200); /* mark as known */
+			i++;
+		}
+	}
+
+	/* the remaining files are new, maildir names start with the time, so sorting gives a sensible order */
+	for (dc_hashelem_t* e = dc_hash_first(&on_disk); e; e = dc_hash_next(e)) {
+		if ((uintptr_t)dc_hash_data(e)!=0x200) {
+			if ((new_names=realloc(new_names, (new_cnt+1)*sizeof(char*)))==NULL) {
+				exit(1);
+			}
+			new_names[new_cnt++] = dc_null_terminate(dc_hash_key(e), dc_hash_keysize(e));
+		}
+	}
+	qsort(new_names, new_cnt, sizeof(char*), cmp_strings);
+	for (size_t i = 0; i < new_cnt; i++) {
+		uintptr_t found = (uintptr_t)dc_hash_find_str(&on_disk, new_names[i]);
+		append_uidlist(folder, add_msg_entry(folder, folder->uidnext++, new_names[i], (int)(found&0xFF), NULL));
+		free(new_names[i]);
+		changed = 1;
+	}
+	free(new_names);
+
+	if (changed) {
+		save_uidlist(folder);
+	}
+
+	dc_hash_clear(&on_disk);
+	return changed;
+}
+
+
+static void load_folder(lb_folder_t* folder)
+{
+	char* filename = dc_mprintf("%s/dc-loopback-uidlist", folder->path);
+	FILE* f = NULL;
+	char  line[4096];
+
+	folder->uidvalidity = (uint32_t)time(NULL);
+	folder->uidnext = 1;
+	folder->highestmodseq = (uint64_t)time(NULL)*1000000;
+	folder->expunged_floor = folder->highestmodseq;
+
+	if ((f=fopen(filename, "r"))!=NULL) {
+		if (fgets(line, sizeof(line), f)) {
+			sscanf(line, "%u %u", &folder->uidvalidity, &folder->uidnext);
+		}
+		while (fgets(line, sizeof(line), f)) {
+			char* p = NULL;
+			uint32_t uid = (uint32_t)strtoul(line, &p, 10);
+			if (uid==0 || *p!=' ') {
+				continue;
+			}
+			p++;
+			p[strcspn(p, "\r\n")] = 0;
+			char* keywords = strchr(p, ' ');
+			if (keywords) {
+				*keywords++ = 0;
+			}
+			if (folder->cnt && uid <= folder->msgs[folder->cnt-1].uid) {
+				continue; /* UIDs must be ascending */
+			}
+			add_msg_entry(folder, uid, p, 0, keywords);
+			folder->uidnext = DC_MAX(folder->uidnext, uid+1);
+		}
+		fclose(f);
+	}
+	else {
+		save_uidlist(folder);
+	}
+
+	free(filename);
+	scan_folder(folder);
+}
+
+
+static char* user_path(const char* user)
+{
+	char* safe = dc_strlower(user);
+	for (char* p = safe; *p; p++) {
+		if (*p=='/' || (p==safe && *p=='.')) {
+			*p = '_';
+		}
+	}
+	char* ret = dc_mprintf("%s/%s", s_opts.maildir, safe);
+	free(safe);
+	return ret;
+}
+
+
+static int is_valid_folder_name(const char* name)
+{
+	return name && name[0] && name[0]!='.' && strchr(name, '/')==NULL;
+}
+
+
+static lb_folder_t* get_folder(const char* user, const char* name_, int create) /* call with the lock held */
+{
+	lb_folder_t* folder = NULL;
+	const char*  name = strcasecmp(name_, "INBOX")==0? "INBOX" : name_;
+	char*        root = NULL;
+	char*        path = NULL;
+	struct stat  st;
+
+	for (folder = s_folders; folder; folder = folder->next) {
+		if (strcmp(folder->user, user)==0 && strcmp(folder->name, name)==0) {
+			return folder;
+		}
+	}
+
+	if (!is_valid_folder_name(name)) {
+		return NULL;
+	}
+
+	root = user_path(user);
+	path = strcmp(name, "INBOX")==0? dc_strdup(root) : dc_mprintf("%s/.%s", root, name);
+	if (stat(path, &st)!=0 || !S_ISDIR(st.st_mode)) {
+		if (!create) {
+			goto cleanup;
+		}
+		mkdir(root, 0700);
+		mkdir(path, 0700);
+	}
+	{
+		/* make sure, the maildir subdirectories exist, also for INBOX */
+		static const char* subdirs[] = { "cur", "new", "tmp" };
+		for (int i = 0; i < 3; i++) {
+			char* subdir = dc_mprintf("%s/%s", path, subdirs[i]);
+			mkdir(subdir, 0700);
+			free(subdir);
+		}
+	}
+
+	if ((folder=calloc(1, sizeof(lb_folder_t)))==NULL) {
+		exit(1);
+	}
+	folder->user = dc_strdup(user);
+	folder->name = dc_strdup(name);
+	folder->path = path;
+	path = NULL;
+	load_folder(folder);
+
+	folder->next = s_folders;
+	s_folders = folder;
+
+cleanup:
+	free(path);
+	free(root);
+	return folder;
+}
+
+
+static int find_msg(const lb_folder_t* folder, uint32_t uid) /* returns the index or -1 */
+{
+	size_t lo = 0, hi = folder->cnt;
+	while (lo < hi) {
+		size_t mid = (lo+hi)/2;
+		if (folder->msgs[mid].uid==uid) {
+			return (int)mid;
+		}
+		else if (folder->msgs[mid].uid < uid) {
+			lo = mid+1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return -1;
+}
+
+
+static uint32_t add_msg(lb_folder_t* folder, const char* data, size_t bytes, int flags, const char* keywords) /* call with the lock held */
+{
+	char*     base = unique_name();
+	char*     tmp_filename = dc_mprintf("%s/tmp/%s", folder->path, base);
+	char*     filename = NULL;
+	FILE*     f = NULL;
+	uint32_t  uid = 0;
+	lb_msg_t* msg = NULL;
+
+	if ((f=fopen(tmp_filename, "wb"))==NULL) {
+		goto cleanup;
+	}
+	if (fwrite(data, 1, bytes, f)!=bytes) {
+		fclose(f);
+		unlink(tmp_filename);
+		goto cleanup;
+	}
+	fclose(f);
+
+	msg = add_msg_entry(folder, folder->uidnext++, base, flags, keywords);
+	filename = msg_path(folder, msg);
+	rename(tmp_filename, filename);
+	append_uidlist(folder, msg);
+	uid = msg->uid;
+	notify_change();
+
+cleanup:
+	free(filename);
+	free(tmp_filename);
+	free(base);
+	return uid;
+}
+
+
+static void set_msg_flags(lb_folder_t* folder, lb_msg_t* msg, int flags, const char* keywords) /* call with the lock held */
+{
+	if (flags!=msg->flags) {
+		char* old_filename = msg_path(folder, msg);
+		msg->flags = flags;
+		msg->modseq = ++folder->highestmodseq;
+		char* new_filename = msg_path(folder, msg);
+		rename(old_filename, new_filename);
+		free(new_filename);
+		free(old_filename);
+	}
+
+	if (keywords && !keywords[0]) {
+		keywords = NULL;
+	}
+	if ((keywords==NULL) != (msg->keywords==NULL)
+	 || (keywords && strcmp(keywords, msg->keywords)!=0)) {
+		free(msg->keywords);
+		msg->keywords = dc_strdup_keep_null(keywords);
+		msg->modseq = ++folder->highestmodseq;
+		save_uidlist(folder);
+	}
+}
+
+
+static void remove_msg(lb_folder_t* folder, size_t i) /* call with the lock held, the caller should save the uidlist */
+{
+	char* filename = msg_path(folder, &folder->msgs[i]);
+	unlink(filename);
+	free(filename);
+	remove_msg_entry(folder, i);
+}
+
+
+static char* read_msg(const lb_folder_t* folder, const lb_msg_t* msg, size_t* ret_bytes)
+{
+	/* read a message, bare LF are converted to CRLF as needed by IMAP */
+	char*    filename = msg_path(folder, msg);
+	char*    raw = NULL;
+	size_t   raw_bytes = 0;
+	lb_buf_t ret = { NULL, 0, 0 };
+
+	*ret_bytes = 0;
+	FILE* f = fopen(filename, "rb");
+	if (f) {
+		char chunk[65536];
+		lb_buf_t file = { NULL, 0, 0 };
+		size_t   n = 0;
+		while ((n=fread(chunk, 1, sizeof(chunk), f)) > 0) {
+			buf_add(&file, chunk, n);
+		}
+		fclose(f);
+		raw = file.buf;
+		raw_bytes = file.bytes;
+	}
+
+	for (size_t i = 0, start = 0; i <= raw_bytes; i++) {
+		if (i==raw_bytes || (raw[i]=='\n' && (i==0 || raw[i-1]!='\r'))) {
+			buf_add(&ret, &raw[start], i-start);
+			if (i<raw_bytes) {
+				buf_add(&ret, "\r\n", 2);
+			}
+			start = i+1;
+		}
+	}
+	if (ret.buf==NULL) {
+		buf_add(&ret, "", 0);
+	}
+
+	free(raw);
+	free(filename);
+	*ret_bytes = ret.bytes;
+	return ret.buf;
+}
+
+
+/*******************************************************************************
+ * IMAP parsing
+ ******************************************************************************/
+
+
+#define LB_CAPABILITIES "IMAP4rev1 IDLE UIDPLUS MOVE LITERAL+ ENABLE ID CONDSTORE QRESYNC COMPRESS=DEFLATE"
+
+
+typedef struct lb_parser_t
+{
+	const char* p;
+	const char* end;
+} lb_parser_t;
+
+
+static char* parse_token(lb_parser_t* ps, size_t* ret_bytes)
+{
+	/* returns the next atom, quoted string, literal or list; lists are returned with the parentheses */
+	const char* start = NULL;
+	lb_buf_t    ret = { NULL, 0, 0 };
+
+	while (ps->p < ps->end && *ps->p==' ') {
+		ps->p++;
+	}
+	if (ps->p >= ps->end) {
+		return NULL;
+	}
+
+	if (*ps->p=='"')
+	{
+		for (ps->p++; ps->p < ps->end && *ps->p!='"'; ps->p++) {
+			if (*ps->p=='\\' && ps->p+1 < ps->end) {
+				ps->p++;
+			}
+			buf_add(&ret, ps->p, 1);
+		}
+		ps->p++;
+	}
+	else if (*ps->p=='{')
+	{
+		char*  p = NULL;
+		size_t bytes = strtoul(ps->p+1, &p, 10);
+		if ((p=strstr(p, "}\r\n"))==NULL || p+3+bytes > ps->end) {
+			ps->p = ps->end;
+			return NULL;
+		}
+		buf_add(&ret, p+3, bytes);
+		ps->p = p+3+bytes;
+	}
+	else if (*ps->p=='(')
+	{
+		int depth = 0, quoted = 0;
+		start = ps->p;
+		for (; ps->p < ps->end; ps->p++) {
+			if (quoted) {
+				if (*ps->p=='\\') { ps->p++; }
+				else if (*ps->p=='"') { quoted = 0; }
+			}
+			else if (*ps->p=='"') { quoted = 1; }
+			else if (*ps->p=='(') { depth++; }
+			else if (*ps->p==')' && --depth==0) { ps->p++; break; }
+		}
+		buf_add(&ret, start, ps->p-start);
+	}
+	else
+	{
+		/* atoms may contain sections as BODY.PEEK[HEADER.FIELDS (A B)] */
+		int depth = 0;
+		start = ps->p;
+		for (; ps->p < ps->end; ps->p++) {
+			if (*ps->p=='[') { depth++; }
+			else if (*ps->p==']') { depth--; }
+			else if (depth<=0 && (*ps->p==' ' || *ps->p==')' || *ps->p=='(')) { break; }
+		}
+		buf_add(&ret, start, ps->p-start);
+	}
+
+	if (ret.buf==NULL) {
+		buf_add(&ret, "", 0);
+	}
+	if (ret_bytes) {
+		*ret_bytes = ret.bytes;
+	}
+	return ret.buf;
+}
+
+
+static void parser_init_list(lb_parser_t* ps, const char* list)
+{
+	/* parse the items of a list token; a single item without parentheses is fine as well */
+	ps->p = list;
+	ps->end = list+strlen(list);
+	if (*ps->p=='(' && ps->end>ps->p && ps->end[-1]==')') {
+		ps->p++;
+		ps->end--;
+	}
+}
+
+
+static int read_command(lb_conn_t* conn, lb_buf_t* cmd)
+{
+	/* read a command line including literals, the result is as sent, but without the final CRLF */
+	cmd->bytes = 0;
+	while (1)
+	{
+		if (!read_line(conn, cmd)) {
+			return 0;
+		}
+
+		/* check for a literal at the end of the line */
+		char* end = &cmd->buf[cmd->bytes];
+		while (end > cmd->buf && (end[-1]=='\r' || end[-1]=='\n')) {
+			end--;
+		}
+		if (end==cmd->buf || end[-1]!='}') {
+			cmd->bytes = end-cmd->buf;
+			cmd->buf[cmd->bytes] = 0;
+			return 1;
+		}
+
+		char* open = end-1;
+		while (open > cmd->buf && *open!='{') {
+			open--;
+		}
+		int    plus = end[-2]=='+';
+		size_t bytes = strtoul(open+1, NULL, 10);
+		if (plus) {
+			/* normalize "{n+}" to "{n}" for the parser */
+			memmove(end-2, end-1, cmd->bytes-(end-1-cmd->buf));
+			cmd->bytes--;
+		}
+		else {
+			buf_add(&conn->out, "+ Ready for literal data\r\n", 26);
+			if (!flush_out(conn)) {
+				return 0;
+			}
+		}
+
+		if (!read_bytes(conn, cmd, bytes)) {
+			return 0;
+		}
+	}
+}
+
+
+static int in_set(const char* set, uint32_t n, uint32_t max)
+{
+	/* check if a number is in a sequence set as "1,3:5,7:*" */
+	const char* p = set;
+	while (*p)
+	{
+		uint32_t lo = 0, hi = 0;
+		char*    next = NULL;
+		if (*p=='*') { lo = max; next = (char*)p+1; } else { lo = (uint32_t)strtoul(p, &next, 10); }
+		hi = lo;
+		if (*next==':') {
+			p = next+1;
+			if (*p=='*') { hi = max; next = (char*)p+1; } else { hi = (uint32_t)strtoul(p, &next, 10); }
+		}
+		if (lo > hi) {
+			uint32_t t = lo; lo = hi; hi = t;
+		}
+		if (n>=lo && n<=hi) {
+			return 1;
+		}
+		if (next==p || (*next!=',' && *next!=0)) {
+			return 0; /* syntax error */
+		}
+		p = *next? next+1 : next;
+	}
+	return 0;
+}
+
+
+static int parse_flags(const char* list, char** ret_keywords)
+{
+	/* returns the system flags as LB_* and the keywords as a space separated string */
+	lb_parser_t ps;
+	char*       token = NULL;
+	int         flags = 0;
+	lb_buf_t    keywords = { NULL, 0, 0 };
+
+	parser_init_list(&ps, list);
+	while ((token=parse_token(&ps, NULL))!=NULL) {
+		if      (strcasecmp(token, "\\Seen")==0)     { flags |= LB_SEEN; }
+		else if (strcasecmp(token, "\\Answered")==0) { flags |= LB_ANSWERED; }
+		else if (strcasecmp(token, "\\Flagged")==0)  { flags |= LB_FLAGGED; }
+		else if (strcasecmp(token, "\\Deleted")==0)  { flags |= LB_DELETED; }
+		else if (strcasecmp(token, "\\Draft")==0)    { flags |= LB_DRAFT; }
+		else if (token[0] && token[0]!='\\') {
+			if (keywords.bytes) {
+				buf_add(&keywords, " ", 1);
+			}
+			buf_add(&keywords, token, strlen(token));
+		}
+		free(token);
+	}
+
+	*ret_keywords = keywords.buf;
+	return flags;
+}
+
+
+static int has_keyword(const char* keywords, const char* keyword)
+{
+	size_t len = strlen(keyword);
+	for (const char* p = keywords; p && *p; ) {
+		size_t n = strcspn(p, " ");
+		if (n==len && strncasecmp(p, keyword, len)==0) {
+			return 1;
+		}
+		p += n;
+		while (*p==' ') { p++; }
+	}
+	return 0;
+}
+
+
+static char* merge_keywords(const char* old, const char* change, int add)
+{
+	lb_buf_t    ret = { NULL, 0, 0 };
+	const char* p = NULL;
+
+	for (p = old; p && *p; ) {
+		size_t n = strcspn(p, " ");
+		char*  keyword = dc_null_terminate(p, n);
+		if (add || !has_keyword(change, keyword)) {
+			buf_addf(&ret, "%s%s", ret.bytes? " " : "", keyword);
+		}
+		free(keyword);
+		p += n;
+		while (*p==' ') { p++; }
+	}
+
+	for (p = change; add && p && *p; ) {
+		size_t n = strcspn(p, " ");
+		char*  keyword = dc_null_terminate(p, n);
+		if (!has_keyword(old, keyword)) {
+			buf_addf(&ret, "%s%s", ret.bytes? " " : "", keyword);
+		}
+		free(keyword);
+		p += n;
+		while (*p==' ') { p++; }
+	}
+
+	return ret.buf;
+}
+
+
+/*******************************************************************************
+ * IMAP responses
+ ******************************************************************************/
+
+
+static void add_string(lb_buf_t* out, const char* str, size_t bytes)
+{
+	/* add a string as quoted string, if possible, else as literal */
+	int quoted = bytes < 1000;
+	for (size_t i = 0; i < bytes && quoted; i++) {
+		if (str[i]=='\r' || str[i]=='\n' || str[i]==0 || (unsigned char)str[i]>=0x80) {
+			quoted = 0;
+		}
+	}
+
+	if (quoted) {
+		buf_add(out, "\"", 1);
+		for (size_t i = 0; i < bytes; i++) {
+			if (str[i]=='"' || str[i]=='\\') {
+				buf_add(out, "\\", 1);
+			}
+			buf_add(out, &str[i], 1);
+		}
+		buf_add(out, "\"", 1);
+	}
+	else {
+		buf_addf(out, "{%lu}\r\n", (unsigned long)bytes);
+		buf_add(out, str, bytes);
+	}
+}
+
+
+static void add_nstring(lb_buf_t* out, const char* str)
+{
+	if (str==NULL) {
+		buf_add(out, "NIL", 3);
+	}
+	else {
+		add_string(out, str, strlen(str));
+	}
+}
+
+
+static void add_flags(lb_buf_t* out, int flags, const char* keywords)
+{
+	lb_buf_t list = { NULL, 0, 0 };
+	if (flags&LB_SEEN)     { buf_addf(&list, " \\Seen"); }
+	if (flags&LB_ANSWERED) { buf_addf(&list, " \\Answered"); }
+	if (flags&LB_FLAGGED)  { buf_addf(&list, " \\Flagged"); }
+	if (flags&LB_DELETED)  { buf_addf(&list, " \\Deleted"); }
+	if (flags&LB_DRAFT)    { buf_addf(&list, " \\Draft"); }
+	if (keywords)          { buf_addf(&list, " %s", keywords); }
+	buf_addf(out, "FLAGS (%s)", list.bytes? list.buf+1 : "");
+	buf_empty(&list);
+}
+
+
+static void add_uid_set(lb_buf_t* out, const uint32_t* uids, size_t cnt)
+{
+	/* add sorted UIDs as a sequence set, consecutive UIDs are combined to ranges */
+	for (size_t i = 0; i < cnt; ) {
+		size_t j = i;
+		while (j+1 < cnt && uids[j+1]==uids[j]+1) {
+			j++;
+		}
+		buf_addf(out, j>i? "%s%u:%u" : "%s%u", i? "," : "", uids[i], uids[j]);
+		i = j+1;
+	}
+}
+
+
+static size_t header_bytes(const char* msg, size_t bytes)
+{
+	/* returns the size of the header including the empty line */
+	for (size_t i = 0; i+1 < bytes; i++) {
+		if (msg[i]=='\n' && (msg[i+1]=='\n' || (msg[i+1]=='\r' && i+2<bytes && msg[i+2]=='\n'))) {
+			return i+1 + (msg[i+1]=='\r'? 2 : 1);
+		}
+	}
+	return bytes;
+}
+
+
+static int header_line_matches(const char* line, const char* names)
+{
+	/* check if a header line belongs to one of the names in a list as "(MESSAGE-ID DATE)" */
+	lb_parser_t ps;
+	char*       name = NULL;
+	size_t      len = strcspn(line, ":\r\n");
+	int         ret = 0;
+
+	parser_init_list(&ps, names);
+	while (!ret && (name=parse_token(&ps, NULL))!=NULL) {
+		ret = strlen(name)==len && strncasecmp(line, name, len)==0;
+		free(name);
+	}
+	return ret;
+}
+
+
+static char* get_header_fields(const char* msg, size_t hdr_bytes, const char* names, int not)
+{
+	lb_buf_t ret = { NULL, 0, 0 };
+	int      matches = 0;
+
+	for (size_t i = 0; i < hdr_bytes; ) {
+		const char* line = &msg[i];
+		const char* lf = memchr(line, '\n', hdr_bytes-i);
+		size_t      len = lf? (size_t)(lf-line)+1 : hdr_bytes-i;
+		if (line[0]=='\r' || line[0]=='\n') {
+			break;
+		}
+		if (line[0]!=' ' && line[0]!='\t') {
+			matches = header_line_matches(line, names) != not;
+		}
+		if (matches) {
+			buf_add(&ret, line, len);
+		}
+		i += len;
+	}
+
+	buf_add(&ret, "\r\n", 2);
+	return ret.buf;
+}
+
+
+static char* get_header(const char* msg, size_t hdr_bytes, const char* name)
+{
+	/* returns the unfolded value of the first header with the given name or NULL */
+	char* names = dc_mprintf("(%s)", name);
+	char* lines = get_header_fields(msg, hdr_bytes, names, 0);
+	char* ret = NULL;
+
+	if (lines[0]!='\r') {
+		lb_buf_t value = { NULL, 0, 0 };
+		const char* p = strchr(lines, ':')+1;
+		while (*p==' ' || *p=='\t') { p++; }
+		for (; *p; p++) {
+			if (*p=='\n' && p[1]!=' ' && p[1]!='\t') {
+				break; /* end of the first header, there may be more with the same name */
+			}
+			if (*p!='\r' && *p!='\n') {
+				buf_add(&value, p, 1);
+			}
+		}
+		ret = value.buf? value.buf : dc_strdup("");
+	}
+
+	free(lines);
+	free(names);
+	return ret;
+}
+
+
+static void add_address_list(lb_buf_t* out, const char* value)
+{
+	/* add an address list of the envelope, this is a simplified parser, no groups, no comments */
+	int added = 0;
+
+	for (const char* p = value; p && *p; )
+	{
+		const char* start = p;
+		int         quoted = 0;
+		while (*p && (quoted || *p!=',')) {
+			if (*p=='"') { quoted = !quoted; }
+			p++;
+		}
+		char* item = dc_null_terminate(start, p-start);
+		if (*p==',') { p++; }
+
+		char* name = NULL;
+		char* addr = NULL;
+		char* lt = strchr(item, '<');
+		if (lt) {
+			char* gt = strchr(lt, '>');
+			addr = dc_null_terminate(lt+1, gt? gt-lt-1 : (int)strlen(lt+1));
+			name = dc_null_terminate(item, lt-item);
+			dc_trim(name);
+			if (name[0]=='"') {
+				memmove(name, name+1, strlen(name));
+				if (name[0] && name[strlen(name)-1]=='"') { name[strlen(name)-1] = 0; }
+			}
+			if (name[0]==0) {
+				free(name);
+				name = NULL;
+			}
+		}
+		else {
+			addr = dc_strdup(item);
+		}
+		dc_trim(addr);
+
+		if (addr[0]) {
+			char* at = strchr(addr, '@');
+			if (at) { *at++ = 0; }
+			buf_add(out, added? "(" : "((", added? 1 : 2);
+			add_nstring(out, name);
+			buf_add(out, " NIL ", 5);
+			add_nstring(out, addr);
+			buf_add(out, " ", 1);
+			add_nstring(out, at? at : "");
+			buf_add(out, ")", 1);
+			added = 1;
+		}
+
+		free(name);
+		free(addr);
+		free(item);
+	}
+
+	if (added) {
+		buf_add(out, ")", 1);
+	}
+	else {
+		buf_add(out, "NIL", 3);
+	}
+}
+
+
+static void add_envelope(lb_buf_t* out, const char* msg, size_t bytes)
+{
+	size_t hdr_bytes = header_bytes(msg, bytes);
+	char*  from = get_header(msg, hdr_bytes, "FROM");
+	char*  sender = get_header(msg, hdr_bytes, "SENDER");
+	char*  reply_to = get_header(msg, hdr_bytes, "REPLY-TO");
+	static const char* strings[] = { "DATE", "SUBJECT" };
+	static const char* addresses[] = { "TO", "CC", "BCC" };
+	static const char* ids[] = { "IN-REPLY-TO", "MESSAGE-ID" };
+
+	buf_add(out, "ENVELOPE (", 10);
+	for (int i = 0; i < 2; i++) {
+		char* value = get_header(msg, hdr_bytes, strings[i]);
+		add_nstring(out, value);
+		buf_add(out, " ", 1);
+		free(value);
+	}
+	add_address_list(out, from);
+	buf_add(out, " ", 1);
+	add_address_list(out, sender? sender : from);
+	buf_add(out, " ", 1);
+	add_address_list(out, reply_to? reply_to : from);
+	for (int i = 0; i < 3; i++) {
+		char* value = get_header(msg, hdr_bytes, addresses[i]);
+		buf_add(out, " ", 1);
+		add_address_list(out, value);
+		free(value);
+	}
+	for (int i = 0; i < 2; i++) {
+		char* value = get_header(msg, hdr_bytes, ids[i]);
+		buf_add(out, " ", 1);
+		add_nstring(out, value);
+		free(value);
+	}
+	buf_add(out, ")", 1);
+
+	free(reply_to);
+	free(sender);
+	free(from);
+}
+
+
+static void sync_view(lb_conn_t* conn, int allow_expunge)
+{
+	/* tell the client about messages added to or removed from the selected folder */
+	if (conn->selected==NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&s_store_lock);
+
+		lb_folder_t* folder = conn->selected;
+
+		if (allow_expunge) {
+			/* with QRESYNC enabled, expunges are reported as `VANISHED <uids>`, see RFC 7162 3.2.10 */
+			uint32_t* vanished = NULL;
+			size_t    vanished_cnt = 0;
+			for (size_t i = 0; i < conn->view_cnt; ) {
+				if (find_msg(folder, conn->view[i]) < 0) {
+					if (conn->qresync) {
+						if ((vanished=realloc(vanished, (vanished_cnt+1)*sizeof(uint32_t)))==NULL) {
+							exit(1);
+						}
+						vanished[vanished_cnt++] = conn->view[i];
+					}
+					else {
+						buf_addf(&conn->out, "* %i EXPUNGE\r\n", (int)i+1);
+					}
+					memmove(&conn->view[i], &conn->view[i+1], (conn->view_cnt-i-1)*sizeof(uint32_t));
+					conn->view_cnt--;
+				}
+				else {
+					i++;
+				}
+			}
+			if (vanished_cnt) {
+				buf_addf(&conn->out, "* VANISHED ");
+				add_uid_set(&conn->out, vanished, vanished_cnt);
+				buf_addf(&conn->out, "\r\n");
+			}
+			free(vanished);
+		}
+
+		uint32_t last_uid = conn->view_cnt? conn->view[conn->view_cnt-1] : 0;
+		size_t   old_cnt = conn->view_cnt;
+		for (size_t i = 0; i < folder->cnt; i++) {
+			if (folder->msgs[i].uid > last_uid) {
+				if (conn->view_cnt >= conn->view_allocated) {
+					conn->view_allocated = DC_MAX(conn->view_allocated*2, 64);
+					if ((conn->view=realloc(conn->view, conn->view_allocated*sizeof(uint32_t)))==NULL) {
+						exit(1);
+					}
+				}
+				conn->view[conn->view_cnt++] = folder->msgs[i].uid;
+			}
+		}
+		if (conn->view_cnt!=old_cnt) {
+			buf_addf(&conn->out, "* %i EXISTS\r\n", (int)conn->view_cnt);
+		}
+
+	pthread_mutex_unlock(&s_store_lock);
+}
+
+
+static int finish(lb_conn_t* conn, const char* tag, int allow_expunge, const char* format, ...)
+{
+	/* send the tagged response, the configured latency is added before */
+	char*   str = NULL;
+	va_list va;
+
+	va_start(va, format);
+	if (vasprintf(&str, format, va) < 0) {
+		exit(1);
+	}
+	va_end(va);
+
+	if (strncmp(str, "OK", 2)==0) {
+		sync_view(conn, allow_expunge);
+	}
+
+	sleep_ms(s_opts.latency_ms);
+	buf_addf(&conn->out, "%s %s\r\n", tag, str);
+	free(str);
+	return flush_out(conn);
+}
+
+
+/*******************************************************************************
+ * IMAP commands
+ ******************************************************************************/
+
+
+static int pattern_matches(const char* pattern, const char* name)
+{
+	/* LIST patterns, `*` matches everything, `%` everything but the delimiter */
+	if (*pattern==0) {
+		return *name==0;
+	}
+	if (*pattern=='*' || *pattern=='%') {
+		for (const char* p = name; ; p++) {
+			if (pattern_matches(pattern+1, p)) {
+				return 1;
+			}
+			if (*p==0 || (*pattern=='%' && *p=='.')) {
+				return 0;
+			}
+		}
+	}
+	if (tolower(*pattern)!=tolower(*name)) {
+		return 0;
+	}
+	return pattern_matches(pattern+1, name+1);
+}
+
+
+static int imap_list(lb_conn_t* conn, const char* tag, lb_parser_t* ps, const char* cmd)
+{
+	char*          ref = parse_token(ps, NULL);
+	char*          pattern = parse_token(ps, NULL);
+	char*          root = user_path(conn->user);
+	DIR*           dir = NULL;
+	struct dirent* entry = NULL;
+
+	if (pattern && pattern[0]==0) {
+		/* an empty pattern asks for the delimiter */
+		buf_addf(&conn->out, "* %s (\\Noselect) \".\" \"\"\r\n", cmd);
+	}
+	else if (pattern) {
+		if (pattern_matches(pattern, "INBOX")) {
+			buf_addf(&conn->out, "* %s (\\HasNoChildren) \".\" \"INBOX\"\r\n", cmd);
+		}
+		if ((dir=opendir(root))!=NULL) {
+			while ((entry=readdir(dir))!=NULL) {
+				const char* name = entry->d_name+1;
+				if (entry->d_name[0]=='.' && is_valid_folder_name(name) && pattern_matches(pattern, name)) {
+					buf_addf(&conn->out, "* %s (\\HasNoChildren) \".\" ", cmd);
+					add_string(&conn->out, name, strlen(name));
+					buf_add(&conn->out, "\r\n", 2);
+				}
+			}
+			closedir(dir);
+		}
+	}
+
+	free(root);
+	free(pattern);
+	free(ref);
+	return finish(conn, tag, 1, "OK %s completed", cmd);
+}
+
+
+static int imap_create(lb_conn_t* conn, const char* tag, lb_parser_t* ps)
+{
+	char* name = parse_token(ps, NULL);
+	int   exists = 0;
+	int   ok = 0;
+
+	pthread_mutex_lock(&s_store_lock);
+		if (name && is_valid_folder_name(name)) {
+			exists = get_folder(conn->user, name, 0)!=NULL;
+			ok = exists || get_folder(conn->user, name, 1)!=NULL;
+		}
+	pthread_mutex_unlock(&s_store_lock);
+
+	free(name);
+	if (exists) {
+		return finish(conn, tag, 1, "NO [ALREADYEXISTS] Mailbox already exists");
+	}
+	return finish(conn, tag, 1, ok? "OK CREATE completed" : "NO Cannot create mailbox");
+}
+
+
+static int imap_select(lb_conn_t* conn, const char* tag, lb_parser_t* ps, int readonly)
+{
+	char*        name = parse_token(ps, NULL);
+	char*        params = parse_token(ps, NULL);
+	lb_folder_t* folder = NULL;
+	uint32_t     uidvalidity = 0, uidnext = 0;
+	uint64_t     highestmodseq = 0;
+
+	conn->selected = NULL;
+	conn->view_cnt = 0;
+
+	/* `SELECT <name> (CONDSTORE)` enables CONDSTORE; the QRESYNC parameter is not supported */
+	if (params && strcasestr(params, "QRESYNC")) {
+		free(params);
+		free(name);
+		return finish(conn, tag, 1, "BAD QRESYNC parameter not supported");
+	}
+	if (params && strcasestr(params, "CONDSTORE")) {
+		conn->condstore = 1;
+	}
+	free(params);
+
+	pthread_mutex_lock(&s_store_lock);
+		if (name && (folder=get_folder(conn->user, name, 0))!=NULL) {
+			scan_folder(folder);
+			uidvalidity = folder->uidvalidity;
+			uidnext = folder->uidnext;
+			highestmodseq = folder->highestmodseq;
+		}
+	pthread_mutex_unlock(&s_store_lock);
+
+	free(name);
+	if (folder==NULL) {
+		return finish(conn, tag, 1, "NO Mailbox does not exist");
+	}
+
+	conn->selected = folder;
+	conn->readonly = readonly;
+	buf_addf(&conn->out, "* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n");
+	buf_addf(&conn->out, "* OK [PERMANENTFLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft \\*)] Flags permitted\r\n");
+	sync_view(conn, 0);
+	if (conn->view_cnt==0) {
+		buf_addf(&conn->out, "* 0 EXISTS\r\n");
+	}
+	buf_addf(&conn->out, "* 0 RECENT\r\n");
+	buf_addf(&conn->out, "* OK [UIDVALIDITY %u] UIDs valid\r\n", uidvalidity);
+	buf_addf(&conn->out, "* OK [UIDNEXT %u] Predicted next UID\r\n", uidnext);
+	buf_addf(&conn->out, "* OK [HIGHESTMODSEQ %llu] Highest\r\n", (unsigned long long)highestmodseq);
+	return finish(conn, tag, 1, readonly? "OK [READ-ONLY] EXAMINE completed" : "OK [READ-WRITE] SELECT completed");
+}
+
+
+static int imap_status(lb_conn_t* conn, const char* tag, lb_parser_t* ps)
+{
+	char*        name = parse_token(ps, NULL);
+	char*        items = parse_token(ps, NULL);
+	lb_folder_t* folder = NULL;
+	lb_buf_t     result = { NULL, 0, 0 };
+
+	pthread_mutex_lock(&s_store_lock);
+		if (name && items && (folder=get_folder(conn->user, name, 0))!=NULL) {
+			lb_parser_t ips;
+			char*       item = NULL;
+			scan_folder(folder);
+			parser_init_list(&ips, items);
+			while ((item=parse_token(&ips, NULL))!=NULL) {
+				uint64_t value = 0;
+				if (strcasecmp(item, "MESSAGES")==0) {
+					value = folder->cnt;
+				}
+				else if (strcasecmp(item, "UIDNEXT")==0) {
+					value = folder->uidnext;
+				}
+				else if (strcasecmp(item, "UIDVALIDITY")==0) {
+					value = folder->uidvalidity;
+				}
+				else if (strcasecmp(item, "UNSEEN")==0) {
+					for (size_t i = 0; i < folder->cnt; i++) {
+						value += (folder->msgs[i].flags&LB_SEEN)? 0 : 1;
+					}
+				}
+				else if (strcasecmp(item, "HIGHESTMODSEQ")==0) {
+					value = folder->highestmodseq;
+				}
+				buf_addf(&result, "%s%s %llu", result.bytes? " " : "", item, (unsigned long long)value);
+				free(item);
+			}
+		}
+	pthread_mutex_unlock(&s_store_lock);
+
+	if (folder) {
+		buf_addf(&conn->out, "* STATUS ");
+		add_string(&conn->out, name, strlen(name));
+		buf_addf(&conn->out, " (%s)\r\n", result.buf? result.buf : "");
+	}
+
+	buf_empty(&result);
+	free(items);
+	free(name);
+	return finish(conn, tag, 1, folder? "OK STATUS completed" : "NO Mailbox does not exist");
+}
+
+
+typedef struct lb_hit_t
+{
+	int      seq;
+	uint32_t uid;
+} lb_hit_t;
+
+
+static lb_hit_t* get_hits(lb_conn_t* conn, const char* set, int uid, size_t* ret_cnt) /* call with the lock held */
+{
+	/* returns the messages of the selected folder matching a set */
+	lb_hit_t* hits = NULL;
+	size_t    cnt = 0;
+	uint32_t  max = uid? (conn->view_cnt? conn->view[conn->view_cnt-1] : 0) : (uint32_t)conn->view_cnt;
+
+	if ((hits=calloc(conn->view_cnt+1, sizeof(lb_hit_t)))==NULL) {
+		exit(1);
+	}
+
+	for (size_t i = 0; i < conn->view_cnt; i++) {
+		if (in_set(set, uid? conn->view[i] : (uint32_t)i+1, max)
+		 && find_msg(conn->selected, conn->view[i]) >= 0) {
+			hits[cnt].seq = (int)i+1;
+			hits[cnt].uid = conn->view[i];
+			cnt++;
+		}
+	}
+
+	*ret_cnt = cnt;
+	return hits;
+}
+
+
+static int cmp_uids(const void* p1, const void* p2)
+{
+	uint32_t u1 = *(const uint32_t*)p1, u2 = *(const uint32_t*)p2;
+	return u1<u2? -1 : (u1>u2? 1 : 0);
+}
+
+
+static uint32_t* get_vanished(const lb_folder_t* folder, const char* set, uint64_t changedsince, size_t* ret_cnt) /* call with the lock held */
+{
+	/* returns the sorted UIDs of the set expunged after the given mod-sequence; if the expunges are
+	not known that far back, all UIDs of the set that do not exist are returned, as RFC 7162 allows */
+	uint32_t* uids = NULL;
+	size_t    cnt = 0;
+	uint32_t  max = folder->uidnext-1;
+
+	if ((uids=calloc(DC_MAX(folder->uidnext, folder->expunged_cnt)+1, sizeof(uint32_t)))==NULL) {
+		exit(1);
+	}
+
+	if (changedsince < folder->expunged_floor) {
+		for (uint32_t uid = 1; uid < folder->uidnext; uid++) {
+			if (in_set(set, uid, max) && find_msg(folder, uid) < 0) {
+				uids[cnt++] = uid;
+			}
+		}
+	}
+	else {
+		for (size_t i = 0; i < folder->expunged_cnt; i++) {
+			if (folder->expunged[i].modseq > changedsince && in_set(set, folder->expunged[i].uid, max)) {
+				uids[cnt++] = folder->expunged[i].uid;
+			}
+		}
+		qsort(uids, cnt, sizeof(uint32_t), cmp_uids);
+	}
+
+	*ret_cnt = cnt;
+	return uids;
+}
+
+
+static void fetch_section(lb_buf_t* out, const char* item, const char* msg, size_t bytes, int* set_seen)
+{
+	/* handle BODY[...], BODY.PEEK[...] and the RFC822 variants */
+	const char* name = item;
+	char*       section = NULL;
+	char*       content = NULL;
+	const char* data = msg;
+	size_t      data_bytes = bytes;
+	size_t      hdr_bytes = header_bytes(msg, bytes);
+	int         peek = 0;
+
+	if (strcasecmp(item, "RFC822")==0) {
+		section = dc_strdup("");
+		*set_seen = 1;
+		name = "RFC822";
+	}
+	else if (strcasecmp(item, "RFC822.HEADER")==0) {
+		section = dc_strdup("HEADER");
+		name = "RFC822.HEADER";
+	}
+	else if (strcasecmp(item, "RFC822.TEXT")==0) {
+		section = dc_strdup("TEXT");
+		*set_seen = 1;
+		name = "RFC822.TEXT";
+	}
+	else {
+		const char* open = strchr(item, '[');
+		const char* close = strrchr(item, ']');
+		section = dc_null_terminate(open+1, close-open-1);
+		peek = strncasecmp(item, "BODY.PEEK[", 10)==0;
+		if (!peek) {
+			*set_seen = 1;
+		}
+		name = NULL;
+	}
+
+	if (strcasecmp(section, "HEADER")==0) {
+		data_bytes = hdr_bytes;
+	}
+	else if (strcasecmp(section, "TEXT")==0 || strcmp(section, "1")==0) {
+		data = msg+hdr_bytes;
+		data_bytes = bytes-hdr_bytes;
+	}
+	else if (strncasecmp(section, "HEADER.FIELDS.NOT ", 18)==0) {
+		content = get_header_fields(msg, hdr_bytes, section+18, 1);
+	}
+	else if (strncasecmp(section, "HEADER.FIELDS ", 14)==0) {
+		content = get_header_fields(msg, hdr_bytes, section+14, 0);
+	}
+	else if (section[0]) {
+		data_bytes = 0; /* parts of multipart messages are not supported */
+	}
+	if (content) {
+		data = content;
+		data_bytes = strlen(content);
+	}
+
+	/* partial fetches as BODY[]<0.100> */
+	const char* partial = strrchr(item, '<');
+	if (partial && partial > strrchr(item, ']')) {
+		size_t origin = strtoul(partial+1, NULL, 10);
+		const char* dot = strchr(partial, '.');
+		size_t count = dot? strtoul(dot+1, NULL, 10) : data_bytes;
+		origin = DC_MIN(origin, data_bytes);
+		data += origin;
+		data_bytes = DC_MIN(count, data_bytes-origin);
+		buf_addf(out, "BODY[%s]<%lu> ", section, (unsigned long)origin);
+	}
+	else if (name) {
+		buf_addf(out, "%s ", name);
+	}
+	else {
+		buf_addf(out, "BODY[%s] ", section);
+	}
+	buf_addf(out, "{%lu}\r\n", (unsigned long)data_bytes);
+	buf_add(out, data, data_bytes);
+
+	free(content);
+	free(section);
+}
+
+
+static int imap_fetch(lb_conn_t* conn, const char* tag, lb_parser_t* ps, int uid)
+{
+	char*     set = parse_token(ps, NULL);
+	char*     items = parse_token(ps, NULL);
+	char*     modifiers = parse_token(ps, NULL);
+	uint64_t  changedsince = 0;
+	int       vanished = 0;
+	uint32_t* vanished_uids = NULL;
+	size_t    vanished_cnt = 0;
+	lb_hit_t* hits = NULL;
+	size_t    hits_cnt = 0;
+
+	/* `(CHANGEDSINCE <modseq> [VANISHED])` returns only messages changed since the given mod-sequence
+	and, for VANISHED, the UIDs expunged meanwhile, see RFC 7162 3.1.4.1 and 3.2.6 */
+	if (modifiers) {
+		lb_parser_t mps;
+		char*       token = NULL;
+		parser_init_list(&mps, modifiers);
+		while ((token=parse_token(&mps, NULL))!=NULL) {
+			if (strcasecmp(token, "CHANGEDSINCE")==0) {
+				char* value = parse_token(&mps, NULL);
+				changedsince = value? strtoull(value, NULL, 10) : 0;
+				free(value);
+			}
+			else if (strcasecmp(token, "VANISHED")==0) {
+				vanished = 1;
+			}
+			free(token);
+		}
+		free(modifiers);
+		if (changedsince==0 || (vanished && (!uid || !conn->qresync))) {
+			free(items);
+			free(set);
+			return finish(conn, tag, 1, "BAD Invalid FETCH modifier");
+		}
+		conn->condstore = 1;
+	}
+
+	if (set==NULL || items==NULL) {
+		free(items);
+		free(set);
+		return finish(conn, tag, 1, "BAD Missing arguments");
+	}
+
+	/* expand the macros */
+	if (strcasecmp(items, "ALL")==0)  { free(items); items = dc_strdup("(FLAGS INTERNALDATE RFC822.SIZE ENVELOPE)"); }
+	if (strcasecmp(items, "FAST")==0) { free(items); items = dc_strdup("(FLAGS INTERNALDATE RFC822.SIZE)"); }
+	if (strcasecmp(items, "FULL")==0) { free(items); items = dc_strdup("(FLAGS INTERNALDATE RFC822.SIZE ENVELOPE)"); }
+
+	pthread_mutex_lock(&s_store_lock);
+		hits = get_hits(conn, set, uid, &hits_cnt);
+		if (vanished) {
+			vanished_uids = get_vanished(conn->selected, set, changedsince, &vanished_cnt);
+		}
+	pthread_mutex_unlock(&s_store_lock);
+
+	if (vanished_cnt) {
+		buf_addf(&conn->out, "* VANISHED (EARLIER) ");
+		add_uid_set(&conn->out, vanished_uids, vanished_cnt);
+		buf_addf(&conn->out, "\r\n");
+	}
+	free(vanished_uids);
+
+	for (size_t h = 0; h < hits_cnt; h++)
+	{
+		lb_parser_t ips;
+		char*       item = NULL;
+		lb_msg_t    msg_copy;
+		char*       msg = NULL;
+		size_t      msg_bytes = 0;
+		time_t      mtime = 0;
+		int         set_seen = 0;
+		int         first = 1;
+		int         modseq_sent = 0;
+
+		/* copy the state of the message, the data are read without holding the lock */
+		pthread_mutex_lock(&s_store_lock);
+			int i = find_msg(conn->selected, hits[h].uid);
+			if (i >= 0) {
+				lb_msg_t* m = &conn->selected->msgs[i];
+				msg_copy.uid = m->uid;
+				msg_copy.base = dc_strdup(m->base);
+				msg_copy.flags = m->flags;
+				msg_copy.keywords = dc_strdup_keep_null(m->keywords);
+				msg_copy.modseq = m->modseq;
+			}
+		pthread_mutex_unlock(&s_store_lock);
+		if (i < 0) {
+			continue;
+		}
+		if (msg_copy.modseq <= changedsince) {
+			free(msg_copy.base);
+			free(msg_copy.keywords);
+			continue;
+		}
+
+		char* filename = msg_path(conn->selected, &msg_copy);
+		struct stat st;
+		if (stat(filename, &st)==0) {
+			mtime = st.st_mtime;
+		}
+		free(filename);
+
+		buf_addf(&conn->out, "* %i FETCH (", hits[h].seq);
+		if (uid) {
+			buf_addf(&conn->out, "UID %u", hits[h].uid);
+			first = 0;
+		}
+
+		parser_init_list(&ips, items);
+		while ((item=parse_token(&ips, NULL))!=NULL)
+		{
+			if (strcasecmp(item, "UID")==0) {
+				if (!uid) {
+					buf_addf(&conn->out, "%sUID %u", first? "" : " ", hits[h].uid);
+					first = 0;
+				}
+				free(item);
+				continue;
+			}
+
+			if (!first) {
+				buf_add(&conn->out, " ", 1);
+			}
+			first = 0;
+
+			if (msg==NULL && strcasecmp(item, "FLAGS")!=0 && strcasecmp(item, "INTERNALDATE")!=0 && strcasecmp(item, "MODSEQ")!=0) {
+				msg = read_msg(conn->selected, &msg_copy, &msg_bytes);
+			}
+
+			if (strcasecmp(item, "FLAGS")==0) {
+				add_flags(&conn->out, msg_copy.flags, msg_copy.keywords);
+			}
+			else if (strcasecmp(item, "MODSEQ")==0) {
+				buf_addf(&conn->out, "MODSEQ (%llu)", (unsigned long long)msg_copy.modseq);
+				modseq_sent = 1;
+			}
+			else if (strcasecmp(item, "INTERNALDATE")==0) {
+				struct tm tm;
+				char      date[64];
+				gmtime_r(&mtime, &tm);
+				strftime(date, sizeof(date), "%d-%b-%Y %H:%M:%S +0000", &tm);
+				buf_addf(&conn->out, "INTERNALDATE \"%s\"", date);
+			}
+			else if (strcasecmp(item, "RFC822.SIZE")==0) {
+				buf_addf(&conn->out, "RFC822.SIZE %lu", (unsigned long)msg_bytes);
+			}
+			else if (strcasecmp(item, "ENVELOPE")==0) {
+				add_envelope(&conn->out, msg, msg_bytes);
+			}
+			else if (strncasecmp(item, "BODY[", 5)==0 || strncasecmp(item, "BODY.PEEK[", 10)==0
+			      || strncasecmp(item, "RFC822", 6)==0) {
+				fetch_section(&conn->out, item, msg, msg_bytes, &set_seen);
+			}
+			else {
+				buf_addf(&conn->out, "NIL"); /* BODYSTRUCTURE and others are not supported */
+			}
+			free(item);
+		}
+
+		if (set_seen && !(msg_copy.flags&LB_SEEN) && !conn->readonly) {
+			pthread_mutex_lock(&s_store_lock);
+				int i = find_msg(conn->selected, hits[h].uid);
+				if (i >= 0) {
+					lb_msg_t* m = &conn->selected->msgs[i];
+					set_msg_flags(conn->selected, m, m->flags|LB_SEEN, m->keywords);
+				}
+			pthread_mutex_unlock(&s_store_lock);
+			buf_add(&conn->out, " ", 1);
+			add_flags(&conn->out, msg_copy.flags|LB_SEEN, msg_copy.keywords);
+		}
+
+		if (changedsince && !modseq_sent) {
+			buf_addf(&conn->out, " MODSEQ (%llu)", (unsigned long long)msg_copy.modseq);
+		}
+
+		buf_add(&conn->out, ")\r\n", 3);
+		free(msg);
+		free(msg_copy.base);
+		free(msg_copy.keywords);
+
+		if (conn->out.bytes > 64*1024 && !flush_out(conn)) {
+			free(hits);
+			free(items);
+			free(set);
+			return 0;
+		}
+	}
+
+	free(hits);
+	free(items);
+	free(set);
+	return finish(conn, tag, uid, "OK %sFETCH completed", uid? "UID " : "");
+}
+
+
+static int imap_store(lb_conn_t* conn, const char* tag, lb_parser_t* ps, int uid)
+{
+	char*     set = parse_token(ps, NULL);
+	char*     op = parse_token(ps, NULL);
+	char*     list = parse_token(ps, NULL);
+	char*     keywords = NULL;
+	int       flags = 0;
+	lb_hit_t* hits = NULL;
+	size_t    hits_cnt = 0;
+
+	if (set==NULL || op==NULL || list==NULL) {
+		free(list);
+		free(op);
+		free(set);
+		return finish(conn, tag, 1, "BAD Missing arguments");
+	}
+	if (conn->readonly) {
+		free(list);
+		free(op);
+		free(set);
+		return finish(conn, tag, 1, "NO Mailbox is read-only");
+	}
+
+	int mode = op[0]=='+'? 1 : (op[0]=='-'? -1 : 0);
+	int silent = strcasestr(op, ".SILENT")!=NULL;
+	flags = parse_flags(list, &keywords);
+
+	pthread_mutex_lock(&s_store_lock);
+		hits = get_hits(conn, set, uid, &hits_cnt);
+		for (size_t h = 0; h < hits_cnt; h++) {
+			int i = find_msg(conn->selected, hits[h].uid);
+			if (i < 0) {
+				continue;
+			}
+			lb_msg_t* m = &conn->selected->msgs[i];
+			char*     new_keywords = mode==0? dc_strdup_keep_null(keywords) : merge_keywords(m->keywords, keywords, mode>0);
+			int       new_flags = mode==0? flags : (mode>0? (m->flags|flags) : (m->flags&~flags));
+			set_msg_flags(conn->selected, m, new_flags, new_keywords);
+			if (!silent) {
+				buf_addf(&conn->out, "* %i FETCH (", hits[h].seq);
+				if (uid) {
+					buf_addf(&conn->out, "UID %u ", hits[h].uid);
+				}
+				add_flags(&conn->out, m->flags, m->keywords);
+				if (conn->condstore) {
+					buf_addf(&conn->out, " MODSEQ (%llu)", (unsigned long long)m->modseq);
+				}
+				buf_add(&conn->out, ")\r\n", 3);
+			}
+			free(new_keywords);
+		}
+	pthread_mutex_unlock(&s_store_lock);
+
+	free(hits);
+	free(keywords);
+	free(list);
+	free(op);
+	free(set);
+	return finish(conn, tag, uid, "OK %sSTORE completed", uid? "UID " : "");
+}
+
+
+static int imap_copy(lb_conn_t* conn, const char* tag, lb_parser_t* ps, int uid, int move)
+{
+	char*        set = parse_token(ps, NULL);
+	char*        dest_name = parse_token(ps, NULL);
+	lb_folder_t* dest = NULL;
+	lb_hit_t*    hits = NULL;
+	size_t       hits_cnt = 0;
+	lb_buf_t     src_uids = { NULL, 0, 0 };
+	lb_buf_t     dest_uids = { NULL, 0, 0 };
+	uint32_t     uidvalidity = 0;
+	int          ret = 0;
+
+	if (set==NULL || dest_name==NULL) {
+		ret = finish(conn, tag, 1, "BAD Missing arguments");
+		goto cleanup;
+	}
+	if (move && conn->readonly) {
+		ret = finish(conn, tag, 1, "NO Mailbox is read-only");
+		goto cleanup;
+	}
+
+	pthread_mutex_lock(&s_store_lock);
+		if ((dest=get_folder(conn->user, dest_name, 0))!=NULL) {
+			uidvalidity = dest->uidvalidity;
+			hits = get_hits(conn, set, uid, &hits_cnt);
+			for (size_t h = 0; h < hits_cnt; h++) {
+				int i = find_msg(conn->selected, hits[h].uid);
+				if (i < 0) {
+					continue;
+				}
+				lb_msg_t* m = &conn->selected->msgs[i];
+				size_t    bytes = 0;
+				char*     data = read_msg(conn->selected, m, &bytes);
+				uint32_t  new_uid = add_msg(dest, data, bytes, m->flags, m->keywords);
+				free(data);
+				if (new_uid) {
+					buf_addf(&src_uids, "%s%u", src_uids.bytes? "," : "", m->uid);
+					buf_addf(&dest_uids, "%s%u", dest_uids.bytes? "," : "", new_uid);
+					if (move && dest!=conn->selected) {
+						remove_msg(conn->selected, i);
+					}
+				}
+			}
+			if (move && src_uids.bytes) {
+				save_uidlist(conn->selected);
+				notify_change();
+			}
+		}
+	pthread_mutex_unlock(&s_store_lock);
+
+	if (dest==NULL) {
+		ret = finish(conn, tag, 1, "NO [TRYCREATE] Mailbox does not exist");
+	}
+	else if (move) {
+		if (src_uids.bytes) {
+			buf_addf(&conn->out, "* OK [COPYUID %u %s %s] Moved\r\n", uidvalidity, src_uids.buf, dest_uids.buf);
+		}
+		ret = finish(conn, tag, 1, "OK %sMOVE completed", uid? "UID " : "");
+	}
+	else if (src_uids.bytes) {
+		ret = finish(conn, tag, 1, "OK [COPYUID %u %s %s] %sCOPY completed", uidvalidity, src_uids.buf, dest_uids.buf, uid? "UID " : "");
+	}
+	else {
+		ret = finish(conn, tag, 1, "OK %sCOPY completed", uid? "UID " : "");
+	}
+
+cleanup:
+	buf_empty(&dest_uids);
+	buf_empty(&src_uids);
+	free(hits);
+	free(dest_name);
+	free(set);
+	return ret;
+}
+
+
+static void expunge(lb_conn_t* conn, const char* uid_set)
+{
+	if (conn->selected==NULL || conn->readonly) {
+		return;
+	}
+
+	pthread_mutex_lock(&s_store_lock);
+		lb_folder_t* folder = conn->selected;
+		int          removed = 0;
+		uint32_t     max = folder->cnt? folder->msgs[folder->cnt-1].uid : 0;
+		for (size_t i = folder->cnt; i > 0; i--) {
+			lb_msg_t* m = &folder->msgs[i-1];
+			if ((m->flags&LB_DELETED) && (uid_set==NULL || in_set(uid_set, m->uid, max))) {
+				remove_msg(folder, i-1);
+				removed = 1;
+			}
+		}
+		if (removed) {
+			save_uidlist(folder);
+			notify_change();
+		}
+	pthread_mutex_unlock(&s_store_lock);
+}
+
+
+static int imap_append(lb_conn_t* conn, const char* tag, lb_parser_t* ps)
+{
+	char*        name = parse_token(ps, NULL);
+	char*        token = NULL;
+	char*        data = NULL;
+	size_t       data_bytes = 0;
+	char*        keywords = NULL;
+	int          flags = 0;
+	lb_folder_t* folder = NULL;
+	uint32_t     new_uid = 0;
+	uint32_t     uidvalidity = 0;
+
+	/* optional flags and date, the message is the last argument */
+	while ((token=parse_token(ps, &data_bytes))!=NULL) {
+		if (token[0]=='(' && data==NULL && ps->p < ps->end) {
+			free(keywords);
+			flags = parse_flags(token, &keywords);
+		}
+		free(data);
+		data = token;
+	}
+
+	pthread_mutex_lock(&s_store_lock);
+		if (name && data && (folder=get_folder(conn->user, name, 0))!=NULL) {
+			uidvalidity = folder->uidvalidity;
+			new_uid = add_msg(folder, data, data_bytes, flags, keywords);
+		}
+	pthread_mutex_unlock(&s_store_lock);
+
+	free(keywords);
+	free(data);
+	free(name);
+	if (folder==NULL) {
+		return finish(conn, tag, 1, "NO [TRYCREATE] Mailbox does not exist");
+	}
+	return finish(conn, tag, 1, new_uid? "OK [APPENDUID %u %u] APPEND completed" : "NO Cannot append", uidvalidity, new_uid);
+}
+
+
+static int imap_idle(lb_conn_t* conn, const char* tag, lb_buf_t* line)
+{
+	int ret = 0;
+
+	buf_addf(&conn->out, "+ idling\r\n");
+	if (!flush_out(conn)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&s_store_lock);
+		conn->idling = 1;
+		conn->next_idling = s_idling;
+		s_idling = conn;
+	pthread_mutex_unlock(&s_store_lock);
+
+	while (1)
+	{
+		sync_view(conn, 1);
+		if (conn->out.bytes && !flush_out(conn)) {
+			goto cleanup;
+		}
+
+		if (!has_input(conn)) {
+			struct pollfd fds[2] = { { conn->fd, POLLIN, 0 }, { conn->wake_pipe[0], POLLIN, 0 } };
+			if (poll(fds, 2, 60*1000) < 0 && errno!=EINTR) {
+				goto cleanup;
+			}
+			if (fds[1].revents&POLLIN) {
+				char buf[64];
+				if (read(conn->wake_pipe[0], buf, sizeof(buf)) < 0) {
+					; /* nothing to do, we just want to wake up */
+				}
+			}
+			if (!(fds[0].revents&(POLLIN|POLLHUP|POLLERR))) {
+				continue;
+			}
+		}
+
+		line->bytes = 0;
+		if (!read_line(conn, line)) {
+			goto cleanup;
+		}
+		log_command(conn, line->buf);
+		if (strncasecmp(line->buf, "DONE", 4)==0) {
+			break;
+		}
+	}
+
+	ret = 1;
+
+cleanup:
+	pthread_mutex_lock(&s_store_lock);
+		for (lb_conn_t** p = &s_idling; *p; p = &(*p)->next_idling) {
+			if (*p==conn) {
+				*p = conn->next_idling;
+				break;
+			}
+		}
+		conn->idling = 0;
+	pthread_mutex_unlock(&s_store_lock);
+
+	return ret? finish(conn, tag, 1, "OK IDLE terminated") : 0;
+}
+
+
+static void imap_session(lb_conn_t* conn)
+{
+	lb_buf_t cmd = { NULL, 0, 0 };
+	lb_buf_t line = { NULL, 0, 0 };
+
+	if (pipe(conn->wake_pipe)!=0) {
+		return;
+	}
+	fcntl(conn->wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(conn->wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+	buf_addf(&conn->out, "* OK [CAPABILITY " LB_CAPABILITIES "] dc-loopback ready\r\n");
+	if (!flush_out(conn)) {
+		goto cleanup;
+	}
+
+	while (read_command(conn, &cmd))
+	{
+		lb_parser_t ps = { cmd.buf, cmd.buf+cmd.bytes };
+		char*       tag = parse_token(&ps, NULL);
+		char*       name = parse_token(&ps, NULL);
+		int         uid = 0;
+		int         ok = 1;
+
+		log_command(conn, cmd.buf);
+		if (!count_command(conn)) {
+			free(name);
+			free(tag);
+			break;
+		}
+
+		if (tag==NULL || name==NULL) {
+			ok = finish(conn, tag? tag : "*", 1, "BAD Missing command");
+		}
+		else
+		{
+			if (strcasecmp(name, "UID")==0) {
+				free(name);
+				name = parse_token(&ps, NULL);
+				uid = 1;
+				if (name==NULL) {
+					name = dc_strdup("");
+				}
+			}
+
+			if (strcasecmp(name, "CAPABILITY")==0) {
+				buf_addf(&conn->out, "* CAPABILITY " LB_CAPABILITIES "\r\n");
+				ok = finish(conn, tag, 1, "OK CAPABILITY completed");
+			}
+			else if (strcasecmp(name, "NOOP")==0 || strcasecmp(name, "CHECK")==0) {
+				if (conn->selected) {
+					pthread_mutex_lock(&s_store_lock);
+						scan_folder(conn->selected);
+					pthread_mutex_unlock(&s_store_lock);
+				}
+				ok = finish(conn, tag, 1, "OK %s completed", name);
+			}
+			else if (strcasecmp(name, "LOGOUT")==0) {
+				buf_addf(&conn->out, "* BYE dc-loopback logging out\r\n");
+				finish(conn, tag, 0, "OK LOGOUT completed");
+				ok = 0;
+			}
+			else if (strcasecmp(name, "ID")==0) {
+				buf_addf(&conn->out, "* ID (\"name\" \"dc-loopback\")\r\n");
+				ok = finish(conn, tag, 1, "OK ID completed");
+			}
+			else if (strcasecmp(name, "LOGIN")==0) {
+				char* user = parse_token(&ps, NULL);
+				char* password = parse_token(&ps, NULL);
+				if (user && user[0] && password) {
+					free(conn->user);
+					conn->user = dc_strdup(user);
+					pthread_mutex_lock(&s_store_lock);
+						get_folder(conn->user, "INBOX", 1);
+					pthread_mutex_unlock(&s_store_lock);
+					ok = finish(conn, tag, 1, "OK [CAPABILITY " LB_CAPABILITIES "] LOGIN completed");
+				}
+				else {
+					ok = finish(conn, tag, 1, "BAD Missing user or password");
+				}
+				free(password);
+				free(user);
+			}
+			else if (conn->user==NULL) {
+				ok = finish(conn, tag, 1, "NO Not authenticated");
+			}
+			else if (strcasecmp(name, "ENABLE")==0) {
+				/* QRESYNC implies CONDSTORE, see RFC 7162 3.2.3 */
+				lb_buf_t enabled = { NULL, 0, 0 };
+				char*    cap = NULL;
+				while ((cap=parse_token(&ps, NULL))!=NULL) {
+					if (strcasecmp(cap, "CONDSTORE")==0 || strcasecmp(cap, "QRESYNC")==0) {
+						conn->condstore = 1;
+						conn->qresync |= strcasecmp(cap, "QRESYNC")==0;
+						buf_addf(&enabled, " %s", cap);
+					}
+					free(cap);
+				}
+				buf_addf(&conn->out, "* ENABLED%s\r\n", enabled.bytes? enabled.buf : "");
+				buf_empty(&enabled);
+				ok = finish(conn, tag, 1, "OK ENABLE completed");
+			}
+			else if (strcasecmp(name, "COMPRESS")==0) {
+				char* mechanism = parse_token(&ps, NULL);
+				if (conn->deflater) {
+					ok = finish(conn, tag, 1, "NO [COMPRESSIONACTIVE] DEFLATE already active");
+				}
+				else if (mechanism==NULL || strcasecmp(mechanism, "DEFLATE")!=0) {
+					ok = finish(conn, tag, 1, "BAD Unsupported compression mechanism");
+				}
+				else {
+					/* the response is the last uncompressed data */
+					ok = finish(conn, tag, 1, "OK DEFLATE active") && start_compress(conn);
+				}
+				free(mechanism);
+			}
+			else if (strcasecmp(name, "LIST")==0 || strcasecmp(name, "LSUB")==0) {
+				for (char* p = name; *p; p++) {
+					*p = toupper(*p);
+				}
+				ok = imap_list(conn, tag, &ps, name);
+			}
+			else if (strcasecmp(name, "CREATE")==0) {
+				ok = imap_create(conn, tag, &ps);
+			}
+			else if (strcasecmp(name, "SUBSCRIBE")==0 || strcasecmp(name, "UNSUBSCRIBE")==0) {
+				ok = finish(conn, tag, 1, "OK %s completed", name);
+			}
+			else if (strcasecmp(name, "SELECT")==0 || strcasecmp(name, "EXAMINE")==0) {
+				ok = imap_select(conn, tag, &ps, strcasecmp(name, "EXAMINE")==0);
+			}
+			else if (strcasecmp(name, "STATUS")==0) {
+				ok = imap_status(conn, tag, &ps);
+			}
+			else if (strcasecmp(name, "APPEND")==0) {
+				ok = imap_append(conn, tag, &ps);
+			}
+			else if (strcasecmp(name, "IDLE")==0) {
+				ok = imap_idle(conn, tag, &line);
+			}
+			else if (conn->selected==NULL) {
+				ok = finish(conn, tag, 1, "NO No mailbox selected");
+			}
+			else if (strcasecmp(name, "FETCH")==0) {
+				ok = imap_fetch(conn, tag, &ps, uid);
+			}
+			else if (strcasecmp(name, "STORE")==0) {
+				ok = imap_store(conn, tag, &ps, uid);
+			}
+			else if (strcasecmp(name, "COPY")==0 || strcasecmp(name, "MOVE")==0) {
+				ok = imap_copy(conn, tag, &ps, uid, strcasecmp(name, "MOVE")==0);
+			}
+			else if (strcasecmp(name, "EXPUNGE")==0) {
+				char* set = uid? parse_token(&ps, NULL) : NULL;
+				expunge(conn, uid? (set? set : "") : NULL);
+				ok = finish(conn, tag, 1, "OK EXPUNGE completed");
+				free(set);
+			}
+			else if (strcasecmp(name, "CLOSE")==0 || strcasecmp(name, "UNSELECT")==0) {
+				if (strcasecmp(name, "CLOSE")==0) {
+					expunge(conn, NULL);
+				}
+				conn->selected = NULL;
+				conn->view_cnt = 0;
+				ok = finish(conn, tag, 0, "OK %s completed", name);
+			}
+			else {
+				ok = finish(conn, tag, 1, "BAD Command not supported");
+			}
+		}
+
+		free(name);
+		free(tag);
+		if (!ok) {
+			break;
+		}
+	}
+
+cleanup:
+	close(conn->wake_pipe[0]);
+	close(conn->wake_pipe[1]);
+	buf_empty(&line);
+	buf_empty(&cmd);
+}
+
+
+/*******************************************************************************
+ * SMTP
+ ******************************************************************************/
+
+
+static int smtp_reply(lb_conn_t* conn, const char* reply)
+{
+	sleep_ms(s_opts.latency_ms);
+	buf_addf(&conn->out, "%s\r\n", reply);
+	return flush_out(conn);
+}
+
+
+static char* get_path_arg(const char* line)
+{
+	/* get the address from "MAIL FROM:<addr> ..." or "RCPT TO:<addr>" */
+	const char* lt = strchr(line, '<');
+	const char* gt = lt? strchr(lt, '>') : NULL;
+	if (lt==NULL || gt==NULL) {
+		return NULL;
+	}
+	return dc_null_terminate(lt+1, gt-lt-1);
+}
+
+
+static void deliver(char** rcpts, int rcpts_cnt, const char* data, size_t bytes)
+{
+	pthread_mutex_lock(&s_store_lock);
+		for (int i = 0; i < rcpts_cnt; i++) {
+			lb_folder_t* inbox = get_folder(rcpts[i], "INBOX", 1);
+			if (inbox) {
+				add_msg(inbox, data, bytes, 0, NULL);
+			}
+		}
+	pthread_mutex_unlock(&s_store_lock);
+}
+
+
+static void smtp_session(lb_conn_t* conn)
+{
+	lb_buf_t line = { NULL, 0, 0 };
+	lb_buf_t data = { NULL, 0, 0 };
+	char**   rcpts = NULL;
+	int      rcpts_cnt = 0;
+	int      has_from = 0;
+
+	if (!smtp_reply(conn, "220 dc-loopback ESMTP ready")) {
+		goto cleanup;
+	}
+
+	while (1)
+	{
+		line.bytes = 0;
+		if (!read_line(conn, &line)) {
+			break;
+		}
+		log_command(conn, line.buf);
+		if (!count_command(conn)) {
+			break;
+		}
+
+		int ok = 1;
+		if (strncasecmp(line.buf, "EHLO", 4)==0) {
+			ok = smtp_reply(conn, "250-dc-loopback\r\n250-AUTH PLAIN LOGIN\r\n250-8BITMIME\r\n250-PIPELINING\r\n250 SIZE 104857600");
+		}
+		else if (strncasecmp(line.buf, "HELO", 4)==0) {
+			ok = smtp_reply(conn, "250 dc-loopback");
+		}
+		else if (strncasecmp(line.buf, "AUTH PLAIN", 10)==0) {
+			/* any user and password is fine, read the credentials if not given in the command */
+			dc_trim(line.buf);
+			if (strlen(line.buf) <= 10) {
+				ok = smtp_reply(conn, "334 ");
+				line.bytes = 0;
+				ok = ok && read_line(conn, &line);
+			}
+			ok = ok && smtp_reply(conn, "235 Authentication succeeded");
+		}
+		else if (strncasecmp(line.buf, "AUTH LOGIN", 10)==0) {
+			ok = smtp_reply(conn, "334 VXNlcm5hbWU6");
+			line.bytes = 0;
+			ok = ok && read_line(conn, &line) && smtp_reply(conn, "334 UGFzc3dvcmQ6");
+			line.bytes = 0;
+			ok = ok && read_line(conn, &line) && smtp_reply(conn, "235 Authentication succeeded");
+		}
+		else if (strncasecmp(line.buf, "MAIL FROM:", 10)==0) {
+			has_from = 1;
+			ok = smtp_reply(conn, "250 OK");
+		}
+		else if (strncasecmp(line.buf, "RCPT TO:", 8)==0) {
+			char* rcpt = get_path_arg(line.buf);
+			if (!has_from) {
+				ok = smtp_reply(conn, "503 Need MAIL first");
+				free(rcpt);
+			}
+			else if (rcpt==NULL || strchr(rcpt, '@')==NULL) {
+				ok = smtp_reply(conn, "501 Bad recipient");
+				free(rcpt);
+			}
+			else {
+				if ((rcpts=realloc(rcpts, (rcpts_cnt+1)*sizeof(char*)))==NULL) {
+					exit(1);
+				}
+				rcpts[rcpts_cnt++] = rcpt;
+				ok = smtp_reply(conn, "250 OK");
+			}
+		}
+		else if (strncasecmp(line.buf, "DATA", 4)==0) {
+			if (rcpts_cnt==0) {
+				ok = smtp_reply(conn, "503 Need RCPT first");
+			}
+			else if ((ok=smtp_reply(conn, "354 End data with <CR><LF>.<CR><LF>"))) {
+				data.bytes = 0;
+				while (1) {
+					line.bytes = 0;
+					if (!read_line(conn, &line)) {
+						ok = 0;
+						break;
+					}
+					if (strcmp(line.buf, ".\r\n")==0 || strcmp(line.buf, ".\n")==0) {
+						break;
+					}
+					/* undo dot-stuffing */
+					buf_add(&data, line.buf[0]=='.'? line.buf+1 : line.buf, line.buf[0]=='.'? line.bytes-1 : line.bytes);
+				}
+				if (ok) {
+					deliver(rcpts, rcpts_cnt, data.buf? data.buf : "", data.bytes);
+					ok = smtp_reply(conn, "250 OK queued");
+				}
+			}
+			for (int i = 0; i < rcpts_cnt; i++) {
+				free(rcpts[i]);
+			}
+			rcpts_cnt = 0;
+			has_from = 0;
+		}
+		else if (strncasecmp(line.buf, "RSET", 4)==0) {
+			for (int i = 0; i < rcpts_cnt; i++) {
+				free(rcpts[i]);
+			}
+			rcpts_cnt = 0;
+			has_from = 0;
+			ok = smtp_reply(conn, "250 OK");
+		}
+		else if (strncasecmp(line.buf, "NOOP", 4)==0) {
+			ok = smtp_reply(conn, "250 OK");
+		}
+		else if (strncasecmp(line.buf, "QUIT", 4)==0) {
+			smtp_reply(conn, "221 Bye");
+			ok = 0;
+		}
+		else {
+			ok = smtp_reply(conn, "502 Command not implemented");
+		}
+
+		if (!ok) {
+			break;
+		}
+	}
+
+cleanup:
+	for (int i = 0; i < rcpts_cnt; i++) {
+		free(rcpts[i]);
+	}
+	free(rcpts);
+	buf_empty(&data);
+	buf_empty(&line);
+}
+
+
+/*******************************************************************************
+ * Main
+ ******************************************************************************/
+
+
+static void* conn_thread_entry_point(void* entry_arg)
+{
+	lb_conn_t* conn = (lb_conn_t*)entry_arg;
+
+	if (s_opts.verbose) {
+		fprintf(stderr, "[%s %i] connected\n", conn->proto, conn->id);
+	}
+
+	if (strcmp(conn->proto, "imap")==0) {
+		imap_session(conn);
+	}
+	else {
+		smtp_session(conn);
+	}
+
+	if (s_opts.verbose) {
+		fprintf(stderr, "[%s %i] closed\n", conn->proto, conn->id);
+	}
+
+	close(conn->fd);
+	buf_empty(&conn->out);
+	if (conn->inflater) {
+		inflateEnd(conn->inflater);
+		free(conn->inflater);
+	}
+	if (conn->deflater) {
+		deflateEnd(conn->deflater);
+		free(conn->deflater);
+	}
+	free(conn->view);
+	free(conn->user);
+	free(conn);
+	return NULL;
+}
+
+
+static int listen_on(int port) /* port 0 picks a free port, see bound_port() */
+{
+	struct sockaddr_in addr;
+	int                fd = socket(AF_INET, SOCK_STREAM, 0);
+	int                one = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr))!=0 || listen(fd, 16)!=0) {
+		fprintf(stderr, "Cannot listen on 127.0.0.1:%i: %s\n", port, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+
+static int bound_port(int fd)
+{
+	struct sockaddr_in addr;
+	socklen_t          addr_len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr*)&addr, &addr_len)!=0) {
+		return 0;
+	}
+	return ntohs(addr.sin_port);
+}
+
+
+static void serve(int imap_fd, int smtp_fd)
+{
+	int conn_cnt = 0;
+
+	while (1)
+	{
+		struct pollfd fds[2] = { { imap_fd, POLLIN, 0 }, { smtp_fd, POLLIN, 0 } };
+		if (poll(fds, 2, -1) < 0) {
+			if (errno==EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for (int i = 0; i < 2; i++) {
+			if (!(fds[i].revents&POLLIN)) {
+				continue;
+			}
+
+			int fd = accept(fds[i].fd, NULL, NULL);
+			if (fd < 0) {
+				continue;
+			}
+
+			lb_conn_t* conn = calloc(1, sizeof(lb_conn_t));
+			pthread_t  thread;
+			if (conn==NULL) {
+				exit(1);
+			}
+			conn->fd = fd;
+			conn->id = ++conn_cnt;
+			conn->proto = i==0? "imap" : "smtp";
+			if (pthread_create(&thread, NULL, conn_thread_entry_point, conn)!=0) {
+				close(fd);
+				free(conn);
+				continue;
+			}
+			pthread_detach(thread);
+		}
+	}
+}
+
+
+/*******************************************************************************
+ * Self test
+ ******************************************************************************/
+
+
+#define LB_TEST_USER "alice"
+#define LB_TEST_ADDR "alice@loopback.example"
+
+
+static int s_listen_fds[2];
+
+
+static void* serve_thread_entry_point(void* entry_arg)
+{
+	serve(s_listen_fds[0], s_listen_fds[1]);
+	return NULL;
+}
+
+
+static uintptr_t selftest_event(dc_context_t* context, int event, uintptr_t data1, uintptr_t data2)
+{
+	switch (event)
+	{
+		case DC_EVENT_INFO:
+		case DC_EVENT_WARNING:
+			if (s_opts.verbose) {
+				fprintf(stderr, "%s\n", (char*)data2);
+			}
+			break;
+
+		case DC_EVENT_ERROR:
+		case DC_EVENT_ERROR_NETWORK:
+			fprintf(stderr, "[Error] %s\n", (char*)data2);
+			break;
+	}
+	return 0;
+}
+
+
+static void remove_dir(const char* path)
+{
+	DIR*           dir = NULL;
+	struct dirent* entry = NULL;
+	struct stat    st;
+
+	if ((dir=opendir(path))!=NULL) {
+		while ((entry=readdir(dir))!=NULL) {
+			if (strcmp(entry->d_name, ".")==0 || strcmp(entry->d_name, "..")==0) {
+				continue;
+			}
+			char* child = dc_mprintf("%s/%s", path, entry->d_name);
+			if (lstat(child, &st)==0 && S_ISDIR(st.st_mode)) {
+				remove_dir(child);
+			}
+			else {
+				unlink(child);
+			}
+			free(child);
+		}
+		closedir(dir);
+	}
+	rmdir(path);
+}
+
+
+static void selftest_deliver(int i)
+{
+	/* add a mail from a stranger to the INBOX of the test user */
+	lb_buf_t msg = { NULL, 0, 0 };
+	buf_addf(&msg, "From: Bob <bob@loopback.example>\r\n"
+	               "To: " LB_TEST_ADDR "\r\n"
+	               "Subject: Test %i\r\n"
+	               "Message-ID: <selftest-%i@loopback.example>\r\n"
+	               "Date: Sat, 01 Jun 2019 12:00:00 +0000\r\n"
+	               "\r\n", i, i);
+	for (int line = 0; line < 200; line++) {
+		buf_addf(&msg, "Line %i of test mail %i, the same text again and again.\r\n", line, i);
+	}
+
+	pthread_mutex_lock(&s_store_lock);
+		assert( add_msg(get_folder(LB_TEST_USER, "INBOX", 1), msg.buf, msg.bytes, 0, NULL)==(uint32_t)i );
+	pthread_mutex_unlock(&s_store_lock);
+
+	buf_empty(&msg);
+}
+
+
+static void selftest_set_flags(uint32_t uid, int add, int remove) /* LB_DELETED removes the message */
+{
+	pthread_mutex_lock(&s_store_lock);
+		lb_folder_t* folder = get_folder(LB_TEST_USER, "INBOX", 0);
+		int          i = find_msg(folder, uid);
+		assert( i >= 0 );
+		if (add&LB_DELETED) {
+			remove_msg(folder, i);
+			save_uidlist(folder);
+		}
+		else {
+			set_msg_flags(folder, &folder->msgs[i], (folder->msgs[i].flags|add)&~remove, folder->msgs[i].keywords);
+		}
+		notify_change();
+	pthread_mutex_unlock(&s_store_lock);
+}
+
+
+static uint64_t selftest_highestmodseq(void)
+{
+	pthread_mutex_lock(&s_store_lock);
+		uint64_t highestmodseq = get_folder(LB_TEST_USER, "INBOX", 0)->highestmodseq;
+	pthread_mutex_unlock(&s_store_lock);
+	return highestmodseq;
+}
+
+
+static int selftest_msg_state(dc_context_t* context, int i, uint32_t* ret_server_uid)
+{
+	/* returns the state of a mail added by selftest_deliver(), 0 if it was not received */
+	char*         rfc724_mid = dc_mprintf("selftest-%i@loopback.example", i);
+	int           state = 0;
+	sqlite3_stmt* stmt = dc_sqlite3_prepare(context->sql, "SELECT state, server_uid FROM msgs WHERE rfc724_mid=? AND server_folder='INBOX';");
+	sqlite3_bind_text(stmt, 1, rfc724_mid, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt)==SQLITE_ROW) {
+		state = sqlite3_column_int(stmt, 0);
+		if (ret_server_uid) {
+			*ret_server_uid = (uint32_t)sqlite3_column_int64(stmt, 1);
+		}
+	}
+	sqlite3_finalize(stmt);
+	free(rfc724_mid);
+	return state;
+}
+
+
+static void selftest_fetch(dc_context_t* context, const dc_loginparam_t* lp, int reconnect)
+{
+	/* a reconnect selects the folder again and returns the current HIGHESTMODSEQ */
+	if (reconnect) {
+		dc_imap_disconnect(context->inbox);
+	}
+	assert( dc_imap_connect(context->inbox, lp) );
+	dc_imap_set_watch_folder(context->inbox, "INBOX");
+	assert( dc_imap_fetch(context->inbox) );
+}
+
+
+static void selftest_condstore(dc_context_t* context, const dc_loginparam_t* lp)
+{
+	uint32_t server_uid = 0;
+	char*    expected = NULL;
+	char*    modseq = NULL;
+
+	/* the INBOX is empty on the first fetch, so all mails added later are received */
+	selftest_fetch(context, lp, 0);
+	assert( context->inbox->has_condstore && context->inbox->qresync_enabled );
+
+	for (int i = 1; i <= 3; i++) {
+		selftest_deliver(i);
+	}
+	selftest_fetch(context, lp, 1);
+	for (int i = 1; i <= 3; i++) {
+		assert( selftest_msg_state(context, i, &server_uid)==DC_STATE_IN_FRESH && server_uid==(uint32_t)i );
+	}
+
+	/* the modseq is initialized from the HIGHESTMODSEQ of the next SELECT */
+	selftest_fetch(context, lp, 1);
+	expected = dc_mprintf("%u:%llu", get_folder(LB_TEST_USER, "INBOX", 0)->uidvalidity, (unsigned long long)selftest_highestmodseq());
+	modseq = dc_sqlite3_get_config(context->sql, "imap.modseq.INBOX", NULL);
+	assert( modseq && strcmp(modseq, expected)==0 );
+	free(modseq);
+	free(expected);
+
+	/* other clients mark #1 as seen, flag #3 and expunge #2; `UID FETCH (CHANGEDSINCE m VANISHED)` reports this */
+	selftest_set_flags(1, LB_SEEN, 0);
+	selftest_set_flags(3, LB_FLAGGED, 0);
+	selftest_set_flags(2, LB_DELETED, 0);
+	selftest_fetch(context, lp, 1);
+	assert( selftest_msg_state(context, 1, &server_uid)==DC_STATE_IN_SEEN && server_uid==1 );
+	assert( selftest_msg_state(context, 2, &server_uid)==DC_STATE_IN_FRESH && server_uid==0 );
+	assert( selftest_msg_state(context, 3, &server_uid)==DC_STATE_IN_FRESH && server_uid==3 );
+
+	/* without a new SELECT, the changes are looked up in any case */
+	selftest_set_flags(3, LB_SEEN, 0);
+	selftest_fetch(context, lp, 0);
+	assert( selftest_msg_state(context, 3, NULL)==DC_STATE_IN_SEEN );
+
+	expected = dc_mprintf("%u:%llu", get_folder(LB_TEST_USER, "INBOX", 0)->uidvalidity, (unsigned long long)selftest_highestmodseq());
+	modseq = dc_sqlite3_get_config(context->sql, "imap.modseq.INBOX", NULL);
+	assert( modseq && strcmp(modseq, expected)==0 );
+	free(modseq);
+	free(expected);
+
+	/* nothing changed, nothing is reported */
+	selftest_fetch(context, lp, 1);
+	assert( selftest_msg_state(context, 2, &server_uid)==DC_STATE_IN_FRESH && server_uid==0 );
+}
+
+
+static void selftest_compress(dc_context_t* context, const dc_loginparam_t* lp)
+{
+	/* the test mails are repetitive, so with COMPRESS=DEFLATE fewer bytes are on the wire than in the payload */
+	dc_imap_t* imap = context->inbox;
+	uint64_t   received = 0, net_received = 0, sent = 0, net_sent = 0;
+
+	for (int i = 4; i <= 6; i++) {
+		selftest_deliver(i);
+	}
+	dc_imap_disconnect(imap);
+	received = imap->bytes_received;
+	net_received = imap->net_bytes_received;
+	selftest_fetch(context, lp, 0);
+	assert( imap->compress );
+	assert( selftest_msg_state(context, 6, NULL)==DC_STATE_IN_FRESH );
+	assert( imap->net_bytes_received > net_received );
+	assert( imap->bytes_received-received > 2*(imap->net_bytes_received-net_received) );
+	assert( imap->bytes_sent > 0 && imap->net_bytes_sent > 0 );
+
+	/* without compression, both counters see the same bytes */
+	dc_sqlite3_set_config_int(context->sql, "imap_compress", 0);
+	for (int i = 7; i <= 9; i++) {
+		selftest_deliver(i);
+	}
+	dc_imap_disconnect(imap);
+	received = imap->bytes_received;
+	net_received = imap->net_bytes_received;
+	sent = imap->bytes_sent;
+	net_sent = imap->net_bytes_sent;
+	selftest_fetch(context, lp, 0);
+	assert( !imap->compress );
+	assert( selftest_msg_state(context, 9, NULL)==DC_STATE_IN_FRESH );
+	assert( imap->net_bytes_received > net_received );
+	assert( imap->bytes_received-received == imap->net_bytes_received-net_received );
+	assert( imap->bytes_sent-sent == imap->net_bytes_sent-net_sent );
+}
+
+
+static int selftest(void)
+{
+	char*            dir = NULL;
+	char*            dbfile = NULL;
+	pthread_t        thread;
+	dc_context_t*    context = NULL;
+	dc_loginparam_t* lp = dc_loginparam_new();
+
+	if (s_opts.maildir==NULL) {
+		dir = dc_mprintf("%s/dc-loopback-XXXXXX", getenv("TMPDIR")? getenv("TMPDIR") : "/tmp");
+		if (mkdtemp(dir)==NULL) {
+			fprintf(stderr, "Cannot create temporary directory.\n");
+			return 1;
+		}
+		s_opts.maildir = dir;
+	}
+	mkdir(s_opts.maildir, 0700);
+
+	s_listen_fds[0] = listen_on(0);
+	s_listen_fds[1] = listen_on(0);
+	if (pthread_create(&thread, NULL, serve_thread_entry_point, NULL)!=0) {
+		return 1;
+	}
+	pthread_detach(thread);
+
+	context = dc_context_new(selftest_event, NULL, "dc-loopback");
+	dbfile = dc_mprintf("%s/selftest.db", s_opts.maildir);
+	if (!dc_open(context, dbfile, NULL)) {
+		fprintf(stderr, "Cannot open %s.\n", dbfile);
+		return 1;
+	}
+	dc_sqlite3_set_config(context->sql, "configured_addr", LB_TEST_ADDR);
+
+	lp->addr         = dc_strdup(LB_TEST_ADDR);
+	lp->mail_server  = dc_strdup("127.0.0.1");
+	lp->mail_port    = bound_port(s_listen_fds[0]);
+	lp->mail_user    = dc_strdup(LB_TEST_USER);
+	lp->mail_pw      = dc_strdup("secret");
+	lp->server_flags = DC_LP_IMAP_SOCKET_PLAIN|DC_LP_SMTP_SOCKET_PLAIN;
+
+	selftest_condstore(context, lp);
+	selftest_compress(context, lp);
+
+	dc_imap_disconnect(context->inbox);
+	dc_close(context);
+	dc_context_unref(context);
+	dc_loginparam_unref(lp);
+	free(dbfile);
+	if (dir) {
+		remove_dir(dir);
+		free(dir);
+	}
+	fprintf(stderr, "dc-loopback: self test passed.\n");
+	return 0;
+}
+
+
+static void usage(const char* prog)
+{
+	fprintf(stderr,
+		"Usage: %s --maildir DIR [options]\n"
+		"  -m, --maildir DIR           where the mailboxes are stored, created if needed\n"
+		"  -i, --imap-port PORT        IMAP port on 127.0.0.1 (default 10143)\n"
+		"  -s, --smtp-port PORT        SMTP port on 127.0.0.1 (default 10025)\n"
+		"  -l, --latency MS            delay added to the response of each command\n"
+		"  -b, --bandwidth BYTES       bytes per second and connection, 0=unlimited (default)\n"
+		"  -d, --disconnect-after N    drop each connection when the client sends command N+1\n"
+		"  -v, --verbose               log the commands\n"
+		"  -t, --selftest              run the IMAP code of the core against the server,\n"
+		"                              in a temporary directory if --maildir is not given\n",
+		prog);
+}
+
+
+int main(int argc, char ** argv)
+{
+	static const struct option long_opts[] = {
+		{ "maildir",          required_argument, NULL, 'm' },
+		{ "imap-port",        required_argument, NULL, 'i' },
+		{ "smtp-port",        required_argument, NULL, 's' },
+		{ "latency",          required_argument, NULL, 'l' },
+		{ "bandwidth",        required_argument, NULL, 'b' },
+		{ "disconnect-after", required_argument, NULL, 'd' },
+		{ "verbose",          no_argument,       NULL, 'v' },
+		{ "selftest",         no_argument,       NULL, 't' },
+		{ "help",             no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int c = 0;
+	int run_selftest = 0;
+
+	while ((c=getopt_long(argc, argv, "m:i:s:l:b:d:vth", long_opts, NULL))!=-1) {
+		switch (c) {
+			case 'm': s_opts.maildir          = optarg; break;
+			case 'i': s_opts.imap_port        = atoi(optarg); break;
+			case 's': s_opts.smtp_port        = atoi(optarg); break;
+			case 'l': s_opts.latency_ms       = DC_MAX(atoi(optarg), 0); break;
+			case 'b': s_opts.bandwidth        = DC_MAX(atoi(optarg), 0); break;
+			case 'd': s_opts.disconnect_after = DC_MAX(atoi(optarg), 0); break;
+			case 'v': s_opts.verbose          = 1; break;
+			case 't': run_selftest            = 1; break;
+			default:  usage(argv[0]); return c=='h'? 0 : 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	if (run_selftest) {
+		return selftest();
+	}
+
+	if (s_opts.maildir==NULL) {
+		usage(argv[0]);
+		return 1;
+	}
+	mkdir(s_opts.maildir, 0700);
+
+	int imap_fd = listen_on(s_opts.imap_port);
+	int smtp_fd = listen_on(s_opts.smtp_port);
+	fprintf(stderr, "dc-loopback: IMAP on 127.0.0.1:%i, SMTP on 127.0.0.1:%i, maildir %s\n",
+		s_opts.imap_port, s_opts.smtp_port, s_opts.maildir);
+
+	serve(imap_fd, smtp_fd);
+	return 0;
+}
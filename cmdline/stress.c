@@ -6,9 +6,15 @@ $ valgrind --leak-check=full --tool=memcheck ./deltachat-core <db>
 
 #include <ctype.h>
 #include <assert.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "../src/dc_context.h"
 #include "../src/dc_simplify.h"
 #include "../src/dc_mimeparser.h"
+#include "../src/dc_base64.h"
+#include "../src/dc_blob.h"
 #include "../src/dc_mimefactory.h"
 #include "../src/dc_pgp.h"
 #include "../src/dc_apeerstate.h"
@@ -17,6 +23,10 @@ $ valgrind --leak-check=full --tool=memcheck ./deltachat-core <db>
 #include "../src/dc_saxparser.h"
 
 
+/* from libetpan/src/data-types/base64.h, which is not installed; used to compare dc_base64_encode() with it */
+char* encode_base64(const char* in, int len);
+
+
 /* some data used for testing
  ******************************************************************************/
 
@@ -151,6 +161,29 @@ static const char* s_em_setupfile =
 "-----END PGP MESSAGE-----\n";
 
 
+static void* transaction_waiter_thread(void* arg)
+{
+	dc_sqlite3_t* sql = (dc_sqlite3_t*)arg;
+	dc_sqlite3_begin_transaction(sql);
+		dc_sqlite3_set_config(sql, "stress.waiter", "1");
+	dc_sqlite3_commit(sql);
+	return NULL;
+}
+
+
+static void* peerstate_loader_thread(void* arg)
+{
+	dc_context_t* context = (dc_context_t*)arg;
+	for (int i = 0; i < 1000; i++) {
+		dc_apeerstate_t* ps = dc_apeerstate_new(context);
+		assert( dc_apeerstate_load_by_addr(ps, context->sql, "cache.test@example.org") );
+		assert( ps->public_key && ps->public_key->bytes==3 );
+		dc_apeerstate_unref(ps);
+	}
+	return NULL;
+}
+
+
 void stress_functions(dc_context_t* context)
 {
 	/* test dc_saxparser_t
@@ -218,6 +251,366 @@ void stress_functions(dc_context_t* context)
 		dc_kml_unref(kml);
 	}
 
+	/* test transactions
+	 **************************************************************************/
+
+	if (dc_is_open(context))
+	{
+		dc_sqlite3_begin_transaction(context->sql);
+			dc_sqlite3_set_config(context->sql, "stress.outer", "1");
+			dc_sqlite3_begin_transaction(context->sql);
+				dc_sqlite3_set_config(context->sql, "stress.inner", "1");
+			dc_sqlite3_rollback(context->sql);
+			assert( !sqlite3_get_autocommit(context->sql->cobj) );
+			dc_sqlite3_begin_transaction(context->sql);
+				dc_sqlite3_set_config(context->sql, "stress.inner2", "1");
+			dc_sqlite3_commit(context->sql);
+		dc_sqlite3_commit(context->sql);
+		assert( sqlite3_get_autocommit(context->sql->cobj) );
+
+		assert( dc_sqlite3_get_config_int(context->sql, "stress.outer", 0)==1 );
+		assert( dc_sqlite3_get_config_int(context->sql, "stress.inner", 0)==0 );
+		assert( dc_sqlite3_get_config_int(context->sql, "stress.inner2", 0)==1 );
+
+		/* events telling about changes are sent after the commit */
+		dc_sqlite3_begin_transaction(context->sql);
+			assert( dc_sqlite3_defer_event(context->sql, DC_EVENT_CONTACTS_CHANGED, 0, 0)==1 );
+			assert( dc_sqlite3_defer_event(context->sql, DC_EVENT_INFO, 0, 0)==0 );
+		dc_sqlite3_commit(context->sql);
+		assert( dc_sqlite3_defer_event(context->sql, DC_EVENT_CONTACTS_CHANGED, 0, 0)==0 );
+
+		dc_sqlite3_begin_batch(context->sql, 2);
+			for (int i = 0; i < 5; i++) {
+				dc_sqlite3_batch_step(context->sql);
+				assert( !sqlite3_get_autocommit(context->sql->cobj) );
+			}
+		dc_sqlite3_end_batch(context->sql);
+		assert( sqlite3_get_autocommit(context->sql->cobj) );
+
+		/* between its commits, a batch gives way to threads waiting for a transaction */
+		pthread_t waiter;
+		dc_sqlite3_begin_batch(context->sql, 1);
+			assert( pthread_create(&waiter, NULL, transaction_waiter_thread, context->sql)==0 );
+			for (int i = 0; i < 100 && dc_sqlite3_get_config_int(context->sql, "stress.waiter", 0)==0; i++) {
+				usleep(10*1000);
+				dc_sqlite3_batch_step(context->sql);
+			}
+			assert( dc_sqlite3_get_config_int(context->sql, "stress.waiter", 0)==1 );
+		dc_sqlite3_end_batch(context->sql);
+		pthread_join(waiter, NULL);
+		dc_sqlite3_set_config(context->sql, "stress.waiter", NULL);
+
+		dc_sqlite3_set_config(context->sql, "stress.outer", NULL);
+		dc_sqlite3_set_config(context->sql, "stress.inner2", NULL);
+	}
+
+	if (dc_is_open(context))
+	{
+		char*         dbfile = dc_mprintf("%s/stress-wal.db", context->blobdir);
+		dc_sqlite3_t* sql = dc_sqlite3_new(context);
+		sqlite3_stmt* stmt = NULL;
+
+		assert( dc_sqlite3_open(sql, dbfile, 0) );
+		assert( sql->readers_cnt==0 );
+		dc_sqlite3_set_config_int(sql, "wal_mode", 1);
+		dc_sqlite3_close(sql);
+
+		assert( dc_sqlite3_open(sql, dbfile, 0) );
+		assert( sql->readers_cnt==DC_READ_POOL_SIZE );
+
+		dc_sqlite3_begin_transaction(sql);
+			dc_sqlite3_set_config(sql, "stress.wal", "1");
+			stmt = dc_sqlite3_prepare_read(sql, "SELECT value FROM config WHERE keyname='stress.wal';");
+			assert( sqlite3_db_handle(stmt)==sql->cobj ); /* uncommitted data are read from the writer */
+			assert( sqlite3_step(stmt)==SQLITE_ROW );
+			sqlite3_finalize(stmt);
+		dc_sqlite3_commit(sql);
+
+		stmt = dc_sqlite3_prepare_read(sql, "SELECT value FROM config WHERE keyname='stress.wal';");
+		assert( sqlite3_db_handle(stmt)!=sql->cobj );
+		assert( sqlite3_step(stmt)==SQLITE_ROW );
+		sqlite3_finalize(stmt);
+
+		dc_sqlite3_unref(sql);
+		assert( dc_delete_file(context, dbfile) );
+		free(dbfile);
+	}
+
+	/* test job queue
+	 **************************************************************************/
+
+	if (dc_is_open(context))
+	{
+		size_t i = 0, cnt = 0;
+
+		dc_job_kill_action(context, DC_JOB_MAYBE_SEND_LOC_ENDED);
+		assert( !dc_job_action_exists(context, DC_JOB_MAYBE_SEND_LOC_ENDED) );
+		cnt = context->smtp_jobs.cnt;
+
+		dc_job_add(context, DC_JOB_MAYBE_SEND_LOC_ENDED, 0, NULL, 3600);
+		dc_job_add(context, DC_JOB_MAYBE_SEND_LOC_ENDED, 0, NULL, 60);
+		dc_job_add(context, DC_JOB_MAYBE_SEND_LOC_ENDED, 0, NULL, 600);
+		assert( dc_job_action_exists(context, DC_JOB_MAYBE_SEND_LOC_ENDED) );
+		assert( context->smtp_jobs.cnt==cnt+3 );
+		for (i = 1; i < context->smtp_jobs.cnt; i++) {
+			assert( context->smtp_jobs.heap[(i-1)/2]->desired_timestamp <= context->smtp_jobs.heap[i]->desired_timestamp );
+		}
+
+		dc_job_unload_queues(context); /* the jobs are reloaded from the database */
+		assert( dc_job_action_exists(context, DC_JOB_MAYBE_SEND_LOC_ENDED) );
+		assert( context->smtp_jobs.cnt==cnt+3 );
+
+		dc_job_kill_action(context, DC_JOB_MAYBE_SEND_LOC_ENDED);
+		assert( !dc_job_action_exists(context, DC_JOB_MAYBE_SEND_LOC_ENDED) );
+		assert( context->smtp_jobs.cnt==cnt );
+	}
+
+	/* test config cache
+	 **************************************************************************/
+
+	if (dc_is_open(context))
+	{
+		dc_sqlite3_set_config(context->sql, "stress.cached", "foo");
+		char* str = dc_sqlite3_get_config(context->sql, "stress.cached", NULL);
+		assert( context->sql->config_cache_loaded );
+		assert( str && strcmp(str, "foo")==0 );
+		free(str);
+
+		dc_sqlite3_begin_transaction(context->sql);
+			dc_sqlite3_set_config(context->sql, "stress.cached", "bar");
+			assert( dc_sqlite3_get_config_int(context->sql, "stress.cached", 0)==0 );
+			dc_sqlite3_set_config_int(context->sql, "stress.cached", 42);
+			assert( dc_sqlite3_get_config_int(context->sql, "stress.cached", 0)==42 );
+		dc_sqlite3_rollback(context->sql);
+		assert( !context->sql->config_cache_loaded );
+
+		str = dc_sqlite3_get_config(context->sql, "stress.cached", NULL);
+		assert( str && strcmp(str, "foo")==0 );
+		free(str);
+
+		dc_sqlite3_set_config(context->sql, "stress.cached", NULL);
+		assert( dc_sqlite3_get_config(context->sql, "stress.cached", NULL)==NULL );
+	}
+
+	/* test full-text-index
+	 **************************************************************************/
+
+	if (dc_is_open(context) && context->sql->fts_enabled)
+	{
+		char*         dbfile = dc_mprintf("%s/stress-fts.db", context->blobdir);
+		dc_sqlite3_t* sql = dc_sqlite3_new(context);
+		sqlite3_stmt* stmt = NULL;
+
+		assert( dc_sqlite3_open(sql, dbfile, 0) );
+		assert( sql->fts_enabled );
+		assert( !dc_fts_ready(sql) ); /* the reserved messages are not yet indexed */
+
+		dc_sqlite3_execute(sql, "INSERT INTO msgs (id, txt) VALUES (100, 'Hello Wörld'), (101, 'hello'), (102, '');");
+		dc_sqlite3_execute(sql, "UPDATE msgs SET txt='bye' WHERE id=101;");
+		dc_sqlite3_execute(sql, "DELETE FROM msgs WHERE id=100;");
+		dc_sqlite3_execute(sql, "INSERT INTO msgs (id, txt) VALUES (103, 'say \"hello\" world');");
+
+		stmt = dc_sqlite3_prepare(sql, "SELECT GROUP_CONCAT(rowid) FROM msgs_fts WHERE msgs_fts MATCH ?;");
+		sqlite3_bind_text(stmt, 1, "\"hel\"* \"wo\"*", -1, SQLITE_STATIC);
+		assert( sqlite3_step(stmt)==SQLITE_ROW );
+		assert( sqlite3_column_int(stmt, 0)==103 );
+		sqlite3_reset(stmt);
+		sqlite3_bind_text(stmt, 1, "\"by\"*", -1, SQLITE_STATIC);
+		assert( sqlite3_step(stmt)==SQLITE_ROW );
+		assert( sqlite3_column_int(stmt, 0)==101 );
+		sqlite3_finalize(stmt);
+
+		dc_sqlite3_unref(sql);
+		assert( dc_delete_file(context, dbfile) );
+		free(dbfile);
+	}
+
+	/* test chats_summary triggers
+	 **************************************************************************/
+
+	if (dc_is_open(context))
+	{
+		char*         dbfile = dc_mprintf("%s/stress-summary.db", context->blobdir);
+		dc_sqlite3_t* sql = dc_sqlite3_new(context);
+		sqlite3_stmt* stmt = NULL;
+
+		assert( dc_sqlite3_open(sql, dbfile, 0) );
+		dc_sqlite3_execute(sql, "INSERT INTO chats (id, type, name) VALUES (10, 100, 'a');");
+		dc_sqlite3_execute(sql, "INSERT INTO msgs (id, chat_id, timestamp, state, hidden) VALUES "
+		                        " (100, 10, 5, 10, 0), (101, 10, 7, 10, 0), (102, 10, 6, 26, 0), (103, 10, 9, 10, 1);");
+
+		#define SUMMARY_IS(last_msg_id, fresh_cnt) \
+			stmt = dc_sqlite3_prepare(sql, "SELECT last_msg_id, fresh_cnt FROM chats_summary WHERE chat_id=10;"); \
+			assert( sqlite3_step(stmt)==SQLITE_ROW ); \
+			assert( sqlite3_column_int(stmt, 0)==(last_msg_id) && sqlite3_column_int(stmt, 1)==(fresh_cnt) ); \
+			sqlite3_finalize(stmt);
+
+		SUMMARY_IS(101, 2); /* 103 is hidden and not counted */
+		dc_sqlite3_execute(sql, "UPDATE msgs SET state=13 WHERE id=100;");
+		SUMMARY_IS(101, 1);
+		dc_sqlite3_execute(sql, "DELETE FROM msgs WHERE id=101;");
+		SUMMARY_IS(102, 0);
+		dc_sqlite3_execute(sql, "UPDATE msgs SET hidden=0 WHERE id=103;");
+		SUMMARY_IS(103, 1);
+		dc_sqlite3_execute(sql, "UPDATE msgs SET chat_id=3 WHERE chat_id=10;");
+		SUMMARY_IS(0, 0);
+
+		dc_sqlite3_execute(sql, "DELETE FROM chats WHERE id=10;");
+		stmt = dc_sqlite3_prepare(sql, "SELECT COUNT(*) FROM chats_summary WHERE chat_id=10;");
+		assert( sqlite3_step(stmt)==SQLITE_ROW && sqlite3_column_int(stmt, 0)==0 );
+		sqlite3_finalize(stmt);
+
+		dc_sqlite3_unref(sql);
+		assert( dc_delete_file(context, dbfile) );
+		free(dbfile);
+	}
+
+	/* test chatlist summaries
+	 **************************************************************************/
+
+	if (dc_is_open(context))
+	{
+		dc_chatlist_t* chatlist = dc_get_chatlist(context, 0, NULL, 0);
+		size_t         cnt = dc_chatlist_get_cnt(chatlist);
+		dc_array_t*    summaries = dc_chatlist_get_summaries(chatlist, 0, cnt+10);
+		assert( dc_array_get_cnt(summaries)==cnt );
+		for (size_t i = 0; i<cnt; i++) {
+			dc_lot_t* lot1 = dc_chatlist_get_summary(chatlist, i, NULL);
+			dc_lot_t* lot2 = (dc_lot_t*)dc_array_get_ptr(summaries, i);
+			assert( lot1->text1_meaning==lot2->text1_meaning && lot1->timestamp==lot2->timestamp && lot1->state==lot2->state );
+			assert( strcmp(lot1->text1? lot1->text1 : "-", lot2->text1? lot2->text1 : "-")==0 );
+			assert( strcmp(lot1->text2? lot1->text2 : "-", lot2->text2? lot2->text2 : "-")==0 );
+			dc_lot_unref(lot1);
+		}
+		dc_array_unref(summaries);
+
+		summaries = dc_chatlist_get_summaries(chatlist, cnt, cnt);
+		assert( summaries && dc_array_get_cnt(summaries)==0 );
+		dc_array_unref(summaries);
+
+		assert( dc_chatlist_get_summaries(NULL, 0, 1)==NULL );
+		dc_chatlist_unref(chatlist);
+	}
+
+	/* test message windows
+	 **************************************************************************/
+
+	if (dc_is_open(context))
+	{
+		dc_chatlist_t* chatlist = dc_get_chatlist(context, 0, NULL, 0);
+		for (size_t i = 0; i<dc_chatlist_get_cnt(chatlist) && i<10; i++) {
+			uint32_t    chat_id = dc_chatlist_get_chat_id(chatlist, i);
+			dc_array_t* all = dc_get_chat_msgs(context, chat_id, DC_GCM_ADDDAYMARKER, 0);
+			dc_array_t* window = dc_get_chat_msgs_window(context, chat_id, DC_GCM_ADDDAYMARKER, 0, 0, 1000000, 0);
+			char*       all_str = dc_array_get_string(all, ",");
+			char*       window_str = dc_array_get_string(window, ",");
+			assert( strcmp(all_str, window_str)==0 );
+			free(all_str);
+			free(window_str);
+			dc_array_unref(window);
+
+			if (dc_array_get_cnt(all)>0) {
+				uint32_t last_id = dc_array_get_id(all, dc_array_get_cnt(all)-1);
+				window = dc_get_chat_msgs_window(context, chat_id, 0, 0, last_id, 0, 10);
+				assert( dc_array_get_cnt(window)==1 && dc_array_get_id(window, 0)==last_id );
+				dc_array_unref(window);
+			}
+			dc_array_unref(all);
+		}
+		dc_chatlist_unref(chatlist);
+	}
+
+	/* test statement cache
+	 **************************************************************************/
+
+	if (dc_is_open(context))
+	{
+		const char*   q = "SELECT COUNT(*) FROM config WHERE keyname=?;";
+		int           hits = context->sql->stmt_cache_hits;
+		sqlite3_stmt* stmt1 = dc_sqlite3_borrow_stmt(context->sql, q);
+		sqlite3_stmt* stmt2 = dc_sqlite3_borrow_stmt(context->sql, q);
+		assert( stmt1 && stmt2 && stmt1!=stmt2 ); /* borrowed statements are not shared */
+		sqlite3_bind_text(stmt1, 1, "dbversion", -1, SQLITE_STATIC);
+		assert( sqlite3_step(stmt1)==SQLITE_ROW && sqlite3_column_int(stmt1, 0)==1 );
+		dc_sqlite3_return_stmt(context->sql, stmt1);
+		dc_sqlite3_return_stmt(context->sql, stmt2);
+
+		sqlite3_stmt* stmt3 = dc_sqlite3_borrow_stmt(context->sql, q);
+		assert( stmt3==stmt1 || stmt3==stmt2 );
+		assert( context->sql->stmt_cache_hits==hits+1 );
+		assert( sqlite3_step(stmt3)==SQLITE_ROW && sqlite3_column_int(stmt3, 0)==0 ); /* bindings are cleared on return */
+		dc_sqlite3_return_stmt(context->sql, stmt3);
+
+		for (int i = 0; i < DC_STMT_CACHE_SIZE*2; i++) {
+			char* q3 = dc_mprintf("SELECT %i;", i);
+			dc_sqlite3_return_stmt(context->sql, dc_sqlite3_borrow_stmt(context->sql, q3));
+			free(q3);
+		}
+
+		/* a statement borrowed while the database is closed stays usable until it is returned */
+		char*         dbfile = dc_mprintf("%s/stress-stmt.db", context->blobdir);
+		dc_sqlite3_t* sql = dc_sqlite3_new(context);
+		assert( dc_sqlite3_open(sql, dbfile, 0) );
+		sqlite3_stmt* stmt4 = dc_sqlite3_borrow_stmt(sql, q);
+		dc_sqlite3_close(sql);
+		assert( sql->stmt_cache[0].stmt==NULL );
+		sqlite3_bind_text(stmt4, 1, "dbversion", -1, SQLITE_STATIC);
+		assert( sqlite3_step(stmt4)==SQLITE_ROW && sqlite3_column_int(stmt4, 0)==1 );
+		dc_sqlite3_return_stmt(sql, stmt4);
+		dc_sqlite3_unref(sql);
+		assert( dc_delete_file(context, dbfile) );
+		free(dbfile);
+	}
+
+	/* test metrics
+	 **************************************************************************/
+
+	{
+		dc_metrics_t* metrics = dc_metrics_new();
+		dc_metrics_add(metrics, DC_METRIC_IMAP_FETCH_BODIES, 0);
+		dc_metrics_add(metrics, DC_METRIC_IMAP_FETCH_BODIES, 3);
+		dc_metrics_add(metrics, DC_METRIC_IMAP_FETCH_BODIES, 1000);
+		dc_metrics_add(metrics, DC_METRIC_FIXED_CNT, 1000); /* out of range, ignored */
+		dc_metrics_add_by_name(metrics, "job.test", 5);
+		dc_metrics_add_by_name(metrics, "job.test", 7);
+		assert( metrics->metrics[DC_METRIC_IMAP_FETCH_BODIES].cnt==3 );
+		assert( metrics->metrics[DC_METRIC_IMAP_FETCH_BODIES].total_us==1003 );
+		assert( metrics->metrics[DC_METRIC_IMAP_FETCH_BODIES].max_us==1000 );
+		assert( metrics->metrics[DC_METRIC_IMAP_FETCH_BODIES].buckets[0]==1 );
+		assert( metrics->metrics[DC_METRIC_IMAP_FETCH_BODIES].buckets[2]==1 );  /* 2..3 */
+		assert( metrics->metrics[DC_METRIC_IMAP_FETCH_BODIES].buckets[10]==1 ); /* 512..1023 */
+		assert( metrics->cnt==DC_METRIC_FIXED_CNT+1 && metrics->metrics[DC_METRIC_FIXED_CNT].cnt==2 );
+
+		int key = 0;
+		dc_metrics_begin(metrics, &key);
+		dc_metrics_end(metrics, DC_METRIC_SQL_READ, &key);
+		dc_metrics_end(metrics, DC_METRIC_SQL_READ, &key); /* not pending anymore, ignored */
+		assert( metrics->metrics[DC_METRIC_SQL_READ].cnt==1 );
+
+		char* json = dc_metrics_get_json(metrics);
+		assert( strncmp(json, "{\"version\":1,", 13)==0 );
+		assert( strstr(json, "\"name\":\"imap.fetch_bodies\",\"count\":3,") );
+		assert( strstr(json, "\"job.test\"") );
+		assert( strstr(json, "imap.connect")==NULL ); /* unused metrics are not listed */
+		free(json);
+
+		size_t bytes = 0;
+		uint8_t* bin = dc_metrics_get_binary(metrics, &bytes);
+		assert( bin && bytes>4 && memcmp(bin, "DCM\x01", 4)==0 );
+		free(bin);
+
+		dc_metrics_reset(metrics);
+		assert( metrics->metrics[DC_METRIC_IMAP_FETCH_BODIES].cnt==0 && metrics->metrics[DC_METRIC_FIXED_CNT].cnt==0 );
+		dc_metrics_unref(metrics);
+	}
+
+	if (dc_is_open(context))
+	{
+		char* json = dc_get_metrics(context, 0, NULL);
+		assert( json && strstr(json, "\"sql.read\"") );
+		free(json);
+	}
+
 	/* test file functions
 	 **************************************************************************/
 
@@ -254,6 +647,41 @@ void stress_functions(dc_context_t* context)
 		assert( buf_bytes==7 );
 		assert( strcmp(buf, "content")==0 );
 		free(buf);
+		assert( dc_read_file_prefix(context, "$BLOBDIR/dada", 4, &buf, &buf_bytes) ); /* prefix shorter than the file */
+		assert( buf_bytes==4 );
+		assert( strcmp(buf, "cont")==0 );
+		free(buf);
+		assert( dc_read_file_prefix(context, "$BLOBDIR/dada", 7, &buf, &buf_bytes) );
+		assert( buf_bytes==7 );
+		assert( strcmp(buf, "content")==0 );
+		free(buf);
+		assert( dc_read_file_prefix(context, "$BLOBDIR/dada", 100, &buf, &buf_bytes) ); /* file shorter than the prefix */
+		assert( buf_bytes==7 );
+		assert( strcmp(buf, "content")==0 );
+		free(buf);
+		assert( dc_write_file(context, "$BLOBDIR/empty", "", 0) );
+		buf = "x"; /* must be reset on errors */
+		buf_bytes = 1;
+		assert( !dc_read_file_prefix(context, "$BLOBDIR/empty", 4, &buf, &buf_bytes) );
+		assert( buf==NULL && buf_bytes==0 );
+		assert( dc_delete_file(context, "$BLOBDIR/empty") );
+		buf = "x";
+		buf_bytes = 1;
+		assert( !dc_read_file_prefix(context, "$BLOBDIR/dadax", 4, &buf, &buf_bytes) );
+		assert( buf==NULL && buf_bytes==0 );
+
+		const void* mapped;
+		size_t mapped_bytes;
+		assert( dc_map_file(context, "$BLOBDIR/dada", 0, &mapped, &mapped_bytes) );
+		assert( mapped_bytes==7 );
+		assert( memcmp(mapped, "content", 7)==0 );
+		dc_unmap_file(mapped, mapped_bytes);
+		assert( dc_map_file(context, "$BLOBDIR/dada", 4, &mapped, &mapped_bytes) );
+		assert( mapped_bytes==4 );
+		assert( memcmp(mapped, "cont", 4)==0 );
+		dc_unmap_file(mapped, mapped_bytes);
+		assert( !dc_map_file(context, "$BLOBDIR/dadax", 0, &mapped, &mapped_bytes) );
+		assert( mapped==NULL && mapped_bytes==0 );
 
 		assert( dc_delete_file(context, "$BLOBDIR/foobar") );
 		assert( dc_delete_file(context, "$BLOBDIR/dada") );
@@ -276,6 +704,278 @@ void stress_functions(dc_context_t* context)
 		free(fn1);
 	}
 
+	/* test blob directory
+	**************************************************************************/
+
+	if (dc_is_open(context))
+	{
+		/* without deduplication, each file is stored on its own */
+		dc_blobwriter_t* writer = dc_blobwriter_new(context, "stress-blob.txt");
+		assert( dc_blobwriter_write(writer, "content", 7) );
+		char* blob0 = dc_blobwriter_finish(writer);
+		dc_blobwriter_unref(writer);
+
+		writer = dc_blobwriter_new(context, "stress-blob.txt");
+		assert( dc_blobwriter_write(writer, "cont", 4) && dc_blobwriter_write(writer, "ent", 3) );
+		char* blob1 = dc_blobwriter_finish(writer);
+		dc_blobwriter_unref(writer);
+
+		assert( strcmp(blob0, "$BLOBDIR/stress-blob.txt")==0 );
+		assert( strcmp(blob1, "$BLOBDIR/stress-blob-1.txt")==0 );
+		assert( dc_get_filebytes(context, blob1)==7 );
+
+		/* with deduplication, the same content is stored once */
+		dc_sqlite3_set_config_int(context->sql, "dedup_blobs", 1);
+
+		writer = dc_blobwriter_new(context, "stress-dedup.txt");
+		dc_blobwriter_write(writer, "same content", 12);
+		char* blob2 = dc_blobwriter_finish(writer);
+		dc_blobwriter_unref(writer);
+
+		/* make the file look old; when it is used again, it must be protected from dc_housekeeping() */
+		char*          abs2 = dc_get_abs_path(context, blob2);
+		struct utimbuf old_times = { time(NULL)-24*60*60, time(NULL)-24*60*60 };
+		assert( utime(abs2, &old_times)==0 );
+
+		writer = dc_blobwriter_new(context, "stress-dedup.txt");
+		dc_blobwriter_write(writer, "same content", 12);
+		char* blob3 = dc_blobwriter_finish(writer);
+		dc_blobwriter_unref(writer);
+
+		assert( strcmp(blob2, "$BLOBDIR/stress-dedup.txt")==0 );
+		assert( strcmp(blob3, blob2)==0 ); /* the name fits, the file is used as is */
+
+		struct stat st2, st4;
+		assert( stat(abs2, &st2)==0 && st2.st_mtime > time(NULL)-60*60 );
+
+		writer = dc_blobwriter_new(context, "stress-other-name.txt");
+		dc_blobwriter_write(writer, "same content", 12);
+		char* blob4 = dc_blobwriter_finish(writer);
+		dc_blobwriter_unref(writer);
+
+		assert( strcmp(blob4, "$BLOBDIR/stress-other-name.txt")==0 );
+		char* abs4 = dc_get_abs_path(context, blob4);
+		assert( stat(abs2, &st2)==0 && stat(abs4, &st4)==0 );
+		assert( st2.st_ino==st4.st_ino ); /* hardlink */
+
+		writer = dc_blobwriter_new(context, "stress-dedup.txt");
+		dc_blobwriter_write(writer, "other content", 13);
+		char* blob5 = dc_blobwriter_finish(writer);
+		dc_blobwriter_unref(writer);
+		assert( strcmp(blob5, "$BLOBDIR/stress-dedup-1.txt")==0 );
+
+		/* files from outside are not copied if the content is known */
+		char* blob6 = dc_blob_copy(context, blob0, "stress-copy.txt");
+		char* blob7 = dc_blob_copy(context, blob0, "stress-copy.txt");
+		assert( strcmp(blob6, "$BLOBDIR/stress-copy.txt")==0 );
+		assert( strcmp(blob7, blob6)==0 );
+
+		/* a deleted file is not used */
+		assert( dc_delete_file(context, blob6) );
+		char* blob8 = dc_blob_copy(context, blob0, "stress-copy.txt");
+		assert( strcmp(blob8, blob6)==0 );
+		assert( dc_get_filebytes(context, blob8)==7 );
+
+		/* no temporary files are left */
+		DIR* dir = opendir(context->blobdir);
+		struct dirent* entry;
+		while ((entry=readdir(dir))!=NULL) {
+			assert( strncmp(entry->d_name, ".tmp-", 5)!=0 );
+		}
+		closedir(dir);
+
+		dc_sqlite3_set_config(context->sql, "dedup_blobs", NULL);
+
+		const char* blobs[] = { blob0, blob1, blob2, blob4, blob5, blob8 };
+		for (int i = 0; i < 6; i++) {
+			assert( dc_delete_file(context, blobs[i]) );
+			sqlite3_stmt* stmt = dc_sqlite3_prepare(context->sql, "DELETE FROM blobs WHERE path=?;");
+			sqlite3_bind_text(stmt, 1, blobs[i], -1, SQLITE_STATIC);
+			sqlite3_step(stmt);
+			sqlite3_finalize(stmt);
+		}
+		free(abs2);
+		free(abs4);
+		free(blob0);
+		free(blob1);
+		free(blob2);
+		free(blob3);
+		free(blob4);
+		free(blob5);
+		free(blob6);
+		free(blob7);
+		free(blob8);
+	}
+
+	/* test base64
+	**************************************************************************/
+
+	{
+		char     enc[2048];
+		uint8_t  bin[1536], dec[1536];
+		uint32_t rnd = 4711;
+		#define  TEST_RND() (rnd = rnd*1103515245+12345, (rnd>>16)&0x7FFF)
+
+		assert( dc_base64_encode("", 0, enc)==0 );
+		assert( dc_base64_encode("f", 1, enc)==4 && strncmp(enc, "Zg==", 4)==0 );
+		assert( dc_base64_encode("fo", 2, enc)==4 && strncmp(enc, "Zm8=", 4)==0 );
+		assert( dc_base64_encode("foobar", 6, enc)==8 && strncmp(enc, "Zm9vYmFy", 8)==0 );
+		assert( dc_base64_decode("Zm9v\r\nYmFy", 10, dec)==6 && memcmp(dec, "foobar", 6)==0 );
+		assert( dc_base64_decode("Zm8=", 4, dec)==2 && memcmp(dec, "fo", 2)==0 );
+		assert( dc_base64_decode(" Z-g= =", 7, dec)==1 && dec[0]=='f' );
+		assert( dc_base64_decode("====", 4, dec)==0 );
+
+		int best = dc_base64_set_impl(DC_BASE64_BEST);
+		for (int impl = DC_BASE64_SCALAR; impl <= best; impl++)
+		{
+			assert( dc_base64_set_impl(impl)==impl );
+			for (int i = 0; i < 200; i++)
+			{
+				/* encoding must give the same result as libetpan and decoding must revert it */
+				size_t bytes = i<100? i : TEST_RND()%sizeof(bin);
+				for (size_t j = 0; j < bytes; j++) {
+					bin[j] = TEST_RND();
+				}
+				size_t enc_bytes = dc_base64_encode(bin, bytes, enc);
+				assert( enc_bytes==DC_BASE64_ENCODED_BYTES(bytes) );
+				char* etpan_enc = encode_base64((const char*)bin, bytes);
+				assert( strlen(etpan_enc)==enc_bytes && strncmp(etpan_enc, enc, enc_bytes)==0 );
+				free(etpan_enc);
+				assert( dc_base64_decode(enc, enc_bytes, dec)==bytes && memcmp(dec, bin, bytes)==0 );
+
+				/* decoding random garbage must give the same result as libetpan */
+				for (size_t j = 0; j < enc_bytes; j++) {
+					switch (TEST_RND()%64) {
+						case 0:  enc[j] = '\r'; break;
+						case 1:  enc[j] = '\n'; break;
+						case 2:  enc[j] = '='; break;
+						case 3:  enc[j] = (char)(0x80|TEST_RND()); break;
+						case 4:  enc[j] = (char)TEST_RND(); break;
+					}
+				}
+				size_t indx = 0, etpan_bytes = 0;
+				char*  etpan_dec = NULL;
+				assert( mailmime_base64_body_parse(enc, enc_bytes, &indx, &etpan_dec, &etpan_bytes)==MAILIMF_NO_ERROR );
+				assert( dc_base64_decode(enc, enc_bytes, dec)==etpan_bytes && memcmp(dec, etpan_dec, etpan_bytes)==0 );
+
+				/* the same in chunks of random size */
+				dc_base64_decoder_t decoder;
+				size_t dec_bytes = 0, pos = 0;
+				dc_base64_decoder_init(&decoder);
+				while (pos < enc_bytes) {
+					size_t chunk = TEST_RND()%40;
+					chunk = DC_MIN(chunk, enc_bytes-pos);
+					dec_bytes += dc_base64_decoder_add(&decoder, enc+pos, chunk, dec+dec_bytes);
+					pos += chunk;
+				}
+				dec_bytes += dc_base64_decoder_finish(&decoder, dec+dec_bytes);
+				assert( dec_bytes==etpan_bytes && memcmp(dec, etpan_dec, etpan_bytes)==0 );
+				mmap_string_unref(etpan_dec);
+			}
+		}
+		dc_base64_set_impl(DC_BASE64_BEST);
+
+		/* base64 bodies are decoded by mailmime_transfer_decode() */
+		const char* txt = "Content-Type: application/octet-stream\r\nContent-Transfer-Encoding: base64\r\n\r\nZm9v\r\nYmFy\r\n";
+		struct mailmime* mime = NULL;
+		size_t dummy = 0;
+		assert( mailmime_parse(txt, strlen(txt), &dummy, &mime)==MAIL_NO_ERROR && mime!=NULL );
+		const char* decoded_data = NULL;
+		size_t      decoded_data_bytes = 0;
+		char*       transfer_decoding_buffer = NULL;
+		assert( mime->mm_type==MAILMIME_MESSAGE && mime->mm_data.mm_message.mm_msg_mime->mm_type==MAILMIME_SINGLE );
+		assert( mailmime_transfer_decode(mime->mm_data.mm_message.mm_msg_mime, &decoded_data, &decoded_data_bytes, &transfer_decoding_buffer) );
+		assert( decoded_data_bytes==6 && strcmp(decoded_data, "foobar")==0 );
+		mmap_string_unref(transfer_decoding_buffer);
+		mailmime_free(mime);
+	}
+
+	/* test quoted-printable, UTF-8 and header words without iconv
+	**************************************************************************/
+
+	{
+		assert( dc_utf8_check("", 0)==DC_UTF8_ASCII );
+		assert( dc_utf8_check("just ascii, more than 8 bytes", 29)==DC_UTF8_ASCII );
+		assert( dc_utf8_check("Bj\xc3\xb6rn", 6)==DC_UTF8_VALID );
+		assert( dc_utf8_check("Bj\xc3\xb6", 4)==DC_UTF8_VALID );
+		assert( dc_utf8_check("Bj\xc3", 3)==DC_UTF8_INVALID );          /* truncated */
+		assert( dc_utf8_check("Bj\xf6rn", 5)==DC_UTF8_INVALID );        /* ISO-8859-1 */
+		assert( dc_utf8_check("\xc0\xaf", 2)==DC_UTF8_INVALID );        /* overlong */
+		assert( dc_utf8_check("\xed\xa0\x80", 3)==DC_UTF8_INVALID );    /* surrogate */
+		assert( dc_utf8_check("\xf0\x9f\x98\x80", 4)==DC_UTF8_VALID );
+
+		assert( !dc_needs_charconv(NULL, DC_UTF8_INVALID) );
+		assert( !dc_needs_charconv("utf-8", DC_UTF8_INVALID) );
+		assert( !dc_needs_charconv("Utf8", DC_UTF8_VALID) );
+		assert(  dc_needs_charconv("Utf8", DC_UTF8_INVALID) );
+		assert( !dc_needs_charconv("us-ascii", DC_UTF8_ASCII) );
+		assert( !dc_needs_charconv("ISO-8859-15", DC_UTF8_ASCII) );
+		assert(  dc_needs_charconv("ISO-8859-15", DC_UTF8_VALID) );
+		assert(  dc_needs_charconv("iso-2022-jp", DC_UTF8_ASCII) );    /* 7 bit, but not ASCII */
+
+		/* quoted-printable must be decoded exactly as by libetpan */
+		const char* qp[] = { "Bj=C3=B6rn=\r\n Petersen", "a_b\nc\rd\r\n", "soft=\nbreak=\r", "bad=ZZ=", "=3d=3D", "=E4ndern", "", "_", "x\r" };
+		for (int i = 0; i < (int)(sizeof(qp)/sizeof(qp[0])); i++) {
+			for (int in_header = 0; in_header <= 1; in_header++) {
+				char   out[64];
+				size_t out_bytes = 0, indx = 0, etpan_bytes = 0;
+				int    utf8 = -1;
+				char*  etpan = NULL;
+				assert( dc_decode_quoted_printable(qp[i], strlen(qp[i]), in_header, out, &out_bytes, &utf8) );
+				assert( mailmime_quoted_printable_body_parse(qp[i], strlen(qp[i]), &indx, &etpan, &etpan_bytes, in_header)==MAILIMF_NO_ERROR );
+				assert( out_bytes==etpan_bytes && memcmp(out, etpan, etpan_bytes)==0 && out[out_bytes]==0 );
+				assert( utf8==dc_utf8_check(etpan, etpan_bytes) );
+				mmap_string_unref(etpan);
+			}
+		}
+		{
+			char   out[64];
+			size_t out_bytes = 0;
+			assert( !dc_decode_quoted_printable("abc=4", 5, 0, out, &out_bytes, NULL) ); /* left to libetpan */
+		}
+
+		/* header words must be decoded exactly as by libetpan, with or without the fast path */
+		const char* words[] = { "", " ", "a  b\t", " =?utf-8?q?a?= =?utf-8?q?b?= c", "x=?UTF-8?B?w7Y=?==?utf-8?b?w7Y=?=y",
+			"=?utf-8?q?=C3?= =?utf-8?q?=B6?=", "=?utf8?q?a_b?=", "=?us-ascii?q?=C3?=", "=?iso-8859-1?q?=E4?=", "\"=?utf-8?q?a?=\"",
+			"=?utf-8?x?a?=", "=?utf-8?q?a", "a=?b", "Bj\xc3\xb6rn", "a\r\n b", "=?utf-8?q?a=00b?= c" };
+		for (int i = 0; i < (int)(sizeof(words)/sizeof(words[0])); i++) {
+			size_t indx = 0;
+			char*  etpan = NULL;
+			if (mailmime_encoded_phrase_parse("iso-8859-1", words[i], strlen(words[i]), &indx, "utf-8", &etpan)!=MAILIMF_NO_ERROR || etpan==NULL) {
+				etpan = dc_strdup(words[i]);
+			}
+			char* decoded = dc_decode_header_words(words[i]);
+			assert( strcmp(decoded, etpan)==0 );
+			free(decoded);
+			free(etpan);
+		}
+
+		/* bare CR or LF inside encoded words, as kept by mailimf_unstructured_parse(), are left to libetpan */
+		for (int i = 0; i < 2; i++) {
+			dc_strbuilder_t word;
+			dc_strbuilder_init(&word, 0);
+			dc_strbuilder_cat(&word, "=?utf-8?q?");
+			for (int j = 0; j < 200; j++) {
+				dc_strbuilder_cat(&word, i? "\n" : "\r");
+			}
+			dc_strbuilder_cat(&word, "x?=");
+			size_t indx = 0;
+			char*  etpan = NULL;
+			if (mailmime_encoded_phrase_parse("iso-8859-1", word.buf, strlen(word.buf), &indx, "utf-8", &etpan)!=MAILIMF_NO_ERROR || etpan==NULL) {
+				etpan = dc_strdup(word.buf);
+			}
+			char* decoded = dc_decode_header_words(word.buf);
+			assert( strcmp(decoded, etpan)==0 );
+			free(decoded);
+			free(etpan);
+			free(word.buf);
+		}
+
+		char* decoded = dc_decode_header_words("=?utf-8?q?Bj=C3=B6rn?= =?UTF-8?B?UGV0ZXJzZW4=?= sagt  hallo ");
+		assert( strcmp(decoded, "BjörnPetersen sagt hallo ")==0 );
+		free(decoded);
+	}
+
 	/* test mailmime
 	**************************************************************************/
 
@@ -346,6 +1046,111 @@ void stress_functions(dc_context_t* context)
 
 		assert( carray_count(mimeparser->parts) == 1 );
 
+		/* text parts, converted with iconv only if needed */
+		const char* charsets[] = { "utf-8", "windows-1252", "iso-8859-1" };
+		const char* bodies[]   = { "Bj=C3=B6rn", "Bjoern", "Bj=F6rn" };
+		const char* expected[] = { "Björn", "Bjoern", "Björn" };
+		for (int i = 0; i < 3; i++) {
+			char* raw2 = dc_mprintf(
+				"Content-Type: text/plain; charset=%s\n"
+				"Content-Transfer-Encoding: quoted-printable\n"
+				"Subject: =?utf-8?q?Gr=C3=BC=C3=9Fe?=\n"
+				"Chat-Version: 1.0\n"
+				"\n"
+				"%s\n", charsets[i], bodies[i]);
+			dc_mimeparser_empty(mimeparser);
+			dc_mimeparser_parse(mimeparser, raw2, strlen(raw2));
+			assert( strcmp(mimeparser->subject, "Grüße")==0 );
+			assert( carray_count(mimeparser->parts)==1 );
+			assert( strcmp(((dc_mimepart_t*)carray_get(mimeparser->parts, 0))->msg, expected[i])==0 );
+			free(raw2);
+		}
+
+		/* attachments larger than the decoding chunks, base64 and quoted-printable; files need an open context */
+		if (dc_is_open(context))
+		{
+			#define ATTACHMENT_BYTES 200003
+			unsigned char* attachment = malloc(ATTACHMENT_BYTES);
+			for (int i = 0; i < ATTACHMENT_BYTES; i++) {
+				attachment[i] = (unsigned char)(i*7 + i/251);
+			}
+			memcpy(attachment, "\x89PNG\r\n\x1a\n\0\0\0\x0dIHDR\0\0\x01\x02\0\0\0\x03", 24);
+
+			dc_strbuilder_t b64;
+			dc_strbuilder_init(&b64, 0);
+			char* b64_buf = malloc(DC_BASE64_ENCODED_BYTES(ATTACHMENT_BYTES)+1);
+			size_t b64_bytes = dc_base64_encode(attachment, ATTACHMENT_BYTES, b64_buf);
+			for (size_t i = 0; i < b64_bytes; i += 76) {
+				dc_strbuilder_catf(&b64, "%.*s\r\n", (int)DC_MIN(76, b64_bytes-i), b64_buf+i);
+			}
+			free(b64_buf);
+
+			dc_strbuilder_t qp;
+			dc_strbuilder_init(&qp, 0);
+			for (int i = 0, col = 0; i < ATTACHMENT_BYTES; i++) {
+				if (isalnum(attachment[i])) {
+					dc_strbuilder_catf(&qp, "%c", attachment[i]);
+					col += 1;
+				}
+				else {
+					dc_strbuilder_catf(&qp, "=%02X", attachment[i]);
+					col += 3;
+				}
+				if (col >= 72) {
+					dc_strbuilder_cat(&qp, i%3? "=\r\n" : "=\n");
+					col = 0;
+				}
+			}
+
+			char* raw3 = dc_mprintf(
+				"Content-Type: multipart/mixed; boundary=\"==break==\"\n"
+				"Subject: attachments\n"
+				"Chat-Version: 1.0\n"
+				"\n"
+				"--==break==\n"
+				"Content-Type: image/png\n"
+				"Content-Transfer-Encoding: base64\n"
+				"Content-Disposition: attachment; filename=\"stress.png\"\n"
+				"\n"
+				"%s"
+				"--==break==\n"
+				"Content-Type: application/octet-stream\n"
+				"Content-Transfer-Encoding: quoted-printable\n"
+				"Content-Disposition: attachment; filename=\"stress.bin\"\n"
+				"\n"
+				"%s\n"
+				"--==break==\n"
+				"Content-Type: application/octet-stream\n"
+				"Content-Transfer-Encoding: base64\n"
+				"Content-Disposition: attachment; filename=\"empty.bin\"\n"
+				"\n"
+				"\n"
+				"--==break==--\n", b64.buf, qp.buf);
+			dc_mimeparser_empty(mimeparser);
+			dc_mimeparser_parse(mimeparser, raw3, strlen(raw3));
+			assert( carray_count(mimeparser->parts)==2 ); /* no part for the empty attachment */
+			for (int i = 0; i < 2; i++) {
+				dc_mimepart_t* part = (dc_mimepart_t*)carray_get(mimeparser->parts, i);
+				assert( part->type==(i==0? DC_MSG_IMAGE : DC_MSG_FILE) );
+				assert( part->bytes==ATTACHMENT_BYTES );
+				assert( dc_param_get_int(part->param, DC_PARAM_WIDTH, 0)==(i==0? 0x102 : 0) );
+				assert( dc_param_get_int(part->param, DC_PARAM_HEIGHT, 0)==(i==0? 3 : 0) );
+				char* file = dc_param_get(part->param, DC_PARAM_FILE, NULL);
+				void* buf = NULL;
+				size_t buf_bytes = 0;
+				assert( dc_read_file(context, file, &buf, &buf_bytes) );
+				assert( buf_bytes==ATTACHMENT_BYTES && memcmp(buf, attachment, ATTACHMENT_BYTES)==0 );
+				dc_delete_file(context, file);
+				free(buf);
+				free(file);
+			}
+			assert( !dc_file_exist(context, "$BLOBDIR/empty.bin") );
+			free(raw3);
+			free(qp.buf);
+			free(b64.buf);
+			free(attachment);
+		}
+
 		dc_mimeparser_unref(mimeparser);
 	}
 
@@ -926,6 +1731,131 @@ void stress_functions(dc_context_t* context)
 		free(setupcode);
 	}
 
+	/* test peerstate cache
+	 **************************************************************************/
+
+	if (dc_is_open(context))
+	{
+		dc_apeerstate_t* ps = dc_apeerstate_new(context);
+		dc_apeerstate_t* ps2 = dc_apeerstate_new(context);
+		assert( !dc_apeerstate_load_by_addr(ps2, context->sql, "cache.test@example.org") ); /* caches the absence */
+
+		ps->addr                   = dc_strdup("Cache.Test@example.org");
+		ps->last_seen              = 100;
+		ps->prefer_encrypt         = DC_PE_MUTUAL;
+		ps->public_key             = dc_key_new();
+		dc_key_set_from_binary(ps->public_key, "\x01\x02\x03", 3, DC_KEY_PUBLIC);
+		ps->public_key_fingerprint = dc_strdup("AAAA1111");
+		ps->to_save                = DC_SAVE_ALL;
+		assert( dc_apeerstate_save_to_db(ps, context->sql, 1/*create*/) );
+
+		assert( dc_apeerstate_load_by_addr(ps2, context->sql, "CACHE.test@example.org") );
+		assert( ps2->last_seen==100 && ps2->prefer_encrypt==DC_PE_MUTUAL && strcmp(ps2->addr, "Cache.Test@example.org")==0 );
+		assert( ps2->public_key==ps->public_key ); /* the key is shared and not copied */
+
+		ps->last_seen = 200;
+		ps->to_save   = DC_SAVE_TIMESTAMPS;
+		assert( dc_apeerstate_save_to_db(ps, context->sql, 0) );
+		assert( dc_apeerstate_load_by_addr(ps2, context->sql, "cache.test@example.org") && ps2->last_seen==200 );
+
+		assert( dc_apeerstate_load_by_fingerprint(ps2, context->sql, "aaaa1111") && strcmp(ps2->addr, "Cache.Test@example.org")==0 );
+		free(ps->public_key_fingerprint);
+		ps->public_key_fingerprint = dc_strdup("BBBB2222");
+		ps->to_save = DC_SAVE_ALL;
+		assert( dc_apeerstate_save_to_db(ps, context->sql, 0) );
+		assert( !dc_apeerstate_load_by_fingerprint(ps2, context->sql, "AAAA1111") );
+		assert( dc_apeerstate_load_by_fingerprint(ps2, context->sql, "BBBB2222") && ps2->last_seen==200 );
+
+		dc_sqlite3_execute(context->sql, "UPDATE acpeerstates SET last_seen=300 WHERE addr='Cache.Test@example.org';");
+		dc_apeerstate_cache_clear(context->sql);
+		assert( dc_apeerstate_load_by_addr(ps2, context->sql, "cache.test@example.org") && ps2->last_seen==300 );
+
+		dc_sqlite3_begin_transaction(context->sql);
+			ps->last_seen = 400;
+			ps->to_save   = DC_SAVE_TIMESTAMPS;
+			assert( dc_apeerstate_save_to_db(ps, context->sql, 0) );
+		dc_sqlite3_rollback(context->sql);
+		assert( dc_apeerstate_load_by_addr(ps2, context->sql, "cache.test@example.org") && ps2->last_seen==300 );
+
+		/* copies sharing the cached keys are loaded and released on several threads */
+		pthread_t loaders[4];
+		int       refcnt = ps2->public_key->_m_heap_refcnt;
+		for (int i = 0; i < 4; i++) {
+			assert( pthread_create(&loaders[i], NULL, peerstate_loader_thread, context)==0 );
+		}
+		for (int i = 0; i < 4; i++) {
+			pthread_join(loaders[i], NULL);
+		}
+		assert( ps2->public_key->_m_heap_refcnt==refcnt );
+
+		dc_sqlite3_execute(context->sql, "DELETE FROM acpeerstates WHERE addr='Cache.Test@example.org';");
+		dc_apeerstate_cache_clear(context->sql);
+		dc_apeerstate_unref(ps);
+		dc_apeerstate_unref(ps2);
+	}
+
+	/* test receive pool
+	 **************************************************************************/
+
+	if (dc_is_open(context))
+	{
+		dc_receive_pool_t* pool = dc_receive_pool_new(context);
+		dc_apeerstate_t*   ps = dc_apeerstate_new(context);
+		dc_key_t*          public_key = dc_key_new();
+		dc_key_t*          private_key = dc_key_new();
+		sqlite3_stmt*      stmt = NULL;
+		#define            POOL_TEST_MSGS 20
+
+		dc_pgp_create_keypair(context, "pool.test@example.org", public_key, private_key);
+		char* keydata = dc_key_render_base64(public_key, 78, "\n ", 0);
+
+		/* only the first message has an Autocrypt header, the later ones degrade the encryption;
+		this requires the peerstates to be updated in the order the messages are received */
+		for (int i = 0; i < POOL_TEST_MSGS; i++) {
+			char* autocrypt = i==0? dc_mprintf("Autocrypt: addr=pool.test@example.org; prefer-encrypt=mutual; keydata=\n %s\n", keydata) : dc_strdup("");
+			char* raw = dc_mprintf(
+				"From: pool.test@example.org\n"
+				"To: bob@example.org\n"
+				"Subject: pool test\n"
+				"Message-ID: <pool.test.%i@example.org>\n"
+				"Date: Sun, 14 Mar 2010 %02i:00:00 +0000\n"
+				"Chat-Version: 1.0\n"
+				"%s"
+				"\n"
+				"message %i\n",
+				i, i, autocrypt, i);
+			dc_receive_pool_add(pool, pool, raw, strlen(raw), "INBOX", 9000+i, 0);
+			free(raw);
+			free(autocrypt);
+		}
+		dc_receive_pool_flush(pool, pool);
+
+		/* all messages are in the database, in the order they were added */
+		stmt = dc_sqlite3_prepare(context->sql, "SELECT server_uid FROM msgs WHERE rfc724_mid LIKE 'pool.test.%' ORDER BY id;");
+		int cnt = 0;
+		while (sqlite3_step(stmt)==SQLITE_ROW) {
+			assert( sqlite3_column_int(stmt, 0)==9000+cnt );
+			cnt++;
+		}
+		sqlite3_finalize(stmt);
+		assert( cnt==POOL_TEST_MSGS );
+
+		assert( dc_apeerstate_load_by_addr(ps, context->sql, "pool.test@example.org") );
+		assert( ps->prefer_encrypt==DC_PE_RESET );
+		assert( ps->last_seen==1268524800+(POOL_TEST_MSGS-1)*3600 );
+		assert( ps->last_seen_autocrypt==1268524800 );
+
+		dc_receive_pool_unref(pool);
+		dc_sqlite3_execute(context->sql, "DELETE FROM msgs WHERE rfc724_mid LIKE 'pool.test.%';");
+		dc_sqlite3_execute(context->sql, "DELETE FROM acpeerstates WHERE addr='pool.test@example.org';");
+		dc_sqlite3_execute(context->sql, "DELETE FROM contacts WHERE addr='pool.test@example.org';");
+		dc_apeerstate_cache_clear(context->sql);
+		dc_apeerstate_unref(ps);
+		dc_key_unref(public_key);
+		dc_key_unref(private_key);
+		free(keydata);
+	}
+
 	/* test end-to-end-encryption
 	 **************************************************************************/
 
@@ -1048,6 +1978,8 @@ void stress_functions(dc_context_t* context)
 			dc_keyring_t* public_keyring = dc_keyring_new();
 			dc_keyring_add(public_keyring, public_key);
 
+			dc_pgp_clear_key_cache(); /* the keys are parsed again */
+
 			void* plain = NULL;
 			int ok = dc_pgp_pk_decrypt(context, ctext_signed, ctext_signed_bytes, keyring, public_keyring/*for validate*/, 1, &plain, &plain_bytes, NULL);
 			assert( ok && plain && plain_bytes>0 );
@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include "dc_context.h"
 #include "dc_apeerstate.h"
 #include "dc_aheader.h"
@@ -5,7 +6,7 @@
 
 
 /*******************************************************************************
- * dc_apeerstate_t represents the state of an Autocrypt peer - Load/save
+ * dc_apeerstate_t represents the state of an Autocrypt peer
  ******************************************************************************/
 
 
@@ -79,46 +80,236 @@ static void dc_apeerstate_set_from_stmt(dc_apeerstate_t* peerstate, sqlite3_stmt
 }
 
 
+static void dc_apeerstate_copy(dc_apeerstate_t* dst, const dc_apeerstate_t* src)
+{
+	/* the keys are shared, they are never modified in place, see dc_apeerstate_apply_header() */
+	dc_apeerstate_empty(dst);
+
+	dst->addr                     = dc_strdup_keep_null(src->addr);
+	dst->last_seen                = src->last_seen;
+	dst->last_seen_autocrypt      = src->last_seen_autocrypt;
+	dst->prefer_encrypt           = src->prefer_encrypt;
+	dst->public_key               = dc_key_ref(src->public_key);
+	dst->public_key_fingerprint   = dc_strdup_keep_null(src->public_key_fingerprint);
+	dst->gossip_key               = dc_key_ref(src->gossip_key);
+	dst->gossip_timestamp         = src->gossip_timestamp;
+	dst->gossip_key_fingerprint   = dc_strdup_keep_null(src->gossip_key_fingerprint);
+	dst->verified_key             = dc_key_ref(src->verified_key);
+	dst->verified_key_fingerprint = dc_strdup_keep_null(src->verified_key_fingerprint);
+}
+
+
+/*******************************************************************************
+ * Peerstate cache
+ ******************************************************************************/
+
+
+/* Sending to a group needs the peerstate of each member, receiving from a
+group loads the peerstates of the sender and of all gossiped members.
+Therefore, the last used peerstates are kept in sql->peerstate_cache,
+also for addresses without a peerstate.
+
+The cache is updated by dc_apeerstate_save_to_db() while peerstate_cache_critical
+is held, so that the order of the writes to the database and to the cache is
+the same; other writes to `acpeerstates` must call dc_apeerstate_cache_clear().
+Code that loads, modifies and saves a peerstate holds context->peerstate_critical
+around all of this, so that concurrent updates of a peerstate are not lost.
+
+sql->peerstate_fingerprints maps fingerprints to addresses as found by
+dc_apeerstate_load_by_fingerprint(); an entry is only used if the cached
+peerstate still has the fingerprint and is dropped if another peerstate is
+saved with the fingerprint. */
+#define DC_PEERSTATE_CACHE_SIZE 500
+
+
+typedef struct dc_peerstate_cache_entry_t
+{
+	dc_apeerstate_t* peerstate;   /* NULL if there is no peerstate for the address */
+	uint64_t         last_used;
+} dc_peerstate_cache_entry_t;
+
+
+static char* get_cache_key(const char* addr_or_fingerprint, int lower)
+{
+	char* key = dc_strdup(addr_or_fingerprint);
+	if (lower) {
+		dc_strlower_in_place(key); /* as `COLLATE NOCASE`, only ASCII characters are compared case-insensitive */
+	}
+	else {
+		for (char* p = key; *p; p++) {
+			*p = toupper(*p);
+		}
+	}
+	return key;
+}
+
+
+static void forget_fingerprint(dc_sqlite3_t* sql, const char* fingerprint) /* must be called with peerstate_cache_critical locked */
+{
+	if (fingerprint && fingerprint[0]) {
+		char* key = get_cache_key(fingerprint, 0);
+			free(dc_hash_insert_str(&sql->peerstate_fingerprints, key, NULL));
+		free(key);
+	}
+}
+
+
+static void free_cache_entry(dc_peerstate_cache_entry_t* entry)
+{
+	if (entry) {
+		dc_apeerstate_unref(entry->peerstate);
+		free(entry);
+	}
+}
+
+
+static dc_peerstate_cache_entry_t* cache_find(dc_sqlite3_t* sql, const char* key) /* must be called with peerstate_cache_critical locked */
+{
+	dc_peerstate_cache_entry_t* entry = dc_hash_find_str(&sql->peerstate_cache, key);
+	if (entry) {
+		entry->last_used = ++sql->peerstate_cache_clock;
+	}
+	return entry;
+}
+
+
+static void cache_put(dc_sqlite3_t* sql, const char* key, const dc_apeerstate_t* peerstate) /* must be called with peerstate_cache_critical locked */
+{
+	dc_peerstate_cache_entry_t* entry = NULL;
+
+	if ((entry=calloc(1, sizeof(dc_peerstate_cache_entry_t)))==NULL) {
+		exit(66); /* cannot allocate little memory, unrecoverable error */
+	}
+	entry->last_used = ++sql->peerstate_cache_clock;
+	if (peerstate) {
+		entry->peerstate = dc_apeerstate_new(peerstate->context);
+		dc_apeerstate_copy(entry->peerstate, peerstate);
+	}
+
+	if (dc_hash_find_str(&sql->peerstate_cache, key)==NULL
+	 && dc_hash_cnt(&sql->peerstate_cache)>=DC_PEERSTATE_CACHE_SIZE)
+	{
+		/* evict the least recently used peerstate */
+		dc_hashelem_t* lru = NULL;
+		for (dc_hashelem_t* e = dc_hash_first(&sql->peerstate_cache); e; e = dc_hash_next(e)) {
+			if (lru==NULL || ((dc_peerstate_cache_entry_t*)dc_hash_data(e))->last_used < ((dc_peerstate_cache_entry_t*)dc_hash_data(lru))->last_used) {
+				lru = e;
+			}
+		}
+		if (lru) {
+			char* lru_key = dc_null_terminate(dc_hash_key(lru), dc_hash_keysize(lru));
+				free_cache_entry(dc_hash_insert_str(&sql->peerstate_cache, lru_key, NULL));
+			free(lru_key);
+		}
+	}
+
+	free_cache_entry(dc_hash_insert_str(&sql->peerstate_cache, key, entry));
+}
+
+
+void dc_apeerstate_cache_clear(dc_sqlite3_t* sql)
+{
+	dc_hashelem_t* elem = NULL;
+
+	if (sql==NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&sql->peerstate_cache_critical);
+		for (elem = dc_hash_first(&sql->peerstate_cache); elem; elem = dc_hash_next(elem)) {
+			free_cache_entry(dc_hash_data(elem));
+		}
+		dc_hash_clear(&sql->peerstate_cache);
+
+		for (elem = dc_hash_first(&sql->peerstate_fingerprints); elem; elem = dc_hash_next(elem)) {
+			free(dc_hash_data(elem));
+		}
+		dc_hash_clear(&sql->peerstate_fingerprints);
+	pthread_mutex_unlock(&sql->peerstate_cache_critical);
+}
+
+
+/*******************************************************************************
+ * Load/save
+ ******************************************************************************/
+
+
 int dc_apeerstate_load_by_addr(dc_apeerstate_t* peerstate, dc_sqlite3_t* sql, const char* addr)
 {
-	int           success = 0;
-	sqlite3_stmt* stmt = NULL;
+	int                         success = 0;
+	sqlite3_stmt*               stmt = NULL;
+	char*                       key = NULL;
+	dc_peerstate_cache_entry_t* entry = NULL;
 
 	if (peerstate==NULL || sql==NULL || addr==NULL) {
-		goto cleanup;
+		return 0;
 	}
 
 	dc_apeerstate_empty(peerstate);
 
+	key = get_cache_key(addr, 1);
+
+	pthread_mutex_lock(&sql->peerstate_cache_critical);
+
+	if ((entry=cache_find(sql, key))!=NULL) {
+		if (entry->peerstate) {
+			dc_apeerstate_copy(peerstate, entry->peerstate);
+			success = 1;
+		}
+		goto cleanup;
+	}
+
 	stmt = dc_sqlite3_prepare(sql,
 		"SELECT " PEERSTATE_FIELDS
 		 " FROM acpeerstates "
 		 " WHERE addr=? COLLATE NOCASE;");
 	sqlite3_bind_text(stmt, 1, addr, -1, SQLITE_STATIC);
-	if (sqlite3_step(stmt)!=SQLITE_ROW) {
-		goto cleanup;
+	if (sqlite3_step(stmt)==SQLITE_ROW) {
+		dc_apeerstate_set_from_stmt(peerstate, stmt);
+		success = 1;
 	}
-	dc_apeerstate_set_from_stmt(peerstate, stmt);
 
-	success = 1;
+	if (stmt) {
+		cache_put(sql, key, success? peerstate : NULL);
+	}
 
 cleanup:
+	pthread_mutex_unlock(&sql->peerstate_cache_critical);
 	sqlite3_finalize(stmt);
+	free(key);
 	return success;
 }
 
 
 int dc_apeerstate_load_by_fingerprint(dc_apeerstate_t* peerstate, dc_sqlite3_t* sql, const char* fingerprint)
 {
-	int           success = 0;
-	sqlite3_stmt* stmt = NULL;
+	int                         success = 0;
+	sqlite3_stmt*               stmt = NULL;
+	char*                       fingerprint_key = NULL;
+	char*                       addr_key = NULL;
+	dc_peerstate_cache_entry_t* entry = NULL;
 
 	if (peerstate==NULL || sql==NULL || fingerprint==NULL) {
-		goto cleanup;
+		return 0;
 	}
 
 	dc_apeerstate_empty(peerstate);
 
+	fingerprint_key = get_cache_key(fingerprint, 0);
+
+	pthread_mutex_lock(&sql->peerstate_cache_critical);
+
+	const char* addr = dc_hash_find_str(&sql->peerstate_fingerprints, fingerprint_key);
+	if (addr
+	 && (entry=cache_find(sql, addr))!=NULL
+	 && entry->peerstate
+	 && ((entry->peerstate->public_key_fingerprint && strcasecmp(entry->peerstate->public_key_fingerprint, fingerprint)==0)
+	  || (entry->peerstate->gossip_key_fingerprint && strcasecmp(entry->peerstate->gossip_key_fingerprint, fingerprint)==0))) {
+		dc_apeerstate_copy(peerstate, entry->peerstate);
+		success = 1;
+		goto cleanup;
+	}
+
 	stmt = dc_sqlite3_prepare(sql,
 		"SELECT " PEERSTATE_FIELDS
 		 " FROM acpeerstates "
@@ -133,23 +324,43 @@ int dc_apeerstate_load_by_fingerprint(dc_apeerstate_t* peerstate, dc_sqlite3_t*
 	}
 	dc_apeerstate_set_from_stmt(peerstate, stmt);
 
+	addr_key = get_cache_key(peerstate->addr, 1);
+	cache_put(sql, addr_key, peerstate);
+	if (dc_hash_cnt(&sql->peerstate_fingerprints)>=DC_PEERSTATE_CACHE_SIZE) {
+		for (dc_hashelem_t* e = dc_hash_first(&sql->peerstate_fingerprints); e; e = dc_hash_next(e)) {
+			free(dc_hash_data(e));
+		}
+		dc_hash_clear(&sql->peerstate_fingerprints);
+	}
+	free(dc_hash_insert_str(&sql->peerstate_fingerprints, fingerprint_key, addr_key));
+	addr_key = NULL;
+
 	success = 1;
 
 cleanup:
+	pthread_mutex_unlock(&sql->peerstate_cache_critical);
 	sqlite3_finalize(stmt);
+	free(fingerprint_key);
+	free(addr_key);
 	return success;
 }
 
 
 int dc_apeerstate_save_to_db(const dc_apeerstate_t* peerstate, dc_sqlite3_t* sql, int create)
 {
-	int           success = 0;
-	sqlite3_stmt* stmt = NULL;
+	int                         success = 0;
+	sqlite3_stmt*               stmt = NULL;
+	char*                       key = NULL;
+	dc_peerstate_cache_entry_t* entry = NULL;
 
 	if (peerstate==NULL || sql==NULL || peerstate->addr==NULL) {
 		return 0;
 	}
 
+	key = get_cache_key(peerstate->addr, 1);
+
+	pthread_mutex_lock(&sql->peerstate_cache_critical);
+
 	if (create) {
 		stmt = dc_sqlite3_prepare(sql, "INSERT INTO acpeerstates (addr) VALUES(?);");
 		sqlite3_bind_text(stmt, 1, peerstate->addr, -1, SQLITE_STATIC);
@@ -179,6 +390,19 @@ int dc_apeerstate_save_to_db(const dc_apeerstate_t* peerstate, dc_sqlite3_t* sql
 		if (sqlite3_step(stmt)!=SQLITE_DONE) {
 			goto cleanup;
 		}
+
+		/* the fingerprints may be found at another peer now */
+		forget_fingerprint(sql, peerstate->public_key_fingerprint);
+		forget_fingerprint(sql, peerstate->gossip_key_fingerprint);
+
+		if (sqlite3_changes(sql->cobj)==1) {
+			cache_put(sql, key, peerstate);
+		}
+		else {
+			/* the address is stored with another case, load the peerstate from the database next time */
+			free_cache_entry(dc_hash_insert_str(&sql->peerstate_cache, key, NULL));
+		}
+
 		sqlite3_finalize(stmt);
 		stmt = NULL;
 	}
@@ -193,18 +417,36 @@ int dc_apeerstate_save_to_db(const dc_apeerstate_t* peerstate, dc_sqlite3_t* sql
 		if (sqlite3_step(stmt)!=SQLITE_DONE) {
 			goto cleanup;
 		}
+
+		if ((entry=dc_hash_find_str(&sql->peerstate_cache, key))!=NULL) {
+			if (sqlite3_changes(sql->cobj)==1 && entry->peerstate) {
+				entry->peerstate->last_seen           = peerstate->last_seen;
+				entry->peerstate->last_seen_autocrypt = peerstate->last_seen_autocrypt;
+				entry->peerstate->gossip_timestamp    = peerstate->gossip_timestamp;
+			}
+			else {
+				free_cache_entry(dc_hash_insert_str(&sql->peerstate_cache, key, NULL));
+			}
+		}
+
 		sqlite3_finalize(stmt);
 		stmt = NULL;
 	}
 
-	if ((peerstate->to_save&DC_SAVE_ALL) || create) {
-		dc_reset_gossiped_timestamp(peerstate->context, 0);
-	}
-
 	success = 1;
 
 cleanup:
+	if (!success) {
+		free_cache_entry(dc_hash_insert_str(&sql->peerstate_cache, key, NULL)); /* the row may be created but not updated */
+	}
+	pthread_mutex_unlock(&sql->peerstate_cache_critical);
 	sqlite3_finalize(stmt);
+	free(key);
+
+	if (success && ((peerstate->to_save&DC_SAVE_ALL) || create)) {
+		dc_reset_gossiped_timestamp(peerstate->context, 0); /* outside of peerstate_cache_critical, this writes to the config */
+	}
+
 	return success;
 }
 
@@ -394,12 +636,11 @@ void dc_apeerstate_apply_header(dc_apeerstate_t* peerstate, const dc_aheader_t*
 			peerstate->to_save |= DC_SAVE_ALL;
 		}
 
-		if (peerstate->public_key==NULL) {
-			peerstate->public_key = dc_key_new();
-		}
-
-		if (!dc_key_equals(peerstate->public_key, header->public_key))
+		/* keys are replaced and not modified, they may be shared with other peerstates or with the verified_key */
+		if (peerstate->public_key==NULL || !dc_key_equals(peerstate->public_key, header->public_key))
 		{
+			dc_key_unref(peerstate->public_key);
+			peerstate->public_key = dc_key_new();
 			dc_key_set_from_key(peerstate->public_key, header->public_key);
 			dc_apeerstate_recalc_fingerprint(peerstate);
 			peerstate->to_save |= DC_SAVE_ALL;
@@ -422,12 +663,10 @@ void dc_apeerstate_apply_gossip(dc_apeerstate_t* peerstate, const dc_aheader_t*
 		peerstate->gossip_timestamp    = message_time;
 		peerstate->to_save             |= DC_SAVE_TIMESTAMPS;
 
-		if (peerstate->gossip_key==NULL) {
-			peerstate->gossip_key = dc_key_new();
-		}
-
-		if (!dc_key_equals(peerstate->gossip_key, gossip_header->public_key))
+		if (peerstate->gossip_key==NULL || !dc_key_equals(peerstate->gossip_key, gossip_header->public_key))
 		{
+			dc_key_unref(peerstate->gossip_key);
+			peerstate->gossip_key = dc_key_new();
 			dc_key_set_from_key(peerstate->gossip_key, gossip_header->public_key);
 			dc_apeerstate_recalc_fingerprint(peerstate);
 			peerstate->to_save |= DC_SAVE_ALL;
@@ -81,6 +81,7 @@ int              dc_apeerstate_set_verified         (dc_apeerstate_t*, int which
 int              dc_apeerstate_load_by_addr         (dc_apeerstate_t*, dc_sqlite3_t*, const char* addr);
 int              dc_apeerstate_load_by_fingerprint  (dc_apeerstate_t*, dc_sqlite3_t*, const char* fingerprint);
 int              dc_apeerstate_save_to_db           (const dc_apeerstate_t*, dc_sqlite3_t*, int create);
+void             dc_apeerstate_cache_clear          (dc_sqlite3_t*); /* must be called after writing to `acpeerstates` without dc_apeerstate_save_to_db() */
 
 int              dc_apeerstate_has_verified_key     (const dc_apeerstate_t*, const dc_hash_t* fingerprints);
 
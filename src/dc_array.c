@@ -43,7 +43,8 @@ dc_array_t* dc_array_new(dc_context_t* context, size_t initsize)
 
 
 /**
- * Free an array object. Does not free any data items.
+ * Free an array object. Does not free any data items,
+ * except for the dc_lot_t objects returned by dc_chatlist_get_summaries().
  *
  * @memberof dc_array_t
  * @param array The array object to free,
@@ -57,7 +58,7 @@ void dc_array_unref(dc_array_t* array)
 		return;
 	}
 
-	if (array->type==DC_ARRAY_LOCATIONS) {
+	if (array->type==DC_ARRAY_LOCATIONS || array->type==DC_ARRAY_LOTS) {
 		dc_array_free_ptr(array);
 	}
 
@@ -82,6 +83,11 @@ void dc_array_free_ptr(dc_array_t* array)
 	}
 
 	for (size_t i = 0; i<array->count; i++) {
+		if (array->type==DC_ARRAY_LOTS) {
+			dc_lot_unref((dc_lot_t*)array->array[i]);
+			array->array[i] = 0;
+			continue;
+		}
 		if (array->type==DC_ARRAY_LOCATIONS) {
 			free(((struct _dc_location*)array->array[i])->marker);
 		}
@@ -0,0 +1,472 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "dc_base64.h"
+
+
+/* Base64 as used for MIME parts, keys and ASCII armor.
+
+Decoding behaves exactly as libetpan's mailmime_base64_body_parse(), which
+was used before: all characters not part of the alphabet are skipped, this
+includes line breaks and the padding; 1 or 2 remaining values result in one
+byte, 3 remaining values result in two bytes.
+
+On x86, blocks of 12 bytes resp. 16 characters are converted using SSSE3 or
+AVX2, selected by the CPU features at runtime; the remainder and blocks that
+contain other characters, typically the line breaks, are converted by the
+table-based code that is used on all other platforms. */
+
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define DC_BASE64_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+
+static const char s_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+static int8_t          s_values[256]; /* -1 for characters not in the alphabet */
+static int             s_best_impl = DC_BASE64_SCALAR;
+static int             s_impl = DC_BASE64_SCALAR;
+static pthread_once_t  s_init_once = PTHREAD_ONCE_INIT;
+
+
+static void init_once(void)
+{
+	memset(s_values, -1, sizeof(s_values));
+	for (int i = 0; i < 64; i++) {
+		s_values[(uint8_t)s_alphabet[i]] = i;
+	}
+
+	#ifdef DC_BASE64_HAVE_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			s_best_impl = DC_BASE64_AVX2;
+		}
+		else if (__builtin_cpu_supports("ssse3")) {
+			s_best_impl = DC_BASE64_SSSE3;
+		}
+	#endif
+
+	s_impl = s_best_impl;
+}
+
+
+#define INIT_ONCE() pthread_once(&s_init_once, init_once)
+
+
+/*******************************************************************************
+ * SSSE3 and AVX2
+ ******************************************************************************/
+
+
+#ifdef DC_BASE64_HAVE_X86
+
+
+/* the bit shuffling and the translation to ASCII follow
+http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html and
+http://0x80.pl/notesen/2016-01-17-sse-base64-decoding.html */
+
+
+__attribute__((target("ssse3")))
+static size_t encode_ssse3(const uint8_t* in, size_t in_bytes, char* out)
+{
+	/* each round reads 16 bytes and uses the first 12 of them */
+	const __m128i shuf      = _mm_set_epi8(10,11,9,10, 7,8,6,7, 4,5,3,4, 1,2,0,1);
+	const __m128i lut       = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	size_t        done = 0;
+
+	while (in_bytes-done >= 16)
+	{
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in+done)), shuf);
+		__m128i t0 = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+		__m128i t1 = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+		v = _mm_or_si128(t0, t1); /* 16 values of 6 bits */
+
+		__m128i idx = _mm_subs_epu8(v, _mm_set1_epi8(51));
+		idx = _mm_sub_epi8(idx, _mm_cmpgt_epi8(v, _mm_set1_epi8(25)));
+		v = _mm_add_epi8(v, _mm_shuffle_epi8(lut, idx));
+
+		_mm_storeu_si128((__m128i*)out, v);
+		out  += 16;
+		done += 12;
+	}
+
+	return done;
+}
+
+
+__attribute__((target("avx2")))
+static size_t encode_avx2(const uint8_t* in, size_t in_bytes, char* out)
+{
+	/* each round reads 28 bytes, the lanes get the bytes 0-11 and 12-23 */
+	const __m256i shuf      = _mm256_set_epi8(10,11,9,10, 7,8,6,7, 4,5,3,4, 1,2,0,1,
+	                                          10,11,9,10, 7,8,6,7, 4,5,3,4, 1,2,0,1);
+	const __m256i lut       = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+	                                           65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	size_t        done = 0;
+
+	while (in_bytes-done >= 28)
+	{
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in+done))),
+			_mm_loadu_si128((const __m128i*)(in+done+12)), 1);
+		v = _mm256_shuffle_epi8(v, shuf);
+		__m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040));
+		__m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010));
+		v = _mm256_or_si256(t0, t1);
+
+		__m256i idx = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+		idx = _mm256_sub_epi8(idx, _mm256_cmpgt_epi8(v, _mm256_set1_epi8(25)));
+		v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut, idx));
+
+		_mm256_storeu_si256((__m256i*)out, v);
+		out  += 32;
+		done += 24;
+	}
+
+	_mm256_zeroupper(); /* not added by the compiler for target-functions; without, the following SSE code is ten times slower */
+	return done + encode_ssse3(in+done, in_bytes-done, out);
+}
+
+
+/* decoding stops at the first block containing a character not in the
+alphabet; exactly 12 bytes are written per 16 characters, so the output
+never exceeds DC_BASE64_DECODED_MAX() */
+__attribute__((target("ssse3")))
+static size_t decode_ssse3(const char* in, size_t in_bytes, uint8_t* out)
+{
+	const __m128i lut_lo    = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	                                        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi    = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	                                        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll  = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f   = _mm_set1_epi8(0x2F);
+	const __m128i pack      = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	size_t        done = 0;
+
+	while (in_bytes-done >= 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(in+done));
+		__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(v, 4), mask_2f);
+		__m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(v, mask_2f));
+		__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xFFFF) {
+			break;
+		}
+
+		__m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(v, mask_2f), hi_nibbles));
+		v = _mm_add_epi8(v, roll); /* 16 values of 6 bits */
+
+		v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+		v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+		v = _mm_shuffle_epi8(v, pack);
+
+		_mm_storel_epi64((__m128i*)out, v);
+		uint32_t last = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+		memcpy(out+8, &last, 4);
+
+		out  += 12;
+		done += 16;
+	}
+
+	return done;
+}
+
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(const char* in, size_t in_bytes, uint8_t* out)
+{
+	const __m256i lut_lo    = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	                                           0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+	                                           0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	                                           0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi    = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	                                           0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll  = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+	                                           0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f   = _mm256_set1_epi8(0x2F);
+	const __m256i pack      = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+	                                           2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	size_t        done = 0;
+
+	while (in_bytes-done >= 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(in+done));
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask_2f);
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(v, mask_2f));
+		__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		if (!_mm256_testz_si256(lo, hi)) {
+			break;
+		}
+
+		__m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(v, mask_2f), hi_nibbles));
+		v = _mm256_add_epi8(v, roll);
+
+		v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+		v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+		v = _mm256_shuffle_epi8(v, pack);
+
+		__m128i lane0 = _mm256_castsi256_si128(v);
+		__m128i lane1 = _mm256_extracti128_si256(v, 1);
+		_mm_storel_epi64((__m128i*)out, lane0);
+		uint32_t last = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(lane0, 8));
+		memcpy(out+8, &last, 4);
+		_mm_storel_epi64((__m128i*)(out+12), lane1);
+		last = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(lane1, 8));
+		memcpy(out+20, &last, 4);
+
+		out  += 24;
+		done += 32;
+	}
+
+	_mm256_zeroupper();
+	return done + decode_ssse3(in+done, in_bytes-done, out);
+}
+
+
+#endif /* DC_BASE64_HAVE_X86 */
+
+
+/*******************************************************************************
+ * Scalar code and main entry points
+ ******************************************************************************/
+
+
+/* decodes complete groups of 4 characters up to the first character not in
+the alphabet; returns the number of characters read, 3/4 of them are written */
+static size_t decode_groups(const char* in, size_t in_bytes, uint8_t* out)
+{
+	size_t done = 0;
+
+	#ifdef DC_BASE64_HAVE_X86
+		if (s_impl==DC_BASE64_AVX2) {
+			done = decode_avx2(in, in_bytes, out);
+		}
+		else if (s_impl==DC_BASE64_SSSE3) {
+			done = decode_ssse3(in, in_bytes, out);
+		}
+		out += done/4*3;
+	#endif
+
+	while (in_bytes-done >= 4)
+	{
+		int32_t a = s_values[(uint8_t)in[done]];
+		int32_t b = s_values[(uint8_t)in[done+1]];
+		int32_t c = s_values[(uint8_t)in[done+2]];
+		int32_t d = s_values[(uint8_t)in[done+3]];
+		if ((a|b|c|d) < 0) {
+			break;
+		}
+
+		uint32_t bits = (a<<18) | (b<<12) | (c<<6) | d;
+		out[0] = (uint8_t)(bits>>16);
+		out[1] = (uint8_t)(bits>>8);
+		out[2] = (uint8_t)bits;
+		out  += 3;
+		done += 4;
+	}
+
+	return done;
+}
+
+
+void dc_base64_decoder_init(dc_base64_decoder_t* decoder)
+{
+	if (decoder==NULL) {
+		return;
+	}
+
+	INIT_ONCE();
+	decoder->bits = 0;
+	decoder->cnt  = 0;
+}
+
+
+/**
+ * Decode the next chunk of base64 data.  The chunks may be split at any
+ * position, also inside a group of 4 characters.  The output buffer must
+ * have room for DC_BASE64_DECODED_MAX(in_bytes) bytes.
+ *
+ * @private @memberof dc_base64_decoder_t
+ * @return The number of bytes written to out.
+ */
+size_t dc_base64_decoder_add(dc_base64_decoder_t* decoder, const char* in, size_t in_bytes, void* out_)
+{
+	uint8_t* out = (uint8_t*)out_;
+	size_t   i = 0;
+
+	if (decoder==NULL || in==NULL || out==NULL) {
+		return 0;
+	}
+
+	while (i < in_bytes)
+	{
+		if (decoder->cnt==0) {
+			size_t done = decode_groups(in+i, in_bytes-i, out);
+			out += done/4*3;
+			i += done;
+			if (i >= in_bytes) {
+				break;
+			}
+		}
+
+		int32_t v = s_values[(uint8_t)in[i++]];
+		if (v < 0) {
+			continue;
+		}
+
+		decoder->bits = (decoder->bits<<6) | v;
+		if (++decoder->cnt==4) {
+			out[0] = (uint8_t)(decoder->bits>>16);
+			out[1] = (uint8_t)(decoder->bits>>8);
+			out[2] = (uint8_t)decoder->bits;
+			out += 3;
+			decoder->bits = 0;
+			decoder->cnt  = 0;
+		}
+	}
+
+	return out - (uint8_t*)out_;
+}
+
+
+size_t dc_base64_decoder_finish(dc_base64_decoder_t* decoder, void* out_)
+{
+	uint8_t* out = (uint8_t*)out_;
+	size_t   ret = 0;
+
+	if (decoder==NULL || out==NULL) {
+		return 0;
+	}
+
+	/* same as libetpan: a single remaining value results in a byte, too */
+	switch (decoder->cnt) {
+		case 1:
+			out[0] = (uint8_t)(decoder->bits<<2);
+			ret = 1;
+			break;
+
+		case 2:
+			out[0] = (uint8_t)(decoder->bits>>4);
+			ret = 1;
+			break;
+
+		case 3:
+			out[0] = (uint8_t)(decoder->bits>>10);
+			out[1] = (uint8_t)(decoder->bits>>2);
+			ret = 2;
+			break;
+	}
+
+	decoder->bits = 0;
+	decoder->cnt  = 0;
+	return ret;
+}
+
+
+/**
+ * Decode base64 data.  The output buffer must have room for
+ * DC_BASE64_DECODED_MAX(in_bytes) bytes.
+ *
+ * @private
+ * @return The number of bytes written to out.
+ */
+size_t dc_base64_decode(const char* in, size_t in_bytes, void* out)
+{
+	dc_base64_decoder_t decoder;
+	size_t              ret = 0;
+
+	if (in==NULL || out==NULL) {
+		return 0;
+	}
+
+	dc_base64_decoder_init(&decoder);
+	ret = dc_base64_decoder_add(&decoder, in, in_bytes, out);
+	ret += dc_base64_decoder_finish(&decoder, (uint8_t*)out+ret);
+	return ret;
+}
+
+
+/**
+ * Encode data as base64.  The output buffer must have room for
+ * DC_BASE64_ENCODED_BYTES(in_bytes) characters; no null-terminator is added.
+ *
+ * @private
+ * @return The number of characters written to out.
+ */
+size_t dc_base64_encode(const void* in_, size_t in_bytes, char* out)
+{
+	const uint8_t* in = (const uint8_t*)in_;
+	size_t         done = 0;
+	char*          p = out;
+
+	if (in==NULL || out==NULL) {
+		return 0;
+	}
+
+	INIT_ONCE();
+
+	#ifdef DC_BASE64_HAVE_X86
+		if (s_impl==DC_BASE64_AVX2) {
+			done = encode_avx2(in, in_bytes, p);
+		}
+		else if (s_impl==DC_BASE64_SSSE3) {
+			done = encode_ssse3(in, in_bytes, p);
+		}
+		p += done/3*4;
+	#endif
+
+	while (in_bytes-done >= 3)
+	{
+		uint32_t bits = (in[done]<<16) | (in[done+1]<<8) | in[done+2];
+		p[0] = s_alphabet[(bits>>18)&0x3F];
+		p[1] = s_alphabet[(bits>>12)&0x3F];
+		p[2] = s_alphabet[(bits>>6)&0x3F];
+		p[3] = s_alphabet[bits&0x3F];
+		p    += 4;
+		done += 3;
+	}
+
+	if (in_bytes-done == 1) {
+		p[0] = s_alphabet[in[done]>>2];
+		p[1] = s_alphabet[(in[done]&0x03)<<4];
+		p[2] = '=';
+		p[3] = '=';
+		p += 4;
+	}
+	else if (in_bytes-done == 2) {
+		p[0] = s_alphabet[in[done]>>2];
+		p[1] = s_alphabet[((in[done]&0x03)<<4) | (in[done+1]>>4)];
+		p[2] = s_alphabet[(in[done+1]&0x0F)<<2];
+		p[3] = '=';
+		p += 4;
+	}
+
+	return p - out;
+}
+
+
+int dc_base64_set_impl(int impl)
+{
+	INIT_ONCE();
+
+	if (impl<0 || impl>s_best_impl) {
+		impl = s_best_impl;
+	}
+
+	s_impl = impl;
+	return s_impl;
+}
+
+
+const char* dc_base64_impl_name(int impl)
+{
+	switch (impl) {
+		case DC_BASE64_SSSE3: return "ssse3";
+		case DC_BASE64_AVX2:  return "avx2";
+		default:              return "scalar";
+	}
+}
@@ -0,0 +1,49 @@
+#ifndef __DC_BASE64_H__
+#define __DC_BASE64_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*** library-private **********************************************************/
+
+typedef struct _dc_base64_decoder dc_base64_decoder_t;
+
+
+/* the number of bytes needed for the output of dc_base64_encode() resp. dc_base64_decode() */
+#define DC_BASE64_ENCODED_BYTES(in_bytes) (((in_bytes)+2)/3*4)
+#define DC_BASE64_DECODED_MAX(in_bytes)   (((in_bytes)+3)/4*3)
+
+
+/* decodes base64 in chunks, eg. while reading a file; characters that are
+not part of the base64 alphabet, as line breaks or the padding, are skipped */
+struct _dc_base64_decoder
+{
+	uint32_t bits;
+	int      cnt;   /* number of 6-bit-values in bits, 0-3 */
+};
+
+
+size_t      dc_base64_encode          (const void* in, size_t in_bytes, char* out); /* no line breaks, the output is padded with `=` */
+size_t      dc_base64_decode          (const char* in, size_t in_bytes, void* out);
+
+void        dc_base64_decoder_init    (dc_base64_decoder_t*);
+size_t      dc_base64_decoder_add     (dc_base64_decoder_t*, const char* in, size_t in_bytes, void* out); /* out must have room for DC_BASE64_DECODED_MAX(in_bytes) */
+size_t      dc_base64_decoder_finish  (dc_base64_decoder_t*, void* out); /* writes 0-2 remaining bytes */
+
+
+/* the implementation is selected by the CPU features at runtime;
+dc_base64_set_impl() is for tests and benchmarks only and must not be called
+while other threads use the functions above */
+#define     DC_BASE64_BEST            -1
+#define     DC_BASE64_SCALAR           0
+#define     DC_BASE64_SSSE3            1
+#define     DC_BASE64_AVX2             2
+int         dc_base64_set_impl        (int impl); /* returns the implementation used, this may be less than the requested one */
+const char* dc_base64_impl_name       (int impl);
+
+
+#ifdef __cplusplus
+} /* /extern "C" */
+#endif
+#endif /* __DC_BASE64_H__ */
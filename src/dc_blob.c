@@ -0,0 +1,455 @@
+/* Files in the blob directory.
+
+New files are written to a temporary file in the blob directory and get their
+final name by link(), which fails atomically if the name is already taken.
+So, no name has to be reserved in advance and no half-written file is visible
+under its final name.
+
+If the config-key `dedup_blobs` is set, the SHA-256 of the content is recorded
+in the table `blobs` for each new file.  A file with the same content as an
+existing one is not stored again: the existing file is used if its name fits
+the desired name, otherwise, a hardlink with the desired name is created.
+As before, files are referenced by the parameters of messages, chats etc.;
+dc_housekeeping() deletes files that are no longer referenced and removes them
+from `blobs`.  Blobs are never written after creation, so sharing the data
+between several messages is fine.
+
+New files may be written by the workers of dc_receive_pool_t, so `blobs` is
+always read and written inside a transaction; otherwise, the writes would
+become part of a transaction opened by another thread. */
+
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include "dc_context.h"
+#include "dc_blob.h"
+
+
+#define DC_BLOB_COPY_BUF_BYTES (64*1024)
+
+
+struct _dc_blobwriter
+{
+	dc_context_t* context;
+	char*         desired_filename;
+	char*         tmp_abs;
+	FILE*         f;
+	EVP_MD_CTX*   md;          /* NULL if deduplication is disabled */
+	size_t        bytes;
+	int           error;
+};
+
+
+/* used if the filesystem does not support link() */
+static pthread_mutex_t s_blobdir_critical = PTHREAD_MUTEX_INITIALIZER;
+
+
+int dc_blob_dedup_enabled(dc_context_t* context)
+{
+	return dc_sqlite3_get_config_int(context->sql, "dedup_blobs", DC_DEDUP_BLOBS_DEFAULT);
+}
+
+
+static char* get_hash_hex(EVP_MD_CTX* md)
+{
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	unsigned int  hash_bytes = 0;
+	if (!EVP_DigestFinal_ex(md, hash, &hash_bytes)) {
+		return NULL;
+	}
+	return dc_binary_to_uc_hex(hash, hash_bytes);
+}
+
+
+/* links src_abs to a fine name for desired_filename in the blob directory,
+as link() fails if the name exists, the names need not to be checked before.
+returns the name as `$BLOBDIR/...`, NULL on errors; errno is set then */
+static char* link_to_fine_pathNfilename(dc_context_t* context, const char* src_abs, const char* desired_filename)
+{
+	char*  ret = NULL;
+	char*  pathNfilename = NULL;
+	char*  pathNfilename_abs = NULL;
+	time_t now = time(NULL);
+
+	for (int i = 0; i < DC_FINE_PATHNFILENAME_TRIES; i++) {
+		free(pathNfilename);
+		free(pathNfilename_abs);
+		pathNfilename = dc_get_fine_pathNfilename_candidate("$BLOBDIR", desired_filename, i, now);
+		if ((pathNfilename_abs=dc_get_abs_path(context, pathNfilename))==NULL) {
+			break;
+		}
+
+		if (link(src_abs, pathNfilename_abs)==0) {
+			ret = pathNfilename;
+			pathNfilename = NULL;
+			break;
+		}
+
+		if (errno!=EEXIST) {
+			break;
+		}
+	}
+
+	free(pathNfilename);
+	free(pathNfilename_abs);
+	return ret;
+}
+
+
+/* checks if the name of an existing file is one dc_get_fine_pathNfilename()
+may have chosen for desired_filename, so that the file can be used as is */
+static int is_fine_pathNfilename_for(const char* pathNfilename, const char* desired_filename)
+{
+	int    fine = 0;
+	char*  filename = dc_get_filename(pathNfilename);
+	char*  desired = dc_strdup(desired_filename);
+	char*  basename = NULL;
+	char*  dotNSuffix = NULL;
+
+	dc_validate_filename(desired);
+	dc_split_filename(desired, &basename, &dotNSuffix);
+
+	size_t filename_len = strlen(filename), basename_len = strlen(basename), suffix_len = strlen(dotNSuffix);
+	if (filename_len >= basename_len+suffix_len
+	 && strncmp(filename, basename, basename_len)==0
+	 && strcmp(filename+filename_len-suffix_len, dotNSuffix)==0)
+	{
+		const char* p   = filename+basename_len;
+		const char* end = filename+filename_len-suffix_len;
+		if (p==end) {
+			fine = 1;
+		}
+		else if (*p=='-' && p+1<end) {
+			for (p++; p<end && isdigit((unsigned char)*p); p++) {
+				;
+			}
+			fine = (p==end);
+		}
+	}
+
+	free(filename);
+	free(desired);
+	free(basename);
+	free(dotNSuffix);
+	return fine;
+}
+
+
+/* returns a file with the given content for desired_filename, if the content is already stored;
+returns NULL if there is no such file or if it cannot be used */
+static char* lookup_blob(dc_context_t* context, const char* hash_hex, uint64_t bytes, const char* desired_filename)
+{
+	char*         ret = NULL;
+	char*         existing = NULL;
+	char*         existing_abs = NULL;
+	sqlite3_stmt* stmt = NULL;
+	struct stat   st;
+
+	dc_sqlite3_begin_transaction(context->sql);
+
+	stmt = dc_sqlite3_prepare(context->sql,
+		"SELECT path FROM blobs WHERE hash=? AND bytes=?;");
+	sqlite3_bind_text (stmt, 1, hash_hex, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, bytes);
+	if (sqlite3_step(stmt)!=SQLITE_ROW) {
+		goto cleanup;
+	}
+	existing = dc_strdup((const char*)sqlite3_column_text(stmt, 0));
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+
+	/* the file may be deleted by dc_housekeeping() in between; the size is checked again
+	in case the blob directory is modified from outside */
+	if ((existing_abs=dc_get_abs_path(context, existing))==NULL
+	 || stat(existing_abs, &st)!=0 || (uint64_t)st.st_size!=bytes) {
+		stmt = dc_sqlite3_prepare(context->sql,
+			"DELETE FROM blobs WHERE hash=?;");
+		sqlite3_bind_text(stmt, 1, hash_hex, -1, SQLITE_STATIC);
+		sqlite3_step(stmt);
+		goto cleanup;
+	}
+
+	if (is_fine_pathNfilename_for(existing, desired_filename)) {
+		/* dc_housekeeping() keeps files changed in the last hour, so that new files
+		are not deleted before they are referenced; the reused file counts as new */
+		if (utime(existing_abs, NULL)!=0) {
+			dc_log_info(context, 0, "Cannot touch \"%s\", storing the file again.", existing);
+			goto cleanup;
+		}
+		ret = existing;
+		existing = NULL;
+	}
+	else if ((ret=link_to_fine_pathNfilename(context, existing_abs, desired_filename))==NULL) {
+		dc_log_info(context, 0, "Cannot link \"%s\", storing the file again.", existing);
+		goto cleanup;
+	}
+
+	dc_log_info(context, 0, "Using stored blob \"%s\".", ret);
+
+cleanup:
+	sqlite3_finalize(stmt);
+	dc_sqlite3_commit(context->sql);
+	free(existing);
+	free(existing_abs);
+	return ret;
+}
+
+
+static void add_blob(dc_context_t* context, const char* hash_hex, uint64_t bytes, const char* pathNfilename)
+{
+	dc_sqlite3_begin_transaction(context->sql);
+		sqlite3_stmt* stmt = dc_sqlite3_prepare(context->sql,
+			"INSERT OR REPLACE INTO blobs (hash, bytes, path) VALUES (?,?,?);");
+		sqlite3_bind_text (stmt, 1, hash_hex, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 2, bytes);
+		sqlite3_bind_text (stmt, 3, pathNfilename, -1, SQLITE_STATIC);
+		sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+	dc_sqlite3_commit(context->sql);
+}
+
+
+/*******************************************************************************
+ * Write new files
+ ******************************************************************************/
+
+
+dc_blobwriter_t* dc_blobwriter_new(dc_context_t* context, const char* desired_filename)
+{
+	dc_blobwriter_t* writer = NULL;
+	int              fd = -1;
+
+	if ((writer=calloc(1, sizeof(dc_blobwriter_t)))==NULL) {
+		exit(76);
+	}
+
+	writer->context          = context;
+	writer->desired_filename = dc_strdup(desired_filename);
+
+	for (int i = 0; i < 10 && fd < 0; i++) {
+		char* id = dc_create_id();
+		free(writer->tmp_abs);
+		writer->tmp_abs = dc_mprintf("%s/.tmp-%s", context->blobdir, id);
+		fd = open(writer->tmp_abs, O_WRONLY|O_CREAT|O_EXCL, 0666);
+		free(id);
+	}
+
+	if (fd < 0 || (writer->f=fdopen(fd, "wb"))==NULL) {
+		dc_log_warning(context, 0, "Cannot create a file in \"%s\".", context->blobdir);
+		if (fd >= 0) {
+			close(fd);
+			unlink(writer->tmp_abs);
+		}
+		free(writer->tmp_abs);
+		writer->tmp_abs = NULL;
+		writer->error = 1;
+		return writer;
+	}
+
+	if (dc_blob_dedup_enabled(context)) {
+		if ((writer->md=EVP_MD_CTX_create())==NULL) {
+			exit(77);
+		}
+		EVP_DigestInit_ex(writer->md, EVP_sha256(), NULL);
+	}
+
+	return writer;
+}
+
+
+void dc_blobwriter_unref(dc_blobwriter_t* writer)
+{
+	if (writer==NULL) {
+		return;
+	}
+
+	if (writer->f) {
+		fclose(writer->f);
+	}
+
+	if (writer->tmp_abs) {
+		unlink(writer->tmp_abs); /* after link() or rename(), or if the writer is not finished */
+	}
+
+	if (writer->md) {
+		EVP_MD_CTX_destroy(writer->md);
+	}
+
+	free(writer->tmp_abs);
+	free(writer->desired_filename);
+	free(writer);
+}
+
+
+int dc_blobwriter_write(dc_blobwriter_t* writer, const void* buf, size_t bytes)
+{
+	if (writer==NULL || writer->error || writer->f==NULL) {
+		return 0;
+	}
+
+	if (fwrite(buf, 1, bytes, writer->f)!=bytes) {
+		dc_log_warning(writer->context, 0, "Cannot write %lu bytes to \"%s\".", (unsigned long)bytes, writer->tmp_abs);
+		writer->error = 1;
+		return 0;
+	}
+
+	if (writer->md) {
+		EVP_DigestUpdate(writer->md, buf, bytes);
+	}
+
+	writer->bytes += bytes;
+	return 1;
+}
+
+
+char* dc_blobwriter_finish(dc_blobwriter_t* writer)
+{
+	char* ret = NULL;
+	char* hash_hex = NULL;
+
+	if (writer==NULL || writer->error || writer->f==NULL) {
+		goto cleanup;
+	}
+
+	int r = fclose(writer->f);
+	writer->f = NULL;
+	if (r!=0) {
+		dc_log_warning(writer->context, 0, "Cannot write \"%s\".", writer->tmp_abs);
+		goto cleanup;
+	}
+
+	if (writer->md
+	 && (hash_hex=get_hash_hex(writer->md))!=NULL
+	 && (ret=lookup_blob(writer->context, hash_hex, writer->bytes, writer->desired_filename))!=NULL) {
+		goto cleanup; /* the temporary file is deleted by dc_blobwriter_unref() */
+	}
+
+	if ((ret=link_to_fine_pathNfilename(writer->context, writer->tmp_abs, writer->desired_filename))==NULL)
+	{
+		if (errno==EEXIST) {
+			dc_log_warning(writer->context, 0, "Cannot store \"%s\": %s", writer->desired_filename, strerror(errno));
+			goto cleanup;
+		}
+
+		/* no hardlinks possible here (EPERM, ENOTSUP, EXDEV, EACCES, EMLINK, ...),
+		pick a name and rename the file; the name is only used by this thread while the lock is held */
+		pthread_mutex_lock(&s_blobdir_critical);
+			char* ret_abs = NULL;
+			if ((ret=dc_get_fine_pathNfilename(writer->context, "$BLOBDIR", writer->desired_filename))==NULL
+			 || (ret_abs=dc_get_abs_path(writer->context, ret))==NULL
+			 || rename(writer->tmp_abs, ret_abs)!=0) {
+				dc_log_warning(writer->context, 0, "Cannot store \"%s\".", writer->desired_filename);
+				free(ret);
+				ret = NULL;
+			}
+			free(ret_abs);
+		pthread_mutex_unlock(&s_blobdir_critical);
+
+		if (ret==NULL) {
+			goto cleanup;
+		}
+	}
+
+	if (hash_hex) {
+		add_blob(writer->context, hash_hex, writer->bytes, ret);
+	}
+
+cleanup:
+	free(hash_hex);
+	return ret;
+}
+
+
+/*******************************************************************************
+ * Copy files from outside
+ ******************************************************************************/
+
+
+static char* hash_file(dc_context_t* context, const char* pathNfilename, uint64_t* ret_bytes)
+{
+	char*       ret = NULL;
+	char*       pathNfilename_abs = NULL;
+	FILE*       f = NULL;
+	EVP_MD_CTX* md = NULL;
+	char*       buf = NULL;
+	size_t      buf_bytes = 0;
+
+	*ret_bytes = 0;
+
+	if ((pathNfilename_abs=dc_get_abs_path(context, pathNfilename))==NULL
+	 || (f=fopen(pathNfilename_abs, "rb"))==NULL) {
+		goto cleanup;
+	}
+
+	if ((buf=malloc(DC_BLOB_COPY_BUF_BYTES))==NULL
+	 || (md=EVP_MD_CTX_create())==NULL) {
+		exit(78);
+	}
+
+	EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+	while ((buf_bytes=fread(buf, 1, DC_BLOB_COPY_BUF_BYTES, f)) > 0) {
+		EVP_DigestUpdate(md, buf, buf_bytes);
+		*ret_bytes += buf_bytes;
+	}
+
+	if (ferror(f)) {
+		goto cleanup;
+	}
+
+	ret = get_hash_hex(md);
+
+cleanup:
+	if (f) { fclose(f); }
+	if (md) { EVP_MD_CTX_destroy(md); }
+	free(buf);
+	free(pathNfilename_abs);
+	return ret;
+}
+
+
+/**
+ * Copy a file from outside into the blob directory.
+ * If `dedup_blobs` is enabled and a file with the same content is already
+ * stored, this file is used and no data are copied.
+ *
+ * @private @memberof dc_context_t
+ * @param context The context object.
+ * @param src The file to copy.
+ * @param desired_filename The name to use in the blob directory,
+ *     a running number is added if needed.
+ * @return The new file as `$BLOBDIR/...`, NULL on errors; must be free()'d.
+ */
+char* dc_blob_copy(dc_context_t* context, const char* src, const char* desired_filename)
+{
+	char*    ret = NULL;
+	char*    hash_hex = NULL;
+	uint64_t bytes = 0;
+
+	if (dc_blob_dedup_enabled(context)
+	 && (hash_hex=hash_file(context, src, &bytes))!=NULL
+	 && (ret=lookup_blob(context, hash_hex, bytes, desired_filename))!=NULL) {
+		goto cleanup;
+	}
+
+	/* dc_copy_file() creates the file with O_EXCL, so it does not overwrite
+	a file created by another thread in between */
+	if ((ret=dc_get_fine_pathNfilename(context, "$BLOBDIR", desired_filename))==NULL
+	 || !dc_copy_file(context, src, ret)) {
+		free(ret);
+		ret = NULL;
+		goto cleanup;
+	}
+
+	if (hash_hex) {
+		add_blob(context, hash_hex, bytes, ret);
+	}
+
+cleanup:
+	free(hash_hex);
+	return ret;
+}
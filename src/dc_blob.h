@@ -0,0 +1,27 @@
+#ifndef __DC_BLOB_H__
+#define __DC_BLOB_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*** library-private **********************************************************/
+
+typedef struct _dc_blobwriter dc_blobwriter_t;
+
+
+/* writes a new file to the blob directory; the data go to a temporary file
+that gets a fine name derived from desired_filename on dc_blobwriter_finish() */
+dc_blobwriter_t* dc_blobwriter_new        (dc_context_t*, const char* desired_filename);
+int              dc_blobwriter_write      (dc_blobwriter_t*, const void* buf, size_t bytes); /* returns 0 on errors, further writes are ignored then */
+char*            dc_blobwriter_finish     (dc_blobwriter_t*); /* returns the file as `$BLOBDIR/...`, NULL on errors; must be free()'d */
+void             dc_blobwriter_unref      (dc_blobwriter_t*); /* removes the temporary file */
+
+char*            dc_blob_copy             (dc_context_t*, const char* src, const char* desired_filename); /* copies a file from outside into the blob directory */
+int              dc_blob_dedup_enabled    (dc_context_t*);
+
+
+#ifdef __cplusplus
+} /* /extern "C" */
+#endif
+#endif /* __DC_BLOB_H__ */
@@ -420,18 +420,24 @@ int dc_chat_update_param(dc_chat_t* chat)
 }
 
 
-static int set_from_stmt(dc_chat_t* chat, sqlite3_stmt* row)
+/**
+ * Set the chat from a row selected with DC_CHAT_FIELDS.
+ *
+ * @private @memberof dc_chat_t
+ * @param chat The chat object to fill, existing data are free()'d.
+ * @param row The statement, the DC_CHAT_FIELDS columns must start at row_offset.
+ * @param row_offset The index of the first DC_CHAT_FIELDS column.
+ * @return The next row offset on success, 0 on errors.
+ */
+int dc_chat_set_from_stmt(dc_chat_t* chat, sqlite3_stmt* row, int row_offset)
 {
-	int         row_offset = 0;
-
 	if (chat==NULL || chat->magic!=DC_CHAT_MAGIC || row==NULL) {
 		return 0;
 	}
 
 	dc_chat_empty(chat);
 
-	#define CHAT_FIELDS " c.id,c.type,c.name, c.grpid,c.param,c.archived, c.blocked, c.gossiped_timestamp, c.locations_send_until "
-	chat->id              =                    sqlite3_column_int  (row, row_offset++); /* the columns are defined in CHAT_FIELDS */
+	chat->id              =                    sqlite3_column_int  (row, row_offset++); /* the columns are defined in DC_CHAT_FIELDS */
 	chat->type            =                    sqlite3_column_int  (row, row_offset++);
 	chat->name            =   dc_strdup((char*)sqlite3_column_text (row, row_offset++));
 	chat->grpid           =   dc_strdup((char*)sqlite3_column_text (row, row_offset++));
@@ -485,22 +491,24 @@ int dc_chat_load_from_db(dc_chat_t* chat, uint32_t chat_id)
 
 	dc_chat_empty(chat);
 
-	stmt = dc_sqlite3_prepare(chat->context->sql,
-		"SELECT " CHAT_FIELDS " FROM chats c WHERE c.id=?;");
+	stmt = dc_sqlite3_borrow_stmt(chat->context->sql,
+		"SELECT " DC_CHAT_FIELDS " FROM chats c WHERE c.id=?;");
 	sqlite3_bind_int(stmt, 1, chat_id);
 
 	if (sqlite3_step(stmt)!=SQLITE_ROW) {
 		goto cleanup;
 	}
 
-	if (!set_from_stmt(chat, stmt)) {
+	if (!dc_chat_set_from_stmt(chat, stmt, 0)) {
 		goto cleanup;
 	}
 
 	success = 1;
 
 cleanup:
-	sqlite3_finalize(stmt);
+	if (stmt) {
+		dc_sqlite3_return_stmt(chat->context->sql, stmt);
+	}
 	return success;
 }
 
@@ -1034,6 +1042,81 @@ cleanup:
 }
 
 
+/* Prepare the statement selecting `m.id, m.timestamp` of the messages shown in a chat.
+`cond_n_order` is added to the WHERE clause, it may refer to the parameters ?2 and above,
+?1 is reserved. The returned statement must be finalized. */
+static sqlite3_stmt* prepare_chat_msgs(dc_context_t* context, uint32_t chat_id, const char* cond_n_order)
+{
+	sqlite3_stmt* stmt = NULL;
+	char*         q3 = NULL;
+
+	if (chat_id==DC_CHAT_ID_DEADDROP)
+	{
+		int show_emails = dc_sqlite3_get_config_int(context->sql,
+			"show_emails", DC_SHOW_EMAILS_DEFAULT);
+
+		q3 = sqlite3_mprintf("SELECT m.id, m.timestamp"
+				" FROM msgs m"
+				" LEFT JOIN chats ON m.chat_id=chats.id"
+				" LEFT JOIN contacts ON m.from_id=contacts.id"
+				" WHERE m.from_id!=" DC_STRINGIFY(DC_CONTACT_ID_SELF)
+				"   AND m.from_id!=" DC_STRINGIFY(DC_CONTACT_ID_DEVICE)
+				"   AND m.hidden=0 "
+				"   AND chats.blocked=" DC_STRINGIFY(DC_CHAT_DEADDROP_BLOCKED)
+				"   AND contacts.blocked=0"
+				"   AND m.msgrmsg>=?1 %s", cond_n_order);
+		stmt = dc_sqlite3_prepare_read(context->sql, q3);
+		sqlite3_bind_int(stmt, 1, show_emails==DC_SHOW_EMAILS_ALL? 0 : 1);
+	}
+	else if (chat_id==DC_CHAT_ID_STARRED)
+	{
+		q3 = sqlite3_mprintf("SELECT m.id, m.timestamp"
+				" FROM msgs m"
+				" LEFT JOIN contacts ct ON m.from_id=ct.id"
+				" WHERE m.starred=1 "
+				"   AND m.hidden=0 "
+				"   AND ct.blocked=0 %s", cond_n_order);
+		stmt = dc_sqlite3_prepare_read(context->sql, q3);
+	}
+	else
+	{
+		q3 = sqlite3_mprintf("SELECT m.id, m.timestamp"
+				" FROM msgs m"
+				//" LEFT JOIN contacts ct ON m.from_id=ct.id"
+				" WHERE m.chat_id=?1 "
+				"   AND m.hidden=0 "
+				//"   AND ct.blocked=0" -- we hide blocked-contacts from starred and deaddrop, but we have to show them in groups (otherwise it may be hard to follow conversation, wa and tg do the same. however, maybe this needs discussion some time :)
+				" %s", cond_n_order); /* uses msgs_index8 (chat_id, hidden, timestamp, id), no sorting needed */
+		stmt = dc_sqlite3_prepare_read(context->sql, q3);
+		sqlite3_bind_int(stmt, 1, chat_id);
+	}
+
+	sqlite3_free(q3);
+	return stmt;
+}
+
+
+static void add_chat_msg(dc_array_t* ret, uint32_t curr_id, time_t curr_timestamp,
+                         uint32_t flags, uint32_t marker1before, long cnv_to_local, int* last_day)
+{
+	/* add user marker */
+	if (curr_id==marker1before) {
+		dc_array_add_id(ret, DC_MSG_ID_MARKER1);
+	}
+
+	/* add daymarker, if needed */
+	if (flags&DC_GCM_ADDDAYMARKER) {
+		int curr_day = (curr_timestamp+cnv_to_local)/DC_SECONDS_PER_DAY;
+		if (curr_day!=*last_day) {
+			dc_array_add_id(ret, DC_MSG_ID_DAYMARKER);
+			*last_day = curr_day;
+		}
+	}
+
+	dc_array_add_id(ret, curr_id);
+}
+
+
 /**
  * Get all message IDs belonging to a chat.
  *
@@ -1044,6 +1127,9 @@ cleanup:
  * Optionally, some special markers added to the ID-array may help to
  * implement virtual lists.
  *
+ * For chats with many messages, consider using dc_get_chat_msgs_window()
+ * which returns only the messages around a given message.
+ *
  * @memberof dc_context_t
  * @param context The context object as returned from dc_context_new().
  * @param chat_id The chat ID of which the messages IDs should be queried.
@@ -1060,87 +1146,145 @@ dc_array_t* dc_get_chat_msgs(dc_context_t* context, uint32_t chat_id, uint32_t f
 	int           success = 0;
 	dc_array_t*   ret = dc_array_new(context, 512);
 	sqlite3_stmt* stmt = NULL;
-
-	uint32_t      curr_id;
-	time_t        curr_local_timestamp;
-	int           curr_day, last_day = 0;
+	int           last_day = 0;
 	long          cnv_to_local = dc_gm2local_offset();
 
 	if (context==NULL || context->magic!=DC_CONTEXT_MAGIC || ret==NULL) {
 		goto cleanup;
 	}
 
-	if (chat_id==DC_CHAT_ID_DEADDROP)
-	{
-		int show_emails = dc_sqlite3_get_config_int(context->sql,
-			"show_emails", DC_SHOW_EMAILS_DEFAULT);
+	stmt = prepare_chat_msgs(context, chat_id,
+		" ORDER BY m.timestamp,m.id;"); /* the list starts with the oldest message*/
 
-		stmt = dc_sqlite3_prepare(context->sql,
-			"SELECT m.id, m.timestamp"
-				" FROM msgs m"
-				" LEFT JOIN chats ON m.chat_id=chats.id"
-				" LEFT JOIN contacts ON m.from_id=contacts.id"
-				" WHERE m.from_id!=" DC_STRINGIFY(DC_CONTACT_ID_SELF)
-				"   AND m.from_id!=" DC_STRINGIFY(DC_CONTACT_ID_DEVICE)
-				"   AND m.hidden=0 "
-				"   AND chats.blocked=" DC_STRINGIFY(DC_CHAT_DEADDROP_BLOCKED)
-				"   AND contacts.blocked=0"
-				"   AND m.msgrmsg>=? "
-				" ORDER BY m.timestamp,m.id;"); /* the list starts with the oldest message*/
-		sqlite3_bind_int(stmt, 1, show_emails==DC_SHOW_EMAILS_ALL? 0 : 1);
-	}
-	else if (chat_id==DC_CHAT_ID_STARRED)
+	while (sqlite3_step(stmt)==SQLITE_ROW)
 	{
-		stmt = dc_sqlite3_prepare(context->sql,
-			"SELECT m.id, m.timestamp"
-				" FROM msgs m"
-				" LEFT JOIN contacts ct ON m.from_id=ct.id"
-				" WHERE m.starred=1 "
-				"   AND m.hidden=0 "
-				"   AND ct.blocked=0"
-				" ORDER BY m.timestamp,m.id;"); /* the list starts with the oldest message*/
+		add_chat_msg(ret, sqlite3_column_int(stmt, 0), (time_t)sqlite3_column_int64(stmt, 1),
+			flags, marker1before, cnv_to_local, &last_day);
 	}
-	else
-	{
-		stmt = dc_sqlite3_prepare(context->sql,
-			"SELECT m.id, m.timestamp"
-				" FROM msgs m"
-				//" LEFT JOIN contacts ct ON m.from_id=ct.id"
-				" WHERE m.chat_id=? "
-				"   AND m.hidden=0 "
-				//"   AND ct.blocked=0" -- we hide blocked-contacts from starred and deaddrop, but we have to show them in groups (otherwise it may be hard to follow conversation, wa and tg do the same. however, maybe this needs discussion some time :)
-				" ORDER BY m.timestamp,m.id;"); /* the list starts with the oldest message*/
-		sqlite3_bind_int(stmt, 1, chat_id);
+
+	success = 1;
+
+cleanup:
+	sqlite3_finalize(stmt);
+
+	//dc_log_info(context, 0, "Message list for chat #%i created in %.3f ms.", chat_id, (double)(clock()-start)*1000.0/CLOCKS_PER_SEC);
+
+	if (success) {
+		return ret;
+	}
+	else {
+		if (ret) {
+			dc_array_unref(ret);
+		}
+		return NULL;
 	}
+}
 
-	while (sqlite3_step(stmt)==SQLITE_ROW)
-	{
-		curr_id = sqlite3_column_int(stmt, 0);
 
-		/* add user marker */
-		if (curr_id==marker1before) {
-			dc_array_add_id(ret, DC_MSG_ID_MARKER1);
+/**
+ * Get the message IDs around a given message of a chat.
+ *
+ * The function returns the same list as dc_get_chat_msgs(),
+ * but only for up to `cnt_before` messages older than `msg_id`,
+ * the message `msg_id` itself and up to `cnt_after` messages newer than `msg_id`.
+ * Opening a chat with many messages does not require to load all IDs this way;
+ * when the user scrolls, the UI loads the next window using the oldest or newest
+ * ID it already has as `msg_id`.
+ *
+ * Daymarkers are added as in the complete list, so a daymarker before the first message
+ * is only added if the previous message of the chat is from another day.
+ *
+ * @memberof dc_context_t
+ * @param context The context object as returned from dc_context_new().
+ * @param chat_id The chat ID of which the messages IDs should be queried.
+ * @param flags If set to DC_GCM_ADDDAYMARKER, the marker DC_MSG_ID_DAYMARKER will
+ *     be added before each day (regarding the local timezone).  Set this to 0 if you do not want this behaviour.
+ * @param marker1before An optional message ID.  If set, the id DC_MSG_ID_MARKER1 will be added just
+ *   before the given ID in the returned array.  Set this to 0 if you do not want this behaviour.
+ * @param msg_id The message ID the window is around.
+ *     If set to 0 or if the message is not found, the window ends with the newest message
+ *     and contains up to `cnt_before`+1 messages.
+ * @param cnt_before The maximal number of messages older than `msg_id`.
+ * @param cnt_after The maximal number of messages newer than `msg_id`.
+ * @return Array of message IDs, must be dc_array_unref()'d when no longer used.
+ */
+dc_array_t* dc_get_chat_msgs_window(dc_context_t* context, uint32_t chat_id, uint32_t flags, uint32_t marker1before,
+                                    uint32_t msg_id, int cnt_before, int cnt_after)
+{
+	int           success = 0;
+	dc_array_t*   ret = dc_array_new(context, 128);
+	dc_array_t*   older = NULL;
+	sqlite3_stmt* stmt = NULL;
+	int64_t       anchor_timestamp = INT64_MAX;
+	uint32_t      anchor_id = UINT32_MAX;
+	int           last_day = 0;
+	long          cnv_to_local = dc_gm2local_offset();
+
+	if (context==NULL || context->magic!=DC_CONTEXT_MAGIC || ret==NULL || cnt_before<0 || cnt_after<0) {
+		goto cleanup;
+	}
+
+	if (msg_id) {
+		stmt = dc_sqlite3_prepare_read(context->sql,
+			"SELECT timestamp FROM msgs WHERE id=?;");
+		sqlite3_bind_int(stmt, 1, msg_id);
+		if (sqlite3_step(stmt)==SQLITE_ROW) {
+			anchor_timestamp = sqlite3_column_int64(stmt, 0);
+			anchor_id = msg_id;
 		}
+		sqlite3_finalize(stmt);
+		stmt = NULL;
+	}
 
-		/* add daymarker, if needed */
+	// select the anchor and the older messages, newest first;
+	// one more message is selected to get the day of the message before the window.
+	older = dc_array_new(context, 128);
+	stmt = prepare_chat_msgs(context, chat_id,
+		" AND (m.timestamp,m.id)<=(?2,?3)"
+		" ORDER BY m.timestamp DESC,m.id DESC LIMIT ?4;");
+	sqlite3_bind_int64(stmt, 2, anchor_timestamp);
+	sqlite3_bind_int64(stmt, 3, anchor_id);
+	sqlite3_bind_int64(stmt, 4, (int64_t)cnt_before+2);
+	while (sqlite3_step(stmt)==SQLITE_ROW) {
+		dc_array_add_id(older, sqlite3_column_int(stmt, 0));
+		dc_array_add_uint(older, (uintptr_t)sqlite3_column_int64(stmt, 1));
+	}
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+
+	size_t older_cnt = dc_array_get_cnt(older)/2;
+	size_t i = older_cnt;
+	if (older_cnt==(size_t)cnt_before+2) { /* the oldest message is not part of the window */
 		if (flags&DC_GCM_ADDDAYMARKER) {
-			curr_local_timestamp = (time_t)sqlite3_column_int64(stmt, 1) + cnv_to_local;
-			curr_day = curr_local_timestamp/DC_SECONDS_PER_DAY;
-			if (curr_day!=last_day) {
-				dc_array_add_id(ret, DC_MSG_ID_DAYMARKER);
-				last_day = curr_day;
-			}
+			last_day = ((time_t)dc_array_get_uint(older, (older_cnt-1)*2+1)+cnv_to_local)/DC_SECONDS_PER_DAY;
+		}
+		i--;
+	}
+	while (i>0) {
+		i--;
+		add_chat_msg(ret, dc_array_get_id(older, i*2), (time_t)dc_array_get_uint(older, i*2+1),
+			flags, marker1before, cnv_to_local, &last_day);
+	}
+
+	// select the newer messages, oldest first
+	if (anchor_id!=UINT32_MAX && cnt_after>0) {
+		stmt = prepare_chat_msgs(context, chat_id,
+			" AND (m.timestamp,m.id)>(?2,?3)"
+			" ORDER BY m.timestamp,m.id LIMIT ?4;");
+		sqlite3_bind_int64(stmt, 2, anchor_timestamp);
+		sqlite3_bind_int64(stmt, 3, anchor_id);
+		sqlite3_bind_int  (stmt, 4, cnt_after);
+		while (sqlite3_step(stmt)==SQLITE_ROW) {
+			add_chat_msg(ret, sqlite3_column_int(stmt, 0), (time_t)sqlite3_column_int64(stmt, 1),
+				flags, marker1before, cnv_to_local, &last_day);
 		}
-
-		dc_array_add_id(ret, curr_id);
 	}
 
 	success = 1;
 
 cleanup:
 	sqlite3_finalize(stmt);
-
-	//dc_log_info(context, 0, "Message list for chat #%i created in %.3f ms.", chat_id, (double)(clock()-start)*1000.0/CLOCKS_PER_SEC);
+	dc_array_unref(older);
 
 	if (success) {
 		return ret;
@@ -1483,11 +1627,8 @@ int dc_get_fresh_msg_cnt(dc_context_t* context, uint32_t chat_id)
 		goto cleanup;
 	}
 
-	stmt = dc_sqlite3_prepare(context->sql,
-		"SELECT COUNT(*) FROM msgs "
-		" WHERE state=" DC_STRINGIFY(DC_STATE_IN_FRESH)
-		"   AND hidden=0 "
-		"   AND chat_id=?;"); /* we have an index over the state-column, this should be sufficient as there are typically only few fresh messages */
+	stmt = dc_sqlite3_prepare_read(context->sql,
+		"SELECT fresh_cnt FROM chats_summary WHERE chat_id=?;"); /* fresh messages are counted by triggers on msgs */
 	sqlite3_bind_int(stmt, 1, chat_id);
 
 	if (sqlite3_step(stmt)!=SQLITE_ROW) {
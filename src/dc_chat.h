@@ -29,6 +29,8 @@ struct _dc_chat
 };
 
 int             dc_chat_load_from_db               (dc_chat_t*, uint32_t id);
+int             dc_chat_set_from_stmt              (dc_chat_t*, sqlite3_stmt*, int row_offset);
+#define         DC_CHAT_FIELDS             " c.id,c.type,c.name, c.grpid,c.param,c.archived, c.blocked, c.gossiped_timestamp, c.locations_send_until "
 int             dc_chat_update_param               (dc_chat_t*);
 
 #define         DC_CHAT_TYPE_IS_MULTI(a)   ((a)==DC_CHAT_TYPE_GROUP || (a)==DC_CHAT_TYPE_VERIFIED_GROUP)
@@ -218,6 +218,180 @@ cleanup:
 }
 
 
+/**
+ * Get the summaries for a range of chatlist indices.
+ *
+ * The function returns the same summaries as dc_chatlist_get_summary()
+ * for the indices `index_from` to `index_to-1`.
+ * However, the chats, the last messages and their senders are loaded
+ * with one query each instead of several queries per chatlist index,
+ * so UIs should prefer this function when painting or scrolling a larger
+ * part of the chatlist.
+ *
+ * @memberof dc_chatlist_t
+ * @param chatlist The chatlist to query as returned eg. from dc_get_chatlist().
+ * @param index_from The first index to query.
+ * @param index_to The index after the last index to query.
+ *     If this is larger than dc_chatlist_get_cnt(), the range ends with the chatlist.
+ * @return An array of dc_lot_t objects, one for each index in the range;
+ *     get the objects using dc_array_get_ptr().
+ *     The objects belong to the array and are freed with the array using dc_array_unref(),
+ *     do not call dc_lot_unref() on them.
+ *     NULL is returned only if the chatlist is invalid.
+ */
+dc_array_t* dc_chatlist_get_summaries(const dc_chatlist_t* chatlist, size_t index_from, size_t index_to)
+{
+	dc_context_t*  context = NULL;
+	dc_array_t*    ret = NULL;
+	dc_array_t*    chat_ids = NULL;
+	dc_array_t*    msg_ids = NULL;
+	char*          ids_str = NULL;
+	char*          q3 = NULL;
+	sqlite3_stmt*  stmt = NULL;
+	dc_hash_t      chats;    /* chat_id -> dc_chat_t* */
+	dc_hash_t      msgs;     /* msg_id -> dc_msg_t* */
+	dc_hash_t      contacts; /* msg_id -> dc_contact_t* of the sender */
+	dc_contact_t*  unknown_contact = NULL;
+	char*          nomessages_str = NULL;
+
+	dc_hash_init(&chats, DC_HASH_INT, 0);
+	dc_hash_init(&msgs, DC_HASH_INT, 0);
+	dc_hash_init(&contacts, DC_HASH_INT, 0);
+
+	if (chatlist==NULL || chatlist->magic!=DC_CHATLIST_MAGIC) {
+		goto cleanup;
+	}
+
+	context = chatlist->context;
+
+	if (index_to>chatlist->cnt) {
+		index_to = chatlist->cnt;
+	}
+
+	ret = dc_array_new_typed(context, DC_ARRAY_LOTS, index_to>index_from? index_to-index_from : 1);
+	if (index_from>=index_to) {
+		goto cleanup;
+	}
+
+	chat_ids = dc_array_new(context, index_to-index_from);
+	msg_ids = dc_array_new(context, index_to-index_from);
+	for (size_t i = index_from; i<index_to; i++) {
+		dc_array_add_id(chat_ids, dc_array_get_id(chatlist->chatNlastmsg_ids, i*DC_CHATLIST_IDS_PER_RESULT));
+		uint32_t lastmsg_id = dc_array_get_id(chatlist->chatNlastmsg_ids, i*DC_CHATLIST_IDS_PER_RESULT+1);
+		if (lastmsg_id) {
+			dc_array_add_id(msg_ids, lastmsg_id);
+		}
+	}
+
+	// load all chats of the range
+	ids_str = dc_array_get_string(chat_ids, ",");
+	q3 = sqlite3_mprintf("SELECT " DC_CHAT_FIELDS " FROM chats c WHERE c.id IN(%s);", ids_str);
+	stmt = dc_sqlite3_prepare_read(context->sql, q3);
+	while (sqlite3_step(stmt)==SQLITE_ROW) {
+		dc_chat_t* chat = dc_chat_new(context);
+		if (dc_chat_set_from_stmt(chat, stmt, 0)) {
+			dc_hash_insert(&chats, NULL, chat->id, chat);
+		}
+		else {
+			dc_chat_unref(chat);
+		}
+	}
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+	sqlite3_free(q3);
+	q3 = NULL;
+	free(ids_str);
+	ids_str = NULL;
+
+	// load all last messages together with their senders
+	if (dc_array_get_cnt(msg_ids)>0) {
+		ids_str = dc_array_get_string(msg_ids, ",");
+		q3 = sqlite3_mprintf("SELECT " DC_MSG_FIELDS ", " DC_CONTACT_FIELDS
+		                     " FROM msgs m"
+		                     " LEFT JOIN chats c ON c.id=m.chat_id"
+		                     " LEFT JOIN contacts ct ON ct.id=m.from_id"
+		                     " WHERE m.id IN(%s);", ids_str);
+		stmt = dc_sqlite3_prepare_read(context->sql, q3);
+		while (sqlite3_step(stmt)==SQLITE_ROW) {
+			dc_msg_t* msg = dc_msg_new_untyped(context);
+			int       contact_offset = dc_msg_set_from_stmt(msg, stmt, 0);
+			dc_hash_insert(&msgs, NULL, msg->id, msg);
+			if (sqlite3_column_type(stmt, contact_offset)!=SQLITE_NULL) {
+				dc_contact_t* contact = dc_contact_new(context);
+				dc_contact_set_from_stmt(contact, stmt, contact_offset);
+				dc_hash_insert(&contacts, NULL, msg->id, contact);
+			}
+		}
+	}
+
+	// build the summaries as done by dc_chatlist_get_summary()
+	for (size_t i = index_from; i<index_to; i++)
+	{
+		dc_lot_t*     lot = dc_lot_new();
+		uint32_t      lastmsg_id = dc_array_get_id(chatlist->chatNlastmsg_ids, i*DC_CHATLIST_IDS_PER_RESULT+1);
+		dc_chat_t*    chat = dc_hash_find(&chats, NULL, dc_array_get_id(chatlist->chatNlastmsg_ids, i*DC_CHATLIST_IDS_PER_RESULT));
+		dc_msg_t*     lastmsg = lastmsg_id? dc_hash_find(&msgs, NULL, lastmsg_id) : NULL;
+		dc_contact_t* lastcontact = NULL;
+
+		if (chat==NULL)
+		{
+			lot->text2 = dc_strdup("ErrCannotReadChat");
+		}
+		else if (chat->id==DC_CHAT_ID_ARCHIVED_LINK)
+		{
+			lot->text2 = dc_strdup(NULL);
+		}
+		else if (lastmsg==NULL || lastmsg->from_id==0)
+		{
+			/* no messages, the stock string is requested only once for the whole range */
+			if (nomessages_str==NULL) {
+				nomessages_str = dc_stock_str(context, DC_STR_NOMESSAGES);
+			}
+			lot->text2 = dc_strdup(nomessages_str);
+		}
+		else
+		{
+			/* show the last message */
+			if (lastmsg->from_id!=DC_CONTACT_ID_SELF && DC_CHAT_TYPE_IS_MULTI(chat->type)) {
+				lastcontact = dc_hash_find(&contacts, NULL, lastmsg_id);
+				if (lastcontact==NULL) {
+					/* as dc_chatlist_get_summary(), use an empty contact if the sender cannot be loaded */
+					if (unknown_contact==NULL) {
+						unknown_contact = dc_contact_new(context);
+					}
+					lastcontact = unknown_contact;
+				}
+			}
+			dc_lot_fill(lot, lastmsg, chat, lastcontact, context);
+		}
+
+		dc_array_add_ptr(ret, lot);
+	}
+
+cleanup:
+	for (dc_hashelem_t* e = dc_hash_first(&chats); e; e = dc_hash_next(e)) {
+		dc_chat_unref((dc_chat_t*)dc_hash_data(e));
+	}
+	for (dc_hashelem_t* e = dc_hash_first(&msgs); e; e = dc_hash_next(e)) {
+		dc_msg_unref((dc_msg_t*)dc_hash_data(e));
+	}
+	for (dc_hashelem_t* e = dc_hash_first(&contacts); e; e = dc_hash_next(e)) {
+		dc_contact_unref((dc_contact_t*)dc_hash_data(e));
+	}
+	dc_hash_clear(&chats);
+	dc_hash_clear(&msgs);
+	dc_hash_clear(&contacts);
+	dc_contact_unref(unknown_contact);
+	sqlite3_finalize(stmt);
+	sqlite3_free(q3);
+	free(ids_str);
+	free(nomessages_str);
+	dc_array_unref(chat_ids);
+	dc_array_unref(msg_ids);
+	return ret;
+}
+
+
 /**
  * Helper function to get the associated context object.
  *
@@ -239,7 +413,7 @@ static uint32_t get_last_deaddrop_fresh_msg(dc_context_t* context)
 	uint32_t      ret = 0;
 	sqlite3_stmt* stmt = NULL;
 
-	stmt = dc_sqlite3_prepare(context->sql,
+	stmt = dc_sqlite3_prepare_read(context->sql,
 		"SELECT m.id "
 		" FROM msgs m "
 		" LEFT JOIN chats c ON c.id=m.chat_id "
@@ -281,23 +455,15 @@ static int dc_chatlist_load_from_db(dc_chatlist_t* chatlist, int listflags, cons
 
 	dc_chatlist_empty(chatlist);
 
-	// select with left join and minimum:
-	// - the inner select must use `hidden` and _not_ `m.hidden`
-	//   which would refer the outer select and take a lot of time
-	// - `GROUP BY` is needed several messages may have the same timestamp
+	// the last visible message of each chat is maintained in chats_summary,
+	// see the triggers in dc_sqlite3_open().
+	// - chats without messages have no entry or an entry with last_msg_id=0
 	// - the list starts with the newest chats
-	#define QUR1 "SELECT c.id, m.id FROM chats c " \
-	             " LEFT JOIN msgs m " \
-	             "        ON c.id=m.chat_id " \
-	             "       AND m.timestamp=( " \
-	                         "SELECT MAX(timestamp) " \
-	                         "  FROM msgs " \
-	                         " WHERE chat_id=c.id " \
-	                         "   AND (hidden=0 OR (hidden=1 AND state=" DC_STRINGIFY(DC_STATE_OUT_DRAFT) ")))" \
+	#define QUR1 "SELECT c.id, IFNULL(s.last_msg_id,0) FROM chats c " \
+	             " LEFT JOIN chats_summary s ON s.chat_id=c.id " \
 	             " WHERE c.id>" DC_STRINGIFY(DC_CHAT_ID_LAST_SPECIAL) \
 	             "   AND c.blocked=0"
-	#define QUR2 " GROUP BY c.id " \
-	             " ORDER BY IFNULL(m.timestamp,0) DESC, m.id DESC;"
+	#define QUR2 " ORDER BY IFNULL(s.last_timestamp,0) DESC, IFNULL(s.last_msg_id,0) DESC;"
 
 	// nb: the query currently shows messages from blocked contacts in groups.
 	// however, for normal-groups, this is okay as the message is also returned by dc_get_chat_msgs()
@@ -308,14 +474,14 @@ static int dc_chatlist_load_from_db(dc_chatlist_t* chatlist, int listflags, cons
 	if (query_contact_id)
 	{
 		// show chats shared with a given contact
-		stmt = dc_sqlite3_prepare(chatlist->context->sql,
+		stmt = dc_sqlite3_prepare_read(chatlist->context->sql,
 			QUR1 " AND c.id IN(SELECT chat_id FROM chats_contacts WHERE contact_id=?) " QUR2);
 		sqlite3_bind_int(stmt, 1, query_contact_id);
 	}
 	else if (listflags & DC_GCL_ARCHIVED_ONLY)
 	{
 		/* show archived chats */
-		stmt = dc_sqlite3_prepare(chatlist->context->sql,
+		stmt = dc_sqlite3_prepare_read(chatlist->context->sql,
 			QUR1 " AND c.archived=1 " QUR2);
 	}
 	else if (query__==NULL)
@@ -330,7 +496,7 @@ static int dc_chatlist_load_from_db(dc_chatlist_t* chatlist, int listflags, cons
 			add_archived_link_item = 1;
 		}
 
-		stmt = dc_sqlite3_prepare(chatlist->context->sql,
+		stmt = dc_sqlite3_prepare_read(chatlist->context->sql,
 			QUR1 " AND c.archived=0 " QUR2);
 	}
 	else
@@ -343,7 +509,7 @@ static int dc_chatlist_load_from_db(dc_chatlist_t* chatlist, int listflags, cons
 			goto cleanup;
 		}
 		strLikeCmd = dc_mprintf("%%%s%%", query);
-		stmt = dc_sqlite3_prepare(chatlist->context->sql,
+		stmt = dc_sqlite3_prepare_read(chatlist->context->sql,
 			QUR1 " AND c.name LIKE ? " QUR2);
 		sqlite3_bind_text(stmt, 1, strLikeCmd, -1, SQLITE_STATIC);
 	}
@@ -384,7 +550,7 @@ cleanup:
 int dc_get_archived_cnt(dc_context_t* context)
 {
 	int ret = 0;
-	sqlite3_stmt* stmt = dc_sqlite3_prepare(context->sql,
+	sqlite3_stmt* stmt = dc_sqlite3_prepare_read(context->sql,
 		"SELECT COUNT(*) FROM chats WHERE blocked=0 AND archived=1;");
 	if (sqlite3_step(stmt)==SQLITE_ROW) {
 		ret = sqlite3_column_int(stmt, 0);
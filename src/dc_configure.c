@@ -512,12 +512,14 @@ static clist* list_folders(dc_imap_t* imap)
 	// when switching to XLIST: at least my server claims
 	// that it support XLIST but does not return folder flags.
 	// so, if we did not get a _single_ flag, sth. seems not to work.
+	uint64_t start = dc_metrics_now();
 	if (imap->has_xlist)  {
 		r = mailimap_xlist(imap->etpan, "", "*", &imap_list);
 	}
 	else {
 		r = mailimap_list(imap->etpan, "", "*", &imap_list);
 	}
+	dc_metrics_add(imap->context->metrics, DC_METRIC_IMAP_LIST, dc_metrics_now()-start);
 
 	if (dc_imap_is_error(imap, r) || imap_list==NULL) {
 		imap_list = NULL;
@@ -338,6 +338,35 @@ int dc_contact_is_verified(dc_contact_t* contact)
 }
 
 
+/**
+ * Set the contact from a row selected with DC_CONTACT_FIELDS.
+ * Unlike dc_contact_load_from_db(), DC_CONTACT_ID_SELF is not handled specially.
+ *
+ * @private @memberof dc_contact_t
+ * @param contact The contact object to fill, existing data are free()'d.
+ * @param row The statement, the DC_CONTACT_FIELDS columns must start at row_offset.
+ * @param row_offset The index of the first DC_CONTACT_FIELDS column.
+ * @return The next row offset.
+ */
+int dc_contact_set_from_stmt(dc_contact_t* contact, sqlite3_stmt* row, int row_offset)
+{
+	if (contact==NULL || contact->magic!=DC_CONTACT_MAGIC || row==NULL) {
+		return 0;
+	}
+
+	dc_contact_empty(contact);
+
+	contact->id               =                  sqlite3_column_int  (row, row_offset++); /* the columns are defined in DC_CONTACT_FIELDS */
+	contact->name             = dc_strdup((char*)sqlite3_column_text (row, row_offset++));
+	contact->addr             = dc_strdup((char*)sqlite3_column_text (row, row_offset++));
+	contact->origin           =                  sqlite3_column_int  (row, row_offset++);
+	contact->blocked          =                  sqlite3_column_int  (row, row_offset++);
+	contact->authname         = dc_strdup((char*)sqlite3_column_text (row, row_offset++));
+
+	return row_offset;
+}
+
+
 /**
  * Load a contact from the database to the contact object.
  *
@@ -363,20 +392,15 @@ int dc_contact_load_from_db(dc_contact_t* contact, dc_sqlite3_t* sql, uint32_t c
 	else
 	{
 		stmt = dc_sqlite3_prepare(sql,
-			"SELECT c.name, c.addr, c.origin, c.blocked, c.authname "
-			" FROM contacts c "
-			" WHERE c.id=?;");
+			"SELECT " DC_CONTACT_FIELDS
+			" FROM contacts ct "
+			" WHERE ct.id=?;");
 		sqlite3_bind_int(stmt, 1, contact_id);
 		if (sqlite3_step(stmt)!=SQLITE_ROW) {
 			goto cleanup;
 		}
 
-		contact->id               = contact_id;
-		contact->name             = dc_strdup((char*)sqlite3_column_text (stmt, 0));
-		contact->addr             = dc_strdup((char*)sqlite3_column_text (stmt, 1));
-		contact->origin           =                  sqlite3_column_int  (stmt, 2);
-		contact->blocked          =                  sqlite3_column_int  (stmt, 3);
-		contact->authname         = dc_strdup((char*)sqlite3_column_text (stmt, 4));
+		dc_contact_set_from_stmt(contact, stmt, 0);
 	}
 
 	success = 1;
@@ -668,7 +692,7 @@ uint32_t dc_add_or_lookup_contact( dc_context_t* context,
 
 	/* insert email-address to database or modify the record with the given email-address.
 	we treat all email-addresses case-insensitive. */
-	stmt = dc_sqlite3_prepare(context->sql,
+	stmt = dc_sqlite3_borrow_stmt(context->sql,
 		"SELECT id, name, addr, origin, authname FROM contacts WHERE addr=? COLLATE NOCASE;");
 	sqlite3_bind_text(stmt, 1, (const char*)addr, -1, SQLITE_STATIC);
 	if (sqlite3_step(stmt)==SQLITE_ROW)
@@ -681,7 +705,7 @@ uint32_t dc_add_or_lookup_contact( dc_context_t* context,
 		row_addr     = dc_strdup((char*)sqlite3_column_text(stmt, 2));
 		row_origin   = sqlite3_column_int(stmt, 3);
 		row_authname = dc_strdup((char*)sqlite3_column_text(stmt, 4));
-		sqlite3_finalize (stmt);
+		dc_sqlite3_return_stmt(context->sql, stmt);
 		stmt = NULL;
 
 		if (name && name[0]) {
@@ -733,7 +757,7 @@ uint32_t dc_add_or_lookup_contact( dc_context_t* context,
 	}
 	else
 	{
-		sqlite3_finalize (stmt);
+		dc_sqlite3_return_stmt(context->sql, stmt);
 		stmt = NULL;
 
 		stmt = dc_sqlite3_prepare(context->sql,
@@ -1051,7 +1075,7 @@ dc_array_t* dc_get_contacts(dc_context_t* context, uint32_t listflags, const cha
 			goto cleanup;
 		}
 		// see comments in dc_search_msgs() about the LIKE operator
-		stmt = dc_sqlite3_prepare(context->sql,
+		stmt = dc_sqlite3_prepare_read(context->sql,
 			"SELECT c.id FROM contacts c"
 				" LEFT JOIN acpeerstates ps ON c.addr=ps.addr "
 				" WHERE c.addr!=?1 AND c.id>?2 AND c.origin>=?3"
@@ -1073,7 +1097,7 @@ dc_array_t* dc_get_contacts(dc_context_t* context, uint32_t listflags, const cha
 	}
 	else
 	{
-		stmt = dc_sqlite3_prepare(context->sql,
+		stmt = dc_sqlite3_prepare_read(context->sql,
 			"SELECT id FROM contacts"
 				" WHERE addr!=?1 AND id>?2 AND origin>=?3 AND blocked=0"
 				" ORDER BY LOWER(name||addr),id;");
@@ -37,8 +37,11 @@ static const char* config_keys[] = {
 	,"sentbox_watch"
 	,"mvbox_watch"
 	,"mvbox_move"
+	,"imap_compress"
 	,"show_emails"
 	,"save_mime_headers"
+	,"wal_mode"
+	,"dedup_blobs"
 	,"configured_addr"
 	,"configured_mail_server"
 	,"configured_mail_user"
@@ -75,8 +78,29 @@ static uintptr_t cb_dummy(dc_context_t* context, int event, uintptr_t data1, uin
 
 
 /**
- * The following three callback are given to dc_imap_new() to read/write configuration
- * and to handle received messages. As the imap-functions are typically used in
+ * All events are sent through this callback, it calls the user-defined
+ * callback and measures the time spent there.
+ * Events telling about database changes are held back until the transaction
+ * of the sending thread is committed, see dc_sqlite3_defer_event().
+ *
+ * @private @memberof dc_context_t
+ */
+static uintptr_t cb_timed(dc_context_t* context, int event, uintptr_t data1, uintptr_t data2)
+{
+	if (dc_sqlite3_defer_event(context->sql, event, data1, data2)) {
+		return 0;
+	}
+
+	uint64_t  start = dc_metrics_now();
+	uintptr_t ret = context->user_cb(context, event, data1, data2);
+	dc_metrics_add(context->metrics, DC_METRIC_EVENT_CALLBACK, dc_metrics_now()-start);
+	return ret;
+}
+
+
+/**
+ * The following callbacks are given to dc_imap_new() to read/write configuration
+ * and to handle received messages and changes on the server. As the imap-functions are typically used in
  * a separate user-thread, also these functions may be called from a different thread.
  *
  * @private @memberof dc_context_t
@@ -144,9 +168,24 @@ static int cb_precheck_imf(dc_imap_t* imap, const char* rfc724_mid,
 
 
 static void cb_receive_imf(dc_imap_t* imap, const char* imf_raw_not_terminated, size_t imf_raw_bytes, const char* server_folder, uint32_t server_uid, uint32_t flags)
+{
+	// the message is parsed in the background and added to the database in order, see dc_receive_pool_t
+	dc_context_t* context = (dc_context_t*)imap->userData;
+	dc_receive_pool_add(context->receive_pool, imap, imf_raw_not_terminated, imf_raw_bytes, server_folder, server_uid, flags);
+}
+
+
+static void cb_flush_imf(dc_imap_t* imap)
 {
 	dc_context_t* context = (dc_context_t*)imap->userData;
-	dc_receive_imf(context, imf_raw_not_terminated, imf_raw_bytes, server_folder, server_uid, flags);
+	dc_receive_pool_flush(context->receive_pool, imap);
+}
+
+
+static void cb_sync_imf(dc_imap_t* imap, const char* server_folder, const dc_array_t* seen_uids, const dc_array_t* expunged_uid_ranges)
+{
+	dc_context_t* context = (dc_context_t*)imap->userData;
+	dc_update_msgs_from_server(context, server_folder, seen_uids, expunged_uid_ranges);
 }
 
 
@@ -194,10 +233,14 @@ dc_context_t* dc_context_new(dc_callback_t cb, void* userdata, const char* os_na
 	pthread_mutex_init(&context->smtpidle_condmutex, NULL);
 	pthread_cond_init(&context->smtpidle_cond, NULL);
 	pthread_mutex_init(&context->oauth2_critical, NULL);
+	pthread_mutex_init(&context->peerstate_critical, NULL);
+	pthread_mutex_init(&context->jobs_critical, NULL);
 
 	context->magic    = DC_CONTEXT_MAGIC;
 	context->userdata = userdata;
-	context->cb       = cb? cb : cb_dummy;
+	context->user_cb  = cb? cb : cb_dummy;
+	context->cb       = cb_timed;
+	context->metrics  = dc_metrics_new();
 	context->os_name  = dc_strdup_keep_null(os_name);
 	context->shall_stop_ongoing = 1; /* the value 1 avoids dc_stop_ongoing_process() from stopping already stopped threads */
 
@@ -205,9 +248,10 @@ dc_context_t* dc_context_new(dc_callback_t cb, void* userdata, const char* os_na
 
 	dc_pgp_init();
 	context->sql      = dc_sqlite3_new(context);
-	context->inbox    = dc_imap_new(cb_get_config, cb_set_config, cb_precheck_imf, cb_receive_imf, (void*)context, context);
-	context->sentbox_thread.imap = dc_imap_new(cb_get_config, cb_set_config, cb_precheck_imf, cb_receive_imf, (void*)context, context);
-	context->mvbox_thread.imap = dc_imap_new(cb_get_config, cb_set_config, cb_precheck_imf, cb_receive_imf, (void*)context, context);
+	context->receive_pool = dc_receive_pool_new(context);
+	context->inbox    = dc_imap_new(cb_get_config, cb_set_config, cb_precheck_imf, cb_receive_imf, cb_flush_imf, cb_sync_imf, (void*)context, context);
+	context->sentbox_thread.imap = dc_imap_new(cb_get_config, cb_set_config, cb_precheck_imf, cb_receive_imf, cb_flush_imf, cb_sync_imf, (void*)context, context);
+	context->mvbox_thread.imap = dc_imap_new(cb_get_config, cb_set_config, cb_precheck_imf, cb_receive_imf, cb_flush_imf, cb_sync_imf, (void*)context, context);
 	context->smtp     = dc_smtp_new(context);
 
 	/* Random-seed.  An additional seed with more random data is done just before key generation
@@ -244,6 +288,9 @@ void dc_context_unref(dc_context_t* context)
 		return;
 	}
 
+	dc_receive_pool_unref(context->receive_pool); // waits for the worker threads, they may still use pgp
+	context->receive_pool = NULL;
+
 	dc_pgp_exit();
 
 	if (dc_is_open(context)) {
@@ -266,7 +313,10 @@ void dc_context_unref(dc_context_t* context)
 	pthread_cond_destroy(&context->smtpidle_cond);
 	pthread_mutex_destroy(&context->smtpidle_condmutex);
 	pthread_mutex_destroy(&context->oauth2_critical);
+	pthread_mutex_destroy(&context->peerstate_critical);
+	pthread_mutex_destroy(&context->jobs_critical);
 
+	dc_metrics_unref(context->metrics);
 	free(context->os_name);
 	context->magic = 0;
 	free(context);
@@ -334,6 +384,8 @@ int dc_open(dc_context_t* context, const char* dbfile, const char* blobdir)
 		goto cleanup;
 	}
 
+	dc_fts_start_backfill(context);
+
 	success = 1;
 
 cleanup:
@@ -372,6 +424,8 @@ void dc_close(dc_context_t* context)
 		dc_sqlite3_close(context->sql);
 	}
 
+	dc_job_unload_queues(context);
+
 	free(context->dbfile);
 	context->dbfile = NULL;
 
@@ -513,6 +567,10 @@ static char* get_sys_config_str(const char* key)
  * - `mvbox_move`   = 1=heuristically detect chat-messages
  *                    and move them to the `DeltaChat`-folder,
  *                    0=do not move chat-messages
+ * - `imap_compress` = 1=use COMPRESS=DEFLATE on the IMAP connections
+ *                    if the server supports it (default),
+ *                    0=do not compress IMAP traffic;
+ *                    changes take effect on the next reconnect
  * - `show_emails`  = DC_SHOW_EMAILS_OFF (0)=
  *                    show direct replies to chats only (default),
  *                    DC_SHOW_EMAILS_ACCEPTED_CONTACTS (1)=
@@ -522,6 +580,17 @@ static char* get_sys_config_str(const char* key)
  * - `save_mime_headers` = 1=save mime headers
  *                    and make dc_get_mime_headers() work for subsequent calls,
  *                    0=do not save mime headers (default)
+ * - `wal_mode`     = 1=use write-ahead logging and separate read connections,
+ *                    so that reading is not blocked by writes of the imap-thread,
+ *                    0=use rollback journaling (default);
+ *                    changes take effect on the next dc_open().
+ *                    the bundled SQLite is built with SQLITE_OMIT_WAL,
+ *                    so the option has no effect unless the core is linked
+ *                    against a system SQLite with WAL support.
+ * - `dedup_blobs`  = 1=store files with the same content only once
+ *                    in the blob directory, identical attachments
+ *                    received or sent in several chats share the data,
+ *                    0=store each file on its own (default)
  *
  * If you want to retrieve a value, use dc_get_config().
  *
@@ -650,9 +719,15 @@ char* dc_get_config(dc_context_t* context, const char* key)
 		else if (strcmp(key, "mvbox_move")==0) {
 			value = dc_mprintf("%i", DC_MVBOX_MOVE_DEFAULT);
 		}
+		else if (strcmp(key, "imap_compress")==0) {
+			value = dc_mprintf("%i", DC_IMAP_COMPRESS_DEFAULT);
+		}
 		else if (strcmp(key, "show_emails")==0) {
 			value = dc_mprintf("%i", DC_SHOW_EMAILS_DEFAULT);
 		}
+		else if (strcmp(key, "dedup_blobs")==0) {
+			value = dc_mprintf("%i", DC_DEDUP_BLOBS_DEFAULT);
+		}
 		else if (strcmp(key, "selfstatus")==0) {
 			value = dc_stock_str(context, DC_STR_STATUSLINE);
 		}
@@ -746,6 +821,8 @@ char* dc_get_info(dc_context_t* context)
 	int              sentbox_watch = 0;
 	int              mvbox_watch = 0;
 	int              mvbox_move = 0;
+	int              imap_compress = 0;
+	int              dedup_blobs = 0;
 	int              folders_configured = 0;
 	char*            configured_sentbox_folder = NULL;
 	char*            configured_mvbox_folder = NULL;
@@ -816,6 +893,8 @@ char* dc_get_info(dc_context_t* context)
 	sentbox_watch = dc_sqlite3_get_config_int(context->sql, "sentbox_watch", DC_SENTBOX_WATCH_DEFAULT);
 	mvbox_watch = dc_sqlite3_get_config_int(context->sql, "mvbox_watch", DC_MVBOX_WATCH_DEFAULT);
 	mvbox_move = dc_sqlite3_get_config_int(context->sql, "mvbox_move", DC_MVBOX_MOVE_DEFAULT);
+	imap_compress = dc_sqlite3_get_config_int(context->sql, "imap_compress", DC_IMAP_COMPRESS_DEFAULT);
+	dedup_blobs = dc_sqlite3_get_config_int(context->sql, "dedup_blobs", DC_DEDUP_BLOBS_DEFAULT);
 	folders_configured = dc_sqlite3_get_config_int(context->sql, "folders_configured", 0);
 	configured_sentbox_folder = dc_sqlite3_get_config(context->sql, "configured_sentbox_folder", "<unset>");
 	configured_mvbox_folder = dc_sqlite3_get_config(context->sql, "configured_mvbox_folder", "<unset>");
@@ -835,6 +914,9 @@ char* dc_get_info(dc_context_t* context)
 		"number_of_contacts=%i\n"
 		"database_dir=%s\n"
 		"database_version=%i\n"
+		"database_read_connections=%i\n"
+		"database_stmt_cache_hits=%i\n"
+		"database_stmt_cache_misses=%i\n"
 		"blobdir=%s\n"
 		"display_name=%s\n"
 		"is_configured=%i\n"
@@ -844,6 +926,8 @@ char* dc_get_info(dc_context_t* context)
 		"sentbox_watch=%i\n"
 		"mvbox_watch=%i\n"
 		"mvbox_move=%i\n"
+		"imap_compress=%i\n"
+		"dedup_blobs=%i\n"
 		"folders_configured=%i\n"
 		"configured_sentbox_folder=%s\n"
 		"configured_mvbox_folder=%s\n"
@@ -866,6 +950,9 @@ char* dc_get_info(dc_context_t* context)
 		, contacts
 		, context->dbfile? context->dbfile : unset
 		, dbversion
+		, context->sql->readers_cnt
+		, context->sql->stmt_cache_hits
+		, context->sql->stmt_cache_misses
 		, context->blobdir? context->blobdir : unset
 		, displayname? displayname : unset
 		, is_configured
@@ -875,6 +962,8 @@ char* dc_get_info(dc_context_t* context)
 		, sentbox_watch
 		, mvbox_watch
 		, mvbox_move
+		, imap_compress
+		, dedup_blobs
 		, folders_configured
 		, configured_sentbox_folder
 		, configured_mvbox_folder
@@ -887,6 +976,19 @@ char* dc_get_info(dc_context_t* context)
 	dc_strbuilder_cat(&ret, temp);
 	free(temp);
 
+	/* traffic of the imap connections as payload/wire bytes; both are equal if COMPRESS=DEFLATE is not used */
+	const dc_imap_t* imaps[3] = { context->inbox, context->sentbox_thread.imap, context->mvbox_thread.imap };
+	const char*      imap_names[3] = { "inbox", "sentbox", "mvbox" };
+	for (int i = 0; i < 3; i++) {
+		if (imaps[i]) {
+			dc_strbuilder_catf(&ret, "%s_traffic=received %llu/%llu bytes, sent %llu/%llu bytes%s\n",
+				imap_names[i],
+				(unsigned long long)imaps[i]->bytes_received, (unsigned long long)imaps[i]->net_bytes_received,
+				(unsigned long long)imaps[i]->bytes_sent, (unsigned long long)imaps[i]->net_bytes_sent,
+				imaps[i]->compress? " (compressed)" : "");
+		}
+	}
+
 	/* free data */
 	dc_loginparam_unref(l);
 	dc_loginparam_unref(l2);
@@ -901,6 +1003,71 @@ char* dc_get_info(dc_context_t* context)
 }
 
 
+/**
+ * Get timing information about the operations done by the context.
+ * For each operation, the number of calls, the total and the maximal time
+ * and a histogram of the durations are collected since the context was created
+ * or since the last call with DC_METRICS_RESET.
+ * Collecting the metrics is cheap and always enabled.
+ *
+ * Operations measured are `imap.connect`, `imap.select`, `imap.fetch_headers`,
+ * `imap.fetch_bodies`, `imap.fetch_flags`, `imap.store`, `imap.move`, `imap.list`,
+ * `smtp.send`, `sql.write` and `sql.read` (SQL statements that modify
+ * the database including commits resp. statements that only read), `pgp.sign`, `pgp.encrypt`, `pgp.decrypt`,
+ * `mime.parse`, `event.callback` (the time spent in the callback given to
+ * dc_context_new()) and `job.<action>` for each job action.
+ * Only operations done at least once are returned.
+ *
+ * The durations are in microseconds.  Histogram bucket 0 counts durations
+ * below 1 microsecond, bucket i counts durations from 2^(i-1) to 2^i-1 microseconds.
+ *
+ * By default, the metrics are returned as a JSON object as
+ * `{"version":1, "elapsed_ms":..., "metrics":[{"name":"imap.select", "count":..., "total_us":...,
+ * "max_us":..., "p50_us":..., "p90_us":..., "p99_us":..., "buckets":[...]}, ...]}`,
+ * the percentiles are estimated from the histogram, trailing empty buckets are omitted.
+ *
+ * With DC_METRICS_BINARY, a compact snapshot is returned instead:
+ * the 4 bytes `DCM\x01`, then the elapsed milliseconds, the number of metrics
+ * and the number of histogram buckets; then for each metric the length of the name,
+ * the name, the count, the total and the maximal duration and all buckets.
+ * All numbers are unsigned LEB128 varints.
+ *
+ * @memberof dc_context_t
+ * @param context The context as created by dc_context_new().
+ * @param flags DC_METRICS_BINARY to get a binary snapshot instead of JSON;
+ *     DC_METRICS_RESET to reset all counters after reading.
+ * @param ret_bytes If not NULL, the size of the returned data is written here,
+ *     without the terminating null character of the JSON string.
+ * @return The metrics, must be free()'d after usage.  Returns NULL on errors.
+ */
+char* dc_get_metrics(dc_context_t* context, int flags, size_t* ret_bytes)
+{
+	char*  ret = NULL;
+	size_t bytes = 0;
+
+	if (context==NULL || context->magic!=DC_CONTEXT_MAGIC) {
+		return NULL;
+	}
+
+	if (flags&DC_METRICS_BINARY) {
+		ret = (char*)dc_metrics_get_binary(context->metrics, &bytes);
+	}
+	else {
+		ret = dc_metrics_get_json(context->metrics);
+		bytes = strlen(ret);
+	}
+
+	if (flags&DC_METRICS_RESET) {
+		dc_metrics_reset(context->metrics);
+	}
+
+	if (ret_bytes) {
+		*ret_bytes = bytes;
+	}
+	return ret;
+}
+
+
 /*******************************************************************************
  * Search
  ******************************************************************************/
@@ -951,6 +1118,40 @@ cleanup:
 }
 
 
+/**
+ * Convert a search string as entered by the user to a FTS5 query:
+ * every word is quoted and marked as prefix, so that `foo ba` finds
+ * messages containing words starting with `foo` _and_ words starting with `ba`.
+ *
+ * @private @memberof dc_context_t
+ */
+static char* get_fts_query(const char* query)
+{
+	dc_strbuilder_t ret;
+	const char*     p = query;
+
+	dc_strbuilder_init(&ret, 0);
+
+	while (*p)
+	{
+		while (*p==' ' || *p=='\t' || *p=='\r' || *p=='\n') {
+			p++;
+		}
+
+		if (*p) {
+			dc_strbuilder_cat(&ret, ret.buf[0]? " \"" : "\"");
+			while (*p && *p!=' ' && *p!='\t' && *p!='\r' && *p!='\n') {
+				dc_strbuilder_catf(&ret, *p=='"'? "\"\"" : "%c", *p); /* quotes inside strings are doubled */
+				p++;
+			}
+			dc_strbuilder_cat(&ret, "\"*");
+		}
+	}
+
+	return ret.buf;
+}
+
+
 /**
  * Search messages containing the given query string.
  * Searching can be done globally (chat_id=0) or in a specified chat only (chat_id
@@ -965,6 +1166,9 @@ cleanup:
  * @param chat_id ID of the chat to search messages in.
  *     Set this to 0 for a global search.
  * @param query The query to search for.
+ *     If the full-text-index is available, messages containing words that start
+ *     with all the words of the query are returned,
+ *     otherwise, messages containing the query as a substring.
  * @return An array of message IDs. Must be freed using dc_array_unref() when no longer needed.
  *     If nothing can be found, the function returns NULL.
  */
@@ -976,6 +1180,7 @@ dc_array_t* dc_search_msgs(dc_context_t* context, uint32_t chat_id, const char*
 	dc_array_t*   ret = dc_array_new(context, 100);
 	char*         strLikeInText = NULL;
 	char*         strLikeBeg = NULL;
+	char*         strMatch = NULL;
 	char*         real_query = NULL;
 	sqlite3_stmt* stmt = NULL;
 
@@ -994,36 +1199,49 @@ dc_array_t* dc_search_msgs(dc_context_t* context, uint32_t chat_id, const char*
 	strLikeBeg = dc_mprintf("%s%%", real_query); /*for the name search, we use "Name%" which is fast as it can use the index ("%Name%" could not). */
 
 	/* Incremental search with "LIKE %query%" cannot take advantages from any index
-	("query%" could for COLLATE NOCASE indexes, see http://www.sqlite.org/optoverview.html#like_opt)
-	An alternative may be the FULLTEXT sqlite stuff, however, this does not really help with incremental search.
-	An extra table with all words and a COLLATE NOCASE indexes may help, however,
-	this must be updated all the time and probably consumes more time than we can save in tenthousands of searches.
-	For now, we just expect the following query to be fast enough :-) */
+	("query%" could for COLLATE NOCASE indexes, see http://www.sqlite.org/optoverview.html#like_opt),
+	so, if available, we use the FTS5 index msgs_fts that finds all words starting with the
+	words of the query.  Until the index is complete or if FTS5 is not available,
+	we just expect the LIKE-query to be fast enough :-) */
+	if (dc_fts_ready(context->sql)) {
+		strMatch = get_fts_query(real_query);
+	}
+
+	#define TXT_MATCHES (strMatch? "m.id IN (SELECT rowid FROM msgs_fts WHERE msgs_fts MATCH ?)" : "m.txt LIKE ?")
+
 	if (chat_id) {
-		stmt = dc_sqlite3_prepare(context->sql,
+		char* q3 = sqlite3_mprintf(
 			"SELECT m.id, m.timestamp FROM msgs m"
 			" LEFT JOIN contacts ct ON m.from_id=ct.id"
 			" WHERE m.chat_id=? "
 				" AND m.hidden=0 "
-				" AND ct.blocked=0 AND (txt LIKE ? OR ct.name LIKE ?)"
-			" ORDER BY m.timestamp,m.id;"); /* chats starts with the oldest message*/
+				" AND ct.blocked=0 AND (%s OR ct.name LIKE ?)"
+			" ORDER BY m.timestamp,m.id;", /* chats starts with the oldest message*/
+			TXT_MATCHES);
+		stmt = dc_sqlite3_prepare_read(context->sql, q3);
+		sqlite3_free(q3);
 		sqlite3_bind_int (stmt, 1, chat_id);
-		sqlite3_bind_text(stmt, 2, strLikeInText, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, strMatch? strMatch : strLikeInText, -1, SQLITE_STATIC);
 		sqlite3_bind_text(stmt, 3, strLikeBeg, -1, SQLITE_STATIC);
 	}
 	else {
+		// `m.from_id IN (...)` is equal to `ct.name LIKE ?`, however, together with
+		// msgs_index7, this allows SQLite to use indexes for both sides of the OR.
 		int show_deaddrop = 0;//dc_sqlite3_get_config_int(context->sql, "show_deaddrop", 0);
-		stmt = dc_sqlite3_prepare(context->sql,
+		char* q3 = sqlite3_mprintf(
 			"SELECT m.id, m.timestamp FROM msgs m"
 			" LEFT JOIN contacts ct ON m.from_id=ct.id"
 			" LEFT JOIN chats c ON m.chat_id=c.id"
 			" WHERE m.chat_id>" DC_STRINGIFY(DC_CHAT_ID_LAST_SPECIAL)
 				" AND m.hidden=0 "
 				" AND (c.blocked=0 OR c.blocked=?)"
-				" AND ct.blocked=0 AND (m.txt LIKE ? OR ct.name LIKE ?)"
-			" ORDER BY m.timestamp DESC,m.id DESC;"); /* chat overview starts with the newest message*/
+				" AND ct.blocked=0 AND (%s OR m.from_id IN (SELECT id FROM contacts WHERE name LIKE ?))"
+			" ORDER BY m.timestamp DESC,m.id DESC;", /* chat overview starts with the newest message*/
+			TXT_MATCHES);
+		stmt = dc_sqlite3_prepare_read(context->sql, q3);
+		sqlite3_free(q3);
 		sqlite3_bind_int (stmt, 1, show_deaddrop? DC_CHAT_DEADDROP_BLOCKED : 0);
-		sqlite3_bind_text(stmt, 2, strLikeInText, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, strMatch? strMatch : strLikeInText, -1, SQLITE_STATIC);
 		sqlite3_bind_text(stmt, 3, strLikeBeg, -1, SQLITE_STATIC);
 	}
 
@@ -1036,6 +1254,7 @@ dc_array_t* dc_search_msgs(dc_context_t* context, uint32_t chat_id, const char*
 cleanup:
 	free(strLikeInText);
 	free(strLikeBeg);
+	free(strMatch);
 	free(real_query);
 	sqlite3_finalize(stmt);
 
@@ -33,6 +33,8 @@ preferrably, this should be done in the project configuration currently */
 #include "dc_smtp.h"
 #include "dc_job.h"
 #include "dc_mimeparser.h"
+#include "dc_receive_pool.h"
+#include "dc_metrics.h"
 #include "dc_hash.h"
 
 
@@ -69,9 +71,21 @@ struct _dc_context
 	int              perform_smtp_jobs_needed;
 	int              probe_smtp_network;   /**< if this flag is set, the smtp-job timeouts are bypassed and messages are sent until they fail */
 
+	pthread_mutex_t  jobs_critical;         /**< protects the job queues below */
+	dc_jobqueue_t    imap_jobs;             /**< in-memory mirror of the `jobs` table for the IMAP-thread, see dc_job_perform() */
+	dc_jobqueue_t    smtp_jobs;             /**< in-memory mirror of the `jobs` table for the SMTP-thread */
+	int              jobs_loaded;
+	int              jobs_generation;       /**< incremented when the queues are unloaded, jobs taken before are dropped then */
+
 	pthread_mutex_t  oauth2_critical;
 
-	dc_callback_t    cb;                    /**< Internal */
+	dc_receive_pool_t* receive_pool;        /**< Internal, parses received messages in parallel, never NULL */
+	pthread_mutex_t  peerstate_critical;    /**< held while a peerstate is loaded, modified and saved */
+
+	dc_callback_t    cb;                    /**< Internal, calls user_cb and measures the time spent there */
+	dc_callback_t    user_cb;               /**< Internal, the callback given to dc_context_new() */
+
+	dc_metrics_t*    metrics;               /**< Internal, never NULL, see dc_get_metrics() */
 
 	char*            os_name;               /**< Internal, may be NULL */
 
@@ -103,6 +117,7 @@ void            dc_log_warning       (dc_context_t*, int data1, const char* msg,
 void            dc_log_info          (dc_context_t*, int data1, const char* msg, ...);
 
 void            dc_receive_imf       (dc_context_t*, const char* imf_raw_not_terminated, size_t imf_raw_bytes, const char* server_folder, uint32_t server_uid, uint32_t flags);
+void            dc_receive_parsed_imf(dc_context_t*, dc_mimeparser_t*, const char* imf_raw_not_terminated, size_t imf_raw_bytes, const char* server_folder, uint32_t server_uid, uint32_t flags);
 
 #define         DC_NOT_CONNECTED     0
 #define         DC_ALREADY_CONNECTED 1
@@ -177,7 +192,9 @@ void            dc_job_do_DC_JOB_MAYBE_SEND_LOC_ENDED (dc_context_t*, dc_job_t*)
 #define DC_SENTBOX_WATCH_DEFAULT  1
 #define DC_MVBOX_WATCH_DEFAULT    1
 #define DC_MVBOX_MOVE_DEFAULT     1
+#define DC_IMAP_COMPRESS_DEFAULT  1
 #define DC_SHOW_EMAILS_DEFAULT    DC_SHOW_EMAILS_OFF
+#define DC_DEDUP_BLOBS_DEFAULT    0
 
 
 typedef struct _dc_e2ee_helper dc_e2ee_helper_t;
@@ -193,6 +210,14 @@ struct _dc_e2ee_helper {
 	int        encrypted;  // encrypted without problems
 	dc_hash_t* signatures; // fingerprints of valid signatures
 	dc_hash_t* gossipped_addr;
+	dc_hash_t* degrade_events; // addr -> DC_DE_* flags, collected by dc_e2ee_update_peerstates()
+
+	// peerstate updates, saved by dc_e2ee_update_peerstates() when the message is added to the database
+	char*      from;
+	time_t     message_time;
+	struct _dc_aheader* autocryptheader; // NULL if the message has no valid Autocrypt header
+	int        contains_report;
+	carray*    gossip_headers;  // struct _dc_aheader* of the valid Autocrypt-Gossip headers for recipients
 
 };
 
@@ -200,6 +225,7 @@ void            dc_e2ee_encrypt      (dc_context_t*, const clist* recipients_add
                                       int force_plaintext, int e2ee_guaranteed, int min_verified,
                                       int do_gossip, struct mailmime* in_out_message, dc_e2ee_helper_t*);
 void            dc_e2ee_decrypt      (dc_context_t*, struct mailmime* in_out_message, dc_e2ee_helper_t*); /* returns 1 if sth. was decrypted, 0 in other cases */
+void            dc_e2ee_update_peerstates(dc_context_t*, dc_e2ee_helper_t*);
 void            dc_e2ee_thanks       (dc_e2ee_helper_t*); /* frees data referenced by "mailmime" but not freed by mailmime_free(). After calling this function, in_out_message cannot be used any longer! */
 int             dc_ensure_secret_key_exists (dc_context_t*); /* makes sure, the private key exists, needed only for exporting keys and the case no message was sent before */
 char*           dc_create_setup_code (dc_context_t*);
@@ -505,6 +505,28 @@ void dc_e2ee_thanks(dc_e2ee_helper_t* helper)
 		free(helper->signatures);
 		helper->signatures = NULL;
 	}
+
+	if (helper->degrade_events)
+	{
+		dc_hash_clear(helper->degrade_events);
+		free(helper->degrade_events);
+		helper->degrade_events = NULL;
+	}
+
+	free(helper->from);
+	helper->from = NULL;
+
+	dc_aheader_unref(helper->autocryptheader);
+	helper->autocryptheader = NULL;
+
+	if (helper->gossip_headers)
+	{
+		for (int i = 0; i < carray_count(helper->gossip_headers); i++) {
+			dc_aheader_unref((dc_aheader_t*)carray_get(helper->gossip_headers, i));
+		}
+		carray_free(helper->gossip_headers);
+		helper->gossip_headers = NULL;
+	}
 }
 
 
@@ -539,7 +561,6 @@ static int decrypt_part(dc_context_t*       context,
                         struct mailmime**   ret_decrypted_mime)
 {
 	struct mailmime_data*        mime_data = NULL;
-	int                          mime_transfer_encoding = MAILMIME_MECHANISM_BINARY;
 	char*                        transfer_decoding_buffer = NULL; /* mmap_string_unref()'d if set */
 	const char*                  decoded_data = NULL; /* must not be free()'d */
 	size_t                       decoded_data_bytes = 0;
@@ -557,41 +578,9 @@ static int decrypt_part(dc_context_t*       context,
 		goto cleanup;
 	}
 
-	/* check headers in `mime` */
-	if (mime->mm_mime_fields!=NULL) {
-		clistiter* cur;
-		for (cur = clist_begin(mime->mm_mime_fields->fld_list); cur!=NULL; cur = clist_next(cur)) {
-			struct mailmime_field* field = (struct mailmime_field*)clist_content(cur);
-			if (field) {
-				if (field->fld_type==MAILMIME_FIELD_TRANSFER_ENCODING && field->fld_data.fld_encoding) {
-					mime_transfer_encoding = field->fld_data.fld_encoding->enc_type;
-				}
-			}
-		}
-	}
-
 	/* regard `Content-Transfer-Encoding:` */
-	if (mime_transfer_encoding==MAILMIME_MECHANISM_7BIT
-	 || mime_transfer_encoding==MAILMIME_MECHANISM_8BIT
-	 || mime_transfer_encoding==MAILMIME_MECHANISM_BINARY)
-	{
-		decoded_data       = mime_data->dt_data.dt_text.dt_data;
-		decoded_data_bytes = mime_data->dt_data.dt_text.dt_length;
-		if (decoded_data==NULL || decoded_data_bytes <= 0) {
-			goto cleanup; /* no error - but no data */
-		}
-	}
-	else
-	{
-		int r;
-		size_t current_index = 0;
-		r = mailmime_part_parse(mime_data->dt_data.dt_text.dt_data, mime_data->dt_data.dt_text.dt_length,
-			&current_index, mime_transfer_encoding,
-			&transfer_decoding_buffer, &decoded_data_bytes);
-		if (r!=MAILIMF_NO_ERROR || transfer_decoding_buffer==NULL || decoded_data_bytes <= 0) {
-			goto cleanup;
-		}
-		decoded_data = transfer_decoding_buffer;
+	if (!mailmime_transfer_decode(mime, &decoded_data, &decoded_data_bytes, &transfer_decoding_buffer)) {
+		goto cleanup;
 	}
 
 	/* encrypted, decoded data in decoded_data now ... */
@@ -602,8 +591,10 @@ static int decrypt_part(dc_context_t*       context,
 	dc_hash_t* add_signatures = dc_hash_cnt(ret_valid_signatures)<=0?
 		ret_valid_signatures : NULL; /*if we already have fingerprints, do not add more; this ensures, only the fingerprints from the outer-most part are collected */
 
-	if (!dc_pgp_pk_decrypt(context, decoded_data, decoded_data_bytes, private_keyring, public_keyring_for_validate, 1, &plain_buf, &plain_bytes, add_signatures)
-	 || plain_buf==NULL || plain_bytes<=0) {
+	uint64_t start = dc_metrics_now();
+	int decrypted = dc_pgp_pk_decrypt(context, decoded_data, decoded_data_bytes, private_keyring, public_keyring_for_validate, 1, &plain_buf, &plain_bytes, add_signatures);
+	dc_metrics_add(context->metrics, DC_METRIC_PGP_DECRYPT, dc_metrics_now()-start);
+	if (!decrypted || plain_buf==NULL || plain_bytes<=0) {
 		goto cleanup;
 	}
 
@@ -703,7 +694,49 @@ static int decrypt_recursive(dc_context_t*           context,
 }
 
 
-static dc_hash_t* update_gossip_peerstates(dc_context_t* context, time_t message_time, struct mailimf_fields* imffields, const struct mailimf_fields* gossip_headers)
+/* Peerstates are not saved while decrypting as this may happen on a worker
+thread before earlier messages are added to the database, see dc_receive_pool_t.
+Instead, dc_e2ee_decrypt() keeps the Autocrypt and Autocrypt-Gossip headers
+in the helper and dc_e2ee_update_peerstates() applies them to the peerstates
+when the message is added, in the order the messages are received. */
+static void add_degrade_event(dc_e2ee_helper_t* helper, const dc_apeerstate_t* peerstate)
+{
+	if (peerstate->degrade_event==0 || peerstate->addr==NULL) {
+		return;
+	}
+
+	if (helper->degrade_events==NULL) {
+		helper->degrade_events = malloc(sizeof(dc_hash_t));
+		dc_hash_init(helper->degrade_events, DC_HASH_STRING, 1/*copy key*/);
+	}
+
+	uintptr_t events = (uintptr_t)dc_hash_find_str(helper->degrade_events, peerstate->addr);
+	dc_hash_insert_str(helper->degrade_events, peerstate->addr, (void*)(events|peerstate->degrade_event));
+}
+
+
+static void handle_degrade_events(dc_context_t* context, dc_e2ee_helper_t* helper)
+{
+	if (helper->degrade_events==NULL) {
+		return;
+	}
+
+	dc_apeerstate_t* peerstate = dc_apeerstate_new(context);
+	for (dc_hashelem_t* elem = dc_hash_first(helper->degrade_events); elem; elem = dc_hash_next(elem)) {
+		free(peerstate->addr);
+		peerstate->addr = dc_null_terminate((const char*)dc_hash_key(elem), dc_hash_keysize(elem));
+		peerstate->degrade_event = (int)(uintptr_t)dc_hash_data(elem);
+		dc_handle_degrade_event(context, peerstate);
+	}
+	dc_apeerstate_unref(peerstate);
+
+	dc_hash_clear(helper->degrade_events);
+	free(helper->degrade_events);
+	helper->degrade_events = NULL;
+}
+
+
+static dc_hash_t* collect_gossip_headers(dc_context_t* context, dc_e2ee_helper_t* helper, struct mailimf_fields* imffields, const struct mailimf_fields* gossip_headers)
 {
 	clistiter*  cur1 = NULL;
 	dc_hash_t*  recipients = NULL;
@@ -728,23 +761,6 @@ static dc_hash_t* update_gossip_peerstates(dc_context_t* context, time_t message
 
 					if (dc_hash_find(recipients, gossip_header->addr, strlen(gossip_header->addr)))
 					{
-						/* valid recipient: update peerstate */
-						dc_apeerstate_t* peerstate = dc_apeerstate_new(context);
-						if (!dc_apeerstate_load_by_addr(peerstate, context->sql, gossip_header->addr)) {
-							dc_apeerstate_init_from_gossip(peerstate, gossip_header, message_time);
-							dc_apeerstate_save_to_db(peerstate, context->sql, 1/*create*/);
-						}
-						else {
-							dc_apeerstate_apply_gossip(peerstate, gossip_header, message_time);
-							dc_apeerstate_save_to_db(peerstate, context->sql, 0/*do not create*/);
-						}
-
-						if (peerstate->degrade_event) {
-							dc_handle_degrade_event(context, peerstate);
-						}
-
-						dc_apeerstate_unref(peerstate);
-
 						// collect all gossipped addresses; we need them later to mark them as being
 						// verified when used in a verified group by a verified sender
 						if (gossipped_addr==NULL) {
@@ -752,6 +768,13 @@ static dc_hash_t* update_gossip_peerstates(dc_context_t* context, time_t message
 							dc_hash_init(gossipped_addr, DC_HASH_STRING, 1/*copy key*/);
 						}
 						dc_hash_insert(gossipped_addr, gossip_header->addr, strlen(gossip_header->addr), (void*)1);
+
+						/* valid recipient: the peerstate is updated by dc_e2ee_update_peerstates() */
+						if (helper->gossip_headers==NULL) {
+							helper->gossip_headers = carray_new(16);
+						}
+						carray_add(helper->gossip_headers, gossip_header, NULL);
+						gossip_header = NULL;
 					}
 					else
 					{
@@ -825,7 +848,13 @@ void dc_e2ee_decrypt(dc_context_t* context, struct mailmime* in_out_message,
 		}
 	}
 
-	/* modify the peerstate (eg. if there is a peer but not autocrypt header, stop encryption) */
+	/* modify the peerstate (eg. if there is a peer but not autocrypt header, stop encryption);
+	the peerstate is only modified in memory here to validate the signatures with the new keys,
+	it is saved by dc_e2ee_update_peerstates() */
+	helper->from            = dc_strdup_keep_null(from);
+	helper->message_time    = message_time;
+	helper->autocryptheader = autocryptheader;
+	helper->contains_report = contains_report(in_out_message);
 
 	/* apply Autocrypt:-header */
 	if (message_time > 0
@@ -834,19 +863,16 @@ void dc_e2ee_decrypt(dc_context_t* context, struct mailmime* in_out_message,
 		if (dc_apeerstate_load_by_addr(peerstate, context->sql, from)) {
 			if (autocryptheader) {
 				dc_apeerstate_apply_header(peerstate, autocryptheader, message_time);
-				dc_apeerstate_save_to_db(peerstate, context->sql, 0/*no not create*/);
 			}
 			else {
 				if (message_time > peerstate->last_seen_autocrypt
-				 && !contains_report(in_out_message) /*reports are ususally not encrpyted; do not degrade decryption then*/){
+				 && !helper->contains_report /*reports are ususally not encrpyted; do not degrade decryption then*/){
 					dc_apeerstate_degrade_encryption(peerstate, message_time);
-					dc_apeerstate_save_to_db(peerstate, context->sql, 0/*no not create*/);
 				}
 			}
 		}
 		else if (autocryptheader) {
 			dc_apeerstate_init_from_header(peerstate, autocryptheader, message_time);
-			dc_apeerstate_save_to_db(peerstate, context->sql, 1/*create*/);
 		}
 	}
 
@@ -864,10 +890,6 @@ void dc_e2ee_decrypt(dc_context_t* context, struct mailmime* in_out_message,
 		dc_apeerstate_load_by_addr(peerstate, context->sql, from);
 	}
 
-	if (peerstate->degrade_event) {
-		dc_handle_degrade_event(context, peerstate);
-	}
-
 	// offer both, gossip and public, for signature validation.
 	// the caller may check the signature fingerprints as needed later.
 	dc_keyring_add(public_keyring_for_validate, peerstate->gossip_key);
@@ -899,14 +921,14 @@ void dc_e2ee_decrypt(dc_context_t* context, struct mailmime* in_out_message,
 
 	/* check for Autocrypt-Gossip */
 	if (gossip_headers) {
-		helper->gossipped_addr = update_gossip_peerstates(context, message_time, imffields, gossip_headers);
+		helper->gossipped_addr = collect_gossip_headers(context, helper, imffields, gossip_headers);
 	}
 
 	//mailmime_print(in_out_message);
 
 cleanup:
 	if (gossip_headers) { mailimf_fields_free(gossip_headers); }
-	dc_aheader_unref(autocryptheader);
+	if (helper==NULL || helper->autocryptheader!=autocryptheader) { dc_aheader_unref(autocryptheader); }
 	dc_apeerstate_unref(peerstate);
 	dc_keyring_unref(private_keyring);
 	dc_keyring_unref(public_keyring_for_validate);
@@ -914,3 +936,68 @@ cleanup:
 	free(self_addr);
 }
 
+
+/**
+ * Save the peerstate updates found by dc_e2ee_decrypt().
+ * This is done when the message is added to the database, so that the
+ * updates are done in the order the messages are received and inside the
+ * transaction of the message.
+ */
+void dc_e2ee_update_peerstates(dc_context_t* context, dc_e2ee_helper_t* helper)
+{
+	dc_apeerstate_t* peerstate = NULL;
+
+	if (context==NULL || context->magic!=DC_CONTEXT_MAGIC || helper==NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&context->peerstate_critical);
+
+		/* apply Autocrypt:-header */
+		if (helper->message_time > 0
+		 && helper->from)
+		{
+			peerstate = dc_apeerstate_new(context);
+			if (dc_apeerstate_load_by_addr(peerstate, context->sql, helper->from)) {
+				if (helper->autocryptheader) {
+					dc_apeerstate_apply_header(peerstate, helper->autocryptheader, helper->message_time);
+					dc_apeerstate_save_to_db(peerstate, context->sql, 0/*no not create*/);
+				}
+				else {
+					if (helper->message_time > peerstate->last_seen_autocrypt
+					 && !helper->contains_report /*reports are ususally not encrpyted; do not degrade decryption then*/){
+						dc_apeerstate_degrade_encryption(peerstate, helper->message_time);
+						dc_apeerstate_save_to_db(peerstate, context->sql, 0/*no not create*/);
+					}
+				}
+			}
+			else if (helper->autocryptheader) {
+				dc_apeerstate_init_from_header(peerstate, helper->autocryptheader, helper->message_time);
+				dc_apeerstate_save_to_db(peerstate, context->sql, 1/*create*/);
+			}
+			add_degrade_event(helper, peerstate);
+			dc_apeerstate_unref(peerstate);
+		}
+
+		/* apply Autocrypt-Gossip:-headers */
+		for (int i = 0; helper->gossip_headers && i < carray_count(helper->gossip_headers); i++)
+		{
+			dc_aheader_t* gossip_header = (dc_aheader_t*)carray_get(helper->gossip_headers, i);
+			peerstate = dc_apeerstate_new(context);
+			if (!dc_apeerstate_load_by_addr(peerstate, context->sql, gossip_header->addr)) {
+				dc_apeerstate_init_from_gossip(peerstate, gossip_header, helper->message_time);
+				dc_apeerstate_save_to_db(peerstate, context->sql, 1/*create*/);
+			}
+			else {
+				dc_apeerstate_apply_gossip(peerstate, gossip_header, helper->message_time);
+				dc_apeerstate_save_to_db(peerstate, context->sql, 0/*do not create*/);
+			}
+			add_degrade_event(helper, peerstate);
+			dc_apeerstate_unref(peerstate);
+		}
+
+	pthread_mutex_unlock(&context->peerstate_critical);
+
+	handle_degrade_events(context, helper);
+}
+
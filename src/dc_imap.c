@@ -111,6 +111,42 @@ static void set_config_lastseenuid(dc_imap_t* imap, const char* folder, uint32_t
 }
 
 
+static void get_config_modseq(dc_imap_t* imap, const char* folder, uint32_t* uidvalidity, uint64_t* modseq)
+{
+	*uidvalidity = 0;
+	*modseq = 0;
+
+	/* the entry has the format `imap.modseq.<folder>=<uidvalidity>:<highestmodseq>`,
+	the modseq is only valid together with the uidvalidity */
+	char* key = dc_mprintf("imap.modseq.%s", folder);
+	char* val1 = imap->get_config(imap, key, NULL), *val2 = NULL;
+	if (val1)
+	{
+		val2 = strchr(val1, ':');
+		if (val2)
+		{
+			*val2 = 0;
+			val2++;
+
+			*uidvalidity = atol(val1);
+			*modseq = strtoull(val2, NULL, 10);
+		}
+	}
+	free(val1); /* val2 is only a pointer inside val1 and MUST NOT be free()'d */
+	free(key);
+}
+
+
+static void set_config_modseq(dc_imap_t* imap, const char* folder, uint32_t uidvalidity, uint64_t modseq)
+{
+	char* key = dc_mprintf("imap.modseq.%s", folder);
+	char* val = dc_mprintf("%lu:%llu", (unsigned long)uidvalidity, (unsigned long long)modseq);
+	imap->set_config(imap, key, val);
+	free(val);
+	free(key);
+}
+
+
 /*******************************************************************************
  * Handle folders
  ******************************************************************************/
@@ -143,9 +179,14 @@ static int select_folder(dc_imap_t* imap, const char* folder /*may be NULL*/)
 		imap->selected_folder_needs_expunge = 0;
 	}
 
-	/* select new folder */
+	/* select new folder; with CONDSTORE, the HIGHESTMODSEQ is returned as well */
+	imap->selected_modseq = 0;
 	if (folder) {
-		int r = mailimap_select(imap->etpan, folder);
+		uint64_t start = dc_metrics_now();
+		int r = imap->has_condstore?
+			mailimap_select_condstore(imap->etpan, folder, &imap->selected_modseq) :
+			mailimap_select(imap->etpan, folder);
+		dc_metrics_add(imap->context->metrics, DC_METRIC_IMAP_SELECT, dc_metrics_now()-start);
 		if (dc_imap_is_error(imap, r) || imap->etpan->imap_selection_info==NULL) {
 			dc_log_info(imap->context, 0, "Cannot select folder; code=%i, imap_response=%s", r,
 				imap->etpan->imap_response? imap->etpan->imap_response : "<none>");
@@ -188,6 +229,29 @@ static uint32_t peek_uid(struct mailimap_msg_att* msg_att)
 }
 
 
+static uint32_t peek_size(struct mailimap_msg_att* msg_att)
+{
+	/* search the RFC822.SIZE in a list of attributes returned by a FETCH command */
+	clistiter* iter1;
+	for (iter1=clist_begin(msg_att->att_list); iter1!=NULL; iter1=clist_next(iter1))
+	{
+		struct mailimap_msg_att_item* item = (struct mailimap_msg_att_item*)clist_content(iter1);
+		if (item)
+		{
+			if (item->att_type==MAILIMAP_MSG_ATT_ITEM_STATIC)
+			{
+				if (item->att_data.att_static->att_type==MAILIMAP_MSG_ATT_RFC822_SIZE)
+				{
+					return item->att_data.att_static->att_data.att_rfc822_size;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+
 static char* unquote_rfc724_mid(const char* in)
 {
 	/* remove < and > from the given message id */
@@ -272,6 +336,33 @@ static int peek_flag_keyword(struct mailimap_msg_att* msg_att, const char* flag_
 }
 
 
+static uint64_t peek_modseq(struct mailimap_msg_att* msg_att)
+{
+	/* search MODSEQ in a list of attributes returned by a FETCH command, see RFC 7162 */
+	if (msg_att==NULL || msg_att->att_list==NULL) {
+		return 0;
+	}
+
+	clistiter* iter1;
+	for (iter1=clist_begin(msg_att->att_list); iter1!=NULL; iter1=clist_next(iter1))
+	{
+		struct mailimap_msg_att_item* item = (struct mailimap_msg_att_item*)clist_content(iter1);
+		if (item && item->att_type==MAILIMAP_MSG_ATT_ITEM_EXTENSION)
+		{
+			struct mailimap_extension_data* ext_data = item->att_data.att_extension_data;
+			if (ext_data
+			 && ext_data->ext_extension->ext_id==MAILIMAP_EXTENSION_CONDSTORE
+			 && ext_data->ext_type==MAILIMAP_CONDSTORE_TYPE_FETCH_DATA
+			 && ext_data->ext_data) {
+				return ((struct mailimap_condstore_fetch_mod_resp*)ext_data->ext_data)->cs_modseq_value;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
 static void peek_body(struct mailimap_msg_att* msg_att, char** p_msg, size_t* p_msg_bytes, uint32_t* flags, int* deleted)
 {
 	if (msg_att==NULL) {
@@ -320,6 +411,49 @@ static void peek_body(struct mailimap_msg_att* msg_att, char** p_msg, size_t* p_
 }
 
 
+static struct mailimap_set* new_uid_set(const dc_array_t* uids)
+{
+	/* build a set from the given UIDs, subsequent UIDs are combined to ranges;
+	the UIDs need not be sorted and may contain duplicates. */
+	struct mailimap_set* set = mailimap_set_new_empty();
+	dc_array_t*          sorted = dc_array_duplicate(uids);
+	size_t               i = 0;
+	size_t               cnt = dc_array_get_cnt(sorted);
+
+	dc_array_sort_ids(sorted);
+
+	for (i = 0; i < cnt; )
+	{
+		uint32_t first = dc_array_get_id(sorted, i), last = first;
+		for (i++; i < cnt && dc_array_get_id(sorted, i)<=last+1; i++) {
+			last = dc_array_get_id(sorted, i);
+		}
+		mailimap_set_add_interval(set, first, last);
+	}
+
+	dc_array_unref(sorted);
+	return set;
+}
+
+
+static void add_set_uids(dc_array_t* uids, const struct mailimap_set* set)
+{
+	/* the opposite of new_uid_set(), the order of the set is kept */
+	clistiter* cur = NULL;
+
+	if (set==NULL) {
+		return;
+	}
+
+	for (cur=clist_begin(set->set_list); cur!=NULL; cur=clist_next(cur)) {
+		struct mailimap_set_item* item = (struct mailimap_set_item*)clist_content(cur);
+		for (uint32_t uid = item->set_first; uid <= item->set_last && uid!=0; uid++) {
+			dc_array_add_id(uids, uid);
+		}
+	}
+}
+
+
 static int fetch_single_msg(dc_imap_t* imap, const char* folder, uint32_t server_uid)
 {
 	/* the function returns:
@@ -345,7 +479,9 @@ static int fetch_single_msg(dc_imap_t* imap, const char* folder, uint32_t server
 
 	{
 		struct mailimap_set* set = mailimap_set_new_single(server_uid);
+		uint64_t start = dc_metrics_now();
 			r = mailimap_uid_fetch(imap->etpan, set, imap->fetch_type_body, &fetch_result);
+		dc_metrics_add(imap->context->metrics, DC_METRIC_IMAP_FETCH_BODIES, dc_metrics_now()-start);
 		FREE_SET(set);
 	}
 
@@ -378,6 +514,257 @@ cleanup:
 }
 
 
+/* Messages that are not yet known are downloaded in batches:
+the UIDs are collected while going through the prefetched envelopes,
+sorted and split into chunks of at most DC_FETCH_BATCH_MSGS messages
+resp. DC_FETCH_BATCH_BYTES bytes (as announced by RFC822.SIZE).
+each chunk is downloaded by a single `UID FETCH <set> (FLAGS BODY.PEEK[])`
+and every message is handed to receive_imf() as soon as it is parsed
+from the stream, so there is only one round-trip per chunk.
+receive_imf() may process the messages in the background, flush_imf()
+is called at the end of each chunk. */
+#define DC_FETCH_BATCH_MSGS  100
+#define DC_FETCH_BATCH_BYTES (4*1024*1024)
+
+
+typedef struct fetch_batch_t
+{
+	dc_imap_t*   imap;
+	const char*  folder;
+	dc_array_t*  uids;      /* requested UIDs, sorted */
+	dc_array_t*  received;  /* UIDs the server has returned a body for */
+} fetch_batch_t;
+
+
+static void fetch_batch_progress(size_t current, size_t maximum, void* userdata)
+{
+	/* libEtPan calls the msg_att handler only if a progress callback is set, so we need this dummy */
+}
+
+
+static void fetch_batch_msg_att_handler(struct mailimap_msg_att* msg_att, void* userdata)
+{
+	/* called by libEtPan for every message while the FETCH response is read */
+	fetch_batch_t* batch = (fetch_batch_t*)userdata;
+	char*          msg_content = NULL;
+	size_t         msg_bytes = 0;
+	uint32_t       flags = 0;
+	int            deleted = 0;
+	uint32_t       server_uid = peek_uid(msg_att);
+
+	if (server_uid==0 || !dc_array_search_id(batch->uids, server_uid, NULL)) {
+		return; /* unsolicited FETCH response, eg. a flag update for another message */
+	}
+
+	peek_body(msg_att, &msg_content, &msg_bytes, &flags, &deleted);
+	if (msg_content==NULL) {
+		return;
+	}
+
+	dc_array_add_id(batch->received, server_uid);
+
+	if (msg_bytes <= 0 || deleted) {
+		return;
+	}
+
+	batch->imap->receive_imf(batch->imap, msg_content, msg_bytes, batch->folder, server_uid, flags);
+}
+
+
+static int fetch_batch(dc_imap_t* imap, const char* folder, dc_array_t* uids)
+{
+	/* the function returns:
+	    0  the caller should try over again later
+	or  1  if the messages should be treated as received, see fetch_single_msg() */
+	int                  r = 0;
+	int                  retry_later = 0;
+	size_t               i = 0;
+	size_t               cnt = dc_array_get_cnt(uids);
+	clist*               fetch_result = NULL;
+	struct mailimap_set* set = NULL;
+	fetch_batch_t        batch;
+	uint64_t             start = 0;
+
+	memset(&batch, 0, sizeof(fetch_batch_t));
+
+	if (imap==NULL || imap->etpan==NULL || cnt==0) {
+		goto cleanup;
+	}
+
+	batch.imap     = imap;
+	batch.folder   = folder;
+	batch.uids     = uids;
+	batch.received = dc_array_new(imap->context, cnt);
+
+	set = new_uid_set(uids);
+
+	mailimap_set_progress_callback(imap->etpan, NULL, fetch_batch_progress, NULL);
+	mailimap_set_msg_att_handler(imap->etpan, fetch_batch_msg_att_handler, &batch);
+	start = dc_metrics_now();
+	r = mailimap_uid_fetch(imap->etpan, set, imap->fetch_type_body, &fetch_result);
+	dc_metrics_add(imap->context->metrics, DC_METRIC_IMAP_FETCH_BODIES, dc_metrics_now()-start); /* includes handing over the messages to the receive pool */
+	if (imap->etpan) {
+		mailimap_set_msg_att_handler(imap->etpan, NULL, NULL);
+		mailimap_set_progress_callback(imap->etpan, NULL, NULL, NULL);
+	}
+
+	if (dc_imap_is_error(imap, r))
+	{
+		dc_log_warning(imap->context, 0, "Error #%i on fetching %i messages from folder \"%s\"; retry=%i.", (int)r, (int)cnt, folder, (int)imap->should_reconnect);
+		if (imap->should_reconnect) {
+			retry_later = 1;
+			goto cleanup;
+		}
+
+		/* the connection is fine, however, the server does not like the batch;
+		fetch the messages not yet received one by one */
+		for (i = 0; i < cnt; i++) {
+			uint32_t server_uid = dc_array_get_id(uids, i);
+			if (!dc_array_search_id(batch.received, server_uid, NULL)
+			 && fetch_single_msg(imap, folder, server_uid)==0) {
+				retry_later = 1;
+				goto cleanup;
+			}
+		}
+	}
+	else if (dc_array_get_cnt(batch.received) < cnt) {
+		/* UIDs not returned by the server do not exist (any longer), do not try to fetch them again */
+		dc_log_info(imap->context, 0, "%i of %i messages do not exist in folder \"%s\".",
+			(int)(cnt-dc_array_get_cnt(batch.received)), (int)cnt, folder);
+	}
+
+cleanup:
+	/* receive_imf() may work in the background; the caller updates lastseenuid
+	after we return, so all messages handed over must be in the database now.
+	this is also done on errors, the messages we got are fine. */
+	if (imap && imap->flush_imf) {
+		imap->flush_imf(imap);
+	}
+
+	FREE_SET(set);
+	FREE_FETCH_LIST(fetch_result);
+	dc_array_unref(batch.received);
+	return retry_later? 0 : 1;
+}
+
+
+/* Flag changes and expunges done by other clients are picked up using CONDSTORE
+resp. QRESYNC (RFC 7162): the HIGHESTMODSEQ of a folder is stored after each sync;
+`UID FETCH 1:<lastseenuid> (FLAGS) (CHANGEDSINCE <modseq> VANISHED)` then returns
+only the messages changed since that modseq and the UIDs expunged meanwhile,
+all in a single round-trip. Without QRESYNC, `VANISHED` is left out and only
+flags are synced. If the folder was just selected and its HIGHESTMODSEQ did not
+change, even this round-trip is skipped. */
+static void sync_from_single_folder(dc_imap_t* imap, const char* folder, uint32_t uidvalidity, uint32_t lastseenuid)
+{
+	int                               r = 0;
+	uint32_t                          modseq_uidvalidity = 0;
+	uint64_t                          modseq = 0;
+	uint64_t                          new_modseq = 0;
+	uint64_t                          selected_modseq = imap->selected_modseq;
+	clist*                            fetch_result = NULL;
+	struct mailimap_qresync_vanished* vanished = NULL;
+	struct mailimap_set*              set = NULL;
+	dc_array_t*                       seen_uids = NULL;
+	dc_array_t*                       expunged_uid_ranges = NULL;
+	clistiter*                        cur = NULL;
+
+	imap->selected_modseq = 0; /* if the folder stays selected, the value gets outdated */
+
+	if (!imap->has_condstore || imap->sync_imf==NULL || imap->etpan==NULL || lastseenuid==0) {
+		goto cleanup;
+	}
+
+	get_config_modseq(imap, folder, &modseq_uidvalidity, &modseq);
+	if (modseq_uidvalidity!=uidvalidity || modseq==0)
+	{
+		/* first sync or UIDVALIDITY has changed: nothing to compare against, start from the current state */
+		if (selected_modseq) {
+			set_config_modseq(imap, folder, uidvalidity, selected_modseq);
+			dc_log_info(imap->context, 0, "modseq initialized to %llu for %s@%i", (unsigned long long)selected_modseq, folder, (int)uidvalidity);
+		}
+		goto cleanup;
+	}
+
+	if (selected_modseq && selected_modseq<=modseq) {
+		goto cleanup; /* nothing changed since the last sync */
+	}
+
+	set = mailimap_set_new_interval(1, lastseenuid);
+	uint64_t start = dc_metrics_now();
+	if (imap->qresync_enabled) {
+		r = mailimap_uid_fetch_qresync(imap->etpan, set, imap->fetch_type_flags, modseq, &fetch_result, &vanished);
+	}
+	else {
+		r = mailimap_uid_fetch_changedsince(imap->etpan, set, imap->fetch_type_flags, modseq, &fetch_result);
+	}
+	dc_metrics_add(imap->context->metrics, DC_METRIC_IMAP_FETCH_FLAGS, dc_metrics_now()-start);
+
+	if (dc_imap_is_error(imap, r)) {
+		fetch_result = NULL;
+		vanished = NULL;
+		dc_log_warning(imap->context, 0, "Cannot sync flags of folder \"%s\"; code=%i.", folder, (int)r);
+		goto cleanup;
+	}
+
+	new_modseq = DC_MAX(modseq, selected_modseq);
+	seen_uids = dc_array_new(imap->context, 16);
+	expunged_uid_ranges = dc_array_new(imap->context, 16);
+
+	for (cur=clist_begin(fetch_result); cur!=NULL; cur=clist_next(cur))
+	{
+		struct mailimap_msg_att* msg_att = (struct mailimap_msg_att*)clist_content(cur);
+		uint32_t server_uid = peek_uid(msg_att);
+		char*    dummy_msg = NULL;
+		size_t   dummy_bytes = 0;
+		uint32_t flags = 0;
+		int      deleted = 0;
+
+		new_modseq = DC_MAX(new_modseq, peek_modseq(msg_att));
+
+		if (server_uid==0 || server_uid>lastseenuid) {
+			continue; /* new messages are fetched with their flags by fetch_from_single_folder() */
+		}
+
+		peek_body(msg_att, &dummy_msg, &dummy_bytes, &flags, &deleted);
+		if (flags&DC_IMAP_SEEN) {
+			dc_array_add_id(seen_uids, server_uid);
+		}
+	}
+
+	if (vanished && vanished->qr_known_uids)
+	{
+		for (cur=clist_begin(vanished->qr_known_uids->set_list); cur!=NULL; cur=clist_next(cur))
+		{
+			struct mailimap_set_item* item = (struct mailimap_set_item*)clist_content(cur);
+			uint32_t first = DC_MIN(item->set_first, item->set_last);
+			uint32_t last  = DC_MAX(item->set_first, item->set_last);
+			dc_array_add_id(expunged_uid_ranges, first);
+			dc_array_add_id(expunged_uid_ranges, last);
+		}
+	}
+
+	if (dc_array_get_cnt(seen_uids) || dc_array_get_cnt(expunged_uid_ranges)) {
+		dc_log_info(imap->context, 0, "%i messages seen and %i UID ranges expunged in \"%s\" by other clients.",
+			(int)dc_array_get_cnt(seen_uids), (int)dc_array_get_cnt(expunged_uid_ranges)/2, folder);
+		imap->sync_imf(imap, folder, seen_uids, expunged_uid_ranges);
+	}
+
+	if (new_modseq > modseq) {
+		set_config_modseq(imap, folder, uidvalidity, new_modseq);
+	}
+
+cleanup:
+	FREE_SET(set);
+	FREE_FETCH_LIST(fetch_result);
+	if (vanished) {
+		mailimap_qresync_vanished_free(vanished);
+	}
+	dc_array_unref(seen_uids);
+	dc_array_unref(expunged_uid_ranges);
+}
+
+
 static int fetch_from_single_folder(dc_imap_t* imap, const char* folder)
 {
 	int                  r;
@@ -389,6 +776,13 @@ static int fetch_from_single_folder(dc_imap_t* imap, const char* folder)
 	size_t               read_errors = 0;
 	clistiter*           cur;
 	struct mailimap_set* set = NULL;
+	dc_array_t*          uids_to_fetch = NULL;
+	dc_array_t*          chunk = NULL;
+	size_t               i = 0;
+	size_t               cnt = 0;
+	dc_hash_t            sizes;
+
+	dc_hash_init(&sizes, DC_HASH_INT, 0);
 
 	if (imap==NULL) {
 		goto cleanup;
@@ -435,7 +829,9 @@ static int fetch_from_single_folder(dc_imap_t* imap, const char* folder)
 			dc_log_info(imap->context, 0, "EXISTS is missing for folder \"%s\", using fallback.", folder);
 			set = mailimap_set_new_single(0);
 		}
+		uint64_t start = dc_metrics_now();
 		r = mailimap_fetch(imap->etpan, set, imap->fetch_type_prefetch, &fetch_result);
+		dc_metrics_add(imap->context->metrics, DC_METRIC_IMAP_FETCH_HEADERS, dc_metrics_now()-start);
 		FREE_SET(set);
 
 		if (dc_imap_is_error(imap, r) || fetch_result==NULL) {
@@ -468,10 +864,15 @@ static int fetch_from_single_folder(dc_imap_t* imap, const char* folder)
 		dc_log_info(imap->context, 0, "lastseenuid initialized to %i for %s@%i", (int)lastseenuid, folder, (int)uidvalidity);
 	}
 
+	/* apply changes done by other clients to the messages already known */
+	sync_from_single_folder(imap, folder, uidvalidity, lastseenuid);
+
 	/* fetch messages with larger UID than the last one seen (`UID FETCH lastseenuid+1:*)`, see RFC 4549 */
 	/* CAVE: some servers return UID smaller or equal to the requested ones under some circumstances! */
 	set = mailimap_set_new_interval(lastseenuid+1, 0);
+	uint64_t start = dc_metrics_now();
 		r = mailimap_uid_fetch(imap->etpan, set, imap->fetch_type_prefetch, &fetch_result);
+	dc_metrics_add(imap->context->metrics, DC_METRIC_IMAP_FETCH_HEADERS, dc_metrics_now()-start);
 	FREE_SET(set);
 
 	if (dc_imap_is_error(imap, r) || fetch_result==NULL)
@@ -485,7 +886,9 @@ static int fetch_from_single_folder(dc_imap_t* imap, const char* folder)
 		goto cleanup;
 	}
 
-	/* go through all mails in folder (this is typically _fast_ as we already have the whole list) */
+	/* go through all mails in folder (this is typically _fast_ as we already have the whole list)
+	and collect the messages that have to be downloaded */
+	uids_to_fetch = dc_array_new(imap->context, 128);
 	for (cur = clist_begin(fetch_result); cur!=NULL ; cur = clist_next(cur))
 	{
 		struct mailimap_msg_att* msg_att = (struct mailimap_msg_att*)clist_content(cur); /* mailimap_msg_att is a list of attributes: list is a list of message attributes */
@@ -496,10 +899,8 @@ static int fetch_from_single_folder(dc_imap_t* imap, const char* folder)
 
 			read_cnt++;
 			if (!imap->precheck_imf(imap, rfc724_mid, folder, cur_uid)) {
-				if (fetch_single_msg(imap, folder, cur_uid)==0/* 0=try again later*/) {
-					dc_log_info(imap->context, 0, "Read error for message %s from \"%s\", trying over later.", rfc724_mid, folder);
-					read_errors++; // with read_errors, lastseenuid is not written
-				}
+				dc_array_add_id(uids_to_fetch, cur_uid);
+				dc_hash_insert(&sizes, NULL, cur_uid, (void*)(uintptr_t)peek_size(msg_att));
 			}
 			else {
 				dc_log_info(imap->context, 0, "Skipping message %s from \"%s\" by precheck.", rfc724_mid, folder);
@@ -512,10 +913,41 @@ static int fetch_from_single_folder(dc_imap_t* imap, const char* folder)
 			free(rfc724_mid);
 		}
 	}
+	FREE_FETCH_LIST(fetch_result);
+
+	/* download the messages in chunks, ordered by UID. as all UIDs below the first UID
+	of a chunk are done when the chunk is started, lastseenuid can be increased
+	after each chunk; on errors, the failed chunk is tried over later. */
+	dc_array_sort_ids(uids_to_fetch);
+	chunk = dc_array_new(imap->context, DC_FETCH_BATCH_MSGS);
+	cnt = dc_array_get_cnt(uids_to_fetch);
+	while (i < cnt)
+	{
+		size_t chunk_bytes = 0;
+		dc_array_empty(chunk);
+		while (i < cnt
+		 && dc_array_get_cnt(chunk) < DC_FETCH_BATCH_MSGS
+		 && (dc_array_get_cnt(chunk)==0 || chunk_bytes < DC_FETCH_BATCH_BYTES))
+		{
+			uint32_t cur_uid = dc_array_get_id(uids_to_fetch, i++);
+			dc_array_add_id(chunk, cur_uid);
+			chunk_bytes += (uintptr_t)dc_hash_find(&sizes, NULL, cur_uid);
+		}
+
+		if (fetch_batch(imap, folder, chunk)==0/* 0=try again later*/) {
+			dc_log_info(imap->context, 0, "Read error for %i messages from \"%s\", trying over later.", (int)dc_array_get_cnt(chunk), folder);
+			read_errors += dc_array_get_cnt(chunk);
+			new_lastseenuid = dc_array_get_id(chunk, 0)-1;
+			break;
+		}
+
+		if (i < cnt && dc_array_get_id(uids_to_fetch, i)-1 > lastseenuid) {
+			lastseenuid = dc_array_get_id(uids_to_fetch, i)-1;
+			set_config_lastseenuid(imap, folder, uidvalidity, lastseenuid);
+		}
+	}
 
-	if (!read_errors && new_lastseenuid > 0) {
-		// TODO: it might be better to increase the lastseenuid also on partial errors.
-		// however, this requires to sort the list before going through it above.
+	if (new_lastseenuid > lastseenuid) {
 		set_config_lastseenuid(imap, folder, uidvalidity, new_lastseenuid);
 	}
 
@@ -530,6 +962,9 @@ cleanup:
 	}
 
 	FREE_FETCH_LIST(fetch_result);
+	dc_array_unref(uids_to_fetch);
+	dc_array_unref(chunk);
+	dc_hash_clear(&sizes);
 	return read_cnt;
 }
 
@@ -708,6 +1143,145 @@ void dc_imap_interrupt_idle(dc_imap_t* imap)
 }
 
 
+/*******************************************************************************
+ * Traffic counting
+ ******************************************************************************/
+
+
+/* a pass-through mailstream_low driver that adds the bytes read and written
+to the counters of the dc_imap_t object.  one counter is put directly above the
+socket/tls layer and counts the bytes on the wire; if COMPRESS=DEFLATE is
+used, a second one is put above the compression layer and counts the payload. */
+#define DC_COUNT_WIRE    0x01
+#define DC_COUNT_PAYLOAD 0x02
+
+typedef struct dc_counter_data_t
+{
+	mailstream_low* inner;
+	dc_imap_t*      imap;
+	int             what;
+} dc_counter_data_t;
+
+
+static ssize_t counter_read(mailstream_low* s, void* buf, size_t count)
+{
+	dc_counter_data_t* data = s->data;
+	ssize_t r = mailstream_low_read(data->inner, buf, count);
+	if (r > 0) {
+		if (data->what&DC_COUNT_WIRE)    { data->imap->net_bytes_received += r; }
+		if (data->what&DC_COUNT_PAYLOAD) { data->imap->bytes_received += r; }
+	}
+	return r;
+}
+
+
+static ssize_t counter_write(mailstream_low* s, const void* buf, size_t count)
+{
+	dc_counter_data_t* data = s->data;
+	ssize_t r = mailstream_low_write(data->inner, buf, count);
+	if (r > 0) {
+		if (data->what&DC_COUNT_WIRE)    { data->imap->net_bytes_sent += r; }
+		if (data->what&DC_COUNT_PAYLOAD) { data->imap->bytes_sent += r; }
+	}
+	return r;
+}
+
+
+static int counter_close(mailstream_low* s)
+{
+	return mailstream_low_close(((dc_counter_data_t*)s->data)->inner);
+}
+
+
+static int counter_get_fd(mailstream_low* s)
+{
+	return mailstream_low_get_fd(((dc_counter_data_t*)s->data)->inner);
+}
+
+
+static void counter_free(mailstream_low* s)
+{
+	dc_counter_data_t* data = s->data;
+	mailstream_low_free(data->inner);
+	free(data);
+	free(s);
+}
+
+
+static void counter_cancel(mailstream_low* s)
+{
+	mailstream_low_cancel(((dc_counter_data_t*)s->data)->inner);
+}
+
+
+static struct mailstream_cancel* counter_get_cancel(mailstream_low* s)
+{
+	return mailstream_low_get_cancel(((dc_counter_data_t*)s->data)->inner);
+}
+
+
+static carray* counter_get_certificate_chain(mailstream_low* s)
+{
+	return mailstream_low_get_certificate_chain(((dc_counter_data_t*)s->data)->inner);
+}
+
+
+static int counter_setup_idle(mailstream_low* s)
+{
+	return mailstream_low_setup_idle(((dc_counter_data_t*)s->data)->inner);
+}
+
+
+static int counter_unsetup_idle(mailstream_low* s)
+{
+	return mailstream_low_unsetup_idle(((dc_counter_data_t*)s->data)->inner);
+}
+
+
+static int counter_interrupt_idle(mailstream_low* s)
+{
+	return mailstream_low_interrupt_idle(((dc_counter_data_t*)s->data)->inner);
+}
+
+
+static mailstream_low_driver counter_driver = {
+	counter_read,
+	counter_write,
+	counter_close,
+	counter_get_fd,
+	counter_free,
+	counter_cancel,
+	counter_get_cancel,
+	counter_get_certificate_chain,
+	counter_setup_idle,
+	counter_unsetup_idle,
+	counter_interrupt_idle
+};
+
+
+static int add_counter(dc_imap_t* imap, int what)
+{
+	mailstream*        stream = imap->etpan->imap_stream;
+	dc_counter_data_t* data = NULL;
+	mailstream_low*    low = NULL;
+
+	if ((data=calloc(1, sizeof(dc_counter_data_t)))==NULL) {
+		return 0;
+	}
+	data->inner = mailstream_get_low(stream);
+	data->imap  = imap;
+	data->what  = what;
+
+	if ((low=mailstream_low_new(data, &counter_driver))==NULL) {
+		free(data);
+		return 0;
+	}
+	mailstream_low_set_timeout(low, mailstream_low_get_timeout(data->inner));
+	mailstream_set_low(stream, low);
+	return 1;
+}
+
+
 /*******************************************************************************
  * Setup handle
  ******************************************************************************/
@@ -715,8 +1289,9 @@ void dc_imap_interrupt_idle(dc_imap_t* imap)
 
 static int setup_handle_if_needed(dc_imap_t* imap)
 {
-	int r = 0;
-	int success = 0;
+	int      r = 0;
+	int      success = 0;
+	uint64_t start = 0;
 
 	if (imap==NULL || imap->imap_server==NULL) {
 		goto cleanup;
@@ -731,6 +1306,7 @@ static int setup_handle_if_needed(dc_imap_t* imap)
 		goto cleanup;
     }
 
+	start = dc_metrics_now();
 	imap->etpan = mailimap_new(0, NULL);
 
 	mailimap_set_timeout(imap->etpan, DC_IMAP_TIMEOUT_SEC);
@@ -770,6 +1346,9 @@ static int setup_handle_if_needed(dc_imap_t* imap)
 		dc_log_info(imap->context, 0, "IMAP-server %s:%i SSL-connected.", imap->imap_server, (int)imap->imap_port);
 	}
 
+	/* until COMPRESS=DEFLATE is enabled, the bytes on the wire are the payload */
+	add_counter(imap, DC_COUNT_WIRE|DC_COUNT_PAYLOAD);
+
 	/* from mailcore2/MCIMAPSession.cpp */
 	if (imap->server_flags&DC_LP_AUTH_OAUTH2)
 	{
@@ -798,9 +1377,66 @@ static int setup_handle_if_needed(dc_imap_t* imap)
 		goto cleanup;
 	}
 
+	dc_metrics_add(imap->context->metrics, DC_METRIC_IMAP_CONNECT, dc_metrics_now()-start);
+
 	dc_log_event(imap->context, DC_EVENT_IMAP_CONNECTED, 0,
                  "IMAP-login as %s ok.", imap->imap_user);
 
+	if (mailimap_has_compress_deflate(imap->etpan))
+	{
+		char* val = imap->get_config(imap, "imap_compress", NULL);
+		int   use_compress = val? atoi(val) : DC_IMAP_COMPRESS_DEFAULT;
+		free(val);
+
+		if (use_compress)
+		{
+			mailstream_low* wire = mailstream_get_low(imap->etpan->imap_stream);
+			r = mailimap_compress(imap->etpan);
+			if (!dc_imap_is_error(imap, r)) {
+				if (wire->driver==&counter_driver) {
+					((dc_counter_data_t*)wire->data)->what = DC_COUNT_WIRE;
+				}
+				add_counter(imap, DC_COUNT_PAYLOAD);
+				imap->compress = 1;
+				dc_log_info(imap->context, 0, "IMAP-COMPRESS=DEFLATE enabled.");
+			}
+			else if (imap->should_reconnect) {
+				goto cleanup;
+			}
+			else {
+				dc_log_warning(imap->context, 0, "IMAP-COMPRESS=DEFLATE failed, continuing uncompressed.");
+			}
+		}
+	}
+
+	/* QRESYNC must be enabled for each session before it can be used, see RFC 7162 */
+	imap->qresync_enabled = 0;
+	if (mailimap_has_qresync(imap->etpan) && mailimap_has_enable(imap->etpan))
+	{
+		struct mailimap_capability_data* caps = NULL;
+		struct mailimap_capability_data* enabled = NULL;
+		clist* cap_list = clist_new();
+		clist_append(cap_list, mailimap_capability_new(MAILIMAP_CAPABILITY_NAME, NULL, dc_strdup("QRESYNC")));
+		caps = mailimap_capability_data_new(cap_list);
+		r = mailimap_enable(imap->etpan, caps, &enabled);
+		if (!dc_imap_is_error(imap, r) && enabled && enabled->cap_list) {
+			clistiter* cur;
+			for (cur=clist_begin(enabled->cap_list); cur!=NULL; cur=clist_next(cur)) {
+				struct mailimap_capability* cap = clist_content(cur);
+				if (cap && cap->cap_type==MAILIMAP_CAPABILITY_NAME && strcasecmp(cap->cap_data.cap_name, "QRESYNC")==0) {
+					imap->qresync_enabled = 1;
+				}
+			}
+		}
+		mailimap_capability_data_free(caps);
+		if (enabled) {
+			mailimap_capability_data_free(enabled);
+		}
+		if (imap->should_reconnect) {
+			goto cleanup;
+		}
+	}
+
 	success = 1;
 
 cleanup:
@@ -834,10 +1470,15 @@ static void unsetup_handle(dc_imap_t* imap)
 		mailimap_free(imap->etpan);
 		imap->etpan = NULL;
 
-		dc_log_info(imap->context, 0, "IMAP disconnected.");
+		dc_log_info(imap->context, 0, "IMAP disconnected. Traffic so far: %llu bytes received, %llu on the wire; %llu bytes sent, %llu on the wire.",
+			(unsigned long long)imap->bytes_received, (unsigned long long)imap->net_bytes_received,
+			(unsigned long long)imap->bytes_sent, (unsigned long long)imap->net_bytes_sent);
 	}
 
 	imap->selected_folder[0] = 0;
+	imap->selected_modseq = 0;
+	imap->qresync_enabled = 0;
+	imap->compress = 0;
 
 	/* we leave sent_folder set; normally this does not change in a normal reconnect; we'll update this folder if we get errors */
 }
@@ -869,6 +1510,7 @@ static void free_connect_param(dc_imap_t* imap)
 	imap->imap_port = 0;
 	imap->can_idle  = 0;
 	imap->has_xlist = 0;
+	imap->has_condstore = 0;
 }
 
 
@@ -900,6 +1542,7 @@ int dc_imap_connect(dc_imap_t* imap, const dc_loginparam_t* lp)
 	/* we set the following flags here and not in setup_handle_if_needed() as they must not change during connection */
 	imap->can_idle = mailimap_has_idle(imap->etpan);
 	imap->has_xlist = mailimap_has_xlist(imap->etpan);
+	imap->has_condstore = mailimap_has_condstore(imap->etpan) || imap->qresync_enabled; /* QRESYNC implies CONDSTORE */
 
 	#ifdef __APPLE__
 	imap->can_idle = 0; // HACK to force iOS not to work IMAP-IDLE which does not work for now, see also (*)
@@ -978,7 +1621,7 @@ void dc_imap_set_watch_folder(dc_imap_t* imap, const char* watch_folder)
 
 
 dc_imap_t* dc_imap_new(dc_get_config_t get_config, dc_set_config_t set_config,
-                       dc_precheck_imf_t precheck_imf, dc_receive_imf_t receive_imf,
+                       dc_precheck_imf_t precheck_imf, dc_receive_imf_t receive_imf, dc_flush_imf_t flush_imf, dc_sync_imf_t sync_imf,
                        void* userData, dc_context_t* context)
 {
 	dc_imap_t* imap = NULL;
@@ -994,6 +1637,8 @@ dc_imap_t* dc_imap_new(dc_get_config_t get_config, dc_set_config_t set_config,
 	imap->set_config     = set_config;
 	imap->precheck_imf   = precheck_imf;
 	imap->receive_imf    = receive_imf;
+	imap->flush_imf      = flush_imf;
+	imap->sync_imf       = sync_imf;
 	imap->userData       = userData;
 
 	pthread_mutex_init(&imap->watch_condmutex, NULL);
@@ -1016,6 +1661,7 @@ dc_imap_t* dc_imap_new(dc_get_config_t get_config, dc_set_config_t set_config,
 	imap->fetch_type_prefetch = mailimap_fetch_type_new_fetch_att_list_empty();
 	mailimap_fetch_type_new_fetch_att_list_add(imap->fetch_type_prefetch, mailimap_fetch_att_new_uid());
 	mailimap_fetch_type_new_fetch_att_list_add(imap->fetch_type_prefetch, mailimap_fetch_att_new_envelope());
+	mailimap_fetch_type_new_fetch_att_list_add(imap->fetch_type_prefetch, mailimap_fetch_att_new_rfc822_size());
 
 	// object to fetch flags and body
 	imap->fetch_type_body = mailimap_fetch_type_new_fetch_att_list_empty();
@@ -1049,14 +1695,14 @@ void dc_imap_unref(dc_imap_t* imap)
 }
 
 
-static int add_flag(dc_imap_t* imap, uint32_t server_uid, struct mailimap_flag* flag)
+static int add_flag(dc_imap_t* imap, struct mailimap_set* set, struct mailimap_flag* flag)
 {
 	int                              r = 0;
 	struct mailimap_flag_list*       flag_list = NULL;
 	struct mailimap_store_att_flags* store_att_flags = NULL;
-	struct mailimap_set*             set = mailimap_set_new_single(server_uid);
 
-	if (imap==NULL || imap->etpan==NULL) {
+	if (imap==NULL || imap->etpan==NULL || set==NULL) {
+		mailimap_flag_free(flag);
 		goto cleanup;
 	}
 
@@ -1065,7 +1711,9 @@ static int add_flag(dc_imap_t* imap, uint32_t server_uid, struct mailimap_flag*
 
 	store_att_flags = mailimap_store_att_flags_new_add_flags(flag_list); /* FLAGS.SILENT does not return the new value */
 
+	uint64_t start = dc_metrics_now();
 	r = mailimap_uid_store(imap->etpan, set, store_att_flags);
+	dc_metrics_add(imap->context->metrics, DC_METRIC_IMAP_STORE, dc_metrics_now()-start);
 	if (dc_imap_is_error(imap, r)) {
 		goto cleanup;
 	}
@@ -1074,70 +1722,99 @@ cleanup:
 	if (store_att_flags) {
 		mailimap_store_att_flags_free(store_att_flags);
 	}
-	FREE_SET(set);
-	return imap->should_reconnect? 0 : 1; /* all non-connection states are treated as success - the mail may already be deleted or moved away on the server */
+	return (imap==NULL || imap->should_reconnect)? 0 : 1; /* all non-connection states are treated as success - the mail may already be deleted or moved away on the server */
 }
 
 
-dc_imap_res dc_imap_move(dc_imap_t* imap, const char* folder, uint32_t uid,
-                         const char* dest_folder, uint32_t* dest_uid)
+/* The following functions work on a set of messages in one folder, so that
+jobs of the same kind need only one round-trip per folder, see dc_job_perform().
+The functions for single messages are just wrappers. */
+
+
+/**
+ * Move messages to another folder.
+ * If the server supports UIDPLUS, the new UIDs are added to dest_uids
+ * in the order of the given UIDs; UIDs not reported by the server are added as 0.
+ *
+ * @private @memberof dc_imap_t
+ */
+dc_imap_res dc_imap_move_uids(dc_imap_t* imap, const char* folder, const dc_array_t* uids,
+                              const char* dest_folder, dc_array_t* dest_uids)
 {
 	dc_imap_res          res = DC_RETRY_LATER;
 	int                  r = 0;
-	struct mailimap_set* set = mailimap_set_new_single(uid);
-	uint32_t             res_uid = 0;
+	size_t               i = 0;
+	size_t               cnt = dc_array_get_cnt(uids);
+	struct mailimap_set* set = NULL;
+	uint32_t             res_uidvalidity = 0;
 	struct mailimap_set* res_setsrc = NULL;
 	struct mailimap_set* res_setdest = NULL;
+	dc_array_t*          src_uids = NULL;
+	dc_array_t*          moved_uids = NULL;
 
-	if (imap==NULL || folder==NULL || uid==0
-	 || dest_folder==NULL || dest_uid==NULL || set==NULL) {
+	if (imap==NULL || folder==NULL || cnt==0
+	 || dest_folder==NULL || dest_uids==NULL) {
 		res = DC_FAILED;
 		goto cleanup;
 	}
 
-    if (strcasecmp(folder, dest_folder)==0) {
-		dc_log_info(imap->context, 0, "Skip moving message; message %s/%i is already in %s...", folder, (int)uid, dest_folder);
+	if (strcasecmp(folder, dest_folder)==0) {
+		dc_log_info(imap->context, 0, "Skip moving %i message(s); already in %s...", (int)cnt, dest_folder);
 		res = DC_ALREADY_DONE;
 		goto cleanup;
-    }
+	}
 
-	dc_log_info(imap->context, 0, "Moving message %s/%i to %s...", folder, (int)uid, dest_folder);
+	dc_log_info(imap->context, 0, "Moving %i message(s) from %s to %s...", (int)cnt, folder, dest_folder);
 
 	if (select_folder(imap, folder)==0) {
-		dc_log_warning(imap->context, 0, "Cannot select folder %s for moving message.", folder);
+		dc_log_warning(imap->context, 0, "Cannot select folder %s for moving messages.", folder);
 		goto cleanup;
 	}
 
+	set = new_uid_set(uids);
+
 	/* TODO/TOCHECK: UIDPLUS extension may not be supported on servers;
 	if in doubt, we can find out the resulting UID using "imap_selection_info->sel_uidnext" then */
 
-	r = mailimap_uidplus_uid_move(imap->etpan, set, dest_folder, &res_uid, &res_setsrc, &res_setdest);
+	uint64_t start = dc_metrics_now();
+	r = mailimap_uidplus_uid_move(imap->etpan, set, dest_folder, &res_uidvalidity, &res_setsrc, &res_setdest);
 	if (dc_imap_is_error(imap, r)) {
 		FREE_SET(res_setsrc);
 		FREE_SET(res_setdest);
-		dc_log_info(imap->context, 0, "Cannot move message, fallback to COPY/DELETE %s/%i to %s...", folder, (int)uid, dest_folder);
-		r = mailimap_uidplus_uid_copy(imap->etpan, set, dest_folder, &res_uid, &res_setsrc, &res_setdest);
+		dc_log_info(imap->context, 0, "Cannot move messages, fallback to COPY/DELETE %s to %s...", folder, dest_folder);
+		r = mailimap_uidplus_uid_copy(imap->etpan, set, dest_folder, &res_uidvalidity, &res_setsrc, &res_setdest);
 		if (dc_imap_is_error(imap, r)) {
-			dc_log_info(imap->context, 0, "Cannot copy message.");
+			dc_log_info(imap->context, 0, "Cannot copy messages.");
 			goto cleanup;
 		}
 		else {
-			if (add_flag(imap, uid, mailimap_flag_new_deleted())==0) {
-				dc_log_warning(imap->context, 0, "Cannot mark message as \"Deleted\".");
+			if (add_flag(imap, set, mailimap_flag_new_deleted())==0) {
+				dc_log_warning(imap->context, 0, "Cannot mark messages as \"Deleted\".");
 			}
 
 			// force an EXPUNGE resp. CLOSE for the selected folder
 			imap->selected_folder_needs_expunge = 1;
 		}
 	}
+	dc_metrics_add(imap->context->metrics, DC_METRIC_IMAP_MOVE, dc_metrics_now()-start);
 
-	if (res_setdest) {
-		clistiter* cur = clist_begin(res_setdest->set_list);
-		if (cur!=NULL) {
-			struct mailimap_set_item* item;
-			item = clist_content(cur);
-			*dest_uid = item->set_first;
+	/* COPYUID lists the source and the destination UIDs in the same order (RFC 4315) */
+	src_uids = dc_array_new(imap->context, cnt);
+	moved_uids = dc_array_new(imap->context, cnt);
+	add_set_uids(src_uids, res_setsrc);
+	add_set_uids(moved_uids, res_setdest);
+
+	for (i = 0; i < cnt; i++) {
+		size_t index = 0;
+		uint32_t dest_uid = 0;
+		if (dc_array_search_id(src_uids, dc_array_get_id(uids, i), &index)
+		 && index < dc_array_get_cnt(moved_uids)) {
+			dest_uid = dc_array_get_id(moved_uids, index);
+		}
+		else if (res_setsrc==NULL && cnt==1 && dc_array_get_cnt(moved_uids)==1) {
+			dest_uid = dc_array_get_id(moved_uids, 0);
 		}
+		dc_array_add_id(dest_uids, dest_uid);
 	}
 
 	res = DC_SUCCESS;
@@ -1146,16 +1823,51 @@ cleanup:
 	FREE_SET(set);
 	FREE_SET(res_setsrc);
 	FREE_SET(res_setdest);
+	dc_array_unref(src_uids);
+	dc_array_unref(moved_uids);
 	return res==DC_RETRY_LATER?
 		(imap->should_reconnect? DC_RETRY_LATER : DC_FAILED) : res;
 }
 
 
-dc_imap_res dc_imap_set_seen(dc_imap_t* imap, const char* folder, uint32_t uid)
+dc_imap_res dc_imap_move(dc_imap_t* imap, const char* folder, uint32_t uid,
+                         const char* dest_folder, uint32_t* dest_uid)
 {
-	dc_imap_res res = DC_RETRY_LATER;
+	dc_imap_res res = DC_FAILED;
+	dc_array_t* uids = NULL;
+	dc_array_t* dest_uids = NULL;
+
+	if (imap==NULL || uid==0 || dest_uid==NULL) {
+		goto cleanup;
+	}
+
+	uids = dc_array_new(imap->context, 1);
+	dest_uids = dc_array_new(imap->context, 1);
+	dc_array_add_id(uids, uid);
+
+	res = dc_imap_move_uids(imap, folder, uids, dest_folder, dest_uids);
+	if (res==DC_SUCCESS) {
+		*dest_uid = dc_array_get_id(dest_uids, 0);
+	}
+
+cleanup:
+	dc_array_unref(uids);
+	dc_array_unref(dest_uids);
+	return res;
+}
+
 
-	if (imap==NULL || folder==NULL || uid==0) {
+/**
+ * Add the \Seen flag to messages.
+ *
+ * @private @memberof dc_imap_t
+ */
+dc_imap_res dc_imap_set_seen_uids(dc_imap_t* imap, const char* folder, const dc_array_t* uids)
+{
+	dc_imap_res          res = DC_RETRY_LATER;
+	struct mailimap_set* set = NULL;
+
+	if (imap==NULL || folder==NULL || dc_array_get_cnt(uids)==0) {
 		res = DC_FAILED;
 		goto cleanup;
 	}
@@ -1164,26 +1876,47 @@ dc_imap_res dc_imap_set_seen(dc_imap_t* imap, const char* folder, uint32_t uid)
 		goto cleanup;
 	}
 
-	dc_log_info(imap->context, 0, "Marking message %s/%i as seen...", folder, (int)uid);
+	dc_log_info(imap->context, 0, "Marking %i message(s) in %s as seen...", (int)dc_array_get_cnt(uids), folder);
 
 	if (select_folder(imap, folder)==0) {
 		dc_log_warning(imap->context, 0, "Cannot select folder %s for setting SEEN flag.", folder);
 		goto cleanup;
 	}
 
-	if (add_flag(imap, uid, mailimap_flag_new_seen())==0) {
-		dc_log_warning(imap->context, 0, "Cannot mark message as seen.");
+	set = new_uid_set(uids);
+	if (add_flag(imap, set, mailimap_flag_new_seen())==0) {
+		dc_log_warning(imap->context, 0, "Cannot mark messages as seen.");
 		goto cleanup;
 	}
 
 	res = DC_SUCCESS;
 
 cleanup:
+	FREE_SET(set);
 	return res==DC_RETRY_LATER?
 		(imap->should_reconnect? DC_RETRY_LATER : DC_FAILED) : res;
 }
 
 
+dc_imap_res dc_imap_set_seen(dc_imap_t* imap, const char* folder, uint32_t uid)
+{
+	dc_imap_res res = DC_FAILED;
+	dc_array_t* uids = NULL;
+
+	if (imap==NULL || uid==0) {
+		goto cleanup;
+	}
+
+	uids = dc_array_new(imap->context, 1);
+	dc_array_add_id(uids, uid);
+	res = dc_imap_set_seen_uids(imap, folder, uids);
+
+cleanup:
+	dc_array_unref(uids);
+	return res;
+}
+
+
 dc_imap_res dc_imap_set_mdnsent(dc_imap_t* imap, const char* folder, uint32_t uid)
 {
 	// returns 0=job should be retried later, 1=job done, 2=job done and flag just set
@@ -1237,7 +1970,9 @@ dc_imap_res dc_imap_set_mdnsent(dc_imap_t* imap, const char* folder, uint32_t ui
 
 	if (can_create_flag)
 	{
+		uint64_t start = dc_metrics_now();
 		int r = mailimap_uid_fetch(imap->etpan, set, imap->fetch_type_flags, &fetch_result);
+		dc_metrics_add(imap->context->metrics, DC_METRIC_IMAP_FETCH_FLAGS, dc_metrics_now()-start);
 		if (dc_imap_is_error(imap, r) || fetch_result==NULL) {
 			fetch_result = NULL;
 			goto cleanup;
@@ -1252,7 +1987,7 @@ dc_imap_res dc_imap_set_mdnsent(dc_imap_t* imap, const char* folder, uint32_t ui
 			res = DC_ALREADY_DONE;
 		}
 		else {
-			if (add_flag(imap, uid, mailimap_flag_new_flag_keyword(dc_strdup("$MDNSent")))==0) {
+			if (add_flag(imap, set, mailimap_flag_new_flag_keyword(dc_strdup("$MDNSent")))==0) {
 				goto cleanup;
 			}
 			res = DC_SUCCESS;
@@ -1274,56 +2009,91 @@ cleanup:
 }
 
 
-int dc_imap_delete_msg(dc_imap_t* imap, const char* rfc724_mid, const char* folder, uint32_t server_uid)
+/**
+ * Mark messages for deletion.
+ * Before, it is checked that the UIDs still match the given Message-IDs
+ * (to detect if the messages were moved around by other MUAs and in place of an UIDVALIDITY check);
+ * messages that do not match are skipped.
+ * rfc724_mids is an array of pointers to the Message-IDs, in the order of the UIDs.
+ *
+ * @private @memberof dc_imap_t
+ * @return 0 on connection problems, we should try later again in this case; 1 otherwise.
+ */
+int dc_imap_delete_msgs(dc_imap_t* imap, const char* folder, const dc_array_t* uids, const dc_array_t* rfc724_mids)
 {
-	int    success = 0;
-	int    r = 0;
-	clist* fetch_result = NULL;
-	char*  is_rfc724_mid = NULL;
-	char*  new_folder = NULL;
+	int                  success = 0;
+	int                  r = 0;
+	size_t               cnt = dc_array_get_cnt(uids);
+	clist*               fetch_result = NULL;
+	clistiter*           cur = NULL;
+	struct mailimap_set* set = NULL;
+	dc_array_t*          matching_uids = NULL;
 
-	if (imap==NULL || rfc724_mid==NULL || folder==NULL || folder[0]==0 || server_uid==0) {
+	if (imap==NULL || folder==NULL || folder[0]==0 || cnt==0 || dc_array_get_cnt(rfc724_mids)!=cnt) {
 		success = 1; /* job done, do not try over */
 		goto cleanup;
 	}
 
-	dc_log_info(imap->context, 0, "Marking message \"%s\", %s/%i for deletion...", rfc724_mid, folder, (int)server_uid);
+	dc_log_info(imap->context, 0, "Marking %i message(s) in %s for deletion...", (int)cnt, folder);
 
 	if (select_folder(imap, folder)==0) {
-		dc_log_warning(imap->context, 0, "Cannot select folder %s for deleting message.", folder);
+		dc_log_warning(imap->context, 0, "Cannot select folder %s for deleting messages.", folder);
 		goto cleanup;
 	}
 
-	/* check if Folder+UID matches the Message-ID (to detect if the messages
-	was moved around by other MUAs and in place of an UIDVALIDITY check)
-	*/
-	{
-		clistiter* cur = NULL;
-		const char* is_quoted_rfc724_mid = NULL;
+	/* check if Folder+UID matches the Message-ID */
+	set = new_uid_set(uids);
+	uint64_t start = dc_metrics_now();
+	r = mailimap_uid_fetch(imap->etpan, set, imap->fetch_type_prefetch, &fetch_result);
+	dc_metrics_add(imap->context->metrics, DC_METRIC_IMAP_FETCH_HEADERS, dc_metrics_now()-start);
+	FREE_SET(set);
 
-		struct mailimap_set* set = mailimap_set_new_single(server_uid);
-			r = mailimap_uid_fetch(imap->etpan, set, imap->fetch_type_prefetch, &fetch_result);
-		FREE_SET(set);
+	if (dc_imap_is_error(imap, r) || fetch_result==NULL) {
+		fetch_result = NULL;
+		dc_log_warning(imap->context, 0, "Cannot delete on IMAP, messages not found in %s.", folder);
+		if (imap->should_reconnect) {
+			goto cleanup;
+		}
+	}
 
-		if (dc_imap_is_error(imap, r) || fetch_result==NULL) {
-			fetch_result = NULL;
-			dc_log_warning(imap->context, 0, "Cannot delete on IMAP, %s/%i not found.", folder, (int)server_uid);
-			server_uid = 0;
+	matching_uids = dc_array_new(imap->context, cnt);
+	for (cur=clist_begin(fetch_result); cur!=NULL; cur=clist_next(cur))
+	{
+		struct mailimap_msg_att* msg_att = (struct mailimap_msg_att*)clist_content(cur);
+		uint32_t                 server_uid = peek_uid(msg_att);
+		const char*              is_quoted_rfc724_mid = peek_rfc724_mid(msg_att);
+		char*                    is_rfc724_mid = is_quoted_rfc724_mid? unquote_rfc724_mid(is_quoted_rfc724_mid) : NULL;
+		size_t                   i = 0;
+		int                      matches = 0;
+
+		for (i = 0; i < cnt; i++) {
+			const char* rfc724_mid = (const char*)dc_array_get_ptr(rfc724_mids, i);
+			if (dc_array_get_id(uids, i)==server_uid
+			 && is_rfc724_mid && rfc724_mid && strcmp(is_rfc724_mid, rfc724_mid)==0) {
+				matches = 1;
+				break;
+			}
 		}
 
-		if( (cur=clist_begin(fetch_result))==NULL
-		 || (is_quoted_rfc724_mid=peek_rfc724_mid((struct mailimap_msg_att*)clist_content(cur)))==NULL
-		 || (is_rfc724_mid=unquote_rfc724_mid(is_quoted_rfc724_mid))==NULL
-		 || strcmp(is_rfc724_mid, rfc724_mid)!=0)
-		{
-			dc_log_warning(imap->context, 0, "Cannot delete on IMAP, %s/%i does not match %s.", folder, (int)server_uid, rfc724_mid);
-			server_uid = 0;
+		if (matches) {
+			dc_array_add_id(matching_uids, server_uid);
+		}
+		else {
+			dc_log_warning(imap->context, 0, "Cannot delete on IMAP, %s/%i does not match %s.", folder, (int)server_uid, is_rfc724_mid? is_rfc724_mid : "?");
 		}
+
+		free(is_rfc724_mid);
+	}
+
+	if (dc_array_get_cnt(matching_uids)==0) {
+		success = 1;
+		goto cleanup;
 	}
 
-	/* mark the message for deletion */
-	if (add_flag(imap, server_uid, mailimap_flag_new_deleted())==0) {
-		dc_log_warning(imap->context, 0, "Cannot mark message as \"Deleted\"."); /* maybe the message is already deleted */
+	/* mark the messages for deletion */
+	set = new_uid_set(matching_uids);
+	if (add_flag(imap, set, mailimap_flag_new_deleted())==0) {
+		dc_log_warning(imap->context, 0, "Cannot mark messages as \"Deleted\"."); /* maybe the messages are already deleted */
 		goto cleanup;
 	}
 
@@ -1333,12 +2103,31 @@ int dc_imap_delete_msg(dc_imap_t* imap, const char* rfc724_mid, const char* fold
 	success = 1;
 
 cleanup:
-
+	FREE_SET(set);
 	FREE_FETCH_LIST(fetch_result);
-	free(is_rfc724_mid);
-	free(new_folder);
-
+	dc_array_unref(matching_uids);
 	return success? 1 : dc_imap_is_connected(imap); /* only return 0 on connection problems; we should try later again in this case */
-
 }
 
+
+int dc_imap_delete_msg(dc_imap_t* imap, const char* rfc724_mid, const char* folder, uint32_t server_uid)
+{
+	int         success = 0;
+	dc_array_t* uids = NULL;
+	dc_array_t* rfc724_mids = NULL;
+
+	if (imap==NULL || rfc724_mid==NULL || server_uid==0) {
+		return 1; /* job done, do not try over */
+	}
+
+	uids = dc_array_new(imap->context, 1);
+	rfc724_mids = dc_array_new(imap->context, 1);
+	dc_array_add_id(uids, server_uid);
+	dc_array_add_ptr(rfc724_mids, (void*)rfc724_mid);
+
+	success = dc_imap_delete_msgs(imap, folder, uids, rfc724_mids);
+
+	dc_array_unref(uids);
+	dc_array_unref(rfc724_mids);
+	return success;
+}
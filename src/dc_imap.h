@@ -26,6 +26,14 @@ typedef int      (*dc_precheck_imf_t)  (dc_imap_t*, const char* rfc724_mid,
 #define DC_IMAP_SEEN 0x0001L
 typedef void     (*dc_receive_imf_t)   (dc_imap_t*, const char* imf_raw_not_terminated, size_t imf_raw_bytes, const char* server_folder, uint32_t server_uid, uint32_t flags);
 
+/* receive_imf may only queue the message, the data must be copied then;
+flush_imf must not return before all messages queued by this dc_imap_t object are processed */
+typedef void     (*dc_flush_imf_t)     (dc_imap_t*);
+
+/* called with the changes made by other clients since the last sync: UIDs that got the \Seen flag
+and UIDs expunged from the folder, the latter as pairs of first and last UID of each range */
+typedef void     (*dc_sync_imf_t)      (dc_imap_t*, const char* server_folder, const dc_array_t* seen_uids, const dc_array_t* expunged_uid_ranges);
+
 
 /**
  * Library-internal.
@@ -51,6 +59,10 @@ struct _dc_imap
 
 	int                   can_idle;
 	int                   has_xlist;
+	int                   has_condstore;   /* RFC 7162; if set, the HIGHESTMODSEQ is used to sync flags */
+	int                   qresync_enabled; /* set if `ENABLE QRESYNC` succeeded for the current session; if set, expunges are synced as well */
+	uint64_t              selected_modseq; /* HIGHESTMODSEQ returned by the last SELECT, 0 if unknown or already used for syncing */
+	int                   compress;        /* set if COMPRESS=DEFLATE (RFC 4978) is active for the current session */
 	char                  imap_delimiter;/* IMAP Path separator. Set as a side-effect during configure() */
 
 	char*                 watch_folder;
@@ -66,9 +78,18 @@ struct _dc_imap
 	dc_set_config_t       set_config;
 	dc_precheck_imf_t     precheck_imf;
 	dc_receive_imf_t      receive_imf;
+	dc_flush_imf_t        flush_imf;
+	dc_sync_imf_t         sync_imf;
 	void*                 userData;
 	dc_context_t*         context;
 
+	/* traffic summed up over all sessions; the payload counters are before compression,
+	the net_ counters are what was actually sent over the network */
+	uint64_t              bytes_received;
+	uint64_t              bytes_sent;
+	uint64_t              net_bytes_received;
+	uint64_t              net_bytes_sent;
+
 	int                   log_connect_errors;
 	int                   skip_log_capabilities;
 
@@ -84,7 +105,7 @@ typedef enum {
 
 
 dc_imap_t* dc_imap_new               (dc_get_config_t, dc_set_config_t,
-                                      dc_precheck_imf_t, dc_receive_imf_t,
+                                      dc_precheck_imf_t, dc_receive_imf_t, dc_flush_imf_t, dc_sync_imf_t,
                                       void* userData, dc_context_t*);
 void       dc_imap_unref             (dc_imap_t*);
 
@@ -99,10 +120,14 @@ void       dc_imap_interrupt_idle    (dc_imap_t*);
 
 dc_imap_res dc_imap_move         (dc_imap_t*, const char* folder, uint32_t uid,
                                   const char* dest_folder, uint32_t* dest_uid);
+dc_imap_res dc_imap_move_uids    (dc_imap_t*, const char* folder, const dc_array_t* uids,
+                                  const char* dest_folder, dc_array_t* dest_uids);
 dc_imap_res dc_imap_set_seen     (dc_imap_t*, const char* folder, uint32_t uid);
+dc_imap_res dc_imap_set_seen_uids(dc_imap_t*, const char* folder, const dc_array_t* uids);
 dc_imap_res dc_imap_set_mdnsent  (dc_imap_t*, const char* folder, uint32_t uid);
 
 int        dc_imap_delete_msg        (dc_imap_t*, const char* rfc724_mid, const char* folder, uint32_t server_uid); /* only returns 0 on connection problems; we should try later again in this case */
+int        dc_imap_delete_msgs       (dc_imap_t*, const char* folder, const dc_array_t* uids, const dc_array_t* rfc724_mids);
 
 int        dc_imap_is_error          (dc_imap_t* imap, int code);
 
@@ -4,6 +4,7 @@
 #include <openssl/rand.h>
 #include <libetpan/mmapstring.h>
 #include "dc_context.h"
+#include "dc_base64.h"
 #include "dc_mimeparser.h"
 #include "dc_loginparam.h"
 #include "dc_aheader.h"
@@ -197,9 +198,8 @@ char* dc_decrypt_setup_file(dc_context_t* context, const char* passphrase, const
 	char*         fc_buf = NULL;
 	const char*   fc_headerline = NULL;
 	const char*   fc_base64 = NULL;
-	char*         binary = NULL;
+	uint8_t*      binary = NULL;
 	size_t        binary_bytes = 0;
-	size_t        indx = 0;
 	void*         plain = NULL;
 	size_t        plain_bytes = 0;
 	char*         payload = NULL;
@@ -212,8 +212,10 @@ char* dc_decrypt_setup_file(dc_context_t* context, const char* passphrase, const
 	}
 
 	/* convert base64 to binary */
-	if (mailmime_base64_body_parse(fc_base64, strlen(fc_base64), &indx, &binary/*must be freed using mmap_string_unref()*/, &binary_bytes)!=MAILIMF_NO_ERROR
-	 || binary==NULL || binary_bytes==0) {
+	if ((binary=malloc(DC_BASE64_DECODED_MAX(strlen(fc_base64))+1))==NULL) {
+		exit(69);
+	}
+	if ((binary_bytes=dc_base64_decode(fc_base64, strlen(fc_base64), binary))==0) {
 		goto cleanup;
 	}
 
@@ -226,7 +228,7 @@ char* dc_decrypt_setup_file(dc_context_t* context, const char* passphrase, const
 cleanup:
 	free(plain);
 	free(fc_buf);
-	if (binary) { mmap_string_unref(binary); }
+	free(binary);
 	return payload;
 }
 
@@ -853,12 +855,14 @@ static int export_backup(dc_context_t* context, const char* dir)
 			free(curr_pathNfilename);
 			curr_pathNfilename = dc_mprintf("%s/%s", context->blobdir, name);
 			free(buf);
-			if (!dc_read_file(context, curr_pathNfilename, &buf, &buf_bytes) || buf==NULL || buf_bytes<=0) {
+			buf = NULL;
+			buf_bytes = 0;
+			if (!dc_read_file(context, curr_pathNfilename, &buf, &buf_bytes)) {
 				continue;
 			}
 
 			sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
-			sqlite3_bind_blob(stmt, 2, buf, buf_bytes, SQLITE_STATIC);
+			sqlite3_bind_blob(stmt, 2, buf, buf_bytes, SQLITE_STATIC); /* blobs are read, not mapped, another thread may truncate them while they are copied */
 			if (sqlite3_step(stmt)!=SQLITE_DONE) {
 				dc_log_error(context, 0, "Disk full? Cannot add file \"%s\" to backup.", curr_pathNfilename);
 				goto cleanup; /* this is not recoverable! writing to the sqlite database should work! */
@@ -938,6 +942,8 @@ static int import_backup(dc_context_t* context, const char* backup_to_import)
 		goto cleanup;
 	}
 
+	dc_job_unload_queues(context); /* the jobs are reloaded from the imported database */
+
 	/* copy all blobs to files */
 	stmt = dc_sqlite3_prepare(context->sql, "SELECT COUNT(*) FROM backup_blobs;");
 	sqlite3_step(stmt);
@@ -975,6 +981,8 @@ static int import_backup(dc_context_t* context, const char* backup_to_import)
 	dc_sqlite3_execute(context->sql, "DROP TABLE backup_blobs;");
 	dc_sqlite3_try_execute(context->sql, "VACUUM;");
 
+	dc_fts_start_backfill(context);
+
 	success = 1;
 
 cleanup:
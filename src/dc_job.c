@@ -33,122 +33,289 @@ cleanup:
 }
 
 
-static void dc_job_do_DC_JOB_DELETE_MSG_ON_IMAP(dc_context_t* context, dc_job_t* job)
+/* DC_JOB_DELETE_MSG_ON_IMAP, DC_JOB_MOVE_MSG and DC_JOB_MARKSEEN_MSG_ON_IMAP
+are done in batches, see dc_job_perform(); the jobs of a batch are grouped by
+the folder of their messages and only one IMAP command is sent per folder. */
+
+
+static int connect_to_inbox_for_jobs(dc_context_t* context, dc_job_t** jobs, int jobs_cnt)
 {
-	int           delete_from_server = 1;
-	dc_msg_t*     msg = dc_msg_new_untyped(context);
+	/* returns 1 if the inbox is connected, otherwise all jobs are tried again later */
+	if (!dc_imap_is_connected(context->inbox)) {
+		connect_to_inbox(context);
+		if (!dc_imap_is_connected(context->inbox)) {
+			for (int i = 0; i < jobs_cnt; i++) {
+				dc_job_try_again_later(jobs[i], DC_STANDARD_DELAY, NULL);
+			}
+			return 0;
+		}
+	}
+	return 1;
+}
 
-	if (!dc_msg_load_from_db(msg, context, job->foreign_id)
-	 || msg->rfc724_mid==NULL || msg->rfc724_mid[0]==0 /* eg. device messages have no Message-ID */) {
-		goto cleanup;
+
+static dc_msg_t** load_job_msgs(dc_context_t* context, dc_job_t** jobs, int jobs_cnt)
+{
+	/* messages that cannot be loaded are set to NULL, the jobs are done then */
+	dc_msg_t** msgs = NULL;
+
+	if ((msgs=calloc(jobs_cnt, sizeof(dc_msg_t*)))==NULL) {
+		exit(59);
+	}
+
+	for (int i = 0; i < jobs_cnt; i++) {
+		msgs[i] = dc_msg_new_untyped(context);
+		if (!dc_msg_load_from_db(msgs[i], context, jobs[i]->foreign_id)) {
+			dc_msg_unref(msgs[i]);
+			msgs[i] = NULL;
+		}
+	}
+
+	return msgs;
+}
+
+
+static void unref_job_msgs(dc_msg_t** msgs, int jobs_cnt)
+{
+	if (msgs) {
+		for (int i = 0; i < jobs_cnt; i++) {
+			dc_msg_unref(msgs[i]);
+		}
+		free(msgs);
+	}
+}
+
+
+#define HAS_SERVER_UID(m) ((m) && (m)->server_folder && (m)->server_folder[0] && (m)->server_uid)
+
+
+static int collect_folder(dc_msg_t** msgs, int jobs_cnt, int first, int* group, dc_array_t* uids)
+{
+	/* collect the messages in the same folder as msgs[first] that are not yet in a group;
+	they are marked as group[i]==first+1 and their UIDs are added to `uids` in the same order.
+	returns the number of messages found, 0 if msgs[first] cannot be used. */
+	int cnt = 0;
+
+	if (group[first] || !HAS_SERVER_UID(msgs[first])) {
+		return 0;
+	}
+
+	dc_array_empty(uids);
+	for (int i = first; i < jobs_cnt; i++) {
+		if (group[i]==0 && HAS_SERVER_UID(msgs[i])
+		 && strcmp(msgs[i]->server_folder, msgs[first]->server_folder)==0) {
+			group[i] = first+1;
+			dc_array_add_id(uids, msgs[i]->server_uid);
+			cnt++;
+		}
+	}
+
+	return cnt;
+}
+
+
+static void dc_job_do_DC_JOB_DELETE_MSG_ON_IMAP(dc_context_t* context, dc_job_t** jobs, int jobs_cnt)
+{
+	dc_msg_t**  msgs = NULL;
+	int*        group = NULL;
+	dc_array_t* uids = dc_array_new(context, jobs_cnt);
+	dc_array_t* rfc724_mids = dc_array_new(context, jobs_cnt);
+	int         i = 0, j = 0;
+
+	if ((group=calloc(jobs_cnt, sizeof(int)))==NULL) {
+		exit(59);
 	}
 
-	if (dc_rfc724_mid_cnt(context, msg->rfc724_mid)!=1) {
-		dc_log_info(context, 0, "The message is deleted from the server when all parts are deleted.");
-		delete_from_server = 0;
+	msgs = load_job_msgs(context, jobs, jobs_cnt);
+
+	for (i = 0; i < jobs_cnt; i++)
+	{
+		if (msgs[i]==NULL
+		 || msgs[i]->rfc724_mid==NULL || msgs[i]->rfc724_mid[0]==0 /* eg. device messages have no Message-ID */) {
+			dc_msg_unref(msgs[i]);
+			msgs[i] = NULL;
+			continue;
+		}
+
+		/* if this is the last existing part of the message, we delete the message from the server.
+		otherwise, we only delete the database entry; this is done at once
+		so that the check works if several parts are deleted in the same batch. */
+		if (dc_rfc724_mid_cnt(context, msgs[i]->rfc724_mid)!=1) {
+			dc_log_info(context, 0, "The message is deleted from the server when all parts are deleted.");
+			dc_delete_msg_from_db(context, msgs[i]->id);
+			dc_msg_unref(msgs[i]);
+			msgs[i] = NULL;
+		}
+		else if (!HAS_SERVER_UID(msgs[i])) {
+			dc_delete_msg_from_db(context, msgs[i]->id);
+			dc_msg_unref(msgs[i]);
+			msgs[i] = NULL;
+		}
 	}
 
-	/* if this is the last existing part of the message, we delete the message from the server */
-	if (delete_from_server)
+	for (i = 0; i < jobs_cnt; i++)
 	{
+		if (msgs[i]==NULL || group[i]) {
+			continue;
+		}
+
 		if (!dc_imap_is_connected(context->inbox)) {
 			connect_to_inbox(context);
 			if (!dc_imap_is_connected(context->inbox)) {
-				dc_job_try_again_later(job, DC_STANDARD_DELAY, NULL);
+				for (j = i; j < jobs_cnt; j++) {
+					if (msgs[j] && group[j]==0) {
+						dc_job_try_again_later(jobs[j], DC_STANDARD_DELAY, NULL);
+					}
+				}
 				goto cleanup;
 			}
 		}
 
-		if (!dc_imap_delete_msg(context->inbox, msg->rfc724_mid, msg->server_folder, msg->server_uid))
-		{
-			dc_job_try_again_later(job, DC_AT_ONCE, NULL);
-			goto cleanup;
+		if (collect_folder(msgs, jobs_cnt, i, group, uids)==0) {
+			continue;
+		}
+
+		dc_array_empty(rfc724_mids);
+		for (j = i; j < jobs_cnt; j++) {
+			if (group[j]==i+1) {
+				dc_array_add_ptr(rfc724_mids, msgs[j]->rfc724_mid);
+			}
 		}
-	}
 
-	/* we delete the database entry ...
-	- if the message is successfully removed from the server
-	- or if there are other parts of the message in the database (in this case we have not deleted if from the server)
-	(As long as the message is not removed from the IMAP-server, we need at least one database entry to avoid a re-download) */
-	dc_delete_msg_from_db(context, msg->id);
+		int deleted = dc_imap_delete_msgs(context->inbox, msgs[i]->server_folder, uids, rfc724_mids);
+
+		/* we delete the database entry if the message is successfully removed from the server
+		(as long as the message is not removed from the IMAP-server, we need at least one database entry to avoid a re-download) */
+		for (j = i; j < jobs_cnt; j++) {
+			if (group[j]==i+1) {
+				if (deleted) {
+					dc_delete_msg_from_db(context, msgs[j]->id);
+				}
+				else {
+					dc_job_try_again_later(jobs[j], DC_AT_ONCE, NULL);
+				}
+			}
+		}
+	}
 
 cleanup:
-	dc_msg_unref(msg);
+	unref_job_msgs(msgs, jobs_cnt);
+	free(group);
+	dc_array_unref(uids);
+	dc_array_unref(rfc724_mids);
 }
 
 
-static void dc_job_do_DC_JOB_MOVE_MSG(dc_context_t* context, dc_job_t* job)
+static void dc_job_do_DC_JOB_MOVE_MSG(dc_context_t* context, dc_job_t** jobs, int jobs_cnt)
 {
-	dc_msg_t* msg = dc_msg_new_untyped(context);
-	char*     dest_folder = NULL;
-	uint32_t  dest_uid = 0;
-
-	if (!dc_imap_is_connected(context->inbox)) {
-		connect_to_inbox(context);
-		if (!dc_imap_is_connected(context->inbox)) {
-			dc_job_try_again_later(job, DC_STANDARD_DELAY, NULL);
-			goto cleanup;
-		}
+	dc_msg_t**  msgs = NULL;
+	int*        group = NULL;
+	char*       dest_folder = NULL;
+	dc_array_t* uids = dc_array_new(context, jobs_cnt);
+	dc_array_t* dest_uids = dc_array_new(context, jobs_cnt);
+	int         i = 0, j = 0, k = 0;
+
+	if (!connect_to_inbox_for_jobs(context, jobs, jobs_cnt)) {
+		goto cleanup;
 	}
 
-	if (!dc_msg_load_from_db(msg, context, job->foreign_id)) {
-		goto cleanup;
+	if ((group=calloc(jobs_cnt, sizeof(int)))==NULL) {
+		exit(59);
 	}
 
+	msgs = load_job_msgs(context, jobs, jobs_cnt);
+
 	if (dc_sqlite3_get_config_int(context->sql, "folders_configured", 0)<DC_FOLDERS_CONFIGURED_VERSION) {
 		dc_configure_folders(context, context->inbox, DC_CREATE_MVBOX);
 	}
 
 	dest_folder = dc_sqlite3_get_config(context->sql, "configured_mvbox_folder", NULL);
 
-	switch (dc_imap_move(context->inbox, msg->server_folder, msg->server_uid, dest_folder, &dest_uid)) {
-		case DC_FAILED:       goto cleanup;
-		case DC_RETRY_LATER:  dc_job_try_again_later(job, DC_STANDARD_DELAY, NULL); break;
-		case DC_ALREADY_DONE: break;
-		case DC_SUCCESS:      dc_update_server_uid(context, msg->rfc724_mid, dest_folder, dest_uid); break;
+	for (i = 0; i < jobs_cnt; i++)
+	{
+		if (collect_folder(msgs, jobs_cnt, i, group, uids)==0) {
+			continue;
+		}
+
+		dc_array_empty(dest_uids);
+		dc_imap_res res = dc_imap_move_uids(context->inbox, msgs[i]->server_folder, uids, dest_folder, dest_uids);
+
+		for (j = i, k = 0; j < jobs_cnt; j++) {
+			if (group[j]==i+1) {
+				switch (res) {
+					case DC_FAILED:       break;
+					case DC_RETRY_LATER:  dc_job_try_again_later(jobs[j], DC_STANDARD_DELAY, NULL); break;
+					case DC_ALREADY_DONE: break;
+					case DC_SUCCESS:      dc_update_server_uid(context, msgs[j]->rfc724_mid, dest_folder, dc_array_get_id(dest_uids, k)); break;
+				}
+				k++;
+			}
+		}
 	}
 
 cleanup:
+	unref_job_msgs(msgs, jobs_cnt);
+	free(group);
 	free(dest_folder);
-	dc_msg_unref(msg);
+	dc_array_unref(uids);
+	dc_array_unref(dest_uids);
 }
 
 
-static void dc_job_do_DC_JOB_MARKSEEN_MSG_ON_IMAP(dc_context_t* context, dc_job_t* job)
+static void dc_job_do_DC_JOB_MARKSEEN_MSG_ON_IMAP(dc_context_t* context, dc_job_t** jobs, int jobs_cnt)
 {
-	dc_msg_t* msg = dc_msg_new_untyped(context);
+	dc_msg_t**  msgs = NULL;
+	int*        group = NULL;
+	dc_array_t* uids = dc_array_new(context, jobs_cnt);
+	int         mdns_enabled = dc_sqlite3_get_config_int(context->sql, "mdns_enabled", DC_MDNS_DEFAULT_ENABLED);
+	int         i = 0, j = 0;
 
-	if (!dc_imap_is_connected(context->inbox)) {
-		connect_to_inbox(context);
-		if (!dc_imap_is_connected(context->inbox)) {
-			dc_job_try_again_later(job, DC_STANDARD_DELAY, NULL);
-			goto cleanup;
-		}
-	}
-
-	if (!dc_msg_load_from_db(msg, context, job->foreign_id)) {
+	if (!connect_to_inbox_for_jobs(context, jobs, jobs_cnt)) {
 		goto cleanup;
 	}
 
-	switch (dc_imap_set_seen(context->inbox, msg->server_folder, msg->server_uid)) {
-		case DC_FAILED:      goto cleanup;
-		case DC_RETRY_LATER: dc_job_try_again_later(job, DC_STANDARD_DELAY, NULL); goto cleanup;
-		default:             break;
+	if ((group=calloc(jobs_cnt, sizeof(int)))==NULL) {
+		exit(59);
 	}
 
-	if (dc_param_get_int(msg->param, DC_PARAM_WANTS_MDN, 0)
-	 && dc_sqlite3_get_config_int(context->sql, "mdns_enabled", DC_MDNS_DEFAULT_ENABLED))
+	msgs = load_job_msgs(context, jobs, jobs_cnt);
+
+	for (i = 0; i < jobs_cnt; i++)
 	{
-		switch (dc_imap_set_mdnsent(context->inbox, msg->server_folder, msg->server_uid)) {
-			case DC_FAILED:       goto cleanup;
-			case DC_RETRY_LATER:  dc_job_try_again_later(job, DC_STANDARD_DELAY, NULL); goto cleanup;
-			case DC_ALREADY_DONE: break;
-			case DC_SUCCESS:      dc_send_mdn(context, msg->id); break;
+		if (collect_folder(msgs, jobs_cnt, i, group, uids)==0) {
+			continue;
+		}
+
+		dc_imap_res res = dc_imap_set_seen_uids(context->inbox, msgs[i]->server_folder, uids);
+
+		for (j = i; j < jobs_cnt; j++)
+		{
+			if (group[j]!=i+1) {
+				continue;
+			}
+
+			switch (res) {
+				case DC_FAILED:      continue;
+				case DC_RETRY_LATER: dc_job_try_again_later(jobs[j], DC_STANDARD_DELAY, NULL); continue;
+				default:             break;
+			}
+
+			if (dc_param_get_int(msgs[j]->param, DC_PARAM_WANTS_MDN, 0) && mdns_enabled)
+			{
+				switch (dc_imap_set_mdnsent(context->inbox, msgs[j]->server_folder, msgs[j]->server_uid)) {
+					case DC_FAILED:       break;
+					case DC_RETRY_LATER:  dc_job_try_again_later(jobs[j], DC_STANDARD_DELAY, NULL); break;
+					case DC_ALREADY_DONE: break;
+					case DC_SUCCESS:      dc_send_mdn(context, msgs[j]->id); break;
+				}
+			}
 		}
 	}
 
 cleanup:
-	dc_msg_unref(msg);
+	unref_job_msgs(msgs, jobs_cnt);
+	free(group);
+	dc_array_unref(uids);
 }
 
 
@@ -198,7 +365,8 @@ cleanup:
 
 
 /**
- * Store the MIME message in a file and send it later with a new SMTP job.
+ * Send the spool file written by dc_mimefactory_render() later with a new SMTP job.
+ * On success, the job takes ownership of the file.
  *
  * @param context The context object as created by dc_context_new()
  * @param action One of the DC_JOB_SEND_ constants
@@ -207,37 +375,31 @@ cleanup:
  */
 static int dc_add_smtp_job(dc_context_t* context, int action, dc_mimefactory_t* mimefactory)
 {
-	char*            pathNfilename = NULL;
 	int              success = 0;
 	char*            recipients = NULL;
 	dc_param_t*      param = dc_param_new();
 
-	// find a free file name in the blob directory
-	pathNfilename = dc_get_fine_pathNfilename(context, "$BLOBDIR", mimefactory->rfc724_mid);
-	if (!pathNfilename) {
-		dc_log_error(context, 0, "Could not find free file name for message with ID <%s>.", mimefactory->rfc724_mid);
-		goto cleanup;
-	}
-
-	// write the file
-	if (!dc_write_file(context, pathNfilename, mimefactory->out->str, mimefactory->out->len)) {
-		dc_log_error(context, 0, "Could not write message <%s> to \"%s\".", mimefactory->rfc724_mid, pathNfilename);
+	if (mimefactory->out_file==NULL) {
+		dc_log_error(context, 0, "Message <%s> was not rendered.", mimefactory->rfc724_mid);
 		goto cleanup;
 	}
 
-	// store recipients in job param
+	// store file and recipients in job param
 	recipients = dc_str_from_clist(mimefactory->recipients_addr, "\x1e");
-	dc_param_set(param, DC_PARAM_FILE, pathNfilename);
+	dc_param_set(param, DC_PARAM_FILE, mimefactory->out_file);
 	dc_param_set(param, DC_PARAM_RECIPIENTS, recipients);
 
 	dc_job_add(context, action, mimefactory->loaded==DC_MF_MSG_LOADED ? mimefactory->msg->id : 0, param->packed, 0);
 
+	// the file is deleted by the job now, not by dc_mimefactory_empty()
+	free(mimefactory->out_file);
+	mimefactory->out_file = NULL;
+
 	success = 1;
 
 cleanup:
 	dc_param_unref(param);
 	free(recipients);
-	free(pathNfilename);
 	return success;
 }
 
@@ -268,16 +430,16 @@ int dc_job_send_msg(dc_context_t* context, uint32_t msg_id)
 		if (pathNfilename) {
 			if ((mimefactory.msg->type==DC_MSG_IMAGE || mimefactory.msg->type==DC_MSG_GIF)
 			 && !dc_param_exists(mimefactory.msg->param, DC_PARAM_WIDTH)) {
-				unsigned char* buf = NULL; size_t buf_bytes; uint32_t w, h;
+				void* buf = NULL; size_t buf_bytes; uint32_t w, h;
 				dc_param_set_int(mimefactory.msg->param, DC_PARAM_WIDTH, 0);
 				dc_param_set_int(mimefactory.msg->param, DC_PARAM_HEIGHT, 0);
-				if (dc_read_file(context, pathNfilename, (void**)&buf, &buf_bytes)) {
+				if (dc_read_file_prefix(context, pathNfilename, DC_FILEMETA_MAX_BYTES, &buf, &buf_bytes)) {
 					if (dc_get_filemeta(buf, buf_bytes, &w, &h)) {
 						dc_param_set_int(mimefactory.msg->param, DC_PARAM_WIDTH, w);
 						dc_param_set_int(mimefactory.msg->param, DC_PARAM_HEIGHT, h);
 					}
+					free(buf);
 				}
-				free(buf);
 				dc_msg_save_param_to_disk(mimefactory.msg);
 			}
 		}
@@ -338,8 +500,6 @@ cleanup:
 static void dc_job_do_DC_JOB_SEND(dc_context_t* context, dc_job_t* job)
 {
 	char*         filename = NULL;
-	void*         buf = NULL;
-	size_t        buf_bytes = 0;
 	char*         recipients = NULL;
 	clist*        recipients_list = NULL;
 	sqlite3_stmt* stmt = NULL;
@@ -362,7 +522,8 @@ static void dc_job_do_DC_JOB_SEND(dc_context_t* context, dc_job_t* job)
 		dc_log_warning(context, 0, "Missing file name for job %d", job->job_id);
 		goto cleanup;
 	}
-	if (!dc_read_file(context, filename, &buf, &buf_bytes)) {
+	if (!dc_file_exist(context, filename)) {
+		dc_log_warning(context, 0, "Missing file \"%s\" for job %d", filename, job->job_id);
 		goto cleanup;
 	}
 
@@ -387,7 +548,7 @@ static void dc_job_do_DC_JOB_SEND(dc_context_t* context, dc_job_t* job)
 
 	/* send message */
 	{
-		if (!dc_smtp_send_msg(context->smtp, recipients_list, buf, buf_bytes)) {
+		if (!dc_smtp_send_file(context->smtp, recipients_list, filename)) {
 			if (job->foreign_id && (
 			    MAILSMTP_ERROR_EXCEED_STORAGE_ALLOCATION==context->smtp->error_etpan
 			 || MAILSMTP_ERROR_INSUFFICIENT_SYSTEM_STORAGE==context->smtp->error_etpan)) {
@@ -425,7 +586,6 @@ cleanup:
 		clist_free(recipients_list);
 	}
 	free(recipients);
-	free(buf);
 	free(filename);
 }
 
@@ -444,8 +604,6 @@ static void dc_send_mdn(dc_context_t* context, uint32_t msg_id)
 		goto cleanup;
     }
 
-	//char* t1=dc_null_terminate(mimefactory.out->str,mimefactory.out->len);printf("~~~~~MDN~~~~~\n%s\n~~~~~/MDN~~~~~",t1);free(t1); // DEBUG OUTPUT
-
 	dc_add_smtp_job(context, DC_JOB_SEND_MDN, &mimefactory);
 
 cleanup:
@@ -502,41 +660,231 @@ static time_t get_backoff_time_offset(int c_tries)
 }
 
 
-static time_t get_next_wakeup_time(dc_context_t* context, int thread)
+/*******************************************************************************
+ * Job queues
+ ******************************************************************************/
+
+
+/* The jobs of each thread are kept in memory in a binary heap ordered by
+desired_timestamp, so finding the due jobs and the next wakeup time needs no
+database query and adding or taking a job is O(log n). The heaps are loaded
+from the `jobs` table on first use; every change is written through to the
+table, which stays the persistent copy. */
+#define FIELDS "id, action, foreign_id, param, added_timestamp, desired_timestamp, tries"
+
+
+static dc_jobqueue_t* get_queue(dc_context_t* context, int thread)
+{
+	return thread==DC_IMAP_THREAD? &context->imap_jobs : &context->smtp_jobs;
+}
+
+
+static void free_job(dc_job_t* job)
+{
+	if (job) {
+		dc_param_unref(job->param);
+		free(job->pending_error);
+		free(job);
+	}
+}
+
+
+static void load_job(sqlite3_stmt* stmt, dc_job_t* job)
+{
+	job->job_id                          = sqlite3_column_int  (stmt, 0);
+	job->action                          = sqlite3_column_int  (stmt, 1);
+	job->foreign_id                      = sqlite3_column_int  (stmt, 2);
+	job->param                           = dc_param_new();
+	dc_param_set_packed(job->param, (char*)sqlite3_column_text (stmt, 3));
+	job->added_timestamp                 = sqlite3_column_int64(stmt, 4);
+	job->desired_timestamp               = sqlite3_column_int64(stmt, 5);
+	job->tries                           = sqlite3_column_int  (stmt, 6);
+}
+
+
+static int job_before(const dc_job_t* a, const dc_job_t* b)
+{
+	return a->desired_timestamp < b->desired_timestamp
+	   || (a->desired_timestamp==b->desired_timestamp && a->job_id < b->job_id);
+}
+
+
+static void heap_sift_down(dc_jobqueue_t* queue, size_t i)
+{
+	while (1) {
+		size_t    first = i, l = 2*i+1, r = 2*i+2;
+		dc_job_t* tmp = NULL;
+
+		if (l < queue->cnt && job_before(queue->heap[l], queue->heap[first])) { first = l; }
+		if (r < queue->cnt && job_before(queue->heap[r], queue->heap[first])) { first = r; }
+		if (first==i) {
+			break;
+		}
+
+		tmp = queue->heap[i]; queue->heap[i] = queue->heap[first]; queue->heap[first] = tmp;
+		i = first;
+	}
+}
+
+
+static void heap_rebuild(dc_jobqueue_t* queue)
+{
+	for (size_t i = queue->cnt/2; i > 0; i--) {
+		heap_sift_down(queue, i-1);
+	}
+}
+
+
+static void heap_push(dc_jobqueue_t* queue, dc_job_t* job)
+{
+	size_t i = 0;
+
+	if (queue->cnt >= queue->allocated) {
+		queue->allocated = DC_MAX(queue->allocated*2, 64);
+		if ((queue->heap=realloc(queue->heap, queue->allocated*sizeof(dc_job_t*)))==NULL) {
+			exit(60);
+		}
+	}
+
+	i = queue->cnt++;
+	queue->heap[i] = job;
+	while (i > 0 && job_before(queue->heap[i], queue->heap[(i-1)/2])) {
+		dc_job_t* tmp = queue->heap[i]; queue->heap[i] = queue->heap[(i-1)/2]; queue->heap[(i-1)/2] = tmp;
+		i = (i-1)/2;
+	}
+}
+
+
+static dc_job_t* heap_pop(dc_jobqueue_t* queue)
+{
+	dc_job_t* job = NULL;
+
+	if (queue->cnt==0) {
+		return NULL;
+	}
+
+	job = queue->heap[0];
+	queue->heap[0] = queue->heap[--queue->cnt];
+	heap_sift_down(queue, 0);
+	return job;
+}
+
+
+static void load_queues_if_needed(dc_context_t* context) /* must be called with jobs_critical locked */
 {
-	time_t        wakeup_time = 0;
 	sqlite3_stmt* stmt = NULL;
 
+	if (context->jobs_loaded || !dc_sqlite3_is_open(context->sql)) {
+		return;
+	}
+
 	stmt = dc_sqlite3_prepare(context->sql,
-		"SELECT MIN(desired_timestamp)"
-		" FROM jobs"
-		" WHERE thread=?;");
-	sqlite3_bind_int(stmt, 1, thread);
-	if (sqlite3_step(stmt)==SQLITE_ROW) {
-		wakeup_time = sqlite3_column_int(stmt, 0);
+		"SELECT " FIELDS ", thread FROM jobs;");
+	while (sqlite3_step(stmt)==SQLITE_ROW)
+	{
+		dc_job_t* job = NULL;
+		int       thread = sqlite3_column_int(stmt, 7);
+
+		if (thread!=DC_IMAP_THREAD && thread!=DC_SMTP_THREAD) {
+			continue;
+		}
+
+		if ((job=calloc(1, sizeof(dc_job_t)))==NULL) {
+			exit(61);
+		}
+		load_job(stmt, job);
+		heap_push(get_queue(context, thread), job);
 	}
+	sqlite3_finalize(stmt);
+
+	context->jobs_loaded = 1;
+	dc_log_info(context, 0, "%i IMAP-jobs and %i SMTP-jobs loaded.", (int)context->imap_jobs.cnt, (int)context->smtp_jobs.cnt);
+}
+
+
+static void requeue_job(dc_context_t* context, dc_jobqueue_t* queue, dc_job_t* job, int generation) /* must be called with jobs_critical locked */
+{
+	// put back a job taken from the queue by dc_job_perform();
+	// the job is dropped if it was killed or if the queues were reloaded meanwhile
+	if (job->killed || generation!=context->jobs_generation) {
+		free_job(job);
+		return;
+	}
+
+	job->try_again = DC_DONT_TRY_AGAIN;
+	free(job->pending_error);
+	job->pending_error = NULL;
+	heap_push(queue, job);
+}
+
+
+void dc_job_unload_queues(dc_context_t* context)
+{
+	if (context==NULL || context->magic!=DC_CONTEXT_MAGIC) {
+		return;
+	}
+
+	pthread_mutex_lock(&context->jobs_critical);
+
+		for (int thread = DC_IMAP_THREAD; thread; thread = (thread==DC_IMAP_THREAD? DC_SMTP_THREAD : 0)) {
+			dc_jobqueue_t* queue = get_queue(context, thread);
+			while (queue->cnt) {
+				free_job(queue->heap[--queue->cnt]);
+			}
+			free(queue->heap);
+			queue->heap = NULL;
+			queue->allocated = 0;
+		}
+
+		context->jobs_loaded = 0;
+		context->jobs_generation++;
+
+	pthread_mutex_unlock(&context->jobs_critical);
+}
+
+
+static time_t get_next_wakeup_time(dc_context_t* context, int thread)
+{
+	time_t         wakeup_time = 0;
+	dc_jobqueue_t* queue = NULL;
+
+	pthread_mutex_lock(&context->jobs_critical);
+		load_queues_if_needed(context);
+		queue = get_queue(context, thread);
+		if (queue->cnt > 0) {
+			wakeup_time = queue->heap[0]->desired_timestamp;
+		}
+	pthread_mutex_unlock(&context->jobs_critical);
 
 	if (wakeup_time==0) {
 		wakeup_time = time(NULL) + 10*60;
 	}
 
-	sqlite3_finalize(stmt);
 	return wakeup_time;
 }
 
 
 int dc_job_action_exists(dc_context_t* context, int action)
 {
-	int           job_exists = 0;
-	sqlite3_stmt* stmt = NULL;
+	int    job_exists = 0;
+	size_t i = 0;
 
-	stmt = dc_sqlite3_prepare(context->sql,
-		"SELECT id FROM jobs WHERE action=?;");
-	sqlite3_bind_int  (stmt, 1, action);
+	pthread_mutex_lock(&context->jobs_critical);
 
-	job_exists = (sqlite3_step(stmt)==SQLITE_ROW);
+		load_queues_if_needed(context);
+
+		for (int thread = DC_IMAP_THREAD; thread && !job_exists; thread = (thread==DC_IMAP_THREAD? DC_SMTP_THREAD : 0)) {
+			dc_jobqueue_t* queue = get_queue(context, thread);
+			for (i = 0; i < queue->cnt && !job_exists; i++) {
+				job_exists = (queue->heap[i]->action==action);
+			}
+			for (i = 0; i < queue->running_cnt && !job_exists; i++) {
+				job_exists = (queue->running[i] && queue->running[i]->action==action && !queue->running[i]->killed);
+			}
+		}
+
+	pthread_mutex_unlock(&context->jobs_critical);
 
-	sqlite3_finalize(stmt);
 	return job_exists;
 }
 
@@ -546,6 +894,7 @@ void dc_job_add(dc_context_t* context, int action, int foreign_id, const char* p
 	time_t        timestamp = time(NULL);
 	sqlite3_stmt* stmt = NULL;
 	int           thread = 0;
+	dc_job_t*     job = NULL;
 
 	if (action >= DC_IMAP_THREAD && action < DC_IMAP_THREAD+1000) {
 		thread = DC_IMAP_THREAD;
@@ -557,16 +906,44 @@ void dc_job_add(dc_context_t* context, int action, int foreign_id, const char* p
 		return;
 	}
 
-	stmt = dc_sqlite3_prepare(context->sql,
-		"INSERT INTO jobs (added_timestamp, thread, action, foreign_id, param, desired_timestamp) VALUES (?,?,?,?,?,?);");
-	sqlite3_bind_int64(stmt, 1, timestamp);
-	sqlite3_bind_int  (stmt, 2, thread);
-	sqlite3_bind_int  (stmt, 3, action);
-	sqlite3_bind_int  (stmt, 4, foreign_id);
-	sqlite3_bind_text (stmt, 5, param? param : "",  -1, SQLITE_STATIC);
-	sqlite3_bind_int64(stmt, 6, timestamp+delay_seconds);
-	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	if ((job=calloc(1, sizeof(dc_job_t)))==NULL) {
+		exit(61);
+	}
+	job->action            = action;
+	job->foreign_id        = foreign_id;
+	job->param             = dc_param_new();
+	dc_param_set_packed(job->param, param);
+	job->added_timestamp   = timestamp;
+	job->desired_timestamp = timestamp+delay_seconds;
+
+	pthread_mutex_lock(&context->jobs_critical);
+
+		// load before inserting, otherwise the new job would be loaded twice
+		load_queues_if_needed(context);
+
+		stmt = dc_sqlite3_prepare(context->sql,
+			"INSERT INTO jobs (added_timestamp, thread, action, foreign_id, param, desired_timestamp) VALUES (?,?,?,?,?,?);");
+		sqlite3_bind_int64(stmt, 1, timestamp);
+		sqlite3_bind_int  (stmt, 2, thread);
+		sqlite3_bind_int  (stmt, 3, action);
+		sqlite3_bind_int  (stmt, 4, foreign_id);
+		sqlite3_bind_text (stmt, 5, param? param : "",  -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 6, timestamp+delay_seconds);
+		if (sqlite3_step(stmt)==SQLITE_DONE && context->jobs_loaded) {
+			// jobs are only inserted here and under this lock, so the new job has the largest ID
+			sqlite3_finalize(stmt);
+			stmt = dc_sqlite3_prepare(context->sql, "SELECT MAX(id) FROM jobs;");
+			if (sqlite3_step(stmt)==SQLITE_ROW) {
+				job->job_id = sqlite3_column_int(stmt, 0);
+				heap_push(get_queue(context, thread), job);
+				job = NULL;
+			}
+		}
+		sqlite3_finalize(stmt);
+
+	pthread_mutex_unlock(&context->jobs_critical);
+
+	free_job(job);
 
 	if (thread==DC_IMAP_THREAD) {
 		dc_interrupt_imap_idle(context);
@@ -617,74 +994,194 @@ void dc_job_try_again_later(dc_job_t* job, int try_again, const char* pending_er
 
 void dc_job_kill_action(dc_context_t* context, int action)
 {
+	size_t i = 0, j = 0;
+
 	if (context==NULL) {
 		return;
 	}
 
-	sqlite3_stmt* stmt = dc_sqlite3_prepare(context->sql,
-		"DELETE FROM jobs WHERE action=?;");
-	sqlite3_bind_int(stmt, 1, action);
-	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	pthread_mutex_lock(&context->jobs_critical);
+
+		for (int thread = DC_IMAP_THREAD; thread; thread = (thread==DC_IMAP_THREAD? DC_SMTP_THREAD : 0)) {
+			dc_jobqueue_t* queue = get_queue(context, thread);
+			for (i = 0, j = 0; i < queue->cnt; i++) {
+				if (queue->heap[i]->action==action) {
+					free_job(queue->heap[i]);
+				}
+				else {
+					queue->heap[j++] = queue->heap[i];
+				}
+			}
+			queue->cnt = j;
+			heap_rebuild(queue);
+
+			for (i = 0; i < queue->running_cnt; i++) {
+				if (queue->running[i] && queue->running[i]->action==action) {
+					queue->running[i]->killed = 1;
+				}
+			}
+		}
+
+		sqlite3_stmt* stmt = dc_sqlite3_prepare(context->sql,
+			"DELETE FROM jobs WHERE action=?;");
+		sqlite3_bind_int(stmt, 1, action);
+		sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+
+	pthread_mutex_unlock(&context->jobs_critical);
 }
 
 
-static void dc_job_perform(dc_context_t* context, int thread, int probe_network)
+static int cmp_jobs_by_action(const void* p1, const void* p2)
 {
-	sqlite3_stmt* select_stmt = NULL;
-	dc_job_t      job;
-	#define       THREAD_STR (thread==DC_IMAP_THREAD? "INBOX" : "SMTP")
-	#define       IS_EXCLUSIVE_JOB (DC_JOB_CONFIGURE_IMAP==job.action || DC_JOB_IMEX_IMAP==job.action)
+	// ORDER BY action DESC, added_timestamp
+	const dc_job_t* a = *(const dc_job_t**)p1;
+	const dc_job_t* b = *(const dc_job_t**)p2;
+	if (a->action!=b->action) {
+		return a->action > b->action? -1 : 1;
+	}
+	if (a->added_timestamp!=b->added_timestamp) {
+		return a->added_timestamp < b->added_timestamp? -1 : 1;
+	}
+	return a->job_id < b->job_id? -1 : (a->job_id > b->job_id? 1 : 0);
+}
 
-	memset(&job, 0, sizeof(dc_job_t));
-	job.param = dc_param_new();
 
-	if (context==NULL || context->magic!=DC_CONTEXT_MAGIC) {
-		goto cleanup;
+static int cmp_jobs_by_desired_timestamp(const void* p1, const void* p2)
+{
+	// ORDER BY desired_timestamp, action DESC
+	const dc_job_t* a = *(const dc_job_t**)p1;
+	const dc_job_t* b = *(const dc_job_t**)p2;
+	if (a->desired_timestamp!=b->desired_timestamp) {
+		return a->desired_timestamp < b->desired_timestamp? -1 : 1;
+	}
+	if (a->action!=b->action) {
+		return a->action > b->action? -1 : 1;
 	}
+	return a->job_id < b->job_id? -1 : (a->job_id > b->job_id? 1 : 0);
+}
+
+
+/* Some actions are done in batches: directly following jobs of the same action
+(the jobs are ordered by action) are handed over together to their
+dc_job_do_DC_JOB_*() function, which needs only one round-trip per folder then.
+Each job of a batch still succeeds, fails or is tried again on its own. */
+#define DC_JOB_BATCH_MAX 500
+#define IS_BATCH_ACTION(a) ((a)==DC_JOB_DELETE_MSG_ON_IMAP || (a)==DC_JOB_MARKSEEN_MSG_ON_IMAP || (a)==DC_JOB_MOVE_MSG)
 
-	if (probe_network==0) {
-		// processing for first-try and after backoff-timeouts:
-		// process jobs in the order they were added.
-		#define FIELDS "id, action, foreign_id, param, added_timestamp, desired_timestamp, tries"
-		select_stmt = dc_sqlite3_prepare(context->sql,
-			"SELECT " FIELDS " FROM jobs"
-			" WHERE thread=? AND desired_timestamp<=?"
-			" ORDER BY action DESC, added_timestamp;");
-		sqlite3_bind_int64(select_stmt, 1, thread);
-		sqlite3_bind_int64(select_stmt, 2, time(NULL));
+
+/* the name under which the duration of a job (resp. of a batch of jobs) is recorded in the metrics */
+static const char* job_metric_name(int action)
+{
+	switch (action) {
+		case DC_JOB_SEND_MSG_TO_SMTP:     return "job.send_msg";
+		case DC_JOB_DELETE_MSG_ON_IMAP:   return "job.delete_msg";
+		case DC_JOB_MARKSEEN_MSG_ON_IMAP: return "job.markseen_msg";
+		case DC_JOB_MARKSEEN_MDN_ON_IMAP: return "job.markseen_mdn";
+		case DC_JOB_MOVE_MSG:             return "job.move_msg";
+		case DC_JOB_SEND_MDN:             return "job.send_mdn";
+		case DC_JOB_CONFIGURE_IMAP:       return "job.configure";
+		case DC_JOB_IMEX_IMAP:            return "job.imex";
+		case DC_JOB_MAYBE_SEND_LOCATIONS: return "job.send_locations";
+		case DC_JOB_MAYBE_SEND_LOC_ENDED: return "job.send_loc_ended";
+		case DC_JOB_HOUSEKEEPING:         return "job.housekeeping";
+		case DC_JOB_FTS_BACKFILL:         return "job.fts_backfill";
+		default:                          return "job.unknown";
 	}
-	else {
-		// processing after call to dc_maybe_network():
-		// process _all_ pending jobs that failed before
-		// in the order of their backoff-times.
-		select_stmt = dc_sqlite3_prepare(context->sql,
-			"SELECT " FIELDS " FROM jobs"
-			" WHERE thread=? AND tries>0"
-			" ORDER BY desired_timestamp, action DESC;");
-		sqlite3_bind_int64(select_stmt, 1, thread);
+}
+
+
+static void dc_job_perform(dc_context_t* context, int thread, int probe_network)
+{
+	dc_jobqueue_t* queue = NULL;
+	dc_job_t**     due = NULL;    // the jobs taken from the queue, set to NULL when done
+	size_t         due_cnt = 0;
+	dc_job_t**     jobs = NULL;   // the job resp. the batch of jobs currently performed, points into `due`
+	int            jobs_cnt = 0;
+	dc_job_t**     todo = NULL;
+	int            todo_cnt = 0;
+	int            generation = 0;
+	int            stop = 0;
+	size_t         first = 0;
+	int            i = 0;
+	time_t         now = time(NULL);
+	#define        THREAD_STR (thread==DC_IMAP_THREAD? "INBOX" : "SMTP")
+	#define        IS_EXCLUSIVE_JOB (DC_JOB_CONFIGURE_IMAP==jobs[0]->action || DC_JOB_IMEX_IMAP==jobs[0]->action)
+
+	if (context==NULL || context->magic!=DC_CONTEXT_MAGIC) {
+		return;
 	}
 
-	while (sqlite3_step(select_stmt)==SQLITE_ROW)
+	pthread_mutex_lock(&context->jobs_critical);
+
+		load_queues_if_needed(context);
+		queue = get_queue(context, thread);
+		generation = context->jobs_generation;
+
+		if ((due=calloc(queue->cnt+1, sizeof(dc_job_t*)))==NULL) {
+			exit(59);
+		}
+
+		if (probe_network==0) {
+			// processing for first-try and after backoff-timeouts:
+			// process jobs in the order they were added.
+			while (queue->cnt > 0 && queue->heap[0]->desired_timestamp<=now) {
+				due[due_cnt++] = heap_pop(queue);
+			}
+			qsort(due, due_cnt, sizeof(dc_job_t*), cmp_jobs_by_action);
+		}
+		else {
+			// processing after call to dc_maybe_network():
+			// process _all_ pending jobs that failed before
+			// in the order of their backoff-times.
+			size_t j = 0;
+			for (first = 0; first < queue->cnt; first++) {
+				if (queue->heap[first]->tries > 0) {
+					due[due_cnt++] = queue->heap[first];
+				}
+				else {
+					queue->heap[j++] = queue->heap[first];
+				}
+			}
+			queue->cnt = j;
+			heap_rebuild(queue);
+			qsort(due, due_cnt, sizeof(dc_job_t*), cmp_jobs_by_desired_timestamp);
+		}
+
+		queue->running     = due;
+		queue->running_cnt = due_cnt;
+
+	pthread_mutex_unlock(&context->jobs_critical);
+
+	if ((todo=calloc(DC_JOB_BATCH_MAX, sizeof(dc_job_t*)))==NULL) {
+		exit(59);
+	}
+
+	for (first = 0; first < due_cnt && !stop; first += jobs_cnt)
 	{
-		job.job_id                          = sqlite3_column_int  (select_stmt, 0);
-		job.action                          = sqlite3_column_int  (select_stmt, 1);
-		job.foreign_id                      = sqlite3_column_int  (select_stmt, 2);
-		dc_param_set_packed(job.param, (char*)sqlite3_column_text (select_stmt, 3));
-		job.added_timestamp                 = sqlite3_column_int64(select_stmt, 4);
-		job.desired_timestamp               = sqlite3_column_int64(select_stmt, 5);
-		job.tries                           = sqlite3_column_int  (select_stmt, 6);
+		jobs = &due[first];
+		jobs_cnt = 1;
 
-		dc_log_info(context, 0, "%s-job #%i, action %i started...", THREAD_STR, (int)job.job_id, (int)job.action);
+		if (IS_BATCH_ACTION(jobs[0]->action)) {
+			while (first+jobs_cnt < due_cnt && jobs_cnt < DC_JOB_BATCH_MAX
+			 && due[first+jobs_cnt]->action==jobs[0]->action) {
+				jobs_cnt++;
+			}
+		}
+
+		if (jobs_cnt==1) {
+			dc_log_info(context, 0, "%s-job #%i, action %i started...", THREAD_STR, (int)jobs[0]->job_id, (int)jobs[0]->action);
+		}
+		else {
+			dc_log_info(context, 0, "%s-jobs #%i..#%i, action %i started as a batch of %i...", THREAD_STR, (int)jobs[0]->job_id, (int)jobs[jobs_cnt-1]->job_id, (int)jobs[0]->action, jobs_cnt);
+		}
 
 		// some configuration jobs are "exclusive":
 		// - they are always executed in the imap-thread and the smtp-thread is suspended during execution
 		// - they may change the database handle change the database handle; we do not keep old pointers therefore
 		// - they can be re-executed one time AT_ONCE, but they are not save in the database for later execution
 		if (IS_EXCLUSIVE_JOB) {
-			dc_job_kill_action(context, job.action);
-			sqlite3_finalize(select_stmt);
-			select_stmt = NULL;
+			dc_job_kill_action(context, jobs[0]->action);
 			dc_jobthread_suspend(&context->sentbox_thread, 1);
 			dc_jobthread_suspend(&context->mvbox_thread, 1);
 			dc_suspend_smtp_thread(context, 1);
@@ -692,83 +1189,115 @@ static void dc_job_perform(dc_context_t* context, int thread, int probe_network)
 
 		for (int tries = 0; tries <= 1; tries++)
 		{
-			job.try_again = DC_DONT_TRY_AGAIN; // this can be modified by a job using dc_job_try_again_later()
-
-			switch (job.action) {
-				case DC_JOB_SEND_MSG_TO_SMTP:     dc_job_do_DC_JOB_SEND                 (context, &job); break;
-				case DC_JOB_DELETE_MSG_ON_IMAP:   dc_job_do_DC_JOB_DELETE_MSG_ON_IMAP   (context, &job); break;
-				case DC_JOB_MARKSEEN_MSG_ON_IMAP: dc_job_do_DC_JOB_MARKSEEN_MSG_ON_IMAP (context, &job); break;
-				case DC_JOB_MARKSEEN_MDN_ON_IMAP: dc_job_do_DC_JOB_MARKSEEN_MDN_ON_IMAP (context, &job); break;
-				case DC_JOB_MOVE_MSG:             dc_job_do_DC_JOB_MOVE_MSG             (context, &job); break;
-				case DC_JOB_SEND_MDN:             dc_job_do_DC_JOB_SEND                 (context, &job); break;
-				case DC_JOB_CONFIGURE_IMAP:       dc_job_do_DC_JOB_CONFIGURE_IMAP       (context, &job); break;
-				case DC_JOB_IMEX_IMAP:            dc_job_do_DC_JOB_IMEX_IMAP            (context, &job); break;
-				case DC_JOB_MAYBE_SEND_LOCATIONS: dc_job_do_DC_JOB_MAYBE_SEND_LOCATIONS (context, &job); break;
-				case DC_JOB_MAYBE_SEND_LOC_ENDED: dc_job_do_DC_JOB_MAYBE_SEND_LOC_ENDED (context, &job); break;
-				case DC_JOB_HOUSEKEEPING:         dc_housekeeping                       (context);       break;
+			// the second try is only done for the jobs that want to be tried again at once
+			todo_cnt = 0;
+			for (i = 0; i < jobs_cnt; i++) {
+				if (tries==0 || jobs[i]->try_again==DC_AT_ONCE) {
+					jobs[i]->try_again = DC_DONT_TRY_AGAIN; // this can be modified by a job using dc_job_try_again_later()
+					todo[todo_cnt++] = jobs[i];
+				}
 			}
 
-			if (job.try_again!=DC_AT_ONCE) {
+			if (todo_cnt==0) {
 				break;
 			}
+
+			uint64_t start = dc_metrics_now();
+			switch (todo[0]->action) {
+				case DC_JOB_SEND_MSG_TO_SMTP:     dc_job_do_DC_JOB_SEND                 (context, todo[0]);  break;
+				case DC_JOB_DELETE_MSG_ON_IMAP:   dc_job_do_DC_JOB_DELETE_MSG_ON_IMAP   (context, todo, todo_cnt); break;
+				case DC_JOB_MARKSEEN_MSG_ON_IMAP: dc_job_do_DC_JOB_MARKSEEN_MSG_ON_IMAP (context, todo, todo_cnt); break;
+				case DC_JOB_MARKSEEN_MDN_ON_IMAP: dc_job_do_DC_JOB_MARKSEEN_MDN_ON_IMAP (context, todo[0]);  break;
+				case DC_JOB_MOVE_MSG:             dc_job_do_DC_JOB_MOVE_MSG             (context, todo, todo_cnt); break;
+				case DC_JOB_SEND_MDN:             dc_job_do_DC_JOB_SEND                 (context, todo[0]);  break;
+				case DC_JOB_CONFIGURE_IMAP:       dc_job_do_DC_JOB_CONFIGURE_IMAP       (context, todo[0]);  break;
+				case DC_JOB_IMEX_IMAP:            dc_job_do_DC_JOB_IMEX_IMAP            (context, todo[0]);  break;
+				case DC_JOB_MAYBE_SEND_LOCATIONS: dc_job_do_DC_JOB_MAYBE_SEND_LOCATIONS (context, todo[0]);  break;
+				case DC_JOB_MAYBE_SEND_LOC_ENDED: dc_job_do_DC_JOB_MAYBE_SEND_LOC_ENDED (context, todo[0]);  break;
+				case DC_JOB_HOUSEKEEPING:         dc_housekeeping                       (context);           break;
+				case DC_JOB_FTS_BACKFILL:         dc_fts_backfill                       (context);           break;
+			}
+			dc_metrics_add_by_name(context->metrics, job_metric_name(todo[0]->action), dc_metrics_now()-start);
 		}
 
 		if (IS_EXCLUSIVE_JOB) {
 			dc_jobthread_suspend(&context->sentbox_thread, 0);
 			dc_jobthread_suspend(&context->mvbox_thread, 0);
 			dc_suspend_smtp_thread(context, 0);
-			goto cleanup;
+			break;
 		}
-		else if (job.try_again==DC_INCREATION_POLL)
-		{
-			// just try over next loop unconditionally, the ui typically interrupts idle when the file (video) is ready
-			dc_log_info(context, 0, "%s-job #%i not yet ready and will be delayed.", THREAD_STR, (int)job.job_id);
-		}
-		else if (job.try_again==DC_AT_ONCE || job.try_again==DC_STANDARD_DELAY)
+
+		for (i = 0; i < jobs_cnt; i++)
 		{
-			int tries = job.tries + 1;
+			dc_job_t* job = jobs[i];
 
-			if( tries < JOB_RETRIES ) {
-				job.tries = tries;
+			if (job->try_again==DC_INCREATION_POLL)
+			{
+				// just try over next loop unconditionally, the ui typically interrupts idle when the file (video) is ready
+				dc_log_info(context, 0, "%s-job #%i not yet ready and will be delayed.", THREAD_STR, (int)job->job_id);
+				continue; // the job is put back to the queue unchanged
+			}
+			else if (job->try_again==DC_AT_ONCE || job->try_again==DC_STANDARD_DELAY)
+			{
+				int tries = job->tries + 1;
 
-				time_t time_offset = get_backoff_time_offset(tries);
-				job.desired_timestamp = job.added_timestamp + time_offset;
+				if( tries < JOB_RETRIES ) {
+					job->tries = tries;
 
-				dc_job_update(context, &job);
-				dc_log_info(context, 0, "%s-job #%i not succeeded on try #%i, retry in ADD_TIME+%i (in %i seconds).", THREAD_STR, (int)job.job_id,
-					tries, time_offset, (job.added_timestamp+time_offset)-time(NULL));
+					time_t time_offset = get_backoff_time_offset(tries);
+					job->desired_timestamp = job->added_timestamp + time_offset;
 
-				if (thread==DC_SMTP_THREAD && tries<(JOB_RETRIES-1)) {
-					pthread_mutex_lock(&context->smtpidle_condmutex);
-						context->perform_smtp_jobs_needed = DC_JOBS_NEEDED_AVOID_DOS;
-					pthread_mutex_unlock(&context->smtpidle_condmutex);
+					dc_job_update(context, job);
+					dc_log_info(context, 0, "%s-job #%i not succeeded on try #%i, retry in ADD_TIME+%i (in %i seconds).", THREAD_STR, (int)job->job_id,
+						tries, time_offset, (job->added_timestamp+time_offset)-time(NULL));
+
+					if (thread==DC_SMTP_THREAD && tries<(JOB_RETRIES-1)) {
+						pthread_mutex_lock(&context->smtpidle_condmutex);
+							context->perform_smtp_jobs_needed = DC_JOBS_NEEDED_AVOID_DOS;
+						pthread_mutex_unlock(&context->smtpidle_condmutex);
+					}
+
+					if (probe_network) {
+						// on dc_maybe_network() we stop trying here;
+						// these jobs are already tried once.
+						// otherwise, we just continue with the next job
+						// to give other jobs a chance being tried at least once.
+						stop = 1;
+					}
+					continue; // the job is put back to the queue with the new desired_timestamp
 				}
-			}
-			else {
-				if (job.action==DC_JOB_SEND_MSG_TO_SMTP) { // in all other cases, the messages is already sent
-					dc_set_msg_failed(context, job.foreign_id, job.pending_error);
+				else {
+					if (job->action==DC_JOB_SEND_MSG_TO_SMTP) { // in all other cases, the messages is already sent
+						dc_set_msg_failed(context, job->foreign_id, job->pending_error);
+					}
+					if (probe_network) {
+						stop = 1;
+					}
 				}
-				dc_job_delete(context, &job);
 			}
 
-			if (probe_network) {
-				// on dc_maybe_network() we stop trying here;
-				// these jobs are already tried once.
-				// otherwise, we just continue with the next job
-				// to give other jobs a chance being tried at least once.
-				goto cleanup;
-			}
-		}
-		else
-		{
-			dc_job_delete(context, &job);
+			dc_job_delete(context, job);
+
+			pthread_mutex_lock(&context->jobs_critical);
+				jobs[i] = NULL;
+				free_job(job);
+			pthread_mutex_unlock(&context->jobs_critical);
 		}
 	}
 
-cleanup:
-	dc_param_unref(job.param);
-	free(job.pending_error);
-	sqlite3_finalize(select_stmt);
+	// put back the jobs that should be tried later or that are not yet performed
+	pthread_mutex_lock(&context->jobs_critical);
+		for (first = 0; first < due_cnt; first++) {
+			if (due[first]) {
+				requeue_job(context, queue, due[first], generation);
+			}
+		}
+		queue->running     = NULL;
+		queue->running_cnt = 0;
+	pthread_mutex_unlock(&context->jobs_critical);
+
+	free(due);
+	free(todo);
 }
 
 
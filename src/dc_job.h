@@ -11,7 +11,8 @@ extern "C" {
 
 
 // jobs in the INBOX-thread, range from DC_IMAP_THREAD..DC_IMAP_THREAD+999
-#define DC_JOB_HOUSEKEEPING           105    // low priority ...
+#define DC_JOB_FTS_BACKFILL           102    // low priority ...
+#define DC_JOB_HOUSEKEEPING           105
 #define DC_JOB_DELETE_MSG_ON_IMAP     110
 #define DC_JOB_MARKSEEN_MDN_ON_IMAP   120
 #define DC_JOB_MARKSEEN_MSG_ON_IMAP   130
@@ -55,12 +56,31 @@ struct _dc_job
 
 	int         try_again;
 	char*       pending_error; // discarded if the retry succeeds
+	int         killed;        // set by dc_job_kill_action() while the job is performed
 };
 
 
+/**
+ * Library-internal.
+ * The in-memory copy of the jobs of one thread, see dc_job_perform().
+ */
+typedef struct _dc_jobqueue
+{
+	/** @privatesection */
+
+	dc_job_t**  heap;          // binary min-heap ordered by desired_timestamp, then by job_id
+	size_t      cnt;
+	size_t      allocated;
+
+	dc_job_t**  running;       // the jobs taken from the heap and performed at the moment, items may be NULL
+	size_t      running_cnt;
+} dc_jobqueue_t;
+
+
 void     dc_job_add                   (dc_context_t*, int action, int foreign_id, const char* param, int delay);
 int      dc_job_action_exists         (dc_context_t*, int action);
 void     dc_job_kill_action           (dc_context_t*, int action); /* delete all pending jobs with the given action */
+void     dc_job_unload_queues         (dc_context_t*); /* must be called when the database is closed or replaced */
 
 int      dc_job_send_msg              (dc_context_t*, uint32_t msg_id); /* special case for DC_JOB_SEND_MSG_TO_SMTP */
 
@@ -153,6 +153,7 @@ void dc_jobthread_fetch(dc_jobthread_t* jobthread, int use_network)
 	}
 
 	dc_log_info(jobthread->context, 0, "%s-fetch started...", jobthread->name);
+
 	dc_imap_fetch(jobthread->imap);
 
 	if (jobthread->imap->should_reconnect)
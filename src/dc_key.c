@@ -1,6 +1,7 @@
 #include <ctype.h>
 #include <memory.h>
 #include "dc_context.h"
+#include "dc_base64.h"
 #include "dc_key.h"
 #include "dc_pgp.h"
 #include "dc_tools.h"
@@ -51,7 +52,8 @@ dc_key_t* dc_key_ref(dc_key_t* key)
 	if (key==NULL) {
 		return NULL;
 	}
-	key->_m_heap_refcnt++;
+	// copies of cached peerstates share their keys and are released on any thread
+	__atomic_add_fetch(&key->_m_heap_refcnt, 1, __ATOMIC_ACQ_REL);
 	return key;
 }
 
@@ -62,8 +64,7 @@ void dc_key_unref(dc_key_t* key)
 		return;
 	}
 
-	key->_m_heap_refcnt--;
-	if (key->_m_heap_refcnt != 0) {
+	if (__atomic_sub_fetch(&key->_m_heap_refcnt, 1, __ATOMIC_ACQ_REL) != 0) {
 		return;
 	}
 
@@ -111,8 +112,9 @@ int dc_key_set_from_stmt(dc_key_t* key, sqlite3_stmt* stmt, int index, int type)
 
 int dc_key_set_from_base64(dc_key_t* key, const char* base64, int type)
 {
-	size_t indx = 0, result_len = 0;
-	char* result = NULL;
+	size_t   base64_bytes = 0;
+	uint8_t* result = NULL;
+	size_t   result_len = 0;
 
 	dc_key_empty(key);
 
@@ -120,24 +122,34 @@ int dc_key_set_from_base64(dc_key_t* key, const char* base64, int type)
 		return 0;
 	}
 
-	if (mailmime_base64_body_parse(base64, strlen(base64), &indx, &result/*must be freed using mmap_string_unref()*/, &result_len)!=MAILIMF_NO_ERROR
-	 || result==NULL || result_len==0) {
+	base64_bytes = strlen(base64);
+	if ((result=malloc(DC_BASE64_DECODED_MAX(base64_bytes)+1))==NULL) {
+		exit(67);
+	}
+
+	if ((result_len=dc_base64_decode(base64, base64_bytes, result))==0) {
+		free(result);
 		return 0; /* bad key */
 	}
 
 	dc_key_set_from_binary(key, result, result_len, type);
-	mmap_string_unref(result);
+	dc_wipe_secret_mem(result, result_len);
+	free(result);
 
 	return 1;
 }
 
 
+#define DC_KEY_FILE_MAX_BYTES (4*1024*1024) /* larger files are no keys; do not copy them to the heap */
+
+
 int dc_key_set_from_file(dc_key_t* key, const char* pathNfilename, dc_context_t* context)
 {
 	char*       buf = NULL;
 	const char* headerline = NULL; // just pointer inside buf, must not be freed
 	const char* base64 = NULL;     //   - " -
-	size_t      buf_bytes = 0;
+	const void* mapped = NULL;
+	size_t      mapped_bytes = 0;
 	int         type = -1;
 	int         success = 0;
 
@@ -147,11 +159,13 @@ int dc_key_set_from_file(dc_key_t* key, const char* pathNfilename, dc_context_t*
 		goto cleanup;
 	}
 
-	if (!dc_read_file(context, pathNfilename, (void**)&buf, &buf_bytes)
-	 || buf_bytes < 50) {
+	if (!dc_map_file(context, pathNfilename, DC_KEY_FILE_MAX_BYTES, &mapped, &mapped_bytes)
+	 || mapped_bytes < 50) {
 		goto cleanup; /* error is already loged */
 	}
 
+	buf = dc_null_terminate(mapped, mapped_bytes); /* dc_split_armored_data() needs a writable, null-terminated string */
+
 	if (!dc_split_armored_data(buf, &headerline, NULL, NULL, &base64)
 	 || headerline==NULL || base64==NULL) {
 		goto cleanup;
@@ -176,6 +190,7 @@ int dc_key_set_from_file(dc_key_t* key, const char* pathNfilename, dc_context_t*
 	success = 1;
 
 cleanup:
+	dc_unmap_file(mapped, mapped_bytes);
 	free(buf);
 	return success;
 }
@@ -226,6 +241,8 @@ int dc_key_save_self_keypair(const dc_key_t* public_key, const dc_key_t* private
 		goto cleanup;
 	}
 
+	dc_pgp_clear_key_cache(); /* do not keep the old keys pinned in the cache */
+
 	success = 1;
 
 cleanup:
@@ -315,9 +332,10 @@ char* dc_render_base64(const void* buf, size_t buf_bytes, int break_every, const
 		goto cleanup;
 	}
 
-	if ((ret = encode_base64((const char*)buf, buf_bytes))==NULL) {
-		goto cleanup;
+	if ((ret=malloc(DC_BASE64_ENCODED_BYTES(buf_bytes)+1))==NULL) {
+		exit(68);
 	}
+	ret[dc_base64_encode(buf, buf_bytes, ret)] = 0;
 
 	#if 0
 	if (add_checksum==1/*appended checksum*/) {
@@ -326,11 +344,11 @@ char* dc_render_base64(const void* buf, size_t buf_bytes, int break_every, const
 		c[0] = (uint8_t)((checksum >> 16)&0xFF);
 		c[1] = (uint8_t)((checksum >> 8)&0xFF);
 		c[2] = (uint8_t)((checksum)&0xFF);
-		char* c64 = encode_base64((const char*)c, 3);
-			char* temp = ret;
-				ret = dc_mprintf("%s=%s", temp, c64);
-			free(temp);
-		free(c64);
+		char c64[DC_BASE64_ENCODED_BYTES(3)+1];
+		c64[dc_base64_encode(c, 3, c64)] = 0;
+		char* temp = ret;
+			ret = dc_mprintf("%s=%s", temp, c64);
+		free(temp);
 	}
 	#endif
 
@@ -346,11 +364,11 @@ char* dc_render_base64(const void* buf, size_t buf_bytes, int break_every, const
 		c[0] = (uint8_t)((checksum >> 16)&0xFF);
 		c[1] = (uint8_t)((checksum >> 8)&0xFF);
 		c[2] = (uint8_t)((checksum)&0xFF);
-		char* c64 = encode_base64((const char*)c, 3);
-			char* temp = ret;
-				ret = dc_mprintf("%s%s=%s", temp, break_chars, c64);
-			free(temp);
-		free(c64);
+		char c64[DC_BASE64_ENCODED_BYTES(3)+1];
+		c64[dc_base64_encode(c, 3, c64)] = 0;
+		char* temp = ret;
+			ret = dc_mprintf("%s%s=%s", temp, break_chars, c64);
+		free(temp);
 	}
 
 cleanup:
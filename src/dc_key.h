@@ -25,7 +25,7 @@ struct _dc_key
 	int            type;
 
 	/** @privatesection */
-	int            _m_heap_refcnt; /* !=0 for objects created with dc_key_new(), 0 for stack objects  */
+	int            _m_heap_refcnt; /* !=0 for objects created with dc_key_new(), 0 for stack objects; changed atomically */
 };
 
 
@@ -0,0 +1,402 @@
+#include <time.h>
+#include "dc_context.h"
+#include "dc_metrics.h"
+
+
+/* The metrics are always collected, so recording must be cheap:
+a call to dc_metrics_add() costs one clock read by the caller and
+some additions while holding an uncontended mutex.  Everything else,
+as percentiles and formatting, is done when the metrics are read. */
+
+
+static const char* s_fixed_names[DC_METRIC_FIXED_CNT] = {
+	 "imap.connect"
+	,"imap.select"
+	,"imap.fetch_headers"
+	,"imap.fetch_bodies"
+	,"imap.fetch_flags"
+	,"imap.store"
+	,"imap.move"
+	,"imap.list"
+	,"smtp.send"
+	,"sql.write"
+	,"sql.read"
+	,"pgp.sign"
+	,"pgp.encrypt"
+	,"pgp.decrypt"
+	,"mime.parse"
+	,"event.callback"
+};
+
+
+/**
+ * Get a monotonic timestamp in microseconds, the difference of two
+ * timestamps can be given to dc_metrics_add().
+ *
+ * @private @memberof dc_metrics_t
+ */
+uint64_t dc_metrics_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + (uint64_t)ts.tv_nsec/1000;
+}
+
+
+dc_metrics_t* dc_metrics_new(void)
+{
+	dc_metrics_t* metrics = NULL;
+
+	if ((metrics=calloc(1, sizeof(dc_metrics_t)))==NULL
+	 || (metrics->metrics=calloc(DC_METRIC_FIXED_CNT+16, sizeof(dc_metric_t)))==NULL) {
+		exit(62);
+	}
+
+	pthread_mutex_init(&metrics->mutex, NULL);
+	metrics->allocated = DC_METRIC_FIXED_CNT+16;
+	for (int i = 0; i < DC_METRIC_FIXED_CNT; i++) {
+		metrics->metrics[i].name = dc_strdup(s_fixed_names[i]);
+	}
+	metrics->cnt = DC_METRIC_FIXED_CNT;
+	metrics->started_us = dc_metrics_now();
+
+	return metrics;
+}
+
+
+void dc_metrics_unref(dc_metrics_t* metrics)
+{
+	if (metrics==NULL) {
+		return;
+	}
+
+	for (int i = 0; i < metrics->cnt; i++) {
+		free(metrics->metrics[i].name);
+	}
+	free(metrics->metrics);
+	pthread_mutex_destroy(&metrics->mutex);
+	free(metrics);
+}
+
+
+/**
+ * Set all counters to zero.  The metrics added by name are kept,
+ * so that the order of the metrics does not change.
+ *
+ * @private @memberof dc_metrics_t
+ */
+void dc_metrics_reset(dc_metrics_t* metrics)
+{
+	if (metrics==NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&metrics->mutex);
+		for (int i = 0; i < metrics->cnt; i++) {
+			char* name = metrics->metrics[i].name;
+			memset(&metrics->metrics[i], 0, sizeof(dc_metric_t));
+			metrics->metrics[i].name = name;
+		}
+		metrics->started_us = dc_metrics_now();
+	pthread_mutex_unlock(&metrics->mutex);
+}
+
+
+static void add_to_metric(dc_metric_t* metric, uint64_t duration_us) /* must be called with the mutex locked */
+{
+	int bucket = 0;
+	for (uint64_t d = duration_us; d && bucket < DC_METRICS_BUCKETS-1; d >>= 1) {
+		bucket++;
+	}
+
+	metric->cnt++;
+	metric->total_us += duration_us;
+	metric->max_us = DC_MAX(metric->max_us, duration_us);
+	metric->buckets[bucket]++;
+}
+
+
+/**
+ * Record the duration of an operation.
+ *
+ * @private @memberof dc_metrics_t
+ * @param metrics The metrics object, if NULL, nothing is done.
+ * @param id One of the DC_METRIC_* constants.
+ * @param duration_us The duration in microseconds, typically calculated using dc_metrics_now().
+ */
+void dc_metrics_add(dc_metrics_t* metrics, int id, uint64_t duration_us)
+{
+	if (metrics==NULL || id < 0 || id >= DC_METRIC_FIXED_CNT) {
+		return;
+	}
+
+	pthread_mutex_lock(&metrics->mutex);
+		add_to_metric(&metrics->metrics[id], duration_us);
+	pthread_mutex_unlock(&metrics->mutex);
+}
+
+
+/**
+ * Record the duration of an operation that has no DC_METRIC_* constant.
+ * The metric is created on first use, this should be used for a
+ * small number of different names only.
+ *
+ * @private @memberof dc_metrics_t
+ */
+void dc_metrics_add_by_name(dc_metrics_t* metrics, const char* name, uint64_t duration_us)
+{
+	int i = 0;
+
+	if (metrics==NULL || name==NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&metrics->mutex);
+
+		for (i = DC_METRIC_FIXED_CNT; i < metrics->cnt; i++) {
+			if (strcmp(metrics->metrics[i].name, name)==0) {
+				break;
+			}
+		}
+
+		if (i==metrics->cnt) {
+			if (metrics->cnt >= metrics->allocated) {
+				metrics->allocated *= 2;
+				if ((metrics->metrics=realloc(metrics->metrics, metrics->allocated*sizeof(dc_metric_t)))==NULL) {
+					exit(63);
+				}
+			}
+			memset(&metrics->metrics[i], 0, sizeof(dc_metric_t));
+			metrics->metrics[i].name = dc_strdup(name);
+			metrics->cnt++;
+		}
+
+		add_to_metric(&metrics->metrics[i], duration_us);
+
+	pthread_mutex_unlock(&metrics->mutex);
+}
+
+
+/**
+ * Remember the start of an operation that is ended at another place,
+ * eg. in another callback.  The key identifies the operation;
+ * if the operation is already started, the first start is kept.
+ *
+ * @private @memberof dc_metrics_t
+ */
+void dc_metrics_begin(dc_metrics_t* metrics, const void* key)
+{
+	if (metrics==NULL || key==NULL) {
+		return;
+	}
+
+	uint64_t now = dc_metrics_now();
+
+	pthread_mutex_lock(&metrics->mutex);
+		int free_slot = -1;
+		for (int i = 0; i < DC_METRICS_MAX_PENDING; i++) {
+			if (metrics->pending_key[i]==key) {
+				free_slot = -1;
+				break;
+			}
+			else if (metrics->pending_key[i]==NULL && free_slot==-1) {
+				free_slot = i;
+			}
+		}
+		if (free_slot >= 0) { /* if there are too many pending operations, we skip this one */
+			metrics->pending_key[free_slot] = key;
+			metrics->pending_start_us[free_slot] = now;
+		}
+	pthread_mutex_unlock(&metrics->mutex);
+}
+
+
+/**
+ * Record the duration of an operation started by dc_metrics_begin().
+ * If the operation was not started, nothing is recorded.
+ *
+ * @private @memberof dc_metrics_t
+ */
+void dc_metrics_end(dc_metrics_t* metrics, int id, const void* key)
+{
+	if (metrics==NULL || key==NULL || id < 0 || id >= DC_METRIC_FIXED_CNT) {
+		return;
+	}
+
+	uint64_t now = dc_metrics_now();
+
+	pthread_mutex_lock(&metrics->mutex);
+		for (int i = 0; i < DC_METRICS_MAX_PENDING; i++) {
+			if (metrics->pending_key[i]==key) {
+				metrics->pending_key[i] = NULL;
+				add_to_metric(&metrics->metrics[id], now-metrics->pending_start_us[i]);
+				break;
+			}
+		}
+	pthread_mutex_unlock(&metrics->mutex);
+}
+
+
+static uint64_t get_percentile(const dc_metric_t* metric, int percent)
+{
+	/* the result is the upper bound of the bucket the percentile falls into, but not more than the maximum */
+	uint64_t wanted = (metric->cnt*percent+99)/100;
+	uint64_t sum = 0;
+
+	for (int i = 0; i < DC_METRICS_BUCKETS; i++) {
+		sum += metric->buckets[i];
+		if (sum >= wanted) {
+			return DC_MIN(((uint64_t)1<<i), metric->max_us);
+		}
+	}
+	return metric->max_us;
+}
+
+
+static dc_metric_t* copy_metrics(dc_metrics_t* metrics, int* ret_cnt, uint64_t* ret_elapsed_us)
+{
+	/* copy the metrics to format them without holding the mutex, the names are still owned by the metrics object */
+	dc_metric_t* copy = NULL;
+
+	pthread_mutex_lock(&metrics->mutex);
+		if ((copy=malloc(metrics->cnt*sizeof(dc_metric_t)))==NULL) {
+			exit(64);
+		}
+		memcpy(copy, metrics->metrics, metrics->cnt*sizeof(dc_metric_t));
+		*ret_cnt = metrics->cnt;
+		*ret_elapsed_us = dc_metrics_now()-metrics->started_us;
+	pthread_mutex_unlock(&metrics->mutex);
+
+	return copy;
+}
+
+
+/**
+ * Get the metrics as a JSON object.  Only operations that were done at least
+ * once are listed, see dc_get_metrics() for the format.
+ *
+ * @private @memberof dc_metrics_t
+ */
+char* dc_metrics_get_json(dc_metrics_t* metrics)
+{
+	dc_strbuilder_t ret;
+	dc_metric_t*    copy = NULL;
+	int             cnt = 0;
+	int             printed = 0;
+	uint64_t        elapsed_us = 0;
+
+	dc_strbuilder_init(&ret, 0);
+
+	if (metrics==NULL) {
+		dc_strbuilder_cat(&ret, "{}");
+		goto cleanup;
+	}
+
+	copy = copy_metrics(metrics, &cnt, &elapsed_us);
+
+	dc_strbuilder_catf(&ret, "{\"version\":1,\"elapsed_ms\":%llu,\"metrics\":[", (unsigned long long)(elapsed_us/1000));
+	for (int i = 0; i < cnt; i++)
+	{
+		const dc_metric_t* m = &copy[i];
+		if (m->cnt==0) {
+			continue;
+		}
+
+		dc_strbuilder_catf(&ret, "%s\n{\"name\":\"%s\",\"count\":%llu,\"total_us\":%llu,\"max_us\":%llu,"
+			"\"p50_us\":%llu,\"p90_us\":%llu,\"p99_us\":%llu,\"buckets\":[",
+			printed++? "," : "", m->name, (unsigned long long)m->cnt, (unsigned long long)m->total_us, (unsigned long long)m->max_us,
+			(unsigned long long)get_percentile(m, 50), (unsigned long long)get_percentile(m, 90), (unsigned long long)get_percentile(m, 99));
+
+		int last = DC_METRICS_BUCKETS-1;
+		while (last > 0 && m->buckets[last]==0) {
+			last--;
+		}
+		for (int b = 0; b <= last; b++) {
+			dc_strbuilder_catf(&ret, "%s%u", b? "," : "", m->buckets[b]);
+		}
+		dc_strbuilder_cat(&ret, "]}");
+	}
+	dc_strbuilder_cat(&ret, "]}");
+
+cleanup:
+	free(copy);
+	return ret.buf;
+}
+
+
+static uint8_t* add_varint(uint8_t* p, uint64_t value)
+{
+	/* LEB128: 7 bits per byte, the lowest first, the high bit is set if more bytes follow */
+	do {
+		*p = (uint8_t)(value&0x7F);
+		value >>= 7;
+		if (value) {
+			*p |= 0x80;
+		}
+		p++;
+	} while (value);
+	return p;
+}
+
+
+/**
+ * Get the metrics as a compact binary snapshot, see dc_get_metrics() for the format.
+ *
+ * @private @memberof dc_metrics_t
+ */
+uint8_t* dc_metrics_get_binary(dc_metrics_t* metrics, size_t* ret_bytes)
+{
+	#define      MAX_VARINT_BYTES 10
+	uint8_t*     ret = NULL;
+	uint8_t*     p = NULL;
+	dc_metric_t* copy = NULL;
+	int          cnt = 0;
+	int          used_cnt = 0;
+	uint64_t     elapsed_us = 0;
+	size_t       max_bytes = 4 + 3*MAX_VARINT_BYTES;
+
+	if (metrics==NULL || ret_bytes==NULL) {
+		return NULL;
+	}
+
+	copy = copy_metrics(metrics, &cnt, &elapsed_us);
+	for (int i = 0; i < cnt; i++) {
+		if (copy[i].cnt) {
+			max_bytes += (4+DC_METRICS_BUCKETS)*MAX_VARINT_BYTES + strlen(copy[i].name);
+			used_cnt++;
+		}
+	}
+
+	if ((ret=malloc(max_bytes))==NULL) {
+		exit(65);
+	}
+
+	p = ret;
+	memcpy(p, "DCM\x01", 4);
+	p += 4;
+	p = add_varint(p, elapsed_us/1000);
+	p = add_varint(p, used_cnt);
+	p = add_varint(p, DC_METRICS_BUCKETS);
+	for (int i = 0; i < cnt; i++)
+	{
+		const dc_metric_t* m = &copy[i];
+		if (m->cnt==0) {
+			continue;
+		}
+
+		size_t name_bytes = strlen(m->name);
+		p = add_varint(p, name_bytes);
+		memcpy(p, m->name, name_bytes);
+		p += name_bytes;
+		p = add_varint(p, m->cnt);
+		p = add_varint(p, m->total_us);
+		p = add_varint(p, m->max_us);
+		for (int b = 0; b < DC_METRICS_BUCKETS; b++) {
+			p = add_varint(p, m->buckets[b]);
+		}
+	}
+
+	free(copy);
+	*ret_bytes = p-ret;
+	return ret;
+}
@@ -0,0 +1,83 @@
+#ifndef __DC_METRICS_H__
+#define __DC_METRICS_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*** library-private **********************************************************/
+
+typedef struct _dc_metric  dc_metric_t;
+typedef struct _dc_metrics dc_metrics_t;
+
+
+/* the operations measured by their id, the names are defined in dc_metrics.c;
+other operations, as the jobs, are added by name using dc_metrics_add_by_name() */
+#define DC_METRIC_IMAP_CONNECT        0
+#define DC_METRIC_IMAP_SELECT         1
+#define DC_METRIC_IMAP_FETCH_HEADERS  2
+#define DC_METRIC_IMAP_FETCH_BODIES   3
+#define DC_METRIC_IMAP_FETCH_FLAGS    4
+#define DC_METRIC_IMAP_STORE          5
+#define DC_METRIC_IMAP_MOVE           6
+#define DC_METRIC_IMAP_LIST           7
+#define DC_METRIC_SMTP_SEND           8
+#define DC_METRIC_SQL_WRITE           9
+#define DC_METRIC_SQL_READ           10
+#define DC_METRIC_PGP_SIGN           11
+#define DC_METRIC_PGP_ENCRYPT        12
+#define DC_METRIC_PGP_DECRYPT        13
+#define DC_METRIC_MIME_PARSE         14
+#define DC_METRIC_EVENT_CALLBACK     15
+#define DC_METRIC_FIXED_CNT          16
+
+
+/* bucket 0 counts durations below 1 microsecond, bucket i>0 durations of 2^(i-1) to 2^i-1 microseconds;
+the last bucket also gets all longer durations, starting at about 67 seconds */
+#define DC_METRICS_BUCKETS 28
+
+
+struct _dc_metric
+{
+	char*           name;
+	uint64_t        cnt;
+	uint64_t        total_us;
+	uint64_t        max_us;
+	uint32_t        buckets[DC_METRICS_BUCKETS];
+};
+
+
+struct _dc_metrics
+{
+	pthread_mutex_t mutex;          /* protects all fields below, it is held only for some instructions */
+	uint64_t        started_us;     /* creation or last reset */
+	dc_metric_t*    metrics;        /* the first DC_METRIC_FIXED_CNT are the ones defined above */
+	int             cnt;
+	int             allocated;
+
+	/* operations started by dc_metrics_begin() that are not yet ended */
+	#define         DC_METRICS_MAX_PENDING 32
+	const void*     pending_key[DC_METRICS_MAX_PENDING];
+	uint64_t        pending_start_us[DC_METRICS_MAX_PENDING];
+};
+
+
+uint64_t      dc_metrics_now         (void);
+
+dc_metrics_t* dc_metrics_new         (void);
+void          dc_metrics_unref       (dc_metrics_t*);
+void          dc_metrics_reset       (dc_metrics_t*);
+
+void          dc_metrics_add         (dc_metrics_t*, int id, uint64_t duration_us);
+void          dc_metrics_add_by_name (dc_metrics_t*, const char* name, uint64_t duration_us);
+void          dc_metrics_begin       (dc_metrics_t*, const void* key);
+void          dc_metrics_end         (dc_metrics_t*, int id, const void* key);
+
+char*         dc_metrics_get_json    (dc_metrics_t*);
+uint8_t*      dc_metrics_get_binary  (dc_metrics_t*, size_t* ret_bytes);
+
+
+#ifdef __cplusplus
+} /* /extern "C" */
+#endif
+#endif /* __DC_METRICS_H__ */
@@ -64,10 +64,12 @@ void dc_mimefactory_empty(dc_mimefactory_t* factory)
 	free(factory->references);
 	factory->references = NULL;
 
-	if (factory->out) {
-		mmap_string_free(factory->out);
-		factory->out = NULL;
+	if (factory->out_file) {
+		dc_delete_file(factory->context, factory->out_file);
+		free(factory->out_file);
+		factory->out_file = NULL;
 	}
+	factory->out_bytes = 0;
 	factory->out_encrypted = 0;
 	factory->loaded = DC_MF_NOTHING_LOADED;
 
@@ -427,6 +429,60 @@ static char* get_subject(const dc_chat_t* chat, const dc_msg_t* msg, int afwd_em
 }
 
 
+static int write_spool_file(dc_mimefactory_t* factory, struct mailmime* message)
+{
+	int   success = 0;
+	int   col = 0;
+	char* pathNfilename = NULL;
+	char* pathNfilename_abs = NULL;
+	FILE* f = NULL;
+
+	// find a free file name in the blob directory
+	pathNfilename = dc_get_fine_pathNfilename(factory->context, "$BLOBDIR", factory->rfc724_mid);
+	if (pathNfilename==NULL
+	 || (pathNfilename_abs=dc_get_abs_path(factory->context, pathNfilename))==NULL) {
+		set_error(factory, "Cannot find free file name for the message.");
+		goto cleanup;
+	}
+
+	if ((f=fopen(pathNfilename_abs, "wb"))==NULL) {
+		set_error(factory, "Cannot open spool file for writing.");
+		goto cleanup;
+	}
+
+	// attachments are added as MAILMIME_DATA_FILE and are encoded line by line
+	// from the mapped source file, so no buffer grows with the size of the message
+	if (mailmime_write_file(f, &col, message)!=MAILIMF_NO_ERROR) {
+		set_error(factory, "Cannot write spool file.");
+		goto cleanup;
+	}
+
+	factory->out_bytes = (size_t)ftell(f);
+
+	if (fclose(f)!=0) {
+		f = NULL;
+		set_error(factory, "Cannot write spool file.");
+		goto cleanup;
+	}
+	f = NULL;
+
+	factory->out_file = pathNfilename;
+	pathNfilename = NULL;
+	success = 1;
+
+cleanup:
+	if (f) {
+		fclose(f);
+	}
+	if (!success && pathNfilename_abs) {
+		remove(pathNfilename_abs);
+	}
+	free(pathNfilename_abs);
+	free(pathNfilename);
+	return success;
+}
+
+
 int dc_mimefactory_render(dc_mimefactory_t* factory)
 {
 	struct mailimf_fields* imf_fields = NULL;
@@ -435,7 +491,6 @@ int dc_mimefactory_render(dc_mimefactory_t* factory)
 	char*                  message_text2 = NULL;
 	char*                  subject_str = NULL;
 	int                    afwd_email = 0;
-	int                    col = 0;
 	int                    success = 0;
 	int                    parts = 0;
 	int                    e2ee_guaranteed = 0;
@@ -446,7 +501,7 @@ int dc_mimefactory_render(dc_mimefactory_t* factory)
 	dc_e2ee_helper_t       e2ee_helper;
 	memset(&e2ee_helper, 0, sizeof(dc_e2ee_helper_t));
 
-	if (factory==NULL || factory->loaded==DC_MF_NOTHING_LOADED || factory->out/*call empty() before*/) {
+	if (factory==NULL || factory->loaded==DC_MF_NOTHING_LOADED || factory->out_file/*call empty() before*/) {
 		set_error(factory, "Invalid use of mimefactory-object.");
 		goto cleanup;
 	}
@@ -826,9 +881,10 @@ int dc_mimefactory_render(dc_mimefactory_t* factory)
 		}
 	}
 
-	/* create the full mail and return */
-	factory->out = mmap_string_new("");
-	mailmime_write_mem(factory->out, &col, message);
+	/* write the full mail to the spool file and return */
+	if (!write_spool_file(factory, message)) {
+		goto cleanup;
+	}
 
 	//{char* t4=dc_null_terminate(ret->str,ret->len); printf("MESSAGE:\n%s\n",t4);free(t4);}
 
@@ -51,8 +51,10 @@ struct _dc_mimefactory {
 	char*         references;
 	int           req_mdn;
 
-	// out: after a call to dc_mimefactory_render(), here's the data or the error
-	MMAPString*   out;
+	// out: after a call to dc_mimefactory_render(), here's the spool file or the error;
+	// the file is deleted by dc_mimefactory_empty() unless the caller takes ownership by setting out_file to NULL
+	char*         out_file;
+	size_t        out_bytes;
 	int           out_encrypted;
 	int           out_gossiped;
 	uint32_t      out_last_added_location_id;
@@ -1,4 +1,6 @@
 #include "dc_context.h"
+#include "dc_base64.h"
+#include "dc_blob.h"
 #include "dc_mimeparser.h"
 #include "dc_mimefactory.h"
 #include "dc_pgp.h"
@@ -487,13 +489,32 @@ struct mailmime_parameter* mailmime_find_ct_parameter(struct mailmime* mime, con
 }
 
 
-int mailmime_transfer_decode(struct mailmime* mime, const char** ret_decoded_data, size_t* ret_decoded_data_bytes, char** ret_to_mmap_string_unref)
+static int get_transfer_encoding(struct mailmime* mime)
+{
+	if (mime->mm_mime_fields!=NULL) {
+		clistiter* cur;
+		for (cur = clist_begin(mime->mm_mime_fields->fld_list); cur!=NULL; cur = clist_next(cur)) {
+			struct mailmime_field* field = (struct mailmime_field*)clist_content(cur);
+			if (field && field->fld_type==MAILMIME_FIELD_TRANSFER_ENCODING && field->fld_data.fld_encoding) {
+				return field->fld_data.fld_encoding->enc_type;
+			}
+		}
+	}
+	return MAILMIME_MECHANISM_BINARY;
+}
+
+
+/* as mailmime_transfer_decode(); if ret_utf8 is set, it gets the result of dc_utf8_check() for the decoded data,
+for quoted-printable, this is done while decoding */
+static int transfer_decode(struct mailmime* mime, const char** ret_decoded_data, size_t* ret_decoded_data_bytes, char** ret_to_mmap_string_unref, int* ret_utf8)
 {
 	int                   mime_transfer_encoding = MAILMIME_MECHANISM_BINARY;
 	struct mailmime_data* mime_data = NULL;
 	const char*           decoded_data = NULL; /* must not be free()'d */
 	size_t                decoded_data_bytes = 0;
 	char*                 transfer_decoding_buffer = NULL; /* mmap_string_unref()'d if set */
+	MMAPString*           str = NULL;
+	int                   utf8 = -1;
 
 	if (mime==NULL || ret_decoded_data==NULL || ret_decoded_data_bytes==NULL || ret_to_mmap_string_unref==NULL
 	 || *ret_decoded_data!=NULL || *ret_decoded_data_bytes!=0 || *ret_to_mmap_string_unref!=NULL) {
@@ -501,17 +522,7 @@ int mailmime_transfer_decode(struct mailmime* mime, const char** ret_decoded_dat
 	}
 
 	mime_data = mime->mm_data.mm_single;
-
-	if (mime->mm_mime_fields!=NULL) {
-		clistiter* cur;
-		for (cur = clist_begin(mime->mm_mime_fields->fld_list); cur!=NULL; cur = clist_next(cur)) {
-			struct mailmime_field* field = (struct mailmime_field*)clist_content(cur);
-			if (field && field->fld_type==MAILMIME_FIELD_TRANSFER_ENCODING && field->fld_data.fld_encoding) {
-				mime_transfer_encoding = field->fld_data.fld_encoding->enc_type;
-				break;
-			}
-		}
-	}
+	mime_transfer_encoding = get_transfer_encoding(mime);
 
 	/* regard `Content-Transfer-Encoding:` */
 	if (mime_transfer_encoding==MAILMIME_MECHANISM_7BIT
@@ -524,8 +535,45 @@ int mailmime_transfer_decode(struct mailmime* mime, const char** ret_decoded_dat
 			return 0; /* no error - but no data */
 		}
 	}
+	else if (mime_transfer_encoding==MAILMIME_MECHANISM_BASE64)
+	{
+		/* decode base64 ourselves as this is much faster for large attachments;
+		the result is a referenced MMAPString as returned by mailmime_part_parse() */
+		const char* encoded = mime_data->dt_data.dt_text.dt_data;
+		size_t      encoded_bytes = mime_data->dt_data.dt_text.dt_length;
+		if (encoded==NULL || encoded_bytes <= 0
+		 || (str=mmap_string_sized_new(DC_BASE64_DECODED_MAX(encoded_bytes)+1))==NULL) {
+			return 0;
+		}
+		str->len = dc_base64_decode(encoded, encoded_bytes, str->str);
+		str->str[str->len] = 0;
+		if (str->len <= 0 || mmap_string_ref(str)!=0) {
+			mmap_string_free(str);
+			return 0;
+		}
+		transfer_decoding_buffer = str->str;
+		decoded_data             = transfer_decoding_buffer;
+		decoded_data_bytes       = str->len;
+	}
+	else if (mime_transfer_encoding==MAILMIME_MECHANISM_QUOTED_PRINTABLE
+	      && mime_data->dt_data.dt_text.dt_data && mime_data->dt_data.dt_text.dt_length > 0
+	      && (str=mmap_string_sized_new(mime_data->dt_data.dt_text.dt_length*2+1))!=NULL
+	      && dc_decode_quoted_printable(mime_data->dt_data.dt_text.dt_data, mime_data->dt_data.dt_text.dt_length, 0, str->str, &str->len, &utf8))
+	{
+		/* decoding and the UTF-8 check in one pass; in some rare cases of malformed data, libetpan is used below */
+		if (str->len <= 0 || mmap_string_ref(str)!=0) {
+			mmap_string_free(str);
+			return 0;
+		}
+		transfer_decoding_buffer = str->str;
+		decoded_data             = transfer_decoding_buffer;
+		decoded_data_bytes       = str->len;
+	}
 	else
 	{
+		if (str) {
+			mmap_string_free(str); /* quoted-printable not decoded above */
+		}
 		int r;
 		size_t current_index = 0;
 		r = mailmime_part_parse(mime_data->dt_data.dt_text.dt_data, mime_data->dt_data.dt_text.dt_length,
@@ -537,6 +585,10 @@ int mailmime_transfer_decode(struct mailmime* mime, const char** ret_decoded_dat
 		decoded_data = transfer_decoding_buffer;
 	}
 
+	if (ret_utf8) {
+		*ret_utf8 = utf8!=-1? utf8 : dc_utf8_check(decoded_data, decoded_data_bytes);
+	}
+
 	*ret_decoded_data         = decoded_data;
 	*ret_decoded_data_bytes   = decoded_data_bytes;
 	*ret_to_mmap_string_unref = transfer_decoding_buffer;
@@ -544,6 +596,12 @@ int mailmime_transfer_decode(struct mailmime* mime, const char** ret_decoded_dat
 }
 
 
+int mailmime_transfer_decode(struct mailmime* mime, const char** ret_decoded_data, size_t* ret_decoded_data_bytes, char** ret_to_mmap_string_unref)
+{
+	return transfer_decode(mime, ret_decoded_data, ret_decoded_data_bytes, ret_to_mmap_string_unref, NULL);
+}
+
+
 struct mailimf_fields* mailmime_find_mailimf_fields(struct mailmime* mime)
 {
 	if (mime==NULL) {
@@ -991,43 +1049,201 @@ static void do_add_single_part(dc_mimeparser_t* parser, dc_mimepart_t* part)
 }
 
 
-static void do_add_single_file_part(dc_mimeparser_t* parser, int msg_type, int mime_type,
-                                    const char* raw_mime,
-                                    const char* decoded_data, size_t decoded_data_bytes,
-                                    const char* desired_filename)
+#define DC_DECODE_CHUNK_BYTES (64*1024) /* encoded bytes decoded at once when writing attachments */
+
+
+typedef struct decoded_file_t
 {
-	dc_mimepart_t* part = NULL;
-	char*          pathNfilename = NULL;
+	dc_blobwriter_t* writer;
+	size_t           bytes;       /* decoded bytes written so far */
+	int              error;
 
-	/* create a free file name to use */
-	if ((pathNfilename=dc_get_fine_pathNfilename(parser->context, "$BLOBDIR", desired_filename))==NULL) {
-		goto cleanup;
+	int              want_filemeta;
+	int              has_filemeta;
+	uint32_t         width;
+	uint32_t         height;
+	char*            head;        /* the first decoded bytes, kept until dc_get_filemeta() succeeds */
+	size_t           head_bytes;
+} decoded_file_t;
+
+
+static void decoded_file_write(decoded_file_t* df, const void* buf, size_t bytes)
+{
+	if (df->error || bytes <= 0) {
+		return;
 	}
 
-	/* copy data to file */
-	if (dc_write_file(parser->context, pathNfilename, decoded_data, decoded_data_bytes)==0) {
-		goto cleanup;
+	if (!dc_blobwriter_write(df->writer, buf, bytes)) {
+		df->error = 1;
+		return;
+	}
+
+	if (df->want_filemeta && !df->has_filemeta && df->bytes < DC_FILEMETA_MAX_BYTES) {
+		/* dc_get_filemeta() gives the same result for any prefix it succeeds on,
+		so we can stop collecting as soon as it does */
+		size_t add = DC_MIN(bytes, DC_FILEMETA_MAX_BYTES-df->head_bytes);
+		if ((df->head=realloc(df->head, df->head_bytes+add))==NULL) {
+			exit(73);
+		}
+		memcpy(df->head+df->head_bytes, buf, add);
+		df->head_bytes += add;
+		if (dc_get_filemeta(df->head, df->head_bytes, &df->width, &df->height)) {
+			df->has_filemeta = 1;
+		}
+		if (df->has_filemeta || df->head_bytes >= DC_FILEMETA_MAX_BYTES) {
+			free(df->head);
+			df->head = NULL;
+		}
+	}
+
+	df->bytes += bytes;
+}
+
+
+static void decoded_file_write_libetpan(decoded_file_t* df, const char* in, size_t in_bytes, int mime_transfer_encoding)
+{
+	char*  decoded = NULL;
+	size_t decoded_bytes = 0;
+	size_t current_index = 0;
+	if (mailmime_part_parse(in, in_bytes, &current_index, mime_transfer_encoding, &decoded, &decoded_bytes)!=MAILIMF_NO_ERROR
+	 || decoded==NULL) {
+		df->error = 1;
+		return;
+	}
+	decoded_file_write(df, decoded, decoded_bytes);
+	mmap_string_unref(decoded);
+}
+
+
+/* returns the number of bytes to decode at once from quoted-printable data,
+chunks must not end inside `=XY`, `=\r\n` or `\r\n`; 0=decode all at once */
+static size_t qp_chunk_bytes(const char* in, size_t in_bytes)
+{
+	if (in_bytes <= DC_DECODE_CHUNK_BYTES) {
+		return in_bytes;
+	}
+
+	for (size_t end = DC_DECODE_CHUNK_BYTES; end > DC_DECODE_CHUNK_BYTES-16; end--) {
+		if (in[end-1]!='=' && in[end-1]!='\r' && in[end-2]!='=') {
+			return end;
+		}
+	}
+
+	return 0; /* garbage as a long sequence of `=` */
+}
+
+
+/* writes the transfer-decoded body of `mime` to a new blob in
+chunks of DC_DECODE_CHUNK_BYTES, so that the decoded data is never held completely in memory;
+for 7bit, 8bit and binary, the body is written as is.
+if ret_filemeta is given, it is set to 1 if dc_get_filemeta() finds the image dimensions in the decoded data.
+returns the number of bytes written, 0 on errors or if there is no data */
+static size_t write_decoded_file(dc_blobwriter_t* writer, struct mailmime* mime,
+                                 int* ret_filemeta, uint32_t* ret_width, uint32_t* ret_height)
+{
+	decoded_file_t        df;
+	char*                 chunk = NULL;
+	struct mailmime_data* mime_data = mime->mm_data.mm_single;
+	const char*           in = mime_data->dt_data.dt_text.dt_data;
+	size_t                in_bytes = mime_data->dt_data.dt_text.dt_length;
+	int                   mime_transfer_encoding = get_transfer_encoding(mime);
+
+	memset(&df, 0, sizeof(decoded_file_t));
+	df.writer        = writer;
+	df.want_filemeta = ret_filemeta!=NULL;
+
+	if (mime_transfer_encoding==MAILMIME_MECHANISM_7BIT
+	 || mime_transfer_encoding==MAILMIME_MECHANISM_8BIT
+	 || mime_transfer_encoding==MAILMIME_MECHANISM_BINARY)
+	{
+		decoded_file_write(&df, in, in_bytes);
+	}
+	else if (mime_transfer_encoding==MAILMIME_MECHANISM_BASE64)
+	{
+		dc_base64_decoder_t decoder;
+		dc_base64_decoder_init(&decoder);
+		if ((chunk=malloc(DC_BASE64_DECODED_MAX(DC_DECODE_CHUNK_BYTES)))==NULL) {
+			exit(74);
+		}
+		while (in_bytes > 0 && !df.error) {
+			size_t chunk_in_bytes = DC_MIN(in_bytes, DC_DECODE_CHUNK_BYTES);
+			decoded_file_write(&df, chunk, dc_base64_decoder_add(&decoder, in, chunk_in_bytes, chunk));
+			in       += chunk_in_bytes;
+			in_bytes -= chunk_in_bytes;
+		}
+		decoded_file_write(&df, chunk, dc_base64_decoder_finish(&decoder, chunk));
+	}
+	else if (mime_transfer_encoding==MAILMIME_MECHANISM_QUOTED_PRINTABLE)
+	{
+		if ((chunk=malloc(DC_DECODE_CHUNK_BYTES*2+1))==NULL) {
+			exit(75);
+		}
+		while (in_bytes > 0 && !df.error) {
+			size_t chunk_in_bytes = qp_chunk_bytes(in, in_bytes), chunk_bytes = 0;
+			if (chunk_in_bytes==0
+			 || !dc_decode_quoted_printable(in, chunk_in_bytes, 0, chunk, &chunk_bytes, NULL)) {
+				/* malformed data, let libetpan decode the remaining bytes, see transfer_decode() */
+				decoded_file_write_libetpan(&df, in, in_bytes, mime_transfer_encoding);
+				break;
+			}
+			decoded_file_write(&df, chunk, chunk_bytes);
+			in       += chunk_in_bytes;
+			in_bytes -= chunk_in_bytes;
+		}
+	}
+	else
+	{
+		decoded_file_write_libetpan(&df, in, in_bytes, mime_transfer_encoding);
+	}
+
+	if (df.has_filemeta) {
+		*ret_filemeta = 1;
+		*ret_width  = df.width;
+		*ret_height = df.height;
+	}
+
+	free(df.head);
+	free(chunk);
+	return df.error? 0 : df.bytes;
+}
+
+
+static void do_add_single_file_part(dc_mimeparser_t* parser, int msg_type, int mime_type,
+                                    const char* raw_mime, struct mailmime* mime,
+                                    const char* desired_filename)
+{
+	dc_mimepart_t*   part = NULL;
+	dc_blobwriter_t* writer = NULL;
+	char*            pathNfilename = NULL;
+	size_t           bytes = 0;
+	int              filemeta = 0;
+	uint32_t         w = 0, h = 0;
+
+	/* decode data to a new file, the file gets its name when it is complete,
+	so several messages can be parsed at the same time */
+	writer = dc_blobwriter_new(parser->context, desired_filename);
+	if ((bytes=write_decoded_file(writer, mime, mime_type==DC_MIMETYPE_IMAGE? &filemeta : NULL, &w, &h))==0
+	 || (pathNfilename=dc_blobwriter_finish(writer))==NULL) {
+		goto cleanup; /* no data or an error */
 	}
 
 	part = dc_mimepart_new();
 	part->type  = msg_type;
 	part->int_mimetype = mime_type;
-	part->bytes = decoded_data_bytes;
+	part->bytes = bytes;
 	dc_param_set(part->param, DC_PARAM_FILE, pathNfilename);
 	dc_param_set(part->param, DC_PARAM_MIMETYPE, raw_mime);
 
-	if (mime_type==DC_MIMETYPE_IMAGE) {
-		uint32_t w = 0, h = 0;
-		if (dc_get_filemeta(decoded_data, decoded_data_bytes, &w, &h)) {
-			dc_param_set_int(part->param, DC_PARAM_WIDTH, w);
-			dc_param_set_int(part->param, DC_PARAM_HEIGHT, h);
-		}
+	if (filemeta) {
+		dc_param_set_int(part->param, DC_PARAM_WIDTH, w);
+		dc_param_set_int(part->param, DC_PARAM_HEIGHT, h);
 	}
 
 	do_add_single_part(parser, part);
 	part = NULL;
 
 cleanup:
+	dc_blobwriter_unref(writer);
 	free(pathNfilename);
 	dc_mimepart_unref(part);
 }
@@ -1047,6 +1263,7 @@ static int dc_mimeparser_add_single_part_if_known(dc_mimeparser_t* mimeparser, s
 
 	char*                        transfer_decoding_buffer = NULL; /* mmap_string_unref()'d if set */
 	char*                        charset_buffer = NULL; /* charconv_buffer_free()'d if set (just calls mmap_string_unref()) */
+	int                          utf8 = DC_UTF8_INVALID; /* set for text parts */
 	const char*                  decoded_data = NULL; /* must not be free()'d */
 	size_t                       decoded_data_bytes = 0;
 	dc_simplify_t*               simplifier = NULL;
@@ -1067,16 +1284,16 @@ static int dc_mimeparser_add_single_part_if_known(dc_mimeparser_t* mimeparser, s
 	}
 
 
-	/* regard `Content-Transfer-Encoding:` */
-	if (!mailmime_transfer_decode(mime, &decoded_data, &decoded_data_bytes, &transfer_decoding_buffer)) {
-		goto cleanup; /* no always error - but no data */
-	}
-
 	switch (mime_type)
 	{
 		case DC_MIMETYPE_TEXT_PLAIN:
 		case DC_MIMETYPE_TEXT_HTML:
 			{
+				/* regard `Content-Transfer-Encoding:` */
+				if (!transfer_decode(mime, &decoded_data, &decoded_data_bytes, &transfer_decoding_buffer, &utf8)) {
+					goto cleanup; /* no always error - but no data */
+				}
+
 				if (simplifier==NULL) {
 					simplifier = dc_simplify_new();
 					if (simplifier==NULL) {
@@ -1085,7 +1302,7 @@ static int dc_mimeparser_add_single_part_if_known(dc_mimeparser_t* mimeparser, s
 				}
 
 				const char* charset = mailmime_content_charset_get(mime->mm_content_type); /* get from `Content-Type: text/...; charset=utf-8`; must not be free()'d */
-				if (charset!=NULL && strcmp(charset, "utf-8")!=0 && strcmp(charset, "UTF-8")!=0) {
+				if (dc_needs_charconv(charset, utf8)) {
 					size_t ret_bytes = 0;
 					int r = charconv_buffer("utf-8", charset, decoded_data, decoded_data_bytes, &charset_buffer, &ret_bytes);
 					if (r!=MAIL_CHARCONV_NO_ERROR) {
@@ -1199,21 +1416,26 @@ static int dc_mimeparser_add_single_part_if_known(dc_mimeparser_t* mimeparser, s
 
 				if (strncmp(desired_filename, "location", 8)==0
 				 && strncmp(desired_filename+strlen(desired_filename)-4, ".kml", 4)==0) {
-					mimeparser->location_kml = dc_kml_parse(mimeparser->context,
-						decoded_data, decoded_data_bytes);
+					if (transfer_decode(mime, &decoded_data, &decoded_data_bytes, &transfer_decoding_buffer, NULL)) {
+						mimeparser->location_kml = dc_kml_parse(mimeparser->context,
+							decoded_data, decoded_data_bytes);
+					}
 					goto cleanup;
 				}
 
 				if (strncmp(desired_filename, "message", 7)==0
 				 && strncmp(desired_filename+strlen(desired_filename)-4, ".kml", 4)==0) {
-					mimeparser->message_kml = dc_kml_parse(mimeparser->context,
-						decoded_data, decoded_data_bytes);
+					if (transfer_decode(mime, &decoded_data, &decoded_data_bytes, &transfer_decoding_buffer, NULL)) {
+						mimeparser->message_kml = dc_kml_parse(mimeparser->context,
+							decoded_data, decoded_data_bytes);
+					}
 					goto cleanup;
 				}
 
 				dc_replace_bad_utf8_chars(desired_filename);
 
-				do_add_single_file_part(mimeparser, msg_type, mime_type, raw_mime, decoded_data, decoded_data_bytes, desired_filename);
+				/* attachments are decoded to the file without holding them completely in memory */
+				do_add_single_file_part(mimeparser, msg_type, mime_type, raw_mime, mime, desired_filename);
 			}
 			break;
 
@@ -1501,6 +1723,7 @@ void dc_mimeparser_parse(dc_mimeparser_t* mimeparser, const char* body_not_termi
 	int                            r = 0;
 	size_t                         index = 0;
 	struct mailimf_optional_field* optional_field = NULL;
+	uint64_t                       start = dc_metrics_now(); /* includes decryption, that is also measured on its own */
 
 	dc_mimeparser_empty(mimeparser);
 
@@ -1719,6 +1942,8 @@ cleanup:
 		}
 		carray_add(mimeparser->parts, (void*)part, NULL);
 	}
+
+	dc_metrics_add(mimeparser->context->metrics, DC_METRIC_MIME_PARSE, dc_metrics_now()-start);
 }
 
 
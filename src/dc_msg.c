@@ -830,12 +830,7 @@ cleanup:
 }
 
 
-#define DC_MSG_FIELDS " m.id,rfc724_mid,m.mime_in_reply_to,m.server_folder,m.server_uid,m.move_state,m.chat_id, " \
-                      " m.from_id,m.to_id,m.timestamp,m.timestamp_sent,m.timestamp_rcvd, m.type,m.state,m.msgrmsg,m.txt, " \
-                      " m.param,m.starred,m.hidden,m.location_id, c.blocked "
-
-
-static int dc_msg_set_from_stmt(dc_msg_t* msg, sqlite3_stmt* row, int row_offset) /* field order must be DC_MSG_FIELDS */
+int dc_msg_set_from_stmt(dc_msg_t* msg, sqlite3_stmt* row, int row_offset) /* field order must be DC_MSG_FIELDS */
 {
 	dc_msg_empty(msg);
 
@@ -869,7 +864,7 @@ static int dc_msg_set_from_stmt(dc_msg_t* msg, sqlite3_stmt* row, int row_offset
 			0/*unwrap*/);
 	}
 
-	return 1;
+	return row_offset; /* success, return the next row offset */
 }
 
 
@@ -887,7 +882,7 @@ int dc_msg_load_from_db(dc_msg_t* msg, dc_context_t* context, uint32_t id)
 		goto cleanup;
 	}
 
-	stmt = dc_sqlite3_prepare(context->sql,
+	stmt = dc_sqlite3_borrow_read_stmt(context->sql,
 		"SELECT " DC_MSG_FIELDS
 		" FROM msgs m LEFT JOIN chats c ON c.id=m.chat_id"
 		" WHERE m.id=?;");
@@ -906,7 +901,9 @@ int dc_msg_load_from_db(dc_msg_t* msg, dc_context_t* context, uint32_t id)
 	success = 1;
 
 cleanup:
-	sqlite3_finalize(stmt);
+	if (stmt) {
+		dc_sqlite3_return_stmt(context->sql, stmt);
+	}
 	return success;
 }
 
@@ -1455,7 +1452,7 @@ uint32_t dc_rfc724_mid_exists(dc_context_t* context, const char* rfc724_mid, cha
 		goto cleanup;
 	}
 
-	stmt = dc_sqlite3_prepare(context->sql,
+	stmt = dc_sqlite3_borrow_stmt(context->sql,
 		"SELECT server_folder, server_uid, id FROM msgs WHERE rfc724_mid=?;");
 	sqlite3_bind_text(stmt, 1, rfc724_mid, -1, SQLITE_STATIC);
 	if (sqlite3_step(stmt)!=SQLITE_ROW) {
@@ -1469,7 +1466,9 @@ uint32_t dc_rfc724_mid_exists(dc_context_t* context, const char* rfc724_mid, cha
 	ret = sqlite3_column_int(stmt, 2);
 
 cleanup:
-	sqlite3_finalize(stmt);
+	if (stmt) {
+		dc_sqlite3_return_stmt(context->sql, stmt);
+	}
 	return ret;
 }
 
@@ -1486,6 +1485,75 @@ void dc_update_server_uid(dc_context_t* context, const char* rfc724_mid, const c
 }
 
 
+/**
+ * Apply changes done by other clients on the server to the messages in the database.
+ * All changes are written in a single transaction.
+ *
+ * Messages that got the `\Seen` flag are marked as seen, as this happens
+ * on another device, no MDN is sent and no IMAP job is added.
+ * For expunged messages, only the UID is cleared as the messages may just be
+ * moved to another folder; if they show up there, the UID is updated on receiving.
+ *
+ * @private @memberof dc_context_t
+ * @param context The context object.
+ * @param server_folder The folder the UIDs belong to.
+ * @param seen_uids UIDs of messages that are seen on the server now.
+ * @param expunged_uid_ranges Pairs of first and last UID of ranges expunged from the folder.
+ * @return None.
+ */
+void dc_update_msgs_from_server(dc_context_t* context, const char* server_folder, const dc_array_t* seen_uids, const dc_array_t* expunged_uid_ranges)
+{
+	sqlite3_stmt* stmt = NULL;
+	size_t        i = 0;
+	int           changed = 0;
+
+	if (context==NULL || context->magic!=DC_CONTEXT_MAGIC || server_folder==NULL) {
+		return;
+	}
+
+	dc_sqlite3_begin_transaction(context->sql);
+
+		if (seen_uids && dc_array_get_cnt(seen_uids)) {
+			stmt = dc_sqlite3_prepare(context->sql,
+				"SELECT id FROM msgs"
+				" WHERE server_folder=? AND server_uid=?"
+				" AND state IN (" DC_STRINGIFY(DC_STATE_IN_FRESH) "," DC_STRINGIFY(DC_STATE_IN_NOTICED) ");");
+			for (i = 0; i < dc_array_get_cnt(seen_uids); i++) {
+				sqlite3_reset(stmt);
+				sqlite3_bind_text (stmt, 1, server_folder, -1, SQLITE_STATIC);
+				sqlite3_bind_int64(stmt, 2, dc_array_get_id(seen_uids, i));
+				while (sqlite3_step(stmt)==SQLITE_ROW) {
+					dc_update_msg_state(context, sqlite3_column_int(stmt, 0), DC_STATE_IN_SEEN);
+					changed++;
+				}
+			}
+			sqlite3_finalize(stmt);
+			stmt = NULL;
+		}
+
+		if (expunged_uid_ranges && dc_array_get_cnt(expunged_uid_ranges)>=2) {
+			stmt = dc_sqlite3_prepare(context->sql,
+				"UPDATE msgs SET server_uid=0 WHERE server_folder=? AND server_uid BETWEEN ? AND ?;");
+			for (i = 0; i+1 < dc_array_get_cnt(expunged_uid_ranges); i += 2) {
+				sqlite3_reset(stmt);
+				sqlite3_bind_text (stmt, 1, server_folder, -1, SQLITE_STATIC);
+				sqlite3_bind_int64(stmt, 2, dc_array_get_id(expunged_uid_ranges, i));
+				sqlite3_bind_int64(stmt, 3, dc_array_get_id(expunged_uid_ranges, i+1));
+				sqlite3_step(stmt);
+			}
+			sqlite3_finalize(stmt);
+			stmt = NULL;
+		}
+
+	dc_sqlite3_commit(context->sql);
+
+	if (changed) {
+		dc_log_info(context, 0, "%i messages marked as seen by other clients.", changed);
+		context->cb(context, DC_EVENT_MSGS_CHANGED, 0, 0);
+	}
+}
+
+
 /**
  * Get a single message object of the type dc_msg_t.
  * For a list of messages in a chat, see dc_get_chat_msgs()
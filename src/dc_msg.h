@@ -79,6 +79,10 @@ struct _dc_msg
 dc_msg_t*       dc_msg_new_untyped                    (dc_context_t*);
 dc_msg_t*       dc_msg_new_load                       (dc_context_t*, uint32_t id);
 int             dc_msg_load_from_db                   (dc_msg_t*, dc_context_t*, uint32_t id);
+int             dc_msg_set_from_stmt                  (dc_msg_t*, sqlite3_stmt*, int row_offset);
+#define         DC_MSG_FIELDS " m.id,rfc724_mid,m.mime_in_reply_to,m.server_folder,m.server_uid,m.move_state,m.chat_id, " \
+                              " m.from_id,m.to_id,m.timestamp,m.timestamp_sent,m.timestamp_rcvd, m.type,m.state,m.msgrmsg,m.txt, " \
+                              " m.param,m.starred,m.hidden,m.location_id, c.blocked " /* needs `LEFT JOIN chats c` */
 int             dc_msg_is_increation                  (const dc_msg_t*);
 char*           dc_msg_get_summarytext_by_raw         (int type, const char* text, dc_param_t*, int approx_bytes, dc_context_t*); /* the returned value must be free()'d */
 void            dc_msg_save_param_to_disk             (dc_msg_t*);
@@ -108,6 +112,7 @@ size_t          dc_get_deaddrop_msg_cnt                    (dc_context_t*);
 int             dc_rfc724_mid_cnt                          (dc_context_t*, const char* rfc724_mid);
 uint32_t        dc_rfc724_mid_exists                       (dc_context_t*, const char* rfc724_mid, char** ret_server_folder, uint32_t* ret_server_uid);
 void            dc_update_server_uid                       (dc_context_t*, const char* rfc724_mid, const char* server_folder, uint32_t server_uid);
+void            dc_update_msgs_from_server                 (dc_context_t*, const char* server_folder, const dc_array_t* seen_uids, const dc_array_t* expunged_uid_ranges);
 
 
 #ifdef __cplusplus
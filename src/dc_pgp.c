@@ -39,6 +39,9 @@ static int      s_io_initialized = 0;
 static pgp_io_t s_io;
 
 
+static void key_cache_init(void);
+
+
 void dc_pgp_init(void)
 {
 	if (s_io_initialized) {
@@ -50,6 +53,8 @@ void dc_pgp_init(void)
 	s_io.errs = stderr;
 	s_io.res  = stderr;
 
+	key_cache_init();
+
 	s_io_initialized = 1;
 }
 
@@ -58,9 +63,218 @@ void dc_pgp_init(void)
 
 void dc_pgp_exit(void)
 {
+	dc_pgp_clear_key_cache();
 }
 
 
+/*******************************************************************************
+ * Parsed key cache
+ ******************************************************************************/
+
+
+#ifdef DC_USE_RPGP
+
+void dc_pgp_clear_key_cache(void)
+{
+}
+
+#else // !DC_USE_RPGP
+
+/* Parsing a key with pgp_filter_keys_from_mem() is expensive compared to
+the encryption of a typical message, and the same keys are used again and again
+(our own private key for every message, the keys of the chat members, the keys
+in the Autocrypt headers of a burst of group messages).
+Therefore, the parsed keys are cached, keyed by the raw key bytes, so that
+a peer's updated key (eg. with a new expiry) is never mixed up with an old version.
+
+The cached keys are added to temporary keyrings using pgp_keyring_add(),
+which copies only the outer structure; such keyrings must be freed
+using pgp_keyring_free() and not using pgp_keyring_purge() therefore.
+Cache entries in use are reference-counted and are not freed before
+they are returned. */
+
+#define DC_PGP_KEY_CACHE_SIZE 100 /* max. number of public keys; private keys are pinned */
+
+typedef struct dc_pgp_parsed_key_t
+{
+	pgp_keyring_t   public_keys;  /* the keys of the raw key as sorted by pgp_filter_keys_from_mem() */
+	pgp_keyring_t   private_keys;
+	int             pinned;
+	int             refcnt;
+	int             dropped;      /* removed from the cache, freed when the last reference is returned */
+	uint64_t        last_used;
+} dc_pgp_parsed_key_t;
+
+static pthread_mutex_t s_key_cache_critical = PTHREAD_MUTEX_INITIALIZER;
+static dc_hash_t       s_key_cache;     /* raw key bytes -> dc_pgp_parsed_key_t* */
+static int             s_key_cache_unpinned_cnt = 0;
+static uint64_t        s_key_cache_clock = 0;
+
+
+static void key_cache_init(void)
+{
+	dc_hash_init(&s_key_cache, DC_HASH_BINARY, DC_HASH_COPY_KEY);
+}
+
+
+static void free_parsed_key(dc_pgp_parsed_key_t* parsed)
+{
+	pgp_keyring_purge(&parsed->public_keys);
+	pgp_keyring_purge(&parsed->private_keys);
+	free(parsed);
+}
+
+
+static void drop_parsed_key(dc_hashelem_t* elem) /* must be called with s_key_cache_critical locked */
+{
+	dc_pgp_parsed_key_t* parsed = (dc_pgp_parsed_key_t*)dc_hash_data(elem);
+
+	if (!parsed->pinned) {
+		s_key_cache_unpinned_cnt--;
+	}
+
+	dc_hash_insert(&s_key_cache, dc_hash_key(elem), dc_hash_keysize(elem), NULL);
+
+	if (parsed->refcnt>0) {
+		parsed->dropped = 1;
+	}
+	else {
+		free_parsed_key(parsed);
+	}
+}
+
+
+/**
+ * Get the parsed version of a raw key, the key is parsed if it is not yet cached.
+ * The returned object must be given back using return_parsed_key() and must not be modified.
+ * Returns NULL only on memory errors or for an empty raw key.
+ *
+ * @private @memberof dc_pgp_parsed_key_t
+ */
+static dc_pgp_parsed_key_t* borrow_parsed_key(const dc_key_t* raw_key)
+{
+	dc_pgp_parsed_key_t* parsed = NULL;
+	pgp_memory_t*        keysmem = NULL;
+
+	if (raw_key==NULL || raw_key->binary==NULL || raw_key->bytes<=0) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&s_key_cache_critical);
+		parsed = dc_hash_find(&s_key_cache, raw_key->binary, raw_key->bytes);
+		if (parsed) {
+			parsed->refcnt++;
+			parsed->last_used = ++s_key_cache_clock;
+		}
+	pthread_mutex_unlock(&s_key_cache_critical);
+
+	if (parsed) {
+		return parsed;
+	}
+
+	/* parse outside the lock, if two threads parse the same key at the same time, only one result is cached */
+	if ((parsed=calloc(1, sizeof(dc_pgp_parsed_key_t)))==NULL
+	 || (keysmem=pgp_memory_new())==NULL) {
+		free(parsed);
+		return NULL;
+	}
+
+	pgp_memory_add(keysmem, raw_key->binary, raw_key->bytes);
+	pgp_filter_keys_from_mem(&s_io, &parsed->public_keys, &parsed->private_keys, NULL, 0, keysmem); /* function returns 0 on any error in any packet - this does not mean, we cannot use the key. */
+	pgp_memory_free(keysmem);
+
+	parsed->pinned = (raw_key->type==DC_KEY_PRIVATE); /* private keys are our own keys, needed for each message */
+	parsed->refcnt = 1;
+
+	pthread_mutex_lock(&s_key_cache_critical);
+		parsed->last_used = ++s_key_cache_clock;
+
+		if (dc_hash_find(&s_key_cache, raw_key->binary, raw_key->bytes)==NULL)
+		{
+			if (!parsed->pinned && s_key_cache_unpinned_cnt>=DC_PGP_KEY_CACHE_SIZE) {
+				/* evict the least recently used public key not in use */
+				dc_hashelem_t* lru = NULL;
+				for (dc_hashelem_t* e = dc_hash_first(&s_key_cache); e; e = dc_hash_next(e)) {
+					dc_pgp_parsed_key_t* p = (dc_pgp_parsed_key_t*)dc_hash_data(e);
+					if (!p->pinned && p->refcnt==0
+					 && (lru==NULL || p->last_used < ((dc_pgp_parsed_key_t*)dc_hash_data(lru))->last_used)) {
+						lru = e;
+					}
+				}
+				if (lru) {
+					drop_parsed_key(lru);
+				}
+			}
+
+			dc_hash_insert(&s_key_cache, raw_key->binary, raw_key->bytes, parsed);
+			if (!parsed->pinned) {
+				s_key_cache_unpinned_cnt++;
+			}
+		}
+		else
+		{
+			parsed->dropped = 1; /* not cached, freed on return */
+		}
+	pthread_mutex_unlock(&s_key_cache_critical);
+
+	return parsed;
+}
+
+
+static void return_parsed_key(dc_pgp_parsed_key_t* parsed)
+{
+	int do_free = 0;
+
+	if (parsed==NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&s_key_cache_critical);
+		parsed->refcnt--;
+		do_free = (parsed->refcnt==0 && parsed->dropped);
+	pthread_mutex_unlock(&s_key_cache_critical);
+
+	if (do_free) {
+		free_parsed_key(parsed);
+	}
+}
+
+
+/* add the parsed keys to a temporary keyring, see the comment above */
+static void add_parsed_keys(pgp_keyring_t* dst, const pgp_keyring_t* src)
+{
+	for (unsigned i = 0; i < src->keyc; i++) {
+		pgp_keyring_add(dst, &src->keys[i]);
+	}
+}
+
+
+/**
+ * Remove all parsed keys from the cache.
+ * Should be called when our own keys are changed;
+ * keys currently in use are freed as soon as they are no longer used.
+ *
+ * @private @memberof dc_pgp_parsed_key_t
+ */
+void dc_pgp_clear_key_cache(void)
+{
+	dc_hashelem_t* e = NULL;
+
+	if (!s_io_initialized) {
+		return;
+	}
+
+	pthread_mutex_lock(&s_key_cache_critical);
+		while ((e=dc_hash_first(&s_key_cache))!=NULL) {
+			drop_parsed_key(e);
+		}
+		s_key_cache_unpinned_cnt = 0;
+	pthread_mutex_unlock(&s_key_cache_critical);
+}
+
+#endif // !DC_USE_RPGP
+
+
 #ifdef DC_USE_RPGP
 
 void dc_pgp_rand_seed(dc_context_t* context, const void* buf, size_t bytes) {}
@@ -537,31 +751,28 @@ cleanup:
 
 int dc_pgp_is_valid_key(dc_context_t* context, const dc_key_t* raw_key)
 {
-	int             key_is_valid = 0;
-	pgp_keyring_t*  public_keys = calloc(1, sizeof(pgp_keyring_t));
-	pgp_keyring_t*  private_keys = calloc(1, sizeof(pgp_keyring_t));
-	pgp_memory_t*   keysmem = pgp_memory_new();
+	int                  key_is_valid = 0;
+	dc_pgp_parsed_key_t* parsed = NULL;
 
 	if (context==NULL || raw_key==NULL
-	 || raw_key->binary==NULL || raw_key->bytes <= 0
-	 || public_keys==NULL || private_keys==NULL || keysmem==NULL) {
+	 || raw_key->binary==NULL || raw_key->bytes <= 0) {
 		goto cleanup;
 	}
 
-	pgp_memory_add(keysmem, raw_key->binary, raw_key->bytes);
-	pgp_filter_keys_from_mem(&s_io, public_keys, private_keys, NULL, 0, keysmem); /* function returns 0 on any error in any packet - this does not mean, we cannot use the key. We check the details below therefore. */
+	/* the key is typically used for encryption or validation soon, so it is parsed and cached here */
+	if ((parsed=borrow_parsed_key(raw_key))==NULL) {
+		goto cleanup;
+	}
 
-	if (raw_key->type==DC_KEY_PUBLIC && public_keys->keyc >= 1) {
+	if (raw_key->type==DC_KEY_PUBLIC && parsed->public_keys.keyc >= 1) {
 		key_is_valid = 1;
 	}
-	else if (raw_key->type==DC_KEY_PRIVATE && private_keys->keyc >= 1) {
+	else if (raw_key->type==DC_KEY_PRIVATE && parsed->private_keys.keyc >= 1) {
 		key_is_valid = 1;
 	}
 
 cleanup:
-	if (keysmem)      { pgp_memory_free(keysmem); }
-	if (public_keys)  { pgp_keyring_purge(public_keys); free(public_keys); } /*pgp_keyring_free() frees the content, not the pointer itself*/
-	if (private_keys) { pgp_keyring_purge(private_keys); free(private_keys); }
+	return_parsed_key(parsed);
 	return key_is_valid;
 }
 
@@ -807,8 +1018,8 @@ int dc_pgp_pk_encrypt( dc_context_t*       context,
 
 	/* sign & encrypt */
 	{
-          clock_t     op_clocks = 0;
-          clock_t start = clock();
+          uint64_t    op_us = 0;
+          uint64_t    start = dc_metrics_now();
 
           if (private_key==NULL) {
 
@@ -819,8 +1030,9 @@ int dc_pgp_pk_encrypt( dc_context_t*       context,
               goto cleanup;
             }
 
-            op_clocks = clock()-start;
-            dc_log_info(context, 0, "Message encrypted in %.3f ms.", (double)(op_clocks)*1000.0/CLOCKS_PER_SEC);
+            op_us = dc_metrics_now()-start;
+            dc_metrics_add(context->metrics, DC_METRIC_PGP_ENCRYPT, op_us);
+            dc_log_info(context, 0, "Message encrypted in %.3f ms.", (double)op_us/1000.0);
           } else {
             encrypted = rpgp_sign_encrypt_bytes_to_keys(plain_text, plain_bytes,
                                                         (const rpgp_signed_public_key* const*)public_keys, public_keys_len,
@@ -830,8 +1042,9 @@ int dc_pgp_pk_encrypt( dc_context_t*       context,
               goto cleanup;
             }
 
-            op_clocks = clock()-start;
-            dc_log_info(context, 0, "Message signed and encrypted in %.3f ms.", (double)(op_clocks)*1000.0/CLOCKS_PER_SEC);
+            op_us = dc_metrics_now()-start;
+            dc_metrics_add(context->metrics, DC_METRIC_PGP_ENCRYPT, op_us);
+            dc_log_info(context, 0, "Message signed and encrypted in %.3f ms.", (double)op_us/1000.0);
           }
 
           /* convert message to armored bytes and return values */
@@ -874,26 +1087,30 @@ int dc_pgp_pk_encrypt( dc_context_t*       context,
 {
 	pgp_keyring_t*  public_keys = calloc(1, sizeof(pgp_keyring_t));
 	pgp_keyring_t*  private_keys = calloc(1, sizeof(pgp_keyring_t));
-	pgp_keyring_t*  dummy_keys = calloc(1, sizeof(pgp_keyring_t));
-	pgp_memory_t*   keysmem = pgp_memory_new();
 	pgp_memory_t*   signedmem = NULL;
+	dc_pgp_parsed_key_t** parsed = NULL; /* one for each public key and one for the signing key */
+	int             parsed_cnt = 0;
 	int             i = 0;
 	int             success = 0;
 
 	if (context==NULL || plain_text==NULL || plain_bytes==0 || ret_ctext==NULL || ret_ctext_bytes==NULL
 	 || raw_public_keys_for_encryption==NULL || raw_public_keys_for_encryption->count<=0
-	 || keysmem==NULL || public_keys==NULL || private_keys==NULL || dummy_keys==NULL) {
+	 || public_keys==NULL || private_keys==NULL
+	 || (parsed=calloc(raw_public_keys_for_encryption->count+1, sizeof(dc_pgp_parsed_key_t*)))==NULL) {
 		goto cleanup;
 	}
 
 	*ret_ctext       = NULL;
 	*ret_ctext_bytes = 0;
 
-	/* setup keys (the keys may come from pgp_filter_keys_fileread(), see also pgp_keyring_add(rcpts, key)) */
+	/* setup keys (the keys are shared with the key cache, see also pgp_keyring_add(rcpts, key)) */
 	for (i = 0; i < raw_public_keys_for_encryption->count; i++) {
-		pgp_memory_clear(keysmem);
-		pgp_memory_add(keysmem, raw_public_keys_for_encryption->keys[i]->binary, raw_public_keys_for_encryption->keys[i]->bytes);
-		pgp_filter_keys_from_mem(&s_io, public_keys, private_keys/*should stay empty*/, NULL, 0, keysmem);
+		dc_pgp_parsed_key_t* p = borrow_parsed_key(raw_public_keys_for_encryption->keys[i]);
+		if (p) {
+			parsed[parsed_cnt++] = p;
+			add_parsed_keys(public_keys, &p->public_keys);
+			add_parsed_keys(private_keys/*should stay empty*/, &p->private_keys);
+		}
 	}
 
 	if (public_keys->keyc <=0 || private_keys->keyc!=0) {
@@ -906,25 +1123,28 @@ int dc_pgp_pk_encrypt( dc_context_t*       context,
 		const void* signed_text = NULL;
 		size_t      signed_bytes = 0;
 		int         encrypt_raw_packet = 0;
-		clock_t     sign_clocks = 0;
-		clock_t     encrypt_clocks = 0;
+		uint64_t    sign_us = 0;
+		uint64_t    encrypt_us = 0;
 
 		if (raw_private_key_for_signing) {
-			pgp_memory_clear(keysmem);
-			pgp_memory_add(keysmem, raw_private_key_for_signing->binary, raw_private_key_for_signing->bytes);
-			pgp_filter_keys_from_mem(&s_io, dummy_keys, private_keys, NULL, 0, keysmem);
+			dc_pgp_parsed_key_t* p = borrow_parsed_key(raw_private_key_for_signing);
+			if (p) {
+				parsed[parsed_cnt++] = p;
+				add_parsed_keys(private_keys, &p->private_keys);
+			}
 			if (private_keys->keyc <= 0) {
 				dc_log_warning(context, 0, "No key for signing found.");
 				goto cleanup;
 			}
 
-			clock_t start = clock();
+			uint64_t start = dc_metrics_now();
 
 			pgp_key_t* sk0 = &private_keys->keys[0];
 			signedmem = pgp_sign_buf(&s_io, plain_text, plain_bytes, &sk0->key.seckey, time(NULL)/*birthtime*/, 0/*duration*/,
 				NULL/*hash, defaults to sha256*/, 0/*armored*/, 0/*cleartext*/);
 
-			sign_clocks = clock()-start;
+			sign_us = dc_metrics_now()-start;
+			dc_metrics_add(context->metrics, DC_METRIC_PGP_SIGN, sign_us);
 
 			if (signedmem==NULL) {
 				dc_log_warning(context, 0, "Signing failed.");
@@ -940,13 +1160,14 @@ int dc_pgp_pk_encrypt( dc_context_t*       context,
 			encrypt_raw_packet = 0;
 		}
 
-		clock_t start = clock();
+		uint64_t start = dc_metrics_now();
 
 		pgp_memory_t* outmem = pgp_encrypt_buf(&s_io, signed_text, signed_bytes, public_keys, use_armor, NULL/*cipher*/, encrypt_raw_packet);
 
-		encrypt_clocks = clock()-start;
+		encrypt_us = dc_metrics_now()-start;
+		dc_metrics_add(context->metrics, DC_METRIC_PGP_ENCRYPT, encrypt_us);
 
-		dc_log_info(context, 0, "Message signed in %.3f ms and encrypted in %.3f ms.", (double)(sign_clocks)*1000.0/CLOCKS_PER_SEC, (double)(encrypt_clocks)*1000.0/CLOCKS_PER_SEC);
+		dc_log_info(context, 0, "Message signed in %.3f ms and encrypted in %.3f ms.", (double)sign_us/1000.0, (double)encrypt_us/1000.0);
 
 		if (outmem==NULL) {
 			dc_log_warning(context, 0, "Encryption failed.");
@@ -960,11 +1181,13 @@ int dc_pgp_pk_encrypt( dc_context_t*       context,
 	success = 1;
 
 cleanup:
-	if (keysmem)      { pgp_memory_free(keysmem); }
 	if (signedmem)    { pgp_memory_free(signedmem); }
-	if (public_keys)  { pgp_keyring_purge(public_keys); free(public_keys); } /*pgp_keyring_free() frees the content, not the pointer itself*/
-	if (private_keys) { pgp_keyring_purge(private_keys); free(private_keys); }
-	if (dummy_keys)   { pgp_keyring_purge(dummy_keys); free(dummy_keys); }
+	if (public_keys)  { pgp_keyring_free(public_keys); free(public_keys); } /*the keys belong to the key cache, pgp_keyring_free() frees only the array*/
+	if (private_keys) { pgp_keyring_free(private_keys); free(private_keys); }
+	for (i = 0; i < parsed_cnt; i++) {
+		return_parsed_key(parsed[i]);
+	}
+	free(parsed);
 	return success;
 }
 
@@ -1100,28 +1323,32 @@ int dc_pgp_pk_decrypt( dc_context_t*       context,
 {
 	pgp_keyring_t*    public_keys = calloc(1, sizeof(pgp_keyring_t)); /*should be 0 after parsing*/
 	pgp_keyring_t*    private_keys = calloc(1, sizeof(pgp_keyring_t));
-	pgp_keyring_t*    dummy_keys = calloc(1, sizeof(pgp_keyring_t));
 	pgp_validation_t* vresult = calloc(1, sizeof(pgp_validation_t));
 	key_id_t*         recipients_key_ids = NULL;
 	unsigned          recipients_cnt = 0;
-	pgp_memory_t*     keysmem = pgp_memory_new();
+	dc_pgp_parsed_key_t** parsed = NULL; /* one for each private and each public key */
+	int               parsed_cnt = 0;
 	int               i = 0;
 	int               success = 0;
 
 	if (context==NULL || ctext==NULL || ctext_bytes==0 || ret_plain==NULL || ret_plain_bytes==NULL
 	 || raw_private_keys_for_decryption==NULL || raw_private_keys_for_decryption->count<=0
-	 || vresult==NULL || keysmem==NULL || public_keys==NULL || private_keys==NULL) {
+	 || vresult==NULL || public_keys==NULL || private_keys==NULL
+	 || (parsed=calloc(raw_private_keys_for_decryption->count
+	                 + (raw_public_keys_for_validation? raw_public_keys_for_validation->count : 0), sizeof(dc_pgp_parsed_key_t*)))==NULL) {
 		goto cleanup;
 	}
 
 	*ret_plain             = NULL;
 	*ret_plain_bytes       = 0;
 
-	/* setup keys (the keys may come from pgp_filter_keys_fileread(), see also pgp_keyring_add(rcpts, key)) */
+	/* setup keys (the keys are shared with the key cache, see also pgp_keyring_add(rcpts, key)) */
 	for (i = 0; i < raw_private_keys_for_decryption->count; i++) {
-		pgp_memory_clear(keysmem); /* a simple concatenate of private binary keys fails (works for public keys, however, we don't do it there either) */
-		pgp_memory_add(keysmem, raw_private_keys_for_decryption->keys[i]->binary, raw_private_keys_for_decryption->keys[i]->bytes);
-		pgp_filter_keys_from_mem(&s_io, dummy_keys/*should stay empty*/, private_keys, NULL, 0, keysmem);
+		dc_pgp_parsed_key_t* p = borrow_parsed_key(raw_private_keys_for_decryption->keys[i]);
+		if (p) {
+			parsed[parsed_cnt++] = p;
+			add_parsed_keys(private_keys, &p->private_keys); /* public keys found here are ignored as before */
+		}
 	}
 
 	if (private_keys->keyc<=0) {
@@ -1131,9 +1358,11 @@ int dc_pgp_pk_decrypt( dc_context_t*       context,
 
 	if (raw_public_keys_for_validation) {
 		for (i = 0; i < raw_public_keys_for_validation->count; i++) {
-			pgp_memory_clear(keysmem);
-			pgp_memory_add(keysmem, raw_public_keys_for_validation->keys[i]->binary, raw_public_keys_for_validation->keys[i]->bytes);
-			pgp_filter_keys_from_mem(&s_io, public_keys, dummy_keys/*should stay empty*/, NULL, 0, keysmem);
+			dc_pgp_parsed_key_t* p = borrow_parsed_key(raw_public_keys_for_validation->keys[i]);
+			if (p) {
+				parsed[parsed_cnt++] = p;
+				add_parsed_keys(public_keys, &p->public_keys);
+			}
 		}
 	}
 
@@ -1175,11 +1404,13 @@ int dc_pgp_pk_decrypt( dc_context_t*       context,
 	success = 1;
 
 cleanup:
-	if (keysmem)            { pgp_memory_free(keysmem); }
-	if (public_keys)        { pgp_keyring_purge(public_keys); free(public_keys); } /*pgp_keyring_free() frees the content, not the pointer itself*/
-	if (private_keys)       { pgp_keyring_purge(private_keys); free(private_keys); }
-	if (dummy_keys)         { pgp_keyring_purge(dummy_keys); free(dummy_keys); }
+	if (public_keys)        { pgp_keyring_free(public_keys); free(public_keys); } /*the keys belong to the key cache, pgp_keyring_free() frees only the array*/
+	if (private_keys)       { pgp_keyring_free(private_keys); free(private_keys); }
 	if (vresult)            { pgp_validate_result_free(vresult); }
+	for (i = 0; i < parsed_cnt; i++) {
+		return_parsed_key(parsed[i]);
+	}
+	free(parsed);
 	free(recipients_key_ids);
 	return success;
 }
@@ -17,6 +17,7 @@ extern "C" {
 /* misc. */
 void dc_pgp_init             (void);
 void dc_pgp_exit             (void);
+void dc_pgp_clear_key_cache  (void);
 void dc_pgp_rand_seed        (dc_context_t*, const void* buf, size_t bytes);
 int  dc_split_armored_data  (char* buf, const char** ret_headerline, const char** ret_setupcodebegin, const char** ret_preferencrypt, const char** ret_base64);
 
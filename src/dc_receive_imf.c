@@ -652,23 +652,27 @@ static int check_verified_properties(dc_context_t* context, dc_mimeparser_t* mim
 		const char* to_addr     = (const char*)sqlite3_column_text(stmt, 0);
 		int is_verified         =              sqlite3_column_int (stmt, 1);
 
-		if (dc_hash_find_str(mimeparser->e2ee_helper->gossipped_addr, to_addr)
-		 && dc_apeerstate_load_by_addr(peerstate, context->sql, to_addr))
+		if (dc_hash_find_str(mimeparser->e2ee_helper->gossipped_addr, to_addr))
 		{
-			// if we're here, we know the gossip key is verified:
-			// - use the gossip-key as verified-key if there is no verified-key
-			// - OR if the verified-key does not match public-key or gossip-key
-			//   (otherwise a verified key can _only_ be updated through QR scan which might be annoying,
-			//   see https://github.com/nextleap-project/countermitm/issues/46 for a discussion about this point)
-			if (!is_verified
-			 ||   (strcmp(peerstate->verified_key_fingerprint, peerstate->public_key_fingerprint)!=0
-			    && strcmp(peerstate->verified_key_fingerprint, peerstate->gossip_key_fingerprint)!=0))
-			{
-				dc_log_info(context, 0, "%s has verfied %s.", contact->addr, to_addr);
-				dc_apeerstate_set_verified(peerstate, DC_PS_GOSSIP_KEY, peerstate->gossip_key_fingerprint, DC_BIDIRECT_VERIFIED);
-				dc_apeerstate_save_to_db(peerstate, context->sql, 0);
-				is_verified = 1;
-			}
+			pthread_mutex_lock(&context->peerstate_critical);
+				if (dc_apeerstate_load_by_addr(peerstate, context->sql, to_addr))
+				{
+					// if we're here, we know the gossip key is verified:
+					// - use the gossip-key as verified-key if there is no verified-key
+					// - OR if the verified-key does not match public-key or gossip-key
+					//   (otherwise a verified key can _only_ be updated through QR scan which might be annoying,
+					//   see https://github.com/nextleap-project/countermitm/issues/46 for a discussion about this point)
+					if (!is_verified
+					 ||   (strcmp(peerstate->verified_key_fingerprint, peerstate->public_key_fingerprint)!=0
+					    && strcmp(peerstate->verified_key_fingerprint, peerstate->gossip_key_fingerprint)!=0))
+					{
+						dc_log_info(context, 0, "%s has verfied %s.", contact->addr, to_addr);
+						dc_apeerstate_set_verified(peerstate, DC_PS_GOSSIP_KEY, peerstate->gossip_key_fingerprint, DC_BIDIRECT_VERIFIED);
+						dc_apeerstate_save_to_db(peerstate, context->sql, 0);
+						is_verified = 1;
+					}
+				}
+			pthread_mutex_unlock(&context->peerstate_critical);
 		}
 
 		if (!is_verified)
@@ -1014,10 +1018,15 @@ cleanup:
  ******************************************************************************/
 
 
-void dc_receive_imf(dc_context_t* context, const char* imf_raw_not_terminated, size_t imf_raw_bytes,
+/* Receiving is done in two stages: dc_mimeparser_parse() parses and decrypts
+the message and does not need to run in the thread writing to the database;
+this is used by dc_receive_pool_t to parse several messages at the same time.
+dc_receive_parsed_imf() then adds the parsed message to the database;
+the raw data must still be valid as it may be saved as well. */
+void dc_receive_parsed_imf(dc_context_t* context, dc_mimeparser_t* mime_parser,
+                           const char* imf_raw_not_terminated, size_t imf_raw_bytes,
                            const char* server_folder, uint32_t server_uid, uint32_t flags)
 {
-	/* the function returns the number of created messages in the database */
 	int              incoming = 1;
 	int              incoming_origin = 0;
 	#define          outgoing (!incoming)
@@ -1043,7 +1052,6 @@ void dc_receive_imf(dc_context_t* context, const char* imf_raw_not_terminated, s
 	time_t           sort_timestamp = DC_INVALID_TIMESTAMP;
 	time_t           sent_timestamp = DC_INVALID_TIMESTAMP;
 	time_t           rcvd_timestamp = DC_INVALID_TIMESTAMP;
-	dc_mimeparser_t* mime_parser = dc_mimeparser_new(context->blobdir, context);
 	int              transaction_pending = 0;
 	const struct mailimf_field* field;
 	char*            mime_in_reply_to = NULL;
@@ -1064,19 +1072,6 @@ void dc_receive_imf(dc_context_t* context, const char* imf_raw_not_terminated, s
 		goto cleanup;
 	}
 
-	/* parse the imf to mailimf_message {
-	        mailimf_fields* msg_fields {
-	          clist* fld_list; // list of mailimf_field
-	        }
-	        mailimf_body* msg_body { //!=NULL
-                const char * bd_text; //!=NULL
-                size_t bd_size;
-	        }
-	   };
-	normally, this is done by mailimf_message_parse(), however, as we also need the MIME data,
-	we use mailmime_parse() through dc_mimeparser (both call mailimf_struct_multiple_parse() somewhen, I did not found out anything
-	that speaks against this approach yet) */
-	dc_mimeparser_parse(mime_parser, imf_raw_not_terminated, imf_raw_bytes);
 	if (dc_hash_cnt(&mime_parser->header)==0) {
 		dc_log_info(context, 0, "No header.");
 		goto cleanup; /* Error - even adding an empty record won't help as we do not know the message ID */
@@ -1102,6 +1097,10 @@ void dc_receive_imf(dc_context_t* context, const char* imf_raw_not_terminated, s
 	dc_sqlite3_begin_transaction(context->sql);
 	transaction_pending = 1;
 
+		/* save the peerstates changed by the Autocrypt headers, this is done here
+		and not while decrypting, so the changes are applied in the order the messages are received */
+		dc_e2ee_update_peerstates(context, mime_parser->e2ee_helper);
+
 		/* get From: and check if it is known (for known From:'s we add the other To:/Cc: in the 3rd pass)
 		or if From: is equal to SELF (in this case, it is any outgoing messages, we do not check Return-Path any more as this is unreliable, see issue #150 */
 		if ((field=dc_mimeparser_lookup_field(mime_parser, "From"))!=NULL
@@ -1652,7 +1651,6 @@ void dc_receive_imf(dc_context_t* context, const char* imf_raw_not_terminated, s
 cleanup:
 	if (transaction_pending) { dc_sqlite3_rollback(context->sql); }
 
-	dc_mimeparser_unref(mime_parser);
 	free(rfc724_mid);
 	free(mime_in_reply_to);
 	free(mime_references);
@@ -1679,3 +1677,26 @@ cleanup:
 	free(txt_raw);
 	sqlite3_finalize(stmt);
 }
+
+
+void dc_receive_imf(dc_context_t* context, const char* imf_raw_not_terminated, size_t imf_raw_bytes,
+                    const char* server_folder, uint32_t server_uid, uint32_t flags)
+{
+	dc_mimeparser_t* mime_parser = dc_mimeparser_new(context->blobdir, context);
+
+	/* parse the imf to mailimf_message {
+	        mailimf_fields* msg_fields {
+	          clist* fld_list; // list of mailimf_field
+	        }
+	        mailimf_body* msg_body { //!=NULL
+                const char * bd_text; //!=NULL
+                size_t bd_size;
+	        }
+	   };
+	normally, this is done by mailimf_message_parse(), however, as we also need the MIME data,
+	we use mailmime_parse() through dc_mimeparser (both call mailimf_struct_multiple_parse() somewhen, I did not found out anything
+	that speaks against this approach yet) */
+	dc_mimeparser_parse(mime_parser, imf_raw_not_terminated, imf_raw_bytes);
+	dc_receive_parsed_imf(context, mime_parser, imf_raw_not_terminated, imf_raw_bytes, server_folder, server_uid, flags);
+	dc_mimeparser_unref(mime_parser);
+}
@@ -0,0 +1,327 @@
+#include <unistd.h>
+#include "dc_context.h"
+#include "dc_receive_pool.h"
+
+
+/* Received messages are handled in three stages:
+
+- the IMAP thread reads the messages from the network and hands them over
+  to dc_receive_pool_add(), the raw data are copied so that the thread can
+  continue reading at once
+
+- a small pool of worker threads parses and decrypts the messages using
+  dc_mimeparser_parse(), this is the CPU-heavy part and may run for several
+  messages at the same time
+
+- the parsed messages are added to the database by dc_receive_parsed_imf();
+  this is done by the thread that has added the messages, strictly in the order
+  they were added, from within dc_receive_pool_add() if too many messages are
+  pending and from dc_receive_pool_flush().  the messages are written in
+  write batches, see dc_sqlite3_begin_batch(), that are only open while
+  writing; the network and the workers are never waited for inside a batch.
+
+when dc_receive_pool_flush() returns, all messages of the queue are in the
+database; dc_imap_t calls this before it moves on the last seen UID. */
+
+
+#define DC_RECEIVE_POOL_MAX_PENDING_CNT   64
+#define DC_RECEIVE_POOL_MAX_PENDING_BYTES (16*1024*1024)
+
+
+static void free_job(dc_receive_job_t* job)
+{
+	if (job==NULL) {
+		return;
+	}
+
+	dc_mimeparser_unref(job->mime_parser);
+	free(job->imf_raw);
+	free(job->server_folder);
+	free(job);
+}
+
+
+static void* worker_thread_entry_point(void* entry_arg)
+{
+	dc_receive_pool_t* pool = (dc_receive_pool_t*)entry_arg;
+	dc_receive_job_t*  job = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (1)
+	{
+		while (pool->todo_first==NULL && !pool->exiting) {
+			pthread_cond_wait(&pool->todo_cond, &pool->mutex);
+		}
+
+		if ((job=pool->todo_first)==NULL) {
+			break; /* exiting and nothing left to do */
+		}
+		pool->todo_first = job->next_todo;
+		if (pool->todo_first==NULL) {
+			pool->todo_last = NULL;
+		}
+
+		pthread_mutex_unlock(&pool->mutex);
+
+		// parsing also decrypts the message; the peerstate updates found there are saved
+		// later by dc_receive_parsed_imf() in the order of the messages, see dc_e2ee_update_peerstates()
+		dc_mimeparser_t* mime_parser = dc_mimeparser_new(pool->context->blobdir, pool->context);
+		dc_mimeparser_parse(mime_parser, job->imf_raw, job->imf_raw_bytes);
+
+		pthread_mutex_lock(&pool->mutex);
+
+		job->mime_parser = mime_parser;
+		job->parsed = 1;
+		pthread_cond_broadcast(&pool->parsed_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+
+static void start_threads(dc_receive_pool_t* pool) /* must be called with the mutex locked */
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int  wanted = (int)DC_MAX(DC_MIN(cpus, DC_RECEIVE_POOL_MAX_THREADS), 2); /* even on one core, parsing and network overlap */
+
+	while (pool->threads_cnt < wanted) {
+		if (pthread_create(&pool->threads[pool->threads_cnt], NULL, worker_thread_entry_point, pool)!=0) {
+			break;
+		}
+		pool->threads_cnt++;
+	}
+
+	dc_log_info(pool->context, 0, "%i threads started for parsing received messages.", pool->threads_cnt);
+}
+
+
+static dc_receive_queue_t* get_queue(dc_receive_pool_t* pool, const void* queue_id) /* must be called with the mutex locked */
+{
+	dc_receive_queue_t* queue = NULL;
+
+	for (queue = pool->queues; queue; queue = queue->next) {
+		if (queue->id==queue_id) {
+			return queue;
+		}
+	}
+
+	if ((queue=calloc(1, sizeof(dc_receive_queue_t)))==NULL) {
+		exit(58);
+	}
+	queue->id = queue_id;
+	queue->next = pool->queues;
+	pool->queues = queue;
+	return queue;
+}
+
+
+static void add_parsed_to_db(dc_receive_pool_t* pool, dc_receive_queue_t* queue, int wait_for_all)
+{
+	/* add the parsed messages at the head of the queue to the database.
+	if wait_for_all is not set, this is only done if too many messages are pending,
+	until half of them are written; otherwise, the messages are left for the next flush.
+	the messages are written in a batch that is closed before waiting for a worker,
+	so the batch does not span the time spent for parsing or on the network */
+	dc_receive_job_t* job = NULL;
+	int               batch_open = 0;
+	int               drain = wait_for_all;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (queue->pending_cnt >= DC_RECEIVE_POOL_MAX_PENDING_CNT
+	 || queue->pending_bytes >= DC_RECEIVE_POOL_MAX_PENDING_BYTES) {
+		drain = 1;
+	}
+
+	while (drain && (job=queue->first)!=NULL)
+	{
+		if (!wait_for_all
+		 && queue->pending_cnt <= DC_RECEIVE_POOL_MAX_PENDING_CNT/2
+		 && queue->pending_bytes <= DC_RECEIVE_POOL_MAX_PENDING_BYTES/2) {
+			break;
+		}
+
+		if (!job->parsed) {
+			if (batch_open) {
+				pthread_mutex_unlock(&pool->mutex);
+				dc_sqlite3_end_batch(pool->context->sql);
+				batch_open = 0;
+				pthread_mutex_lock(&pool->mutex);
+				continue;
+			}
+			pthread_cond_wait(&pool->parsed_cond, &pool->mutex);
+			continue;
+		}
+
+		queue->first = job->next;
+		if (queue->first==NULL) {
+			queue->last = NULL;
+		}
+		queue->pending_cnt--;
+		queue->pending_bytes -= job->imf_raw_bytes;
+
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (!batch_open) {
+			dc_sqlite3_begin_batch(pool->context->sql, DC_BATCH_DEFAULT_SIZE);
+			batch_open = 1;
+		}
+
+		dc_receive_parsed_imf(pool->context, job->mime_parser, job->imf_raw, job->imf_raw_bytes,
+			job->server_folder, job->server_uid, job->flags);
+		free_job(job);
+
+		// commit every some messages
+		dc_sqlite3_batch_step(pool->context->sql);
+
+		pthread_mutex_lock(&pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (batch_open) {
+		dc_sqlite3_end_batch(pool->context->sql);
+	}
+}
+
+
+dc_receive_pool_t* dc_receive_pool_new(dc_context_t* context)
+{
+	dc_receive_pool_t* pool = NULL;
+
+	if ((pool=calloc(1, sizeof(dc_receive_pool_t)))==NULL) {
+		exit(57);
+	}
+
+	pool->context = context;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->todo_cond, NULL);
+	pthread_cond_init(&pool->parsed_cond, NULL);
+
+	return pool;
+}
+
+
+void dc_receive_pool_unref(dc_receive_pool_t* pool)
+{
+	if (pool==NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+		pool->exiting = 1;
+		pthread_cond_broadcast(&pool->todo_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (int i = 0; i < pool->threads_cnt; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	/* messages not flushed are dropped, they are not marked as being seen and will be downloaded again */
+	while (pool->queues) {
+		dc_receive_queue_t* queue = pool->queues;
+		pool->queues = queue->next;
+		while (queue->first) {
+			dc_receive_job_t* job = queue->first;
+			queue->first = job->next;
+			free_job(job);
+		}
+		free(queue);
+	}
+
+	pthread_cond_destroy(&pool->parsed_cond);
+	pthread_cond_destroy(&pool->todo_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+
+/**
+ * Hand over a received message for parsing and adding it to the database.
+ * The message is copied, so the caller can reuse the buffer at once.
+ * Messages added with the same queue_id are added to the database in the
+ * order of the calls, by the calling thread, either during one of the next
+ * calls to this function or by dc_receive_pool_flush().
+ *
+ * @private @memberof dc_receive_pool_t
+ */
+void dc_receive_pool_add(dc_receive_pool_t* pool, const void* queue_id,
+                         const char* imf_raw_not_terminated, size_t imf_raw_bytes,
+                         const char* server_folder, uint32_t server_uid, uint32_t flags)
+{
+	dc_receive_job_t*   job = NULL;
+	dc_receive_queue_t* queue = NULL;
+
+	if (pool==NULL || imf_raw_not_terminated==NULL) {
+		return;
+	}
+
+	if ((job=calloc(1, sizeof(dc_receive_job_t)))==NULL
+	 || (job->imf_raw=malloc(imf_raw_bytes+1))==NULL) {
+		exit(56);
+	}
+	memcpy(job->imf_raw, imf_raw_not_terminated, imf_raw_bytes);
+	job->imf_raw[imf_raw_bytes] = 0;
+	job->imf_raw_bytes = imf_raw_bytes;
+	job->server_folder = dc_strdup(server_folder);
+	job->server_uid    = server_uid;
+	job->flags         = flags;
+
+	pthread_mutex_lock(&pool->mutex);
+
+		if (pool->threads_cnt==0 && !pool->exiting) {
+			start_threads(pool);
+		}
+
+		if (pool->threads_cnt==0 || pool->exiting) {
+			pthread_mutex_unlock(&pool->mutex);
+			dc_receive_imf(pool->context, job->imf_raw, job->imf_raw_bytes, job->server_folder, job->server_uid, job->flags);
+			free_job(job);
+			return;
+		}
+
+		queue = get_queue(pool, queue_id);
+		if (queue->last) {
+			queue->last->next = job;
+		}
+		else {
+			queue->first = job;
+		}
+		queue->last = job;
+		queue->pending_cnt++;
+		queue->pending_bytes += imf_raw_bytes;
+
+		if (pool->todo_last) {
+			pool->todo_last->next_todo = job;
+		}
+		else {
+			pool->todo_first = job;
+		}
+		pool->todo_last = job;
+		pthread_cond_signal(&pool->todo_cond);
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	add_parsed_to_db(pool, queue, 0);
+}
+
+
+/**
+ * Wait until all messages added with the given queue_id are parsed
+ * and added to the database.
+ *
+ * @private @memberof dc_receive_pool_t
+ */
+void dc_receive_pool_flush(dc_receive_pool_t* pool, const void* queue_id)
+{
+	dc_receive_queue_t* queue = NULL;
+
+	if (pool==NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+		queue = get_queue(pool, queue_id);
+	pthread_mutex_unlock(&pool->mutex);
+
+	add_parsed_to_db(pool, queue, 1);
+}
@@ -0,0 +1,74 @@
+#ifndef __DC_RECEIVE_POOL_H__
+#define __DC_RECEIVE_POOL_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*** library-private **********************************************************/
+
+typedef struct _dc_receive_job   dc_receive_job_t;
+typedef struct _dc_receive_queue dc_receive_queue_t;
+typedef struct _dc_receive_pool  dc_receive_pool_t;
+
+
+/* a message waiting to be parsed resp. to be added to the database */
+struct _dc_receive_job
+{
+	dc_receive_job_t*   next_todo;      /* next message to parse, only used while in dc_receive_pool_t::todo_first */
+	dc_receive_job_t*   next;           /* next message of the same queue, in the order the messages were added */
+
+	char*               imf_raw;
+	size_t              imf_raw_bytes;
+	char*               server_folder;
+	uint32_t            server_uid;
+	uint32_t            flags;
+
+	dc_mimeparser_t*    mime_parser;    /* set by the worker */
+	int                 parsed;
+};
+
+
+/* the messages added by one thread, they are added to the database in this order */
+struct _dc_receive_queue
+{
+	const void*         id;
+	dc_receive_job_t*   first;
+	dc_receive_job_t*   last;
+	size_t              pending_cnt;
+	size_t              pending_bytes;
+	dc_receive_queue_t* next;
+};
+
+
+struct _dc_receive_pool
+{
+	dc_context_t*       context;
+
+	pthread_mutex_t     mutex;          /* protects all fields below */
+	pthread_cond_t      todo_cond;      /* signalled when a message is added or the workers should exit */
+	pthread_cond_t      parsed_cond;    /* signalled when a message is parsed */
+
+	dc_receive_job_t*   todo_first;
+	dc_receive_job_t*   todo_last;
+	dc_receive_queue_t* queues;
+
+	#define             DC_RECEIVE_POOL_MAX_THREADS 4
+	pthread_t           threads[DC_RECEIVE_POOL_MAX_THREADS];
+	int                 threads_cnt;
+	int                 exiting;
+};
+
+
+dc_receive_pool_t* dc_receive_pool_new   (dc_context_t*);
+void               dc_receive_pool_unref (dc_receive_pool_t*);
+void               dc_receive_pool_add   (dc_receive_pool_t*, const void* queue_id,
+                                          const char* imf_raw_not_terminated, size_t imf_raw_bytes,
+                                          const char* server_folder, uint32_t server_uid, uint32_t flags);
+void               dc_receive_pool_flush (dc_receive_pool_t*, const void* queue_id);
+
+
+#ifdef __cplusplus
+} /* /extern "C" */
+#endif
+#endif /* __DC_RECEIVE_POOL_H__ */
@@ -167,6 +167,8 @@ static int mark_peer_as_verified(dc_context_t* context, const char* fingerprint)
 	int              success = 0;
 	dc_apeerstate_t* peerstate = dc_apeerstate_new(context);
 
+	pthread_mutex_lock(&context->peerstate_critical);
+
 	if (!dc_apeerstate_load_by_fingerprint(peerstate, context->sql, fingerprint)) {
 		goto cleanup;
 	}
@@ -185,6 +187,7 @@ static int mark_peer_as_verified(dc_context_t* context, const char* fingerprint)
 	success = 1;
 
 cleanup:
+	pthread_mutex_unlock(&context->peerstate_critical);
 	dc_apeerstate_unref(peerstate);
 	return success;
 }
@@ -1,4 +1,5 @@
 #include <unistd.h>
+#include <sys/stat.h>
 #include <libetpan/libetpan.h>
 #include "dc_context.h"
 #include "dc_smtp.h"
@@ -254,17 +255,130 @@ void dc_smtp_disconnect(dc_smtp_t* smtp)
  ******************************************************************************/
 
 
-int dc_smtp_send_msg(dc_smtp_t* smtp, const clist* recipients, const char* data_not_terminated, size_t data_bytes)
+#define DC_SMTP_CHUNK_BYTES 65536
+
+
+typedef struct dc_smtp_stuffer_t
+{
+	int at_line_start;
+	int pending_cr;
+} dc_smtp_stuffer_t;
+
+
+/* Converts one chunk of the spool file as mailsmtp_data_message() would do:
+bare CR and LF become CRLF and lines starting with a dot get an additional dot.
+The state is kept across chunks; `out` must have room for 2*in_bytes+2 bytes. */
+static size_t stuff_chunk(dc_smtp_stuffer_t* st, const char* in, size_t in_bytes, char* out)
+{
+	size_t i = 0, o = 0;
+
+	for (i = 0; i < in_bytes; i++) {
+		char c = in[i];
+
+		if (st->pending_cr) {
+			st->pending_cr = 0;
+			out[o++] = '\r';
+			out[o++] = '\n';
+			st->at_line_start = 1;
+			if (c=='\n') {
+				continue;
+			}
+		}
+
+		if (c=='\r') {
+			st->pending_cr = 1;
+		}
+		else if (c=='\n') {
+			out[o++] = '\r';
+			out[o++] = '\n';
+			st->at_line_start = 1;
+		}
+		else {
+			if (st->at_line_start && c=='.') {
+				out[o++] = '.';
+			}
+			out[o++] = c;
+			st->at_line_start = 0;
+		}
+	}
+
+	return o;
+}
+
+
+static int send_file_data(dc_smtp_t* smtp, FILE* f)
+{
+	int               success = 0;
+	char*             in = malloc(DC_SMTP_CHUNK_BYTES);
+	char*             out = malloc(DC_SMTP_CHUNK_BYTES*2 + 2);
+	size_t            in_bytes = 0;
+	size_t            out_bytes = 0;
+	dc_smtp_stuffer_t st = { 1, 0 };
+
+	if (in==NULL || out==NULL) {
+		exit(55);
+	}
+
+	while ((in_bytes=fread(in, 1, DC_SMTP_CHUNK_BYTES, f)) > 0) {
+		out_bytes = stuff_chunk(&st, in, in_bytes, out);
+		if (mailstream_write(smtp->etpan->stream, out, out_bytes)==-1) {
+			goto cleanup;
+		}
+	}
+
+	if (ferror(f)) {
+		goto cleanup;
+	}
+
+	if (st.pending_cr) {
+		if (mailstream_write(smtp->etpan->stream, "\r\n", 2)==-1) {
+			goto cleanup;
+		}
+	}
+
+	success = 1;
+
+cleanup:
+	free(in);
+	free(out);
+	return success;
+}
+
+
+/**
+ * Send the content of a file as a message. The file is read in chunks of
+ * DC_SMTP_CHUNK_BYTES, so the memory used does not depend on the message size.
+ *
+ * @private @memberof dc_smtp_t
+ * @param smtp The SMTP object.
+ * @param recipients List of recipient addresses.
+ * @param pathNfilename The message file, typically the spool file written by dc_mimefactory_render();
+ *     may be prefixed by `$BLOBDIR`.
+ * @return 1=success, 0=error. On errors, smtp->error and smtp->error_etpan are set.
+ */
+int dc_smtp_send_file(dc_smtp_t* smtp, const clist* recipients, const char* pathNfilename)
 {
 	int        success = 0;
 	int        r = 0;
 	clistiter* iter = NULL;
+	char*      pathNfilename_abs = NULL;
+	FILE*      f = NULL;
+	uint64_t   start = 0;
+	struct stat st;
 
 	if (smtp==NULL) {
 		goto cleanup;
 	}
 
-	if (recipients==NULL || clist_count(recipients)==0 || data_not_terminated==NULL || data_bytes==0) {
+	if (pathNfilename==NULL
+	 || (pathNfilename_abs=dc_get_abs_path(smtp->context, pathNfilename))==NULL
+	 || (f=fopen(pathNfilename_abs, "rb"))==NULL
+	 || fstat(fileno(f), &st)!=0) {
+		dc_log_warning(smtp->context, 0, "Cannot open message file \"%s\".", pathNfilename);
+		goto cleanup;
+	}
+
+	if (recipients==NULL || clist_count(recipients)==0 || st.st_size==0) {
 		success = 1;
 		goto cleanup; // "null message" send
 	}
@@ -273,6 +387,8 @@ int dc_smtp_send_msg(dc_smtp_t* smtp, const clist* recipients, const char* data_
 		goto cleanup;
 	}
 
+	start = dc_metrics_now();
+
 	// set source
 	// the `etPanSMTPTest` is the ENVID from RFC 3461 (SMTP DSNs), we should probably replace it by a random value
 	if ((r=(smtp->esmtp?
@@ -304,15 +420,28 @@ int dc_smtp_send_msg(dc_smtp_t* smtp, const clist* recipients, const char* data_
 		goto cleanup;
 	}
 
-	if ((r = mailsmtp_data_message(smtp->etpan, data_not_terminated, data_bytes)) != MAILSMTP_NO_ERROR) {
+	// stream the file; an empty mailsmtp_data_message() then adds the terminating dot and reads the response.
+	// if streaming fails, the connection is in an undefined state and the caller has to reconnect.
+	if (!send_file_data(smtp, f)) {
+		log_error(smtp, "SMTP failed to send message", MAILSMTP_ERROR_STREAM);
+		goto cleanup;
+	}
+
+	if ((r = mailsmtp_data_message(smtp->etpan, "", 0)) != MAILSMTP_NO_ERROR) {
 		log_error(smtp, "SMTP failed to send message", r);
 		goto cleanup;
 	}
 
+	dc_metrics_add(smtp->context->metrics, DC_METRIC_SMTP_SEND, dc_metrics_now()-start);
+
     dc_log_event(smtp->context, DC_EVENT_SMTP_MESSAGE_SENT, 0,
                  "Message was sent to SMTP server");
 	success = 1;
 
 cleanup:
+	if (f) {
+		fclose(f);
+	}
+	free(pathNfilename_abs);
 	return success;
 }
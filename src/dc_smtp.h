@@ -31,7 +31,7 @@ void         dc_smtp_unref        (dc_smtp_t*);
 int          dc_smtp_is_connected (const dc_smtp_t*);
 int          dc_smtp_connect      (dc_smtp_t*, const dc_loginparam_t*);
 void         dc_smtp_disconnect   (dc_smtp_t*);
-int          dc_smtp_send_msg     (dc_smtp_t*, const clist* recipients, const char* data, size_t data_bytes);
+int          dc_smtp_send_file    (dc_smtp_t*, const clist* recipients, const char* pathNfilename);
 
 
 #ifdef __cplusplus
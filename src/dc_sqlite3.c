@@ -5,6 +5,10 @@
 #include "dc_apeerstate.h"
 
 
+static void flush_stmt_cache(dc_sqlite3_t*);
+static void invalidate_config_cache(dc_sqlite3_t*);
+
+
 /* This class wraps around SQLite.
 
 We use a single handle for the database connections, mainly because
@@ -18,12 +22,36 @@ safe. However, there are some points to keep in mind:
    is halted until the first has finished writing, at most the timespan set
    by sqlite3_busy_timeout().
 
-2. Transactions are possible using `BEGIN IMMEDIATE` (this causes the first
-   thread trying to write to block the others as described in 1.
-   Transaction cannot be nested, we recommend to use them only in the
-   top-level functions or not to use them.
-
-3. Using sqlite3_last_insert_rowid() and sqlite3_changes() cause race conditions
+2. Transactions are started by dc_sqlite3_begin_transaction() using
+   `BEGIN IMMEDIATE`; only one thread can have a transaction open,
+   other threads calling dc_sqlite3_begin_transaction() wait until the
+   transaction is committed or rolled back.  Nested calls from the same
+   thread are mapped to `SAVEPOINT`s, so functions using transactions
+   can be called from within other transactions.
+   As all threads share the same handle, statements executed by other
+   threads _without_ a transaction become part of an open transaction;
+   keep this in mind when rolling back.
+
+   dc_sqlite3_begin_batch() opens a transaction that is committed and
+   re-opened after every n dc_sqlite3_batch_step(), this is used to
+   bundle the writes of many received messages.  as other threads cannot
+   write while a batch is open, it should only be open while writing,
+   never while waiting for the network; between the commits, the batch
+   gives way to threads waiting in dc_sqlite3_begin_transaction().
+
+3. If the config-key `wal_mode` is set, the database is switched to
+   write-ahead logging on the next dc_sqlite3_open() and a small pool of
+   read-only connections is opened.  Statements prepared by
+   dc_sqlite3_prepare_read() run on these connections and are not blocked
+   by the writer, however, they cannot see uncommitted changes; if the
+   calling thread has a transaction open or other threads have written
+   into it, dc_sqlite3_prepare_read() falls back to the writer connection.
+   events that make the UI read changed data are deferred until the sending
+   thread commits, see dc_sqlite3_defer_event().
+   the bundled SQLite is built with SQLITE_OMIT_WAL, with it, switching to WAL
+   fails and the database stays in rollback journaling without readers.
+
+4. Using sqlite3_last_insert_rowid() and sqlite3_changes() cause race conditions
    (between the query and the call another thread may insert or update a row.
    These functions MUST NOT be used;
    dc_sqlite3_get_rowid() provides an alternative. */
@@ -50,6 +78,31 @@ void dc_sqlite3_log_error(dc_sqlite3_t* sql, const char* msg_format, ...)
 }
 
 
+static void check_foreign_write(dc_sqlite3_t* sql, sqlite3_stmt* stmt)
+{
+	// with WAL, writes done by other threads into the open transaction
+	// are not visible to the readers until committed, see dc_sqlite3_prepare_read()
+	if (sql->readers_cnt>0 && !sqlite3_stmt_readonly(stmt)) {
+		if (pthread_mutex_trylock(&sql->transaction_critical)==0) {
+			pthread_mutex_unlock(&sql->transaction_critical);
+		}
+		else {
+			pthread_mutex_lock(&sql->readers_critical);
+				sql->foreign_writes = 1;
+			pthread_mutex_unlock(&sql->readers_critical);
+		}
+	}
+}
+
+
+static void reset_foreign_writes(dc_sqlite3_t* sql)
+{
+	pthread_mutex_lock(&sql->readers_critical);
+		sql->foreign_writes = 0;
+	pthread_mutex_unlock(&sql->readers_critical);
+}
+
+
 sqlite3_stmt* dc_sqlite3_prepare(dc_sqlite3_t* sql, const char* querystr)
 {
 	sqlite3_stmt* stmt = NULL;
@@ -67,11 +120,77 @@ sqlite3_stmt* dc_sqlite3_prepare(dc_sqlite3_t* sql, const char* querystr)
 		return NULL;
 	}
 
+	check_foreign_write(sql, stmt);
+
 	/* success - the result must be freed using sqlite3_finalize() */
 	return stmt;
 }
 
 
+static sqlite3* get_read_connection(dc_sqlite3_t* sql)
+{
+	sqlite3* reader = NULL;
+
+	if (sql->readers_cnt==0) {
+		return sql->cobj;
+	}
+
+	// the readers cannot see uncommitted changes, so, use the writer
+	// if the current thread has a transaction open or if other threads have
+	// written into the transaction opened by another thread.
+	int foreign_transaction = 1;
+	if (pthread_mutex_trylock(&sql->transaction_critical)==0) {
+		int own_transaction = sql->transaction_depth>0;
+		foreign_transaction = 0;
+		pthread_mutex_unlock(&sql->transaction_critical);
+		if (own_transaction) {
+			return sql->cobj;
+		}
+	}
+
+	pthread_mutex_lock(&sql->readers_critical);
+		if (foreign_transaction && sql->foreign_writes) {
+			reader = sql->cobj;
+		}
+		else {
+			reader = sql->readers[sql->next_reader];
+			sql->next_reader = (sql->next_reader+1) % sql->readers_cnt;
+		}
+	pthread_mutex_unlock(&sql->readers_critical);
+
+	return reader;
+}
+
+
+static sqlite3_stmt* prepare_on(dc_sqlite3_t* sql, sqlite3* db, const char* querystr)
+{
+	sqlite3_stmt* stmt = NULL;
+
+	if (db==sql->cobj) {
+		return dc_sqlite3_prepare(sql, querystr);
+	}
+
+	if (sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL) != SQLITE_OK) {
+		dc_log_error(sql->context, 0, "Read-query failed: %s SQLite says: %s",
+			querystr, sqlite3_errmsg(db));
+		return NULL;
+	}
+
+	return stmt;
+}
+
+
+sqlite3_stmt* dc_sqlite3_prepare_read(dc_sqlite3_t* sql, const char* querystr)
+{
+	if (sql==NULL || querystr==NULL || sql->cobj==NULL) {
+		return NULL;
+	}
+
+	/* the result must be freed using sqlite3_finalize() */
+	return prepare_on(sql, get_read_connection(sql), querystr);
+}
+
+
 int dc_sqlite3_try_execute(dc_sqlite3_t* sql, const char* querystr)
 {
 	// same as dc_sqlite3_execute() but does not pass error to ui
@@ -172,6 +291,24 @@ dc_sqlite3_t* dc_sqlite3_new(dc_context_t* context)
 
 	sql->context          = context;
 
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&sql->transaction_critical, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_mutex_init(&sql->transaction_waiters_critical, NULL);
+	pthread_cond_init(&sql->transaction_waiters_cond, NULL);
+
+	pthread_mutex_init(&sql->readers_critical, NULL);
+	pthread_mutex_init(&sql->stmt_cache_critical, NULL);
+
+	dc_hash_init(&sql->config_cache, DC_HASH_BINARY, DC_HASH_COPY_KEY);
+	pthread_mutex_init(&sql->config_critical, NULL);
+
+	dc_hash_init(&sql->peerstate_cache, DC_HASH_BINARY, DC_HASH_COPY_KEY);
+	dc_hash_init(&sql->peerstate_fingerprints, DC_HASH_BINARY, DC_HASH_COPY_KEY);
+	pthread_mutex_init(&sql->peerstate_cache_critical, NULL);
+
 	return sql;
 }
 
@@ -186,10 +323,158 @@ void dc_sqlite3_unref(dc_sqlite3_t* sql)
 		dc_sqlite3_close(sql);
 	}
 
+	pthread_mutex_destroy(&sql->transaction_critical);
+	pthread_cond_destroy(&sql->transaction_waiters_cond);
+	pthread_mutex_destroy(&sql->transaction_waiters_critical);
+	pthread_mutex_destroy(&sql->readers_critical);
+	pthread_mutex_destroy(&sql->stmt_cache_critical);
+	invalidate_config_cache(sql);
+	pthread_mutex_destroy(&sql->config_critical);
+	dc_apeerstate_cache_clear(sql);
+	pthread_mutex_destroy(&sql->peerstate_cache_critical);
 	free(sql);
 }
 
 
+static int sqlite_master_has(dc_sqlite3_t* sql, const char* type, const char* name)
+{
+	int           ret = 0;
+	sqlite3_stmt* stmt = dc_sqlite3_prepare(sql,
+		"SELECT COUNT(*) FROM sqlite_master WHERE type=? AND name=?;");
+	sqlite3_bind_text(stmt, 1, type, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt)==SQLITE_ROW) {
+		ret = sqlite3_column_int(stmt, 0)>0;
+	}
+	sqlite3_finalize(stmt);
+	return ret;
+}
+
+
+static void update_fts(dc_sqlite3_t* sql)
+{
+	// FTS5 registers the SQL-function fts5(), use this to check if
+	// FTS5 is available without logging errors.
+	sqlite3_stmt* stmt = NULL;
+	int           fts5_available = (sqlite3_prepare_v2(sql->cobj, "SELECT fts5(?);", -1, &stmt, NULL)==SQLITE_OK);
+	sqlite3_finalize(stmt);
+
+	sql->fts_enabled = 0;
+
+	if (fts5_available)
+	{
+		if (!sqlite_master_has(sql, "table", "msgs_fts")) {
+			// `prefix` adds indexes for prefixes of 2 and 3 characters,
+			// which speeds up the typical as-you-type-search.
+			dc_sqlite3_execute(sql, "CREATE VIRTUAL TABLE msgs_fts USING fts5(txt, prefix='2 3');");
+		}
+
+		if (!sqlite_master_has(sql, "trigger", "msgs_fts_insert"))
+		{
+			// the triggers catch all inserts/updates/deletes on msgs, eg. from
+			// dc_receive_imf(), prepare_msg_raw() or dc_delete_msg_from_db().
+			// messages existing before are added by dc_fts_backfill().
+			dc_sqlite3_execute(sql, "CREATE TRIGGER msgs_fts_insert AFTER INSERT ON msgs WHEN new.txt!='' BEGIN"
+						" INSERT INTO msgs_fts (rowid, txt) VALUES (new.id, new.txt);"
+						" END;");
+			dc_sqlite3_execute(sql, "CREATE TRIGGER msgs_fts_update AFTER UPDATE OF txt ON msgs BEGIN"
+						" DELETE FROM msgs_fts WHERE rowid=old.id;"
+						" INSERT INTO msgs_fts (rowid, txt) SELECT new.id, new.txt WHERE new.txt!='';"
+						" END;");
+			dc_sqlite3_execute(sql, "CREATE TRIGGER msgs_fts_delete AFTER DELETE ON msgs BEGIN"
+						" DELETE FROM msgs_fts WHERE rowid=old.id;"
+						" END;");
+
+			dc_sqlite3_execute(sql, "DELETE FROM msgs_fts;");
+			dc_sqlite3_set_config_int(sql, "fts_backfill_pos", 0);
+			stmt = dc_sqlite3_prepare(sql, "SELECT MAX(id) FROM msgs;");
+			sqlite3_step(stmt);
+			dc_sqlite3_set_config_int(sql, "fts_backfill_end", sqlite3_column_int(stmt, 0));
+			sqlite3_finalize(stmt);
+		}
+
+		sql->fts_enabled = 1;
+	}
+	else if (sqlite_master_has(sql, "trigger", "msgs_fts_insert"))
+	{
+		// without the module, the triggers would make every change on msgs fail.
+		// if FTS5 is available again later, the index is rebuilt.
+		dc_log_warning(sql->context, 0, "FTS5 not available, disabling full-text-index.");
+		dc_sqlite3_execute(sql, "DROP TRIGGER msgs_fts_insert;");
+		dc_sqlite3_execute(sql, "DROP TRIGGER msgs_fts_update;");
+		dc_sqlite3_execute(sql, "DROP TRIGGER msgs_fts_delete;");
+	}
+}
+
+
+static int set_journal_mode(dc_sqlite3_t* sql, const char* mode)
+{
+	// `PRAGMA journal_mode` returns the new mode, which may differ from the
+	// requested one, eg. for in-memory-databases or if the WAL is not supported.
+	int           success = 0;
+	char*         q3 = sqlite3_mprintf("PRAGMA journal_mode=%s;", mode);
+	sqlite3_stmt* stmt = dc_sqlite3_prepare(sql, q3);
+
+	if (sqlite3_step(stmt)==SQLITE_ROW
+	 && strcasecmp((const char*)sqlite3_column_text(stmt, 0), mode)==0) {
+		success = 1;
+	}
+	else {
+		dc_log_warning(sql->context, 0, "Cannot set journal mode to \"%s\".", mode);
+	}
+
+	sqlite3_finalize(stmt);
+	sqlite3_free(q3);
+	return success;
+}
+
+
+static int trace_cb(unsigned type, void* userdata, void* p, void* x)
+{
+	/* measure the execution time of all statements; SQLITE_TRACE_PROFILE
+	reports a time as well, but with millisecond resolution only */
+	dc_sqlite3_t* sql = (dc_sqlite3_t*)userdata;
+
+	if (sql->context==NULL) {
+		return 0;
+	}
+
+	if (type==SQLITE_TRACE_STMT) {
+		dc_metrics_begin(sql->context->metrics, p);
+	}
+	else if (type==SQLITE_TRACE_PROFILE) {
+		/* classify by the statement, not by the connection, as without WAL all statements run on the
+		writing connection; COMMIT and RELEASE are read-only for sqlite3_stmt_readonly(), but do the writing */
+		sqlite3_stmt* stmt = (sqlite3_stmt*)p;
+		const char*   stmt_sql = sqlite3_sql(stmt);
+		int           is_write = !sqlite3_stmt_readonly(stmt)
+			|| (stmt_sql && (strncasecmp(stmt_sql, "COMMIT", 6)==0 || strncasecmp(stmt_sql, "END", 3)==0 || strncasecmp(stmt_sql, "RELEASE", 7)==0));
+		dc_metrics_end(sql->context->metrics, is_write? DC_METRIC_SQL_WRITE : DC_METRIC_SQL_READ, p);
+	}
+	return 0;
+}
+
+
+static void open_readers(dc_sqlite3_t* sql, const char* dbfile)
+{
+	while (sql->readers_cnt < DC_READ_POOL_SIZE)
+	{
+		sqlite3* reader = NULL;
+		if (sqlite3_open_v2(dbfile, &reader,
+				SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+			dc_log_warning(sql->context, 0, "Cannot open read connection to \"%s\", using %i connections.", dbfile, sql->readers_cnt);
+			sqlite3_close(reader);
+			break;
+		}
+		sqlite3_busy_timeout(reader, 10*1000);
+		sqlite3_trace_v2(reader, SQLITE_TRACE_STMT|SQLITE_TRACE_PROFILE, trace_cb, sql);
+		sql->readers[sql->readers_cnt++] = reader;
+	}
+
+	dc_log_info(sql->context, 0, "WAL enabled, %i read connections.", sql->readers_cnt);
+}
+
+
 int dc_sqlite3_open(dc_sqlite3_t* sql, const char* dbfile, int flags)
 {
 	if (dc_sqlite3_is_open(sql)) {
@@ -236,6 +521,8 @@ int dc_sqlite3_open(dc_sqlite3_t* sql, const char* dbfile, int flags)
 	// (without a busy_timeout, sqlite3_step() would return SQLITE_BUSY at once)
 	sqlite3_busy_timeout(sql->cobj, 10*1000);
 
+	sqlite3_trace_v2(sql->cobj, SQLITE_TRACE_STMT|SQLITE_TRACE_PROFILE, trace_cb, sql);
+
 	if (!(flags&DC_OPEN_READONLY))
 	{
 		int exists_before_update = 0;
@@ -637,6 +924,136 @@ int dc_sqlite3_open(dc_sqlite3_t* sql, const char* dbfile, int flags)
 			}
 		#undef NEW_DB_VERSION
 
+		#define NEW_DB_VERSION 56
+			if (dbversion < NEW_DB_VERSION)
+			{
+				dc_sqlite3_execute(sql, "CREATE INDEX msgs_index7 ON msgs (from_id);"); /* needed to search messages by the name of the sender */
+
+				dbversion = NEW_DB_VERSION;
+				dc_sqlite3_set_config_int(sql, "dbversion", NEW_DB_VERSION);
+			}
+		#undef NEW_DB_VERSION
+
+		#define NEW_DB_VERSION 57
+			if (dbversion < NEW_DB_VERSION)
+			{
+				// chats_summary holds the last visible message and the number of
+				// fresh messages per chat, so that the chatlist needs no
+				// aggregation over msgs.  The table is maintained by triggers,
+				// which covers all places where messages are added, changed or deleted.
+				// Only if the last message is deleted or hidden, it is searched again.
+				#define SUMMARY_VISIBLE(m) "(" m ".hidden=0 OR (" m ".hidden=1 AND " m ".state=" DC_STRINGIFY(DC_STATE_OUT_DRAFT) "))"
+				#define SUMMARY_FRESH(m)   "(" m ".state=" DC_STRINGIFY(DC_STATE_IN_FRESH) " AND " m ".hidden=0)"
+				#define SUMMARY_SET_LAST(m) " last_msg_id=" m ".id, last_timestamp=" m ".timestamp, last_from_id=" m ".from_id"
+				#define SUMMARY_IS_LATER(m) " (" m ".timestamp>last_timestamp OR (" m ".timestamp=last_timestamp AND " m ".id>last_msg_id))"
+				#define SUMMARY_RECALC_LAST(chat_id) \
+					" UPDATE chats_summary SET (last_msg_id, last_timestamp, last_from_id)=" \
+					"  (SELECT id, timestamp, from_id FROM msgs m" \
+					"    WHERE m.chat_id=" chat_id " AND " SUMMARY_VISIBLE("m") " ORDER BY timestamp DESC, id DESC LIMIT 1)" \
+					"  WHERE chat_id=" chat_id " AND last_msg_id=old.id"
+				#define SUMMARY_RESET_EMPTY(chat_id) \
+					" UPDATE chats_summary SET last_msg_id=0, last_timestamp=0, last_from_id=0" \
+					"  WHERE chat_id=" chat_id " AND last_msg_id IS NULL;"
+
+				dc_sqlite3_execute(sql, "CREATE TABLE chats_summary ("
+							" chat_id INTEGER PRIMARY KEY,"
+							" last_msg_id INTEGER DEFAULT 0,"
+							" last_timestamp INTEGER DEFAULT 0,"
+							" last_from_id INTEGER DEFAULT 0,"
+							" fresh_cnt INTEGER DEFAULT 0);");
+
+				dc_sqlite3_execute(sql, "CREATE TRIGGER chats_summary_insert AFTER INSERT ON msgs BEGIN"
+							" INSERT OR IGNORE INTO chats_summary (chat_id) VALUES (new.chat_id);"
+							" UPDATE chats_summary SET fresh_cnt=fresh_cnt+1 WHERE chat_id=new.chat_id AND " SUMMARY_FRESH("new") ";"
+							" UPDATE chats_summary SET " SUMMARY_SET_LAST("new")
+							"  WHERE chat_id=new.chat_id AND " SUMMARY_VISIBLE("new") " AND " SUMMARY_IS_LATER("new") ";"
+							" END;");
+
+				dc_sqlite3_execute(sql, "CREATE TRIGGER chats_summary_delete AFTER DELETE ON msgs BEGIN"
+							" UPDATE chats_summary SET fresh_cnt=fresh_cnt-1 WHERE chat_id=old.chat_id AND " SUMMARY_FRESH("old") ";"
+							SUMMARY_RECALC_LAST("old.chat_id") ";"
+							SUMMARY_RESET_EMPTY("old.chat_id")
+							" END;");
+
+				#define SUMMARY_STAYS_LAST "(old.chat_id=new.chat_id AND " SUMMARY_VISIBLE("new") " AND new.timestamp>=old.timestamp)"
+				dc_sqlite3_execute(sql, "CREATE TRIGGER chats_summary_update AFTER UPDATE OF chat_id, from_id, timestamp, state, hidden ON msgs BEGIN"
+							" INSERT OR IGNORE INTO chats_summary (chat_id) VALUES (new.chat_id);"
+							" UPDATE chats_summary SET fresh_cnt=fresh_cnt-1 WHERE chat_id=old.chat_id AND " SUMMARY_FRESH("old") ";"
+							" UPDATE chats_summary SET fresh_cnt=fresh_cnt+1 WHERE chat_id=new.chat_id AND " SUMMARY_FRESH("new") ";"
+							" UPDATE chats_summary SET " SUMMARY_SET_LAST("new")
+							"  WHERE chat_id=new.chat_id AND last_msg_id=new.id AND " SUMMARY_STAYS_LAST ";"
+							SUMMARY_RECALC_LAST("old.chat_id") " AND NOT " SUMMARY_STAYS_LAST ";"
+							SUMMARY_RESET_EMPTY("old.chat_id")
+							" UPDATE chats_summary SET " SUMMARY_SET_LAST("new")
+							"  WHERE chat_id=new.chat_id AND " SUMMARY_VISIBLE("new") " AND " SUMMARY_IS_LATER("new") ";"
+							" END;");
+
+				dc_sqlite3_execute(sql, "CREATE TRIGGER chats_summary_delete_chat AFTER DELETE ON chats BEGIN"
+							" DELETE FROM chats_summary WHERE chat_id=old.id;"
+							" END;");
+
+				// initial fill, this is the last time, the chatlist is created the slow way
+				dc_sqlite3_execute(sql, "INSERT INTO chats_summary (chat_id, last_msg_id, last_timestamp, last_from_id, fresh_cnt)"
+							" SELECT c.id, IFNULL(m.id,0), IFNULL(m.timestamp,0), IFNULL(m.from_id,0),"
+							"  (SELECT COUNT(*) FROM msgs f WHERE f.chat_id=c.id AND " SUMMARY_FRESH("f") ")"
+							" FROM chats c"
+							" LEFT JOIN msgs m ON m.id=(SELECT id FROM msgs l WHERE l.chat_id=c.id AND " SUMMARY_VISIBLE("l") " ORDER BY timestamp DESC, id DESC LIMIT 1);");
+
+				#undef SUMMARY_VISIBLE
+				#undef SUMMARY_FRESH
+				#undef SUMMARY_SET_LAST
+				#undef SUMMARY_IS_LATER
+				#undef SUMMARY_RECALC_LAST
+				#undef SUMMARY_RESET_EMPTY
+				#undef SUMMARY_STAYS_LAST
+
+				dbversion = NEW_DB_VERSION;
+				dc_sqlite3_set_config_int(sql, "dbversion", NEW_DB_VERSION);
+			}
+		#undef NEW_DB_VERSION
+
+		#define NEW_DB_VERSION 58
+			if (dbversion < NEW_DB_VERSION)
+			{
+				// composite indices matching the WHERE and ORDER BY of the most frequent queries,
+				// so that the rows are read in order and no temporary b-tree is needed for sorting:
+				// - msgs_index8 is used by dc_get_chat_msgs() and dc_get_chat_msgs_window()
+				// - msgs_index9 is used by dc_get_fresh_msgs() and for the deaddrop's last fresh message
+				// the old single-column indices are prefixes of the new ones and are no longer needed.
+				dc_sqlite3_execute(sql, "CREATE INDEX msgs_index8 ON msgs (chat_id, hidden, timestamp, id);");
+				dc_sqlite3_execute(sql, "CREATE INDEX msgs_index9 ON msgs (state, hidden, timestamp, id);");
+				dc_sqlite3_execute(sql, "DROP INDEX IF EXISTS msgs_index2;");
+				dc_sqlite3_execute(sql, "DROP INDEX IF EXISTS msgs_index4;");
+
+				dbversion = NEW_DB_VERSION;
+				dc_sqlite3_set_config_int(sql, "dbversion", NEW_DB_VERSION);
+			}
+		#undef NEW_DB_VERSION
+
+		#define NEW_DB_VERSION 59
+			if (dbversion < NEW_DB_VERSION)
+			{
+				// needed to apply flag changes and expunges reported by the server, see dc_update_msgs_from_server()
+				dc_sqlite3_execute(sql, "CREATE INDEX msgs_index10 ON msgs (server_folder, server_uid);");
+
+				dbversion = NEW_DB_VERSION;
+				dc_sqlite3_set_config_int(sql, "dbversion", NEW_DB_VERSION);
+			}
+		#undef NEW_DB_VERSION
+
+		#define NEW_DB_VERSION 60
+			if (dbversion < NEW_DB_VERSION)
+			{
+				// content of the files in the blob directory, used if `dedup_blobs` is enabled, see dc_blob.c;
+				// the files are still referenced by the params of msgs, chats etc.
+				dc_sqlite3_execute(sql, "CREATE TABLE blobs (hash TEXT PRIMARY KEY, bytes INTEGER DEFAULT 0, path TEXT DEFAULT '');");
+				dc_sqlite3_execute(sql, "CREATE INDEX blobs_index1 ON blobs (path);");
+
+				dbversion = NEW_DB_VERSION;
+				dc_sqlite3_set_config_int(sql, "dbversion", NEW_DB_VERSION);
+			}
+		#undef NEW_DB_VERSION
+
 		// (2) updates that require high-level objects
 		// (the structure is complete now and all objects are usable)
 		// --------------------------------------------------------------------
@@ -676,6 +1093,31 @@ int dc_sqlite3_open(dc_sqlite3_t* sql, const char* dbfile, int flags)
 			free(repl_from);
 			dc_sqlite3_set_config(sql, "backup_for", NULL);
 		}
+
+		// (3) full-text-index; this is not done by a versioned update
+		// as the availability of FTS5 may change, eg. on backup import.
+		// --------------------------------------------------------------------
+
+		update_fts(sql);
+
+		// (4) journal mode; this is stored in the database file, so we set
+		// it explicitly also when WAL is disabled.
+		// --------------------------------------------------------------------
+
+		if (dc_sqlite3_get_config_int(sql, "wal_mode", 0))
+		{
+			if (set_journal_mode(sql, "wal"))
+			{
+				// in WAL mode, synchronous=NORMAL is still safe against corruption,
+				// only the last transactions may be lost on power failure.
+				dc_sqlite3_execute(sql, "PRAGMA synchronous=NORMAL;");
+				open_readers(sql, dbfile);
+			}
+		}
+		else
+		{
+			set_journal_mode(sql, "delete");
+		}
 	}
 
 	dc_log_info(sql->context, 0, "Opened \"%s\".", dbfile);
@@ -693,9 +1135,26 @@ void dc_sqlite3_close(dc_sqlite3_t* sql)
 		return;
 	}
 
+	// statements that are still borrowed keep their connection alive as a
+	// zombie (sqlite3_close_v2()) until they are finalized on return
+	flush_stmt_cache(sql);
+	invalidate_config_cache(sql);
+	dc_apeerstate_cache_clear(sql);
+
+	// close the readers first, the last connection closed checkpoints the WAL
+	while (sql->readers_cnt>0) {
+		sql->readers_cnt--;
+		sqlite3_close_v2(sql->readers[sql->readers_cnt]);
+		sql->readers[sql->readers_cnt] = NULL;
+	}
+	sql->next_reader = 0;
+	reset_foreign_writes(sql);
+	dc_array_unref(sql->deferred_events);
+	sql->deferred_events = NULL;
+
 	if (sql->cobj)
 	{
-		sqlite3_close(sql->cobj);
+		sqlite3_close_v2(sql->cobj);
 		sql->cobj = NULL;
 	}
 
@@ -750,13 +1209,229 @@ cleanup:
 }
 
 
+/*******************************************************************************
+ * Statement cache
+ ******************************************************************************/
+
+
+static uint32_t hash_querystr(const char* querystr)
+{
+	uint32_t hash = 5381;
+	while (*querystr) {
+		hash = (hash<<5) + hash + (unsigned char)*querystr++;
+	}
+	return hash;
+}
+
+
+static sqlite3_stmt* borrow_stmt(dc_sqlite3_t* sql, sqlite3* db, const char* querystr)
+{
+	sqlite3_stmt*          stmt = NULL;
+	uint32_t               hash = hash_querystr(querystr);
+	dc_stmt_cache_entry_t* entry = NULL;
+	int                    i = 0;
+
+	pthread_mutex_lock(&sql->stmt_cache_critical);
+		sql->stmt_cache_clock++;
+		for (i = 0; i < DC_STMT_CACHE_SIZE; i++) {
+			entry = &sql->stmt_cache[i];
+			if (entry->stmt && !entry->in_use && entry->db==db
+			 && entry->hash==hash && strcmp(entry->querystr, querystr)==0) {
+				entry->in_use = 1;
+				entry->last_used = sql->stmt_cache_clock;
+				stmt = entry->stmt;
+				break;
+			}
+		}
+		if (stmt) {
+			sql->stmt_cache_hits++;
+		}
+		else {
+			sql->stmt_cache_misses++;
+		}
+	pthread_mutex_unlock(&sql->stmt_cache_critical);
+
+	if (stmt) {
+		if (db==sql->cobj) {
+			check_foreign_write(sql, stmt);
+		}
+		return stmt;
+	}
+
+	if ((stmt=prepare_on(sql, db, querystr))==NULL) {
+		return NULL;
+	}
+
+	// add the statement to the cache, replace the least recently used one
+	// that is not borrowed; if all entries are borrowed, the statement is
+	// just finalized on return.
+	pthread_mutex_lock(&sql->stmt_cache_critical);
+		dc_stmt_cache_entry_t* lru = NULL;
+		for (i = 0; i < DC_STMT_CACHE_SIZE; i++) {
+			entry = &sql->stmt_cache[i];
+			if (entry->stmt==NULL) {
+				lru = entry;
+				break;
+			}
+			if (!entry->in_use && (lru==NULL || entry->last_used < lru->last_used)) {
+				lru = entry;
+			}
+		}
+
+		if (lru) {
+			if (lru->stmt) {
+				sqlite3_finalize(lru->stmt);
+				free(lru->querystr);
+			}
+			lru->db        = db;
+			lru->querystr  = dc_strdup(querystr);
+			lru->hash      = hash;
+			lru->stmt      = stmt;
+			lru->in_use    = 1;
+			lru->last_used = sql->stmt_cache_clock;
+		}
+	pthread_mutex_unlock(&sql->stmt_cache_critical);
+
+	return stmt;
+}
+
+
+sqlite3_stmt* dc_sqlite3_borrow_stmt(dc_sqlite3_t* sql, const char* querystr)
+{
+	if (sql==NULL || querystr==NULL || sql->cobj==NULL) {
+		return NULL;
+	}
+
+	return borrow_stmt(sql, sql->cobj, querystr);
+}
+
+
+sqlite3_stmt* dc_sqlite3_borrow_read_stmt(dc_sqlite3_t* sql, const char* querystr)
+{
+	if (sql==NULL || querystr==NULL || sql->cobj==NULL) {
+		return NULL;
+	}
+
+	return borrow_stmt(sql, get_read_connection(sql), querystr);
+}
+
+
+void dc_sqlite3_return_stmt(dc_sqlite3_t* sql, sqlite3_stmt* stmt)
+{
+	int found = 0;
+	int i = 0;
+
+	if (sql==NULL || stmt==NULL) {
+		return;
+	}
+
+	// resetting the statement also ends implicit read transactions
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	pthread_mutex_lock(&sql->stmt_cache_critical);
+		for (i = 0; i < DC_STMT_CACHE_SIZE; i++) {
+			if (sql->stmt_cache[i].stmt==stmt) {
+				sql->stmt_cache[i].in_use = 0;
+				found = 1;
+				break;
+			}
+		}
+	pthread_mutex_unlock(&sql->stmt_cache_critical);
+
+	if (!found) {
+		sqlite3_finalize(stmt);
+	}
+}
+
+
+static void flush_stmt_cache(dc_sqlite3_t* sql)
+{
+	int i = 0;
+
+	pthread_mutex_lock(&sql->stmt_cache_critical);
+		for (i = 0; i < DC_STMT_CACHE_SIZE; i++) {
+			dc_stmt_cache_entry_t* entry = &sql->stmt_cache[i];
+			if (entry->stmt) {
+				if (entry->in_use) {
+					// the borrower is still using the statement; just drop it
+					// from the cache, dc_sqlite3_return_stmt() finalizes it then.
+					dc_log_warning(sql->context, 0, "Statement still borrowed on close: %s", entry->querystr);
+				}
+				else {
+					sqlite3_finalize(entry->stmt);
+				}
+				free(entry->querystr);
+				memset(entry, 0, sizeof(dc_stmt_cache_entry_t));
+			}
+		}
+	pthread_mutex_unlock(&sql->stmt_cache_critical);
+}
+
+
 /*******************************************************************************
  * Handle configuration
  ******************************************************************************/
 
 
+/* All config values are read into config_cache on first access, subsequent
+reads do not touch the database.  dc_sqlite3_set_config() writes through,
+rollbacks and closing the database invalidate the whole cache. */
+
+
+static void invalidate_config_cache(dc_sqlite3_t* sql)
+{
+	dc_hashelem_t* elem = NULL;
+
+	pthread_mutex_lock(&sql->config_critical);
+		for (elem = dc_hash_first(&sql->config_cache); elem; elem = dc_hash_next(elem)) {
+			free(dc_hash_data(elem));
+		}
+		dc_hash_clear(&sql->config_cache);
+		sql->config_cache_loaded = 0;
+	pthread_mutex_unlock(&sql->config_critical);
+}
+
+
+static int load_config_cache(dc_sqlite3_t* sql)
+{
+	// config_critical must be held by the caller
+	sqlite3_stmt* stmt = NULL;
+
+	if (sql->config_cache_loaded) {
+		return 1;
+	}
+
+	if ((stmt=dc_sqlite3_prepare(sql, "SELECT keyname, value FROM config ORDER BY id;"))==NULL) {
+		return 0;
+	}
+
+	while (sqlite3_step(stmt)==SQLITE_ROW) {
+		const char* key   = (const char*)sqlite3_column_text(stmt, 0);
+		const char* value = (const char*)sqlite3_column_text(stmt, 1);
+		if (key && value && dc_hash_find_str(&sql->config_cache, key)==NULL) { /* for duplicate keys, the first record wins as for a direct query */
+			dc_hash_insert_str(&sql->config_cache, key, dc_strdup(value));
+		}
+	}
+
+	sqlite3_finalize(stmt);
+	sql->config_cache_loaded = 1;
+	return 1;
+}
+
+
+static void update_config_cache(dc_sqlite3_t* sql, const char* key, const char* value)
+{
+	// config_critical must be held by the caller
+	if (sql->config_cache_loaded) {
+		free(dc_hash_insert_str(&sql->config_cache, key, value? dc_strdup(value) : NULL));
+	}
+}
+
+
 int dc_sqlite3_set_config(dc_sqlite3_t* sql, const char* key, const char* value)
 {
+	int           success = 0;
 	int           state = 0;
 	sqlite3_stmt* stmt = NULL;
 
@@ -770,61 +1445,81 @@ int dc_sqlite3_set_config(dc_sqlite3_t* sql, const char* key, const char* value)
 		return 0;
 	}
 
+	// the lock is held during the write, so that the order of the
+	// writes to the database and to the cache is the same
+	pthread_mutex_lock(&sql->config_critical);
+
 	if (value)
 	{
 		/* insert/update key=value */
 		#define SELECT_v_FROM_config_k_STATEMENT "SELECT value FROM config WHERE keyname=?;"
-		stmt = dc_sqlite3_prepare(sql, SELECT_v_FROM_config_k_STATEMENT);
+		stmt = dc_sqlite3_borrow_stmt(sql, SELECT_v_FROM_config_k_STATEMENT);
 		sqlite3_bind_text (stmt, 1, key, -1, SQLITE_STATIC);
 		state = sqlite3_step(stmt);
-		sqlite3_finalize(stmt);
+		dc_sqlite3_return_stmt(sql, stmt);
 
 		if (state==SQLITE_DONE) {
-			stmt = dc_sqlite3_prepare(sql, "INSERT INTO config (keyname, value) VALUES (?, ?);");
+			stmt = dc_sqlite3_borrow_stmt(sql, "INSERT INTO config (keyname, value) VALUES (?, ?);");
 			sqlite3_bind_text (stmt, 1, key,   -1, SQLITE_STATIC);
 			sqlite3_bind_text (stmt, 2, value, -1, SQLITE_STATIC);
 			state = sqlite3_step(stmt);
-			sqlite3_finalize(stmt);
+			dc_sqlite3_return_stmt(sql, stmt);
 		}
 		else if (state==SQLITE_ROW) {
-			stmt = dc_sqlite3_prepare(sql, "UPDATE config SET value=? WHERE keyname=?;");
+			stmt = dc_sqlite3_borrow_stmt(sql, "UPDATE config SET value=? WHERE keyname=?;");
 			sqlite3_bind_text (stmt, 1, value, -1, SQLITE_STATIC);
 			sqlite3_bind_text (stmt, 2, key,   -1, SQLITE_STATIC);
 			state = sqlite3_step(stmt);
-			sqlite3_finalize(stmt);
+			dc_sqlite3_return_stmt(sql, stmt);
 		}
 		else {
 			dc_log_error(sql->context, 0, "dc_sqlite3_set_config(): Cannot read value.");
-			return 0;
+			goto cleanup;
 		}
 	}
 	else
 	{
 		/* delete key */
-		stmt = dc_sqlite3_prepare(sql, "DELETE FROM config WHERE keyname=?;");
+		stmt = dc_sqlite3_borrow_stmt(sql, "DELETE FROM config WHERE keyname=?;");
 		sqlite3_bind_text (stmt, 1, key,   -1, SQLITE_STATIC);
 		state = sqlite3_step(stmt);
-		sqlite3_finalize(stmt);
+		dc_sqlite3_return_stmt(sql, stmt);
 	}
 
 	if (state != SQLITE_DONE)  {
 		dc_log_error(sql->context, 0, "dc_sqlite3_set_config(): Cannot change value.");
-		return 0;
+		goto cleanup;
 	}
 
-	return 1;
+	update_config_cache(sql, key, value);
+	success = 1;
+
+cleanup:
+	pthread_mutex_unlock(&sql->config_critical);
+	return success;
 }
 
 
 char* dc_sqlite3_get_config(dc_sqlite3_t* sql, const char* key, const char* def) /* the returned string must be free()'d, NULL is only returned if def is NULL */
 {
 	sqlite3_stmt* stmt = NULL;
+	char*         ret = NULL;
 
 	if (!dc_sqlite3_is_open(sql) || key==NULL) {
 		return dc_strdup_keep_null(def);
 	}
 
-	stmt = dc_sqlite3_prepare(sql, SELECT_v_FROM_config_k_STATEMENT);
+	pthread_mutex_lock(&sql->config_critical);
+		if (load_config_cache(sql)) {
+			const char* value = dc_hash_find_str(&sql->config_cache, key);
+			ret = dc_strdup_keep_null(value? value : def);
+			pthread_mutex_unlock(&sql->config_critical);
+			return ret;
+		}
+	pthread_mutex_unlock(&sql->config_critical);
+
+	/* the cache cannot be loaded, eg. as the table does not exist, try over directly */
+	stmt = dc_sqlite3_borrow_stmt(sql, SELECT_v_FROM_config_k_STATEMENT);
 	sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
 	if (sqlite3_step(stmt)==SQLITE_ROW)
 	{
@@ -832,14 +1527,14 @@ char* dc_sqlite3_get_config(dc_sqlite3_t* sql, const char* key, const char* def)
 		if (ptr)
 		{
 			/* success, fall through below to free objects */
-			char* ret = dc_strdup((const char*)ptr);
-			sqlite3_finalize(stmt);
+			ret = dc_strdup((const char*)ptr);
+			dc_sqlite3_return_stmt(sql, stmt);
 			return ret;
 		}
 	}
 
 	/* return the default value */
-	sqlite3_finalize(stmt);
+	dc_sqlite3_return_stmt(sql, stmt);
 	return dc_strdup_keep_null(def);
 }
 
@@ -898,45 +1593,371 @@ int dc_sqlite3_set_config_int64(dc_sqlite3_t* sql, const char* key, int64_t valu
  ******************************************************************************/
 
 
-#undef USE_TRANSACTIONS
+/* Events that make the UI read the database are deferred while the sending thread
+has a transaction open, otherwise the UI may miss the changes on the read-only
+connections or see changes that are rolled back later.  the events are sent
+when the outermost transaction is committed and are dropped on rollback. */
+int dc_sqlite3_defer_event(dc_sqlite3_t* sql, int event, uintptr_t data1, uintptr_t data2)
+{
+	int deferred = 0;
+
+	if (sql==NULL || sql->cobj==NULL) {
+		return 0;
+	}
+
+	switch (event) {
+		case DC_EVENT_MSGS_CHANGED:
+		case DC_EVENT_INCOMING_MSG:
+		case DC_EVENT_MSG_DELIVERED:
+		case DC_EVENT_MSG_FAILED:
+		case DC_EVENT_MSG_READ:
+		case DC_EVENT_CHAT_MODIFIED:
+		case DC_EVENT_CONTACTS_CHANGED:
+		case DC_EVENT_LOCATION_CHANGED:
+			break;
+
+		default:
+			return 0;
+	}
+
+	// a transaction opened by another thread is not our business
+	if (pthread_mutex_trylock(&sql->transaction_critical)!=0) {
+		return 0;
+	}
+
+	if (sql->transaction_depth>0) {
+		if (sql->deferred_events==NULL) {
+			sql->deferred_events = dc_array_new(NULL, 32);
+		}
+		dc_array_add_uint(sql->deferred_events, sql->transaction_depth);
+		dc_array_add_uint(sql->deferred_events, event);
+		dc_array_add_uint(sql->deferred_events, data1);
+		dc_array_add_uint(sql->deferred_events, data2);
+		deferred = 1;
+	}
+
+	pthread_mutex_unlock(&sql->transaction_critical);
+	return deferred;
+}
+
+
+static void release_deferred_events(dc_sqlite3_t* sql, int depth) /* must be called with transaction_critical locked */
+{
+	// the events of a released savepoint belong to the enclosing transaction now
+	for (size_t i = 0; i+3 < dc_array_get_cnt(sql->deferred_events); i += 4) {
+		if ((int)sql->deferred_events->array[i]>=depth) {
+			sql->deferred_events->array[i] = depth-1;
+		}
+	}
+}
+
+
+static void drop_deferred_events(dc_sqlite3_t* sql, int depth) /* must be called with transaction_critical locked */
+{
+	size_t kept = 0;
+	for (size_t i = 0; i+3 < dc_array_get_cnt(sql->deferred_events); i += 4) {
+		if ((int)sql->deferred_events->array[i] < depth) {
+			memmove(&sql->deferred_events->array[kept], &sql->deferred_events->array[i], 4*sizeof(uintptr_t));
+			kept += 4;
+		}
+	}
+
+	if (sql->deferred_events) {
+		sql->deferred_events->count = kept;
+	}
+}
 
 
 void dc_sqlite3_begin_transaction(dc_sqlite3_t* sql)
 {
-#ifdef USE_TRANSACTIONS
-	// `BEGIN IMMEDIATE` ensures, only one thread may write.
-	// all other calls to `BEGIN IMMEDIATE` will try over until sqlite3_busy_timeout() is reached.
-	// CAVE: This also implies that transactions MUST NOT be nested.
-	sqlite3_stmt* stmt = dc_sqlite3_prepare(sql, "BEGIN IMMEDIATE;");
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		dc_sqlite3_log_error(sql, "Cannot begin transaction.");
+	char* q3 = NULL;
+
+	if (sql==NULL) {
+		return;
 	}
-	sqlite3_finalize(stmt);
-#endif
+
+	// the mutex is recursive, if the transaction is opened by another thread,
+	// we wait here until it is closed.  waiting threads are counted,
+	// so that dc_sqlite3_batch_step() can give way to them.
+	if (pthread_mutex_trylock(&sql->transaction_critical)!=0)
+	{
+		pthread_mutex_lock(&sql->transaction_waiters_critical);
+			sql->transaction_waiters++;
+		pthread_mutex_unlock(&sql->transaction_waiters_critical);
+
+		pthread_mutex_lock(&sql->transaction_critical);
+
+		pthread_mutex_lock(&sql->transaction_waiters_critical);
+			sql->transaction_waiters--;
+			pthread_cond_broadcast(&sql->transaction_waiters_cond);
+		pthread_mutex_unlock(&sql->transaction_waiters_critical);
+	}
+
+	sql->transaction_depth++;
+	if (sql->transaction_depth==1) {
+		// `BEGIN IMMEDIATE` acquires the write lock at once,
+		// other processes will try over until sqlite3_busy_timeout() is reached.
+		if (!dc_sqlite3_execute(sql, "BEGIN IMMEDIATE;")) {
+			dc_sqlite3_log_error(sql, "Cannot begin transaction.");
+		}
+	}
+	else {
+		q3 = sqlite3_mprintf("SAVEPOINT dc_tx%i;", sql->transaction_depth);
+		if (!dc_sqlite3_execute(sql, q3)) {
+			dc_sqlite3_log_error(sql, "Cannot begin nested transaction #%i.", sql->transaction_depth);
+		}
+	}
+
+	sqlite3_free(q3);
 }
 
 
 void dc_sqlite3_rollback(dc_sqlite3_t* sql)
 {
-#ifdef USE_TRANSACTIONS
-	sqlite3_stmt* stmt = dc_sqlite3_prepare(sql, "ROLLBACK;");
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		dc_sqlite3_log_error(sql, "Cannot rollback transaction.");
+	char* q3 = NULL;
+
+	if (sql==NULL) {
+		return;
 	}
-	sqlite3_finalize(stmt);
-#endif
+
+	pthread_mutex_lock(&sql->transaction_critical);
+
+	if (sql->transaction_depth<=0) {
+		dc_log_error(sql->context, 0, "Cannot rollback, no transaction open.");
+		goto cleanup;
+	}
+
+	if (sql->transaction_depth==1) {
+		if (!dc_sqlite3_execute(sql, "ROLLBACK;")) {
+			dc_sqlite3_log_error(sql, "Cannot rollback transaction.");
+		}
+		reset_foreign_writes(sql);
+	}
+	else {
+		// `ROLLBACK TO` leaves the savepoint on the stack, so it is released afterwards
+		q3 = sqlite3_mprintf("ROLLBACK TO dc_tx%i; RELEASE dc_tx%i;", sql->transaction_depth, sql->transaction_depth);
+		if (sqlite3_exec(sql->cobj, q3, NULL, NULL, NULL)!=SQLITE_OK) {
+			dc_sqlite3_log_error(sql, "Cannot rollback nested transaction #%i.", sql->transaction_depth);
+		}
+	}
+
+	// config values and peerstates written in the transaction are still in the caches,
+	// the events sent in the transaction are obsolete
+	invalidate_config_cache(sql);
+	dc_apeerstate_cache_clear(sql);
+	drop_deferred_events(sql, sql->transaction_depth);
+
+	sql->transaction_depth--;
+	pthread_mutex_unlock(&sql->transaction_critical); // the lock from dc_sqlite3_begin_transaction()
+
+cleanup:
+	sqlite3_free(q3);
+	pthread_mutex_unlock(&sql->transaction_critical);
 }
 
 
 void dc_sqlite3_commit(dc_sqlite3_t* sql)
 {
-#ifdef USE_TRANSACTIONS
-	sqlite3_stmt* stmt = dc_sqlite3_prepare(sql, "COMMIT;");
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		dc_sqlite3_log_error(sql, "Cannot commit transaction.");
+	char*       q3 = NULL;
+	dc_array_t* events_to_send = NULL;
+
+	if (sql==NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&sql->transaction_critical);
+
+	if (sql->transaction_depth<=0) {
+		dc_log_error(sql->context, 0, "Cannot commit, no transaction open.");
+		goto cleanup;
+	}
+
+	if (sql->transaction_depth==1) {
+		if (!dc_sqlite3_execute(sql, "COMMIT;")) {
+			// make sure, the handle is back in autocommit mode,
+			// otherwise all subsequent transactions would fail
+			dc_sqlite3_log_error(sql, "Cannot commit transaction.");
+			dc_sqlite3_execute(sql, "ROLLBACK;");
+			invalidate_config_cache(sql);
+			dc_apeerstate_cache_clear(sql);
+			drop_deferred_events(sql, 1);
+		}
+		reset_foreign_writes(sql);
+		events_to_send = sql->deferred_events;
+		sql->deferred_events = NULL;
+	}
+	else {
+		q3 = sqlite3_mprintf("RELEASE dc_tx%i;", sql->transaction_depth);
+		if (!dc_sqlite3_execute(sql, q3)) {
+			dc_sqlite3_log_error(sql, "Cannot commit nested transaction #%i.", sql->transaction_depth);
+		}
+		release_deferred_events(sql, sql->transaction_depth);
+	}
+
+	sql->transaction_depth--;
+	pthread_mutex_unlock(&sql->transaction_critical); // the lock from dc_sqlite3_begin_transaction()
+
+cleanup:
+	sqlite3_free(q3);
+	pthread_mutex_unlock(&sql->transaction_critical);
+
+	// the changes are visible to all connections now
+	for (size_t i = 0; i+3 < dc_array_get_cnt(events_to_send); i += 4) {
+		sql->context->cb(sql->context, (int)dc_array_get_uint(events_to_send, i+1),
+			dc_array_get_uint(events_to_send, i+2), dc_array_get_uint(events_to_send, i+3));
+	}
+	dc_array_unref(events_to_send);
+}
+
+
+void dc_sqlite3_begin_batch(dc_sqlite3_t* sql, int commit_every)
+{
+	if (sql==NULL) {
+		return;
+	}
+
+	dc_sqlite3_begin_transaction(sql);
+	if (sql->transaction_depth==1) {
+		sql->batch_size = DC_MAX(commit_every, 1);
+		sql->batch_cnt  = 0;
+	}
+}
+
+
+void dc_sqlite3_batch_step(dc_sqlite3_t* sql)
+{
+	if (sql==NULL) {
+		return;
+	}
+
+	// only the thread owning the batch can step it; other threads just return here
+	if (pthread_mutex_trylock(&sql->transaction_critical)!=0) {
+		return;
+	}
+
+	if (sql->batch_size>0 && sql->transaction_depth==1)
+	{
+		sql->batch_cnt++;
+		if (sql->batch_cnt>=sql->batch_size)
+		{
+			// commit the batch and give other threads the chance to write;
+			// while the lock is released, the batch is not marked as such.
+			int batch_size = sql->batch_size;
+			sql->batch_size = 0;
+			dc_sqlite3_commit(sql);
+			pthread_mutex_unlock(&sql->transaction_critical);
+
+			// a mutex is not fair, relocking at once would mostly win against
+			// the threads waiting in dc_sqlite3_begin_transaction(); so, wait until they got their turn.
+			pthread_mutex_lock(&sql->transaction_waiters_critical);
+				while (sql->transaction_waiters>0) {
+					pthread_cond_wait(&sql->transaction_waiters_cond, &sql->transaction_waiters_critical);
+				}
+			pthread_mutex_unlock(&sql->transaction_waiters_critical);
+
+			pthread_mutex_lock(&sql->transaction_critical);
+			dc_sqlite3_begin_transaction(sql);
+			sql->batch_size = batch_size;
+			sql->batch_cnt  = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&sql->transaction_critical);
+}
+
+
+void dc_sqlite3_end_batch(dc_sqlite3_t* sql)
+{
+	if (sql==NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&sql->transaction_critical);
+		if (sql->transaction_depth==1) {
+			sql->batch_size = 0;
+			sql->batch_cnt  = 0;
+		}
+		dc_sqlite3_commit(sql);
+	pthread_mutex_unlock(&sql->transaction_critical);
+}
+
+
+/*******************************************************************************
+ * Full-text-search
+ ******************************************************************************/
+
+
+int dc_fts_ready(dc_sqlite3_t* sql)
+{
+	// the index can be used only if all existing messages are added
+	if (sql==NULL || !sql->fts_enabled) {
+		return 0;
+	}
+	return dc_sqlite3_get_config_int(sql, "fts_backfill_end", 0)==0;
+}
+
+
+void dc_fts_start_backfill(dc_context_t* context)
+{
+	if (context==NULL || context->magic!=DC_CONTEXT_MAGIC
+	 || !context->sql->fts_enabled
+	 || dc_sqlite3_get_config_int(context->sql, "fts_backfill_end", 0)==0) {
+		return;
+	}
+
+	dc_job_kill_action(context, DC_JOB_FTS_BACKFILL);
+	dc_job_add(context, DC_JOB_FTS_BACKFILL, 0, NULL, 0);
+}
+
+
+void dc_fts_backfill(dc_context_t* context)
+{
+	sqlite3_stmt* stmt = NULL;
+	int           pos = 0;
+	int           end = 0;
+	int           chunk_end = 0;
+
+	if (context==NULL || context->magic!=DC_CONTEXT_MAGIC || !context->sql->fts_enabled) {
+		return;
+	}
+
+	pos = dc_sqlite3_get_config_int(context->sql, "fts_backfill_pos", 0);
+	end = dc_sqlite3_get_config_int(context->sql, "fts_backfill_end", 0);
+	if (end==0) {
+		return;
+	}
+	chunk_end = DC_MIN(pos+DC_FTS_BACKFILL_CHUNK, end);
+
+	// messages changed meanwhile are already added by the update trigger
+	dc_sqlite3_begin_transaction(context->sql);
+
+		stmt = dc_sqlite3_prepare(context->sql,
+			"INSERT INTO msgs_fts (rowid, txt)"
+			" SELECT id, txt FROM msgs"
+			" WHERE id>?1 AND id<=?2 AND txt!=''"
+			"   AND id NOT IN (SELECT rowid FROM msgs_fts WHERE rowid>?1 AND rowid<=?2);");
+		sqlite3_bind_int(stmt, 1, pos);
+		sqlite3_bind_int(stmt, 2, chunk_end);
+		sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+
+		if (chunk_end>=end) {
+			dc_sqlite3_set_config(context->sql, "fts_backfill_pos", NULL);
+			dc_sqlite3_set_config(context->sql, "fts_backfill_end", NULL);
+		}
+		else {
+			dc_sqlite3_set_config_int(context->sql, "fts_backfill_pos", chunk_end);
+		}
+
+	dc_sqlite3_commit(context->sql);
+
+	if (chunk_end>=end) {
+		dc_log_info(context, 0, "Full-text-index complete.");
+	}
+	else {
+		// one chunk per job, so that other jobs are not blocked for too long
+		dc_job_add(context, DC_JOB_FTS_BACKFILL, 0, NULL, 0);
 	}
-	sqlite3_finalize(stmt);
-#endif
 }
 
 
@@ -1085,6 +2106,14 @@ void dc_housekeeping(dc_context_t* context)
 			unreferenced_count, name);
 
 		dc_delete_file(context, path);
+
+		sqlite3_finalize(stmt);
+		stmt = dc_sqlite3_prepare(context->sql,
+			"DELETE FROM blobs WHERE path=?;");
+		char* rel_path = dc_mprintf("$BLOBDIR/%s", name);
+		sqlite3_bind_text(stmt, 1, rel_path, -1, SQLITE_STATIC);
+		sqlite3_step(stmt);
+		free(rel_path);
 	}
 
 cleanup:
@@ -10,11 +10,31 @@ extern "C" {
 #include <sqlite3.h>
 #include <libetpan/libetpan.h>
 #include <pthread.h>
+#include "dc_hash.h"
 
 
 typedef struct _dc_sqlite3 dc_sqlite3_t;
 
 
+/* number of read-only connections opened in WAL mode */
+#define DC_READ_POOL_SIZE 2
+
+
+/**
+ * Library-internal.
+ */
+typedef struct _dc_stmt_cache_entry
+{
+	/** @privatesection */
+	sqlite3*        db;                 /**< the connection the statement was prepared on */
+	char*           querystr;
+	uint32_t        hash;               /**< hash of querystr, checked before comparing the strings */
+	sqlite3_stmt*   stmt;               /**< NULL for unused entries */
+	int             in_use;             /**< set while the statement is borrowed */
+	uint64_t        last_used;
+} dc_stmt_cache_entry_t;
+
+
 /**
  * Library-internal.
  */
@@ -24,6 +44,39 @@ struct _dc_sqlite3
 	sqlite3*        cobj;               /**< is the database given as dbfile to Open() */
 	dc_context_t*   context;            /**< used for logging and to acquire wakelocks, there may be N dc_sqlite3_t objects per context! In practise, we use 2 on backup, 1 otherwise. */
 
+	pthread_mutex_t transaction_critical; /**< recursive, held by the thread that has a transaction open */
+	int             transaction_depth;  /**< 0=no transaction, 1=BEGIN IMMEDIATE, >1=nested SAVEPOINTs; only accessed by the thread holding transaction_critical */
+	int             batch_size;         /**< if >0, the outermost transaction is a write batch committed every batch_size steps */
+	int             batch_cnt;
+	int             transaction_waiters; /**< number of threads waiting in dc_sqlite3_begin_transaction(), a batch gives way to them */
+	pthread_mutex_t transaction_waiters_critical; /**< protects transaction_waiters */
+	pthread_cond_t  transaction_waiters_cond; /**< signalled when a waiting thread got the transaction */
+
+	sqlite3*        readers[DC_READ_POOL_SIZE]; /**< read-only connections, only opened in WAL mode */
+	int             readers_cnt;
+	int             next_reader;
+	pthread_mutex_t readers_critical;   /**< protects next_reader and foreign_writes */
+	int             foreign_writes;     /**< set if other threads have written into the open transaction, the readers cannot see these changes */
+	dc_array_t*     deferred_events;    /**< depth, event, data1, data2 of each event deferred by dc_sqlite3_defer_event(); only accessed by the thread holding transaction_critical */
+
+	#define         DC_STMT_CACHE_SIZE  32
+	dc_stmt_cache_entry_t stmt_cache[DC_STMT_CACHE_SIZE];
+	pthread_mutex_t stmt_cache_critical;
+	uint64_t        stmt_cache_clock;
+	int             stmt_cache_hits;
+	int             stmt_cache_misses;
+
+	dc_hash_t       config_cache;       /**< keyname -> value of the `config` table, values are owned by the cache */
+	int             config_cache_loaded; /**< 0=the cache is empty and is loaded on the next read */
+	pthread_mutex_t config_critical;    /**< protects config_cache, also held while writing to the `config` table */
+
+	dc_hash_t       peerstate_cache;    /**< lowercased addr -> last used peerstates, see dc_apeerstate.c */
+	dc_hash_t       peerstate_fingerprints; /**< uppercased fingerprint -> lowercased addr */
+	uint64_t        peerstate_cache_clock;
+	pthread_mutex_t peerstate_cache_critical; /**< protects the peerstate cache, also held while writing peerstates */
+
+	int             fts_enabled;        /**< 1=the full-text-index msgs_fts is kept up to date by triggers */
+
 };
 
 
@@ -46,6 +99,10 @@ int64_t       dc_sqlite3_get_config_int64 (dc_sqlite3_t*, const char* key, int64
 
 /* tools, these functions are compatible to the corresponding sqlite3_* functions */
 sqlite3_stmt* dc_sqlite3_prepare          (dc_sqlite3_t*, const char* sql); /* the result mus be freed using sqlite3_finalize() */
+sqlite3_stmt* dc_sqlite3_prepare_read     (dc_sqlite3_t*, const char* sql); /* same as dc_sqlite3_prepare(), however, the statement may run on a read-only connection */
+sqlite3_stmt* dc_sqlite3_borrow_stmt      (dc_sqlite3_t*, const char* sql); /* same as dc_sqlite3_prepare(), however, the statement is taken from a cache and must be given back using dc_sqlite3_return_stmt() */
+sqlite3_stmt* dc_sqlite3_borrow_read_stmt (dc_sqlite3_t*, const char* sql); /* same as dc_sqlite3_borrow_stmt(), however, the statement may run on a read-only connection */
+void          dc_sqlite3_return_stmt      (dc_sqlite3_t*, sqlite3_stmt*);
 int           dc_sqlite3_execute          (dc_sqlite3_t*, const char* sql);
 int           dc_sqlite3_try_execute      (dc_sqlite3_t*, const char* sql);
 int           dc_sqlite3_table_exists     (dc_sqlite3_t*, const char* name);
@@ -56,6 +113,19 @@ uint32_t      dc_sqlite3_get_rowid2       (dc_sqlite3_t*, const char* table, con
 void          dc_sqlite3_begin_transaction(dc_sqlite3_t*);
 void          dc_sqlite3_commit           (dc_sqlite3_t*);
 void          dc_sqlite3_rollback         (dc_sqlite3_t*);
+int           dc_sqlite3_defer_event      (dc_sqlite3_t*, int event, uintptr_t data1, uintptr_t data2); /* returns 1 if the event is sent after the transaction of the calling thread is committed */
+
+/* write batches, eg. to receive many messages with only a few fsync() */
+#define       DC_BATCH_DEFAULT_SIZE       50
+void          dc_sqlite3_begin_batch      (dc_sqlite3_t*, int commit_every);
+void          dc_sqlite3_batch_step       (dc_sqlite3_t*);
+void          dc_sqlite3_end_batch        (dc_sqlite3_t*);
+
+/* full-text-search, the index is filled in the background for existing messages */
+#define       DC_FTS_BACKFILL_CHUNK       2000
+void          dc_fts_start_backfill       (dc_context_t*);
+void          dc_fts_backfill             (dc_context_t*);
+int           dc_fts_ready                (dc_sqlite3_t*);
 
 /* housekeeping */
 #define       DC_HOUSEKEEPING_DELAY_SEC   10
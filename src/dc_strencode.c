@@ -1,6 +1,7 @@
 #include <ctype.h>
 #include <libetpan/libetpan.h>
 #include "dc_context.h"
+#include "dc_base64.h"
 #include "dc_strencode.h"
 
 
@@ -418,6 +419,201 @@ cleanup:
 }
 
 
+static int is_header_ws(char c)
+{
+	return c==' ' || c=='\t';
+}
+
+
+static int is_etoken_char(char c)
+{
+	return (unsigned char)c>=31 && strchr(" ()<>@,;:\"/[]?=", c)==NULL;
+}
+
+
+/* parses `=?charset?e?` and returns a pointer behind it or NULL */
+static const char* parse_encoded_word_start(const char* p, const char** ret_charset, size_t* ret_charset_len, char* ret_encoding)
+{
+	if (p[0]!='=' || p[1]!='?') {
+		return NULL;
+	}
+	p += 2;
+
+	*ret_charset = p;
+	while (*p && is_etoken_char(*p)) {
+		p++;
+	}
+	*ret_charset_len = p-*ret_charset;
+	if (*ret_charset_len==0 || p[0]!='?' || p[1]==0 || p[2]!='?') {
+		return NULL;
+	}
+
+	*ret_encoding = toupper((unsigned char)p[1]);
+	return p+3;
+}
+
+
+/* Decodes header words as mailmime_encoded_phrase_parse() does, but without
+iconv; this is done for ASCII words and for encoded words in UTF-8 or US-ASCII,
+which are the typical cases.  For everything else, NULL is returned and
+libetpan should be used: for other charsets, 8-bit characters, line breaks
+(also inside encoded words), quoted encoded words or malformed encoded words. */
+static char* decode_header_words_fast(const char* in)
+{
+	size_t      in_bytes = strlen(in);
+	const char* p = in;
+	char*       out = NULL;
+	char*       o = NULL;
+	char*       body = NULL;    /* the text of adjacent encoded words */
+	char*       decoded = NULL;
+	int         first = 1;
+	int         last_was_encoded = 0;
+	int         success = 0;
+
+	/* the decoded text is not larger than the input, however, for safety, `out` has room
+	for dc_decode_quoted_printable() turning every byte into CRLF */
+	if ((out=malloc(in_bytes*2+2))==NULL
+	 || (body=malloc(in_bytes+1))==NULL
+	 || (decoded=malloc(in_bytes*2+4))==NULL) {
+		exit(70);
+	}
+	o = out;
+
+	while (1)
+	{
+		const char* ws_start = p;
+		while (is_header_ws(*p)) {
+			p++;
+		}
+		int has_fws = p>ws_start;
+
+		if (*p==0) {
+			if (has_fws) {
+				*o++ = ' '; /* as libetpan, trailing whitespace results in a single space */
+			}
+			break;
+		}
+
+		if (*p=='"' && p[1]=='=' && p[2]=='?') {
+			goto cleanup;
+		}
+
+		if (p[0]=='=' && p[1]=='?')
+		{
+			/* one or more encoded words with the same charset and encoding */
+			const char* charset = NULL;
+			size_t      charset_len = 0;
+			char        encoding = 0;
+			size_t      body_len = 0;
+			size_t      decoded_len = 0;
+			int         utf8 = DC_UTF8_INVALID;
+
+			if ((p=parse_encoded_word_start(p, &charset, &charset_len, &encoding))==NULL
+			 || (encoding!='Q' && encoding!='B')) {
+				goto cleanup;
+			}
+
+			while (1)
+			{
+				const char* text_end = strstr(p, "?=");
+				if (text_end==NULL) {
+					goto cleanup;
+				}
+				memcpy(body+body_len, p, text_end-p);
+				body_len += text_end-p;
+				int has_base64_padding = (encoding=='B' && text_end>p && text_end[-1]=='=');
+				p = text_end+2;
+
+				if (has_base64_padding) {
+					break;
+				}
+
+				const char* next = p;
+				const char* next_charset = NULL;
+				size_t      next_charset_len = 0;
+				char        next_encoding = 0;
+				while (is_header_ws(*next)) {
+					next++;
+				}
+				if ((next=parse_encoded_word_start(next, &next_charset, &next_charset_len, &next_encoding))==NULL
+				 || next_charset_len!=charset_len || strncasecmp(next_charset, charset, charset_len)!=0
+				 || next_encoding!=encoding) {
+					break;
+				}
+				p = next;
+			}
+
+			if (memchr(body, '\r', body_len) || memchr(body, '\n', body_len)) {
+				goto cleanup; /* line breaks inside encoded words, leave them to libetpan as for unencoded words */
+			}
+
+			if (encoding=='B') {
+				decoded_len = dc_base64_decode(body, body_len, decoded);
+			}
+			else if (!dc_decode_quoted_printable(body, body_len, 1, decoded, &decoded_len, NULL)) {
+				goto cleanup;
+			}
+			decoded_len = strnlen(decoded, decoded_len); /* libetpan uses the decoded text as a string */
+
+			utf8 = dc_utf8_check(decoded, decoded_len);
+			if ((charset_len==5 && strncasecmp(charset, "utf-8", 5)==0)
+			 || (charset_len==4 && strncasecmp(charset, "utf8", 4)==0)) {
+				if (utf8==DC_UTF8_INVALID) {
+					goto cleanup;
+				}
+			}
+			else if (charset_len==8 && strncasecmp(charset, "us-ascii", 8)==0) {
+				if (utf8!=DC_UTF8_ASCII) {
+					goto cleanup;
+				}
+			}
+			else {
+				goto cleanup;
+			}
+
+			if (!first && has_fws && !last_was_encoded) {
+				*o++ = ' ';
+			}
+			memcpy(o, decoded, decoded_len);
+			o += decoded_len;
+			last_was_encoded = 1;
+		}
+		else
+		{
+			/* a word that is not encoded, it ends at whitespace or at the start of an encoded word */
+			const char* word = p;
+			while (*p && !is_header_ws(*p) && !(p[0]=='=' && p[1]=='?')) {
+				if ((unsigned char)*p >= 0x80 || *p=='\r' || *p=='\n') {
+					goto cleanup;
+				}
+				p++;
+			}
+
+			if (!first && has_fws) {
+				*o++ = ' ';
+			}
+			memcpy(o, word, p-word);
+			o += p-word;
+			last_was_encoded = 0;
+		}
+
+		first = 0;
+	}
+
+	*o = 0;
+	success = 1;
+
+cleanup:
+	free(decoded);
+	free(body);
+	if (!success) {
+		free(out);
+		out = NULL;
+	}
+	return out;
+}
+
+
 /**
  * Decode non-ascii-strings as `=?UTF-8?Q?Bj=c3=b6rn_Petersen?=`.
  * Belongs to RFC 2047: https://tools.ietf.org/html/rfc2047
@@ -435,7 +631,11 @@ char* dc_decode_header_words(const char* in)
 		return NULL; /* no string given */
 	}
 
-	char* out = NULL;
+	char* out = decode_header_words_fast(in);
+	if (out) {
+		return out;
+	}
+
 	size_t cur_token = 0;
 	int r = mailmime_encoded_phrase_parse(DEF_INCOMING_CHARSET, in, strlen(in), &cur_token, DEF_DISPLAY_CHARSET, &out);
 	if (r != MAILIMF_NO_ERROR || out==NULL) {
@@ -842,7 +1042,7 @@ char* dc_decode_ext_header(const char* to_decode)
 	// decode text
 	decoded = dc_urldecode(p2);
 
-	if (charset!=NULL && strcmp(charset, "utf-8")!=0 && strcmp(charset, "UTF-8")!=0) {
+	if (dc_needs_charconv(charset, dc_utf8_check(decoded, strlen(decoded)))) {
 		char* converted = NULL;
 		int r = charconv("utf-8", charset, decoded, strlen(decoded), &converted);
 		if (r==MAIL_CHARCONV_NO_ERROR && converted != NULL) {
@@ -858,3 +1058,276 @@ cleanup:
 	free(charset);
 	return decoded? decoded : dc_strdup(to_decode);
 }
+
+
+/*******************************************************************************
+ * Quoted-printable and charsets without iconv
+ ******************************************************************************/
+
+
+/* Most texts are ASCII or UTF-8, in this case nothing needs to be converted
+and we can avoid iconv which is slow to set up for each part or header word.
+The UTF-8 check is done byte by byte, so it can be combined with decoding. */
+
+
+typedef struct utf8_check_t
+{
+	int     need;      /* continuation bytes still expected */
+	uint8_t lo, hi;    /* range of the next continuation byte */
+	int     non_ascii;
+	int     invalid;
+} utf8_check_t;
+
+
+static inline void utf8_check_byte(utf8_check_t* check, uint8_t c)
+{
+	if (check->need==0) {
+		if (c < 0x80) {
+			return;
+		}
+		check->non_ascii = 1;
+		check->lo = 0x80;
+		check->hi = 0xBF;
+		if (c>=0xC2 && c<=0xDF) {
+			check->need = 1;
+		}
+		else if (c>=0xE0 && c<=0xEF) {
+			check->need = 2;
+			if (c==0xE0) { check->lo = 0xA0; } /* overlong */
+			if (c==0xED) { check->hi = 0x9F; } /* U+D800 to U+DFFF */
+		}
+		else if (c>=0xF0 && c<=0xF4) {
+			check->need = 3;
+			if (c==0xF0) { check->lo = 0x90; } /* overlong */
+			if (c==0xF4) { check->hi = 0x8F; } /* above U+10FFFF */
+		}
+		else {
+			check->invalid = 1;
+		}
+	}
+	else if (c<check->lo || c>check->hi) {
+		check->invalid = 1;
+		check->need = 0;
+	}
+	else {
+		check->lo = 0x80;
+		check->hi = 0xBF;
+		check->need--;
+	}
+}
+
+
+static inline int utf8_check_result(const utf8_check_t* check)
+{
+	if (check->invalid || check->need) {
+		return DC_UTF8_INVALID;
+	}
+	return check->non_ascii? DC_UTF8_VALID : DC_UTF8_ASCII;
+}
+
+
+/**
+ * Check if a buffer is ASCII or valid UTF-8 as defined by RFC 3629.
+ *
+ * @param buf The buffer to check, need not to be null-terminated.
+ * @param bytes The number of bytes in buf.
+ * @return DC_UTF8_ASCII if all bytes are below 0x80,
+ *     DC_UTF8_VALID for valid UTF-8 with non-ASCII characters,
+ *     DC_UTF8_INVALID otherwise.
+ */
+int dc_utf8_check(const char* buf, size_t bytes)
+{
+	const uint8_t* p = (const uint8_t*)buf;
+	const uint8_t* end = p + bytes;
+	utf8_check_t   check;
+
+	memset(&check, 0, sizeof(utf8_check_t));
+
+	if (buf==NULL) {
+		return DC_UTF8_ASCII;
+	}
+
+	while (p < end && !check.invalid)
+	{
+		/* skip ASCII in words of 8 bytes */
+		if (check.need==0) {
+			while (end-p >= 8) {
+				uint64_t w;
+				memcpy(&w, p, 8);
+				if (w & 0x8080808080808080ULL) {
+					break;
+				}
+				p += 8;
+			}
+			if (p >= end) {
+				break;
+			}
+		}
+
+		utf8_check_byte(&check, *p++);
+	}
+
+	return utf8_check_result(&check);
+}
+
+
+static inline uint8_t qp_hex_value(uint8_t c)
+{
+	if (c>='0' && c<='9') { return c-'0'; }
+	if (c>='a' && c<='f') { return c-'a'+10; }
+	if (c>='A' && c<='F') { return c-'A'+10; }
+	return 0; /* as libetpan */
+}
+
+
+/**
+ * Decode quoted-printable and check the result for UTF-8 in the same pass.
+ *
+ * The result is exactly the same as from libetpan's
+ * mailmime_quoted_printable_body_parse(), including the handling of
+ * malformed input, single LF or CR become CRLF.  The only exception is an
+ * incomplete `=X` at the very end, which libetpan decodes by reading behind
+ * the data; 0 is returned in this case and libetpan should be used.
+ *
+ * @param in The data to decode, need not to be null-terminated.
+ * @param in_bytes The number of bytes in `in`.
+ * @param in_header 1=decode `_` to a space, as used in header words.
+ * @param out Buffer for the decoded data, must have room for 2*in_bytes+1 bytes;
+ *     the result is null-terminated.
+ * @param[out] ret_bytes The number of bytes written to out, without the null-terminator.
+ * @param[out] ret_utf8 Result of dc_utf8_check() for the decoded data, may be NULL.
+ * @return 1=success, 0=use libetpan.
+ */
+int dc_decode_quoted_printable(const char* in, size_t in_bytes, int in_header, char* out, size_t* ret_bytes, int* ret_utf8)
+{
+	const uint8_t* p = (const uint8_t*)in;
+	const uint8_t* end = p + in_bytes;
+	uint8_t*       o = (uint8_t*)out;
+	utf8_check_t   check;
+	uint8_t        c = 0;
+
+	memset(&check, 0, sizeof(utf8_check_t));
+
+	if (in==NULL || out==NULL || ret_bytes==NULL) {
+		return 0;
+	}
+
+	while (p < end)
+	{
+		/* copy ASCII without `=`, CR, LF and `_` in words of 8 bytes */
+		#define HAS_ZERO_BYTE(w) (((w)-0x0101010101010101ULL) & ~(w) & 0x8080808080808080ULL)
+		#define HAS_BYTE(w, b)   HAS_ZERO_BYTE((w) ^ (0x0101010101010101ULL*(b)))
+		if (check.need==0) {
+			while (end-p >= 8) {
+				uint64_t w;
+				memcpy(&w, p, 8);
+				if ((w & 0x8080808080808080ULL) || HAS_BYTE(w, '=') || HAS_BYTE(w, '\r') || HAS_BYTE(w, '\n') || HAS_BYTE(w, '_')) {
+					break;
+				}
+				memcpy(o, &w, 8);
+				o += 8;
+				p += 8;
+			}
+			if (p >= end) {
+				break;
+			}
+		}
+
+		c = *p;
+		if (c=='=')
+		{
+			if (p+1 >= end) {
+				p++; /* a single `=` at the end is copied */
+			}
+			else if (p[1]=='\n') {
+				p += 2; /* soft line break */
+				continue;
+			}
+			else if (p[1]=='\r') {
+				if (p+2 >= end) {
+					break;
+				}
+				p += p[2]=='\n'? 3 : 2;
+				continue;
+			}
+			else if (p+2 >= end) {
+				return 0;
+			}
+			else {
+				c = (qp_hex_value(p[1])<<4) | qp_hex_value(p[2]);
+				p += 3;
+			}
+		}
+		else if (c=='\n' || c=='\r')
+		{
+			if (c=='\r') {
+				if (p+1 >= end) {
+					break; /* a CR at the end is dropped */
+				}
+				if (p[1]=='\n') {
+					p++;
+				}
+			}
+			p++;
+			*o++ = '\r';
+			*o++ = '\n';
+			utf8_check_byte(&check, '\r');
+			continue;
+		}
+		else
+		{
+			if (c=='_' && in_header) {
+				c = ' ';
+			}
+			p++;
+		}
+
+		*o++ = c;
+		utf8_check_byte(&check, c);
+	}
+
+	*o = 0;
+	*ret_bytes = o - (uint8_t*)out;
+	if (ret_utf8) {
+		*ret_utf8 = utf8_check_result(&check);
+	}
+	return 1;
+}
+
+
+static int is_utf8_charset(const char* charset)
+{
+	return strcasecmp(charset, "utf-8")==0 || strcasecmp(charset, "utf8")==0;
+}
+
+
+static int is_ascii_compatible_charset(const char* charset)
+{
+	/* only some common charsets are listed here */
+	return is_utf8_charset(charset)
+	    || strcasecmp(charset, "us-ascii")==0
+	    || strcasecmp(charset, "ascii")==0
+	    || strncasecmp(charset, "iso-8859-", 9)==0
+	    || strncasecmp(charset, "windows-125", 11)==0;
+}
+
+
+/**
+ * Check if data in the given charset must be converted to UTF-8 using iconv.
+ * This is not needed if the data is ASCII and the charset is a superset of
+ * ASCII, or if the data is valid UTF-8 and declared as such.
+ *
+ * @param charset The declared charset, NULL if unknown.
+ * @param utf8 The result of dc_utf8_check() for the data.
+ * @return 1=the data must be converted, 0=the data can be used as is.
+ */
+int dc_needs_charconv(const char* charset, int utf8)
+{
+	if (charset==NULL
+	 || strcmp(charset, "utf-8")==0 || strcmp(charset, "UTF-8")==0 /* as before, data declared as UTF-8 is never converted */
+	 || (utf8==DC_UTF8_ASCII && is_ascii_compatible_charset(charset))
+	 || (utf8==DC_UTF8_VALID && is_utf8_charset(charset))) {
+		return 0;
+	}
+	return 1;
+}
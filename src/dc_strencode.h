@@ -18,6 +18,13 @@ int     dc_needs_ext_header       (const char*);
 char*   dc_encode_ext_header      (const char*);
 char*   dc_decode_ext_header      (const char*);
 
+#define DC_UTF8_INVALID 0
+#define DC_UTF8_VALID   1
+#define DC_UTF8_ASCII   2
+int     dc_utf8_check             (const char*, size_t bytes);
+int     dc_decode_quoted_printable(const char* in, size_t in_bytes, int in_header, char* out, size_t* ret_bytes, int* ret_utf8);
+int     dc_needs_charconv         (const char* charset, int utf8);
+
 
 #ifdef __cplusplus
 } // /extern "C"
@@ -1,14 +1,21 @@
 #include <stdarg.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>   /* for FICLONE */
+#endif
 #include <sys/types.h> /* for getpid() */
 #include <unistd.h>    /* for getpid() */
 #include <openssl/rand.h>
 #include <libetpan/libetpan.h>
 #include <libetpan/mailimap_types.h>
 #include "dc_context.h"
+#include "dc_blob.h"
 
 
 /*******************************************************************************
@@ -1334,6 +1341,14 @@ int dc_copy_file(dc_context_t* context, const char* src, const char* dest)
 		goto cleanup;
 	}
 
+	#ifdef FICLONE
+		/* share the data on copy-on-write filesystems as btrfs or xfs; fails on other filesystems */
+		if (ioctl(fd_dest, FICLONE, fd_src)==0) {
+			success = 1;
+			goto cleanup;
+		}
+	#endif
+
     while ((bytes_read=read(fd_src, buf, DC_COPY_BUF_SIZE)) > 0) {
         if (write(fd_dest, buf, bytes_read)!=bytes_read) {
             dc_log_error(context, 0, "Cannot write %i bytes to \"%s\".", bytes_read, dest);
@@ -1465,15 +1480,181 @@ cleanup:
 }
 
 
-char* dc_get_fine_pathNfilename(dc_context_t* context, const char* pathNfolder, const char* desired_filenameNsuffix__)
+/**
+ * Read at most max_bytes from the beginning of a file into the heap.
+ * Unlike dc_map_file(), this is safe for files in the blob directory that
+ * may be truncated by another thread while the data are used.
+ *
+ * @private
+ * @param context The context object.
+ * @param pathNfilename The file to read, may be prefixed by `$BLOBDIR`.
+ * @param max_bytes Read at most this number of bytes.
+ * @param[out] buf Receives the data, null-terminated as with dc_read_file(); must be free()'d.
+ * @param[out] buf_bytes Receives the number of bytes read.
+ * @return 1=success, 0=error or the file is empty.
+ */
+int dc_read_file_prefix(dc_context_t* context, const char* pathNfilename, size_t max_bytes, void** buf, size_t* buf_bytes)
 {
-	char*  ret = NULL;
-	char*  pathNfolder_wo_slash = NULL;
-	char*  filenameNsuffix = NULL;
-	char*  basename = NULL;
-	char*  dotNSuffix = NULL;
-	time_t now = time(NULL);
-	int    i = 0;
+	int     success = 0;
+	char*   pathNfilename_abs = NULL;
+	int     fd = -1;
+	ssize_t r = 0;
+
+	if (pathNfilename==NULL || max_bytes==0 || buf==NULL || buf_bytes==NULL) {
+		return 0; /* do not go to cleanup as this would dereference "buf" and "buf_bytes" */
+	}
+
+	*buf = NULL;
+	*buf_bytes = 0;
+
+	if ((pathNfilename_abs=dc_get_abs_path(context, pathNfilename))==NULL
+	 || (fd=open(pathNfilename_abs, O_RDONLY))<0) {
+		goto cleanup;
+	}
+
+	if ((*buf=malloc(max_bytes+1))==NULL) {
+		exit(72);
+	}
+
+	while (*buf_bytes < max_bytes
+	    && (r=read(fd, (char*)*buf + *buf_bytes, max_bytes - *buf_bytes))!=0) {
+		if (r<0) {
+			if (errno==EINTR) {
+				continue;
+			}
+			goto cleanup;
+		}
+		*buf_bytes += r;
+	}
+
+	if (*buf_bytes==0) {
+		goto cleanup;
+	}
+
+	((char*)*buf)[*buf_bytes] = 0;
+	success = 1;
+
+cleanup:
+	if (fd>=0) {
+		close(fd);
+	}
+	if (success==0) {
+		free(*buf);
+		*buf = NULL;
+		*buf_bytes = 0;
+		dc_log_warning(context, 0, "Cannot read \"%s\" or file is empty.", pathNfilename);
+	}
+	free(pathNfilename_abs);
+	return success;
+}
+
+
+/**
+ * Map a file read-only into memory instead of copying it to the heap.
+ * Pages are only read from disk when they are accessed, so mapping a large
+ * file to look at its header is cheap.
+ *
+ * The mapping must not be used for files that may be truncated while they
+ * are mapped, accessing the lost pages raises SIGBUS. For files in the blob
+ * directory, use dc_read_file() or dc_read_file_prefix() instead.
+ *
+ * @private
+ * @param context The context object.
+ * @param pathNfilename The file to map, may be prefixed by `$BLOBDIR`.
+ * @param max_bytes Map at most this number of bytes from the beginning of the file;
+ *     0 maps the whole file.
+ * @param[out] buf Receives the mapped data. The data are not null-terminated.
+ * @param[out] buf_bytes Receives the number of mapped bytes.
+ * @return 1=success, 0=error or the file is empty.
+ *     On success, the mapping must be released using dc_unmap_file().
+ */
+int dc_map_file(dc_context_t* context, const char* pathNfilename, size_t max_bytes, const void** buf, size_t* buf_bytes)
+{
+	int         success = 0;
+	char*       pathNfilename_abs = NULL;
+	int         fd = -1;
+	struct stat st;
+	void*       mapped = MAP_FAILED;
+
+	if (pathNfilename==NULL || buf==NULL || buf_bytes==NULL) {
+		return 0; /* do not go to cleanup as this would dereference "buf" and "buf_bytes" */
+	}
+
+	*buf = NULL;
+	*buf_bytes = 0;
+
+	if ((pathNfilename_abs=dc_get_abs_path(context, pathNfilename))==NULL) {
+		goto cleanup;
+	}
+
+	if ((fd=open(pathNfilename_abs, O_RDONLY))<0
+	 || fstat(fd, &st)!=0
+	 || st.st_size<=0
+	 || (uint64_t)st.st_size>(uint64_t)SIZE_MAX) {
+		goto cleanup;
+	}
+
+	*buf_bytes = (size_t)st.st_size;
+	if (max_bytes>0 && *buf_bytes>max_bytes) {
+		*buf_bytes = max_bytes;
+	}
+
+	if ((mapped=mmap(NULL, *buf_bytes, PROT_READ, MAP_PRIVATE, fd, 0))==MAP_FAILED) {
+		goto cleanup;
+	}
+
+	*buf = mapped;
+	success = 1;
+
+cleanup:
+	if (fd>=0) {
+		close(fd); /* the mapping stays valid */
+	}
+	if (success==0) {
+		*buf_bytes = 0;
+		dc_log_warning(context, 0, "Cannot map \"%s\" or file is empty.", pathNfilename);
+	}
+	free(pathNfilename_abs);
+	return success;
+}
+
+
+/**
+ * Release a mapping returned by dc_map_file().
+ *
+ * @private
+ * @param buf The mapped data as returned by dc_map_file(). If NULL, nothing happens.
+ * @param buf_bytes The number of bytes as returned by dc_map_file().
+ * @return None.
+ */
+void dc_unmap_file(const void* buf, size_t buf_bytes)
+{
+	if (buf==NULL || buf_bytes==0) {
+		return;
+	}
+
+	munmap((void*)buf, buf_bytes);
+}
+
+/**
+ * Get the i-th name tried by dc_get_fine_pathNfilename(), 0 is the desired
+ * name itself, the following names get a running number and, after 100 tries,
+ * a timestamp.  This allows to create a file for a name without checking
+ * before, eg. by link() or open() with O_EXCL, and to try the next name on EEXIST.
+ *
+ * @param pathNfolder Folder, with or without trailing slash.
+ * @param desired_filenameNsuffix__ Name to start with, the name is validated.
+ * @param i Index of the name, 0 to DC_FINE_PATHNFILENAME_TRIES-1.
+ * @param now Time to use from the 100th name on, should be the same for all names tried.
+ * @return Path and name, must be free()'d.
+ */
+char* dc_get_fine_pathNfilename_candidate(const char* pathNfolder, const char* desired_filenameNsuffix__, int i, time_t now)
+{
+	char* ret = NULL;
+	char* pathNfolder_wo_slash = NULL;
+	char* filenameNsuffix = NULL;
+	char* basename = NULL;
+	char* dotNSuffix = NULL;
 
 	pathNfolder_wo_slash = dc_strdup(pathNfolder);
 	dc_ensure_no_slash(pathNfolder_wo_slash);
@@ -1482,22 +1663,14 @@ char* dc_get_fine_pathNfilename(dc_context_t* context, const char* pathNfolder,
 	dc_validate_filename(filenameNsuffix);
 	dc_split_filename(filenameNsuffix, &basename, &dotNSuffix);
 
-	for (i = 0; i < 1000 /*no deadlocks, please*/; i++) {
-		if (i) {
-			time_t idx = i<100? i : now+i;
-			ret = dc_mprintf("%s/%s-%lu%s", pathNfolder_wo_slash, basename, (unsigned long)idx, dotNSuffix);
-		}
-		else {
-			ret = dc_mprintf("%s/%s%s", pathNfolder_wo_slash, basename, dotNSuffix);
-		}
-		if (!dc_file_exist(context, ret)) {
-			goto cleanup; /* fine filename found */
-		}
-		free(ret); /* try over with the next index */
-		ret = NULL;
+	if (i) {
+		time_t idx = i<100? i : now+i;
+		ret = dc_mprintf("%s/%s-%lu%s", pathNfolder_wo_slash, basename, (unsigned long)idx, dotNSuffix);
+	}
+	else {
+		ret = dc_mprintf("%s/%s%s", pathNfolder_wo_slash, basename, dotNSuffix);
 	}
 
-cleanup:
 	free(filenameNsuffix);
 	free(basename);
 	free(dotNSuffix);
@@ -1506,6 +1679,25 @@ cleanup:
 }
 
 
+char* dc_get_fine_pathNfilename(dc_context_t* context, const char* pathNfolder, const char* desired_filenameNsuffix__)
+{
+	char*  ret = NULL;
+	time_t now = time(NULL);
+	int    i = 0;
+
+	for (i = 0; i < DC_FINE_PATHNFILENAME_TRIES /*no deadlocks, please*/; i++) {
+		ret = dc_get_fine_pathNfilename_candidate(pathNfolder, desired_filenameNsuffix__, i, now);
+		if (!dc_file_exist(context, ret)) {
+			return ret; /* fine filename found */
+		}
+		free(ret); /* try over with the next index */
+		ret = NULL;
+	}
+
+	return NULL;
+}
+
+
 void dc_make_rel_path(dc_context_t* context, char** path)
 {
 	if (context==NULL || path==NULL || *path==NULL) {
@@ -1558,8 +1750,7 @@ int dc_make_rel_and_copy(dc_context_t* context, char** path)
 	}
 
 	if ((filename=dc_get_filename(*path))==NULL
-	 || (blobdir_path=dc_get_fine_pathNfilename(context, "$BLOBDIR", filename))==NULL
-	 || !dc_copy_file(context, *path, blobdir_path)) {
+	 || (blobdir_path=dc_blob_copy(context, *path, filename))==NULL) {
 		goto cleanup;
 	}
 
@@ -51,9 +51,6 @@ char*   dc_str_from_clist          (const clist*, const char* delimiter);
 clist*  dc_str_to_clist            (const char*, const char* delimiter);
 int     dc_str_to_color            (const char*);
 
-// from libetpan/src/data-types/base64.h (which cannot be included without adding libetpan/src/... to the include-search-paths, which would result in double-file-name-errors, so, for now, we use this hack)
-char*   encode_base64              (const char * in, int len);
-
 /* clist tools */
 void    clist_free_content         (const clist*); /* calls free() for each item content */
 int     clist_search_string_nocase (const clist*, const char* str);
@@ -96,7 +93,12 @@ int      dc_copy_file               (dc_context_t*, const char* pathNFilename, c
 int      dc_create_folder           (dc_context_t*, const char* pathNfilename);
 int      dc_write_file              (dc_context_t*, const char* pathNfilename, const void* buf, size_t buf_bytes);
 int      dc_read_file               (dc_context_t*, const char* pathNfilename, void** buf, size_t* buf_bytes);
+int      dc_read_file_prefix        (dc_context_t*, const char* pathNfilename, size_t max_bytes, void** buf, size_t* buf_bytes);
+int      dc_map_file                (dc_context_t*, const char* pathNfilename, size_t max_bytes, const void** buf, size_t* buf_bytes);
+void     dc_unmap_file              (const void* buf, size_t buf_bytes);
 char*    dc_get_fine_pathNfilename  (dc_context_t*, const char* pathNfolder, const char* desired_name);
+char*    dc_get_fine_pathNfilename_candidate (const char* pathNfolder, const char* desired_name, int i, time_t now);
+#define  DC_FINE_PATHNFILENAME_TRIES 1000
 int      dc_is_blobdir_path         (dc_context_t*, const char* path);
 void     dc_make_rel_path           (dc_context_t*, char** pathNfilename);
 int      dc_make_rel_and_copy       (dc_context_t*, char** pathNfilename);
@@ -107,6 +109,8 @@ int      dc_make_rel_and_copy       (dc_context_t*, char** pathNfilename);
 #define DC_MIN(X, Y) (((X) < (Y))? (X) : (Y))
 #define DC_MAX(X, Y) (((X) > (Y))? (X) : (Y))
 
+#define DC_FILEMETA_MAX_BYTES (1024*1024) /* prefix passed to dc_get_filemeta(); leaves room for large JPEG APPn segments before the frame header */
+
 
 #ifdef __cplusplus
 } /* /extern "C" */
@@ -227,6 +227,9 @@ char*           dc_get_blobdir               (const dc_context_t*);
 int             dc_set_config                (dc_context_t*, const char* key, const char* value);
 char*           dc_get_config                (dc_context_t*, const char* key);
 char*           dc_get_info                  (dc_context_t*);
+#define         DC_METRICS_BINARY            0x01
+#define         DC_METRICS_RESET             0x02
+char*           dc_get_metrics               (dc_context_t*, int flags, size_t* ret_bytes);
 char*           dc_get_oauth2_url            (dc_context_t*, const char* addr, const char* redirect);
 char*           dc_get_version_str           (void);
 void            dc_openssl_init_not_required (void);
@@ -277,6 +280,7 @@ dc_msg_t*       dc_get_draft                 (dc_context_t*, uint32_t chat_id);
 
 #define         DC_GCM_ADDDAYMARKER          0x01
 dc_array_t*     dc_get_chat_msgs             (dc_context_t*, uint32_t chat_id, uint32_t flags, uint32_t marker1before);
+dc_array_t*     dc_get_chat_msgs_window      (dc_context_t*, uint32_t chat_id, uint32_t flags, uint32_t marker1before, uint32_t msg_id, int cnt_before, int cnt_after);
 int             dc_get_msg_cnt               (dc_context_t*, uint32_t chat_id);
 int             dc_get_fresh_msg_cnt         (dc_context_t*, uint32_t chat_id);
 dc_array_t*     dc_get_fresh_msgs            (dc_context_t*);
@@ -445,6 +449,7 @@ size_t           dc_chatlist_get_cnt         (const dc_chatlist_t*);
 uint32_t         dc_chatlist_get_chat_id     (const dc_chatlist_t*, size_t index);
 uint32_t         dc_chatlist_get_msg_id      (const dc_chatlist_t*, size_t index);
 dc_lot_t*        dc_chatlist_get_summary     (const dc_chatlist_t*, size_t index, dc_chat_t*);
+dc_array_t*      dc_chatlist_get_summaries   (const dc_chatlist_t*, size_t index_from, size_t index_to);
 dc_context_t*    dc_chatlist_get_context     (dc_chatlist_t*);
 
 